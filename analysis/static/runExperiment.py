@@ -121,6 +121,7 @@ parser.add_argument("--trainqueries", action="store", default=100, type=int, hel
 parser.add_argument("--model", action="store", choices=["none", "postgres", "stholes", "kde_heuristic", "kde_scv", "kde_adaptive", "kde_batch"], default="none", help="Which model should be tested?")
 parser.add_argument("--modelsize", action="store", required=True, type=int, help="For KDE: How many rows are used in the underlying sample. For STHoles: How many points are used to build the model?")
 parser.add_argument("--logbw", action="store_true", help="Use a logarithmic bandwidth representation.")
+parser.add_argument("--precision", action="store", choices=["double", "single"], default="double", help="For KDE: Floating point precision of the estimates.")
     # General arguments
 parser.add_argument("--log", action="store", required=True, help="Where to append the experimental results?")
 
@@ -170,6 +171,7 @@ if "kde" in args.model:
     # KDE-specific parameters.
     cur.execute("SET kde_samplesize TO %i;" % args.modelsize)
     cur.execute("SET kde_enable TO true;")
+    cur.execute("SET kde_estimation_precision TO %s;" % args.precision)
     if args.logbw:
         cur.execute("SET kde_bandwidth_representation TO Log;")
 
@@ -224,6 +226,9 @@ if (args.model == "kde_scv"):
     cur.execute("SELECT kde_set_bandwidth('%s',%s);" % (table, bw_array))
 
 # Ok, we are all set. Run the experiments!
+model_name = args.model
+if "kde" in args.model and args.precision <> "double":
+    model_name = "%s_%s" % (args.model, args.precision)
 f = open(args.log, "a+")
 sys.stdout.write("\tRunning test queries ... ")
 sys.stdout.flush()
@@ -237,7 +242,7 @@ for query in testing_workload:
             m = re.match(".+rows=([0-9]+).+rows=([0-9]+).+", text)
             predicted = int(m.group(1))
             actual = int(m.group(2))
-            f.write("%s;%i;%s;%s;%i;%i;%i\n" % (table, dimensions, workload_type, args.model, args.modelsize, predicted, actual))
+            f.write("%s;%i;%s;%s;%i;%i;%i\n" % (table, dimensions, workload_type, model_name, args.modelsize, predicted, actual))
 print "done (took %.2f ms)!" % (1000*(time.time() - ts))
 
 # Clean up
@@ -0,0 +1,40 @@
+#!/bin/bash
+
+DIR="$( cd "$( dirname "${BASH_SOURCE[0]}" )" && pwd )"
+source $DIR/../conf.sh
+
+# Some general parameters.
+REPETITIONS=5
+TESTQUERIES=1000
+TIMINGLOG=$DIR/../evaluation/backend/result_time.csv
+
+DIMENSIONS=(2 5 8)
+MODELSIZES=(1024 4096 16384 65536)
+BACKENDS=(opencl native)
+
+mkdir -p `dirname $TIMINGLOG`
+
+# Throughput: Compare the estimation time of the OpenCL and the host backend.
+cd $DIR/timing
+for MODELSIZE in "${MODELSIZES[@]}"; do
+   echo "  Timing with modelsize $MODELSIZE:"
+   $POSTGRES -D $PGDATAFOLDER -p $PGPORT >>  postgres.log 2>&1 &
+   PGPID=$!
+   sleep 2
+   for i in $(seq 1 $REPETITIONS); do
+      echo "    Repetition $i:"
+      for D in "${DIMENSIONS[@]}"; do
+         for BACKEND in "${BACKENDS[@]}"; do
+            echo "      KDE Heuristic ($D dimensions, $BACKEND):"
+            $PYTHON $DIR/timing/runTimingExperiment.py             \
+               --dbname=$PGDATABASE --port=$PGPORT                \
+               --dimensions=$D --log=$TIMINGLOG                   \
+               --model=kde_heuristic --modelsize=$MODELSIZE       \
+               --trainqueries=0 --queries=$TESTQUERIES            \
+               --backend=$BACKEND
+         done
+      done
+   done
+   kill -9 $PGPID
+   sleep 5
+done
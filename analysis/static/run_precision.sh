@@ -0,0 +1,73 @@
+#!/bin/bash
+
+DIR="$( cd "$( dirname "${BASH_SOURCE[0]}" )" && pwd )"
+source $DIR/../conf.sh
+
+# Some general parameters.
+REPETITIONS=10
+TRAINQUERIES=100
+TESTQUERIES=100
+LOGFILE=$DIR/../evaluation/precision/result.csv
+TIMINGLOG=$DIR/../evaluation/precision/result_time.csv
+
+dataset=$DIR/datasets/forest
+query=$dataset/queries/forest8_dt_0.01.sql
+
+MODELSIZES=(1024 4096 16384 65536)
+PRECISIONS=(double single)
+
+# Accuracy: Compare the estimation errors of both precisions.
+for MODELSIZE in "${MODELSIZES[@]}"; do
+        query_file=`basename $query`
+        echo "  Running for query file $query_file with modelsize $MODELSIZE:"
+        $POSTGRES -D $PGDATAFOLDER -p $PGPORT >>  postgres.log 2>&1 &
+        PGPID=$!
+        sleep 2
+        for i in $(seq 1 $REPETITIONS); do
+           echo "    Repetition $i:"
+           TS=$SECONDS
+
+           for PRECISION in "${PRECISIONS[@]}"; do
+              echo "      KDE (batch, $PRECISION):"
+              $PYTHON $DIR/runExperiment.py                                 \
+                 --dbname=$PGDATABASE --port=$PGPORT                       \
+                 --queryfile=$query --log=$LOGFILE                         \
+                 --model=kde_batch --modelsize=$MODELSIZE                  \
+                 --trainqueries=$TRAINQUERIES --testqueries=$TESTQUERIES   \
+                 --precision=$PRECISION
+
+              echo "      KDE (heuristic, $PRECISION):"
+              $PYTHON $DIR/runExperiment.py                                 \
+                 --dbname=$PGDATABASE --port=$PGPORT                       \
+                 --queryfile=$query --log=$LOGFILE                         \
+                 --model=kde_heuristic --modelsize=$MODELSIZE              \
+                 --trainqueries=$TRAINQUERIES --testqueries=$TESTQUERIES   \
+                 --replay_experiment --precision=$PRECISION
+           done
+
+           ELAPSED=$(($SECONDS - $TS))
+           echo "    Repetition finished (took $ELAPSED seconds)!"
+        done
+        kill -9 $PGPID
+        sleep 2
+    done
+
+# Throughput: Compare the estimation time of both precisions.
+cd $DIR/timing
+for MODELSIZE in "${MODELSIZES[@]}"; do
+      echo "  Timing with modelsize $MODELSIZE:"
+      $POSTGRES -D $PGDATAFOLDER -p $PGPORT >>  postgres.log 2>&1 &
+      PGPID=$!
+      sleep 2
+      for PRECISION in "${PRECISIONS[@]}"; do
+         echo "      KDE Heuristic (GPU, $PRECISION):"
+         $PYTHON $DIR/timing/runTimingExperiment.py             \
+            --dbname=$PGDATABASE --port=$PGPORT                \
+            --dimensions=8 --log=$TIMINGLOG                    \
+            --model=kde_heuristic --modelsize=$MODELSIZE       \
+            --trainqueries=0 --queries=$TESTQUERIES --gpu      \
+            --precision=$PRECISION
+      done
+      kill -9 $PGPID
+      sleep 5
+done
@@ -35,6 +35,11 @@ def createQuery(table, dimensions):
     query += "c%i > %f AND c%i < %f" % (i, interval[0], i, interval[1])
   return query
 
+# Fetch the time (in microseconds) spent in each estimator phase so far.
+def readTimings(cur):
+  cur.execute("SELECT phase, total_time FROM kde_timings;")
+  return dict((phase, int(total * 1000)) for (phase, total) in cur.fetchall())
+
 # Define and parse the command line arguments
 parser = argparse.ArgumentParser()
 parser.add_argument("--dbname", action="store", required=True, help="Database to which the script will connect.")
@@ -81,8 +86,8 @@ cur = conn.cursor()
 
 query_time = 0
 
-# Activate the internal timing.
-cur.execute("SET kde_timing_logfile TO '/tmp/time_%i.log'" % args.port)
+# Only measure the internal timing of the experiment queries.
+start_timings = readTimings(cur)
 
 sys.stdout.write("\tRunning experiment ... ")
 sys.stdout.flush()
@@ -98,28 +103,16 @@ while (finished_queries < args.queries):
    total_runtime += (te - ts)
    finished_queries += 1
 print "done!"
+timings = readTimings(cur)
 conn.close()
 total_runtime *= 1000
 
 # Now aggregate the measurements.
 construction_time = 0
-estimation_time = 0
+estimation_time = timings["estimation"] - start_timings["estimation"]
 maintenance_time = 0
-first = True
-f = open("/tmp/time_%i.log" % args.port, "r")
-for line in f:
-   m = re.search("([a-zA-Z ]+): ([0-9]+)", line)
-   if m:
-      category = m.group(1)
-      runtime = int(m.group(2))
-      if category == "Estimation" and not first:
-         estimation_time += runtime
-      elif category == "Model Construction":
-         construction_time += runtime
-      elif category == "Model Maintenance" and not first:
-         maintenance_time += runtime
-      first = False
-f.close()
+for phase in ["propagation", "maintenance"]:
+   maintenance_time += timings[phase] - start_timings[phase]
 
 f = open(args.log, "a+")
 if os.path.getsize(args.log) == 0:
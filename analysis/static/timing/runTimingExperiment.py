@@ -42,6 +42,11 @@ def createQuery(table, dimensions):
     query += "c%i > %f AND c%i < %f" % (i, interval[0], i, interval[1])
   return query
 
+# Fetch the time (in microseconds) spent in each estimator phase so far.
+def readTimings(cur):
+  cur.execute("SELECT phase, total_time FROM kde_timings;")
+  return dict((phase, int(total * 1000)) for (phase, total) in cur.fetchall())
+
 # Define and parse the command line arguments
 parser = argparse.ArgumentParser()
 parser.add_argument("--dbname", action="store", required=True, help="Database to which the script will connect.")
@@ -52,6 +57,8 @@ parser.add_argument("--trainqueries", action="store", default=100, type=int, hel
 parser.add_argument("--gpu", action="store_true", help="Use the graphics card.")
 parser.add_argument("--model", action="store", choices=["none", "stholes", "kde_heuristic", "kde_adaptive","kde_batch", "kde_optimal"], default="none", help="Which model should be used?")
 parser.add_argument("--modelsize", action="store", required=True, type=int, help="How many rows should the generated model sample?")
+parser.add_argument("--precision", action="store", choices=["double", "single"], default="double", help="Floating point precision of the KDE estimates.")
+parser.add_argument("--backend", action="store", choices=["opencl", "native", "grid"], default="opencl", help="Where should the KDE estimates be computed?")
 parser.add_argument("--log", action="store", required=True, help="Where to append the experimental results?")
 parser.add_argument("--reuse", action="store_true", help="Don't rebuild the model.")
 
@@ -61,6 +68,11 @@ args = parser.parse_args()
 queries = args.queries
 trainqueries = args.trainqueries
 model = args.model
+model_name = model
+if "kde" in model and args.precision <> "double":
+    model_name = "%s_%s" % (model, args.precision)
+if "kde" in model and args.backend <> "opencl":
+    model_name = "%s_%s" % (model_name, args.backend)
 modelsize = args.modelsize
 log = args.log
 
@@ -69,9 +81,6 @@ conn = psycopg2.connect("dbname=%s host=localhost port=%i" % (args.dbname, args.
 conn.set_session('read uncommitted', autocommit=True)
 cur = conn.cursor()
 
-# Activate the internal timing.
-cur.execute("SET kde_timing_logfile TO '/tmp/time_%i.log'" % args.port)
-
 # Prepare the table name.
 table = "time%i" % args.dimensions
 
@@ -97,6 +106,8 @@ elif (model <> "none"):
       cur.execute("SET ocl_use_gpu TO false;")
     cur.execute("SET kde_enable TO true;")
     cur.execute("SET kde_debug TO false;")
+    cur.execute("SET kde_estimation_precision TO %s;" % args.precision)
+    cur.execute("SET kde_backend TO %s;" % args.backend)
 
 # Initialize the training phase.
 if (model == "kde_batch"):
@@ -164,31 +175,17 @@ while (finished_queries < queries):
    total_runtime += (te - ts)
    finished_queries += 1
 print "done!"
+timings = readTimings(cur)
 conn.close()
 total_runtime *= 1000
 
 # Now aggregate the measurements.
-construction_time = 0
-estimation_time = 0
-maintenance_time = 0
-first = True
-f = open("/tmp/time_%i.log" % args.port, "r")
-for line in f:
-   m = re.search("([a-zA-Z ]+): ([0-9]+)", line)
-   if m:
-      category = m.group(1)
-      runtime = int(m.group(2))
-      if category == "Estimation" and not first:
-         estimation_time += runtime
-      elif category == "Model Construction":
-         construction_time += runtime
-      elif category == "Model Maintenance" and not first:
-         maintenance_time += runtime
-      first = False
-f.close()
+construction_time = timings["construction"]
+estimation_time = timings["estimation"]
+maintenance_time = timings["maintenance"]
 
 f = open(log, "a+")
 if os.path.getsize(log) == 0:
     f.write("Dimensions;Model;GPU;ModelSize;ConstructionTime;EstimationTime;MaintenanceTime;TotalRuntime\n")
-f.write("%i;%s;%s;%i;%i;%i;%i;%.2f\n" % (args.dimensions, args.model, args.gpu, args.modelsize, construction_time, estimation_time, maintenance_time, total_runtime))
+f.write("%i;%s;%s;%i;%i;%i;%i;%.2f\n" % (args.dimensions, model_name, args.gpu, args.modelsize, construction_time, estimation_time, maintenance_time, total_runtime))
 f.close()
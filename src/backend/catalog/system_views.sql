@@ -387,6 +387,9 @@ CREATE VIEW pg_timezone_abbrevs AS
 CREATE VIEW pg_timezone_names AS
     SELECT * FROM pg_timezone_names();
 
+CREATE VIEW kde_timings AS
+    SELECT * FROM kde_get_timings();
+
 -- Statistics views
 
 CREATE VIEW pg_stat_all_tables AS
@@ -185,8 +185,6 @@ ExecInsert(TupleTableSlot *slot,
 	resultRelInfo = estate->es_result_relation_info;
 	resultRelationDesc = resultRelInfo->ri_RelationDesc;
 
-	ocl_notifySampleMaintenanceOfInsertion(resultRelationDesc, tuple);
-
 	/*
 	 * If the result relation has OIDs, force the tuple's OID to zero so that
 	 * heap_insert will assign a fresh OID.  Usually the OID already will be
@@ -264,6 +262,12 @@ ExecInsert(TupleTableSlot *slot,
 		newId = heap_insert(resultRelationDesc, tuple,
 							estate->es_output_cid, 0, NULL);
 
+		/*
+		 * notify the KDE models, they remember the tid of sampled tuples
+		 */
+		ocl_notifySampleMaintenanceOfInsertion(resultRelationDesc, tuple,
+											   &resultRelInfo->ri_KdeChanges);
+
 		/*
 		 * insert index entries for tuple
 		 */
@@ -328,7 +332,8 @@ ExecDelete(ItemPointer tupleid,
 	resultRelInfo = estate->es_result_relation_info;
 	resultRelationDesc = resultRelInfo->ri_RelationDesc;
 
-	ocl_notifySampleMaintenanceOfDeletion(resultRelationDesc,tupleid);
+	ocl_notifySampleMaintenanceOfDeletion(resultRelationDesc, tupleid,
+										  &resultRelInfo->ri_KdeChanges);
 
 	/* BEFORE ROW DELETE Triggers */
 	if (resultRelInfo->ri_TrigDesc &&
@@ -752,6 +757,12 @@ lreplace:;
 				return NULL;
 		}
 
+		/*
+		 * notify the KDE models, sampled tuples have moved to a new tid
+		 */
+		ocl_notifySampleMaintenanceOfUpdate(resultRelationDesc, tupleid, tuple,
+											&resultRelInfo->ri_KdeChanges);
+
 		/*
 		 * Note: instead of having to update the old index tuples associated
 		 * with the heap tuple, all we do is form and insert new index tuples.
@@ -1365,6 +1376,18 @@ ExecEndModifyTable(ModifyTableState *node)
 														   resultRelInfo);
 	}
 
+	/*
+	 * Apply the KDE sample changes that were collected during the statement
+	 */
+	for (i = 0; i < node->mt_nplans; i++)
+	{
+		ResultRelInfo *resultRelInfo = node->resultRelInfo + i;
+
+		ocl_flushSampleMaintenance(resultRelInfo->ri_RelationDesc,
+								   resultRelInfo->ri_KdeChanges);
+		resultRelInfo->ri_KdeChanges = NULL;
+	}
+
 	/*
 	 * Free the exprcontext
 	 */
@@ -3,6 +3,8 @@
 //KDE
 #include "postgres.h"
 #include "kde_feedback/kde_feedback.h"
+#include "kde_feedback/kde_feedback_queue.h"
+#include "miscadmin.h"
 #include "nodes/execnodes.h"
 #include "executor/instrument.h"
 #include "utils/builtins.h"
@@ -38,31 +40,19 @@ bool kde_feedback_use_collection() {
     return ocl_reportErrors() || kde_collect_feedback || kde_enable_adaptive_bandwidth;
 }
 
-// Helper function to materialize an RQlist to a buffer.
-static bytea* materialize_rqlist_to_buffer(RQClauseList *rqlist,
-                                           unsigned int* attribute_bitmap) {
-  // First, count how many elements are in the list.
-  unsigned int elements_in_list = 0;
-  RQClauseList* tmp = rqlist;
-  while (tmp) {
-    elements_in_list++;
-    tmp = tmp->next;
-  }
-  if (elements_in_list == 0) return NULL;
-  // Allocate the result buffer.
-  bytea* buffer = palloc(sizeof(RQClause) * elements_in_list + VARHDRSZ);
-  // Register the buffer size.
-  SET_VARSIZE(buffer, sizeof(RQClause) * elements_in_list + VARHDRSZ);
-  // And materialize all list elements.
-  unsigned int pos = 0;
-  char* payload = VARDATA(buffer);
+// Helper function to materialize an RQlist to a feedback record. Returns
+// false if the list has more clauses than a record can hold.
+static bool materialize_rqlist_to_record(RQClauseList *rqlist,
+                                         kde_feedback_record_t* record) {
+  record->nr_of_clauses = 0;
+  record->columns = 0;
   while (rqlist) {
-    *((RQClause*)(&(payload[pos]))) = rqlist->clause;
-    (*attribute_bitmap) |= (0x1 << rqlist->clause.var);
-    pos += sizeof(RQClause);
+    if (record->nr_of_clauses == KDE_FEEDBACK_MAX_CLAUSES) return false;
+    record->clauses[record->nr_of_clauses++] = rqlist->clause;
+    record->columns |= (0x1 << rqlist->clause.var);
     rqlist = rqlist->next;
   }
-  return buffer;
+  return true;
 }
 
 // Helper function to extract a materialized list of RQClauses from a buffer.
@@ -294,12 +284,7 @@ cleanup:
 int kde_finish(PlanState *node){
 	List* rtable;
   	RangeTblEntry *rte;
-	
-	Relation pg_database_rel;
-	Datum		new_record[Natts_pg_kdefeedback];
-	bool		new_record_nulls[Natts_pg_kdefeedback];
-	HeapTuple	tuple;
-	CatalogIndexState index_state;
+	kde_feedback_record_t record;
 
 	if(node == NULL) return 0;
 	
@@ -313,12 +298,8 @@ int kde_finish(PlanState *node){
        rtable=node->instrument->kde_rtable;
 	    rte = rt_fetch(((Scan *) node->plan)->scanrelid, rtable);
 	    
-	    MemSet(new_record, 0, sizeof(new_record));
-	    MemSet(new_record_nulls, false, sizeof(new_record_nulls));
-	    
-	    unsigned int attribute_bitmap = 0;
-	    bytea* rq_buffer = materialize_rqlist_to_buffer(
-	        node->instrument->kde_rq, &attribute_bitmap);
+	    bool complete_record = materialize_rqlist_to_record(
+	        node->instrument->kde_rq, &record);
        release_rqlist(node->instrument->kde_rq);
        node->instrument->kde_rq = NULL;
 	    float8 qual_tuples =
@@ -333,7 +314,6 @@ int kde_finish(PlanState *node){
 	    //However, empty tables are not that interesting from a selectivity estimators point of view anyway.
 	    if(qual_tuples == 0.0 && all_tuples == 0.0){
 	      node->instrument->kde_rq = NULL;
-	      pfree(rq_buffer);
 	      return 1;
 	    }
 
@@ -342,26 +322,20 @@ int kde_finish(PlanState *node){
 	        rte->relid, qual_tuples, all_tuples);
 
 	    if (!kde_collect_feedback) return 1;
+	    if (!complete_record) {
+	      kde_count_dropped_feedback();
+	      return 1;
+	    }
 
-	    pg_database_rel = heap_open(KdeFeedbackRelationID, RowExclusiveLock);
-	    index_state = CatalogOpenIndexes(pg_database_rel);
-	    
-	    new_record[Anum_pg_kdefeedback_timestamp-1] = Int64GetDatum((int64)time(NULL));
-	    new_record[Anum_pg_kdefeedback_relid-1] = ObjectIdGetDatum(rte->relid);
-	    new_record[Anum_pg_kdefeedback_columns-1] = Int32GetDatum(attribute_bitmap);
-	    new_record[Anum_pg_kdefeedback_ranges-1] = PointerGetDatum(rq_buffer);
-	    new_record[Anum_pg_kdefeedback_all_tuples-1] = Float8GetDatum(all_tuples);
-      new_record[Anum_pg_kdefeedback_qualified_tuples-1] = Float8GetDatum(qual_tuples);
-	    
-	    tuple = heap_form_tuple(RelationGetDescr(pg_database_rel),
-							new_record, new_record_nulls);
-	    simple_heap_insert(pg_database_rel, tuple);
-	    CatalogIndexInsert(index_state, tuple);
-	
-	    CatalogCloseIndexes(index_state);
-	    heap_close(pg_database_rel, RowExclusiveLock);
-	    pfree(rq_buffer);
-	    node->instrument->kde_rq = NULL;	    
+	    record.database = MyDatabaseId;
+	    record.timestamp = (int64)time(NULL);
+	    record.table = rte->relid;
+	    record.all_tuples = all_tuples;
+	    record.qualified_tuples = qual_tuples;
+
+	    // Hand the record to the feedback worker. If the queue is disabled, we
+	    // have to insert it ourselves.
+	    if (!kde_enqueue_feedback(&record)) kde_insert_feedback(&record, 1);
 	  }
 	  
 	} 
@@ -0,0 +1,477 @@
+/*
+ * kde_feedback_queue.c
+ */
+
+#include "postgres.h"
+#include "kde_feedback/kde_feedback_queue.h"
+
+#include <signal.h>
+
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "access/heapam.h"
+#include "access/htup_details.h"
+#include "access/xact.h"
+#include "catalog/indexing.h"
+#include "catalog/pg_kdefeedback.h"
+#include "catalog/pg_type.h"
+#include "postmaster/bgworker.h"
+#include "storage/barrier.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/lwlock.h"
+#include "storage/proc.h"
+#include "storage/shmem.h"
+#include "storage/spin.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/memutils.h"
+#include "utils/rel.h"
+#include "utils/snapmgr.h"
+
+// GUC configuration variable.
+int kde_feedback_queue_size = 1024;
+
+// Number of records that are inserted with a single multi-row insert.
+#define KDE_FEEDBACK_BATCH_SIZE 64
+
+typedef enum {
+  SLOT_FREE,        // Not part of the queue.
+  SLOT_WRITING,     // Reserved by a backend that still copies its record.
+  SLOT_READY,       // Waiting to be inserted.
+  SLOT_CLAIMED,     // Inserted by a transaction that has not committed yet.
+  SLOT_CONSUMED     // Inserted, waiting for the tail to move past it.
+} kde_feedback_slot_state_t;
+
+typedef struct kde_feedback_slot {
+  int state;
+  kde_feedback_record_t record;
+} kde_feedback_slot_t;
+
+/*
+ * Shared ring buffer of feedback records. Backends only hold the spinlock to
+ * reserve a slot and copy their record without holding any lock. Consumers
+ * (the worker, or a backend that needs the feedback right away) are
+ * serialized by KdeFeedbackQueueLock and may skip records of other databases,
+ * so the tail only moves past a contiguous range of consumed slots.
+ *
+ * A consumer claims the slots it inserts. The slots are only consumed once
+ * the inserting transaction commits, and become ready again if it aborts.
+ */
+typedef struct kde_feedback_queue {
+  slock_t mutex;                // Protects the positions, counters and latch.
+  uint64 head;                  // Position of the next slot to reserve.
+  uint64 tail;                  // Position of the oldest slot in use.
+  uint64 enqueued;
+  uint64 dropped;               // Records that were never inserted.
+  Latch* worker_latch;          // Latch of the worker, NULL if not running.
+  Oid connecting_database;      // Database the worker is connecting to.
+  kde_feedback_slot_t slots[FLEXIBLE_ARRAY_MEMBER];
+} kde_feedback_queue_t;
+
+static kde_feedback_queue_t* feedback_queue = NULL;
+
+// Set by the SIGTERM handler of the worker.
+static volatile sig_atomic_t got_sigterm = false;
+
+Size kde_feedback_queue_shmem_size(void) {
+  if (kde_feedback_queue_size == 0) return 0;
+  return MAXALIGN(add_size(
+      offsetof(kde_feedback_queue_t, slots),
+      mul_size(kde_feedback_queue_size, sizeof(kde_feedback_slot_t))));
+}
+
+void kde_feedback_queue_shmem_init(void) {
+  bool found;
+  int i;
+  if (kde_feedback_queue_size == 0) return;
+  feedback_queue = ShmemInitStruct(
+      "KDE Feedback Queue", kde_feedback_queue_shmem_size(), &found);
+  if (!found) {
+    SpinLockInit(&(feedback_queue->mutex));
+    feedback_queue->head = 0;
+    feedback_queue->tail = 0;
+    feedback_queue->enqueued = 0;
+    feedback_queue->dropped = 0;
+    feedback_queue->worker_latch = NULL;
+    feedback_queue->connecting_database = InvalidOid;
+    for (i = 0; i < kde_feedback_queue_size; ++i) {
+      feedback_queue->slots[i].state = SLOT_FREE;
+    }
+  }
+}
+
+// Helper function to access the slot at the given position of the ring.
+static volatile kde_feedback_slot_t* get_slot(uint64 position) {
+  return &(feedback_queue->slots[position % kde_feedback_queue_size]);
+}
+
+bool kde_enqueue_feedback(const kde_feedback_record_t* record) {
+  volatile kde_feedback_queue_t* queue = feedback_queue;
+  volatile kde_feedback_slot_t* slot;
+  Latch* worker_latch;
+  if (queue == NULL) return false;
+  SpinLockAcquire(&(queue->mutex));
+  if (queue->head - queue->tail >= (uint64) kde_feedback_queue_size) {
+    queue->dropped++;
+    SpinLockRelease(&(queue->mutex));
+    return true;
+  }
+  slot = get_slot(queue->head++);
+  slot->state = SLOT_WRITING;
+  queue->enqueued++;
+  worker_latch = queue->worker_latch;
+  SpinLockRelease(&(queue->mutex));
+  // Copy the record outside of the lock, and only then publish it.
+  memcpy((void*) &(slot->record), record, sizeof(kde_feedback_record_t));
+  pg_write_barrier();
+  slot->state = SLOT_READY;
+  if (worker_latch) SetLatch(worker_latch);
+  return true;
+}
+
+void kde_count_dropped_feedback(void) {
+  volatile kde_feedback_queue_t* queue = feedback_queue;
+  if (queue == NULL) return;
+  SpinLockAcquire(&(queue->mutex));
+  queue->dropped++;
+  SpinLockRelease(&(queue->mutex));
+}
+
+void kde_insert_feedback(
+    const kde_feedback_record_t* records, unsigned int nr_of_records) {
+  unsigned int i;
+  Datum values[Natts_pg_kdefeedback];
+  bool nulls[Natts_pg_kdefeedback];
+  Relation feedback_rel;
+  HeapTuple* tuples;
+  CatalogIndexState index_state;
+  if (nr_of_records == 0) return;
+  feedback_rel = heap_open(KdeFeedbackRelationID, RowExclusiveLock);
+  tuples = palloc(sizeof(HeapTuple) * nr_of_records);
+  MemSet(nulls, false, sizeof(nulls));
+  for (i = 0; i < nr_of_records; ++i) {
+    const kde_feedback_record_t* record = &(records[i]);
+    size_t ranges_size = sizeof(RQClause) * record->nr_of_clauses;
+    bytea* ranges = palloc(ranges_size + VARHDRSZ);
+    SET_VARSIZE(ranges, ranges_size + VARHDRSZ);
+    memcpy(VARDATA(ranges), record->clauses, ranges_size);
+    values[Anum_pg_kdefeedback_timestamp-1] = Int64GetDatum(record->timestamp);
+    values[Anum_pg_kdefeedback_relid-1] = ObjectIdGetDatum(record->table);
+    values[Anum_pg_kdefeedback_columns-1] = Int32GetDatum(record->columns);
+    values[Anum_pg_kdefeedback_ranges-1] = PointerGetDatum(ranges);
+    values[Anum_pg_kdefeedback_all_tuples-1] =
+        Float8GetDatum(record->all_tuples);
+    values[Anum_pg_kdefeedback_qualified_tuples-1] =
+        Float8GetDatum(record->qualified_tuples);
+    tuples[i] = heap_form_tuple(
+        RelationGetDescr(feedback_rel), values, nulls);
+    pfree(ranges);
+  }
+  heap_multi_insert(
+      feedback_rel, tuples, nr_of_records, GetCurrentCommandId(true), 0, NULL);
+  index_state = CatalogOpenIndexes(feedback_rel);
+  for (i = 0; i < nr_of_records; ++i) {
+    CatalogIndexInsert(index_state, tuples[i]);
+    heap_freetuple(tuples[i]);
+  }
+  CatalogCloseIndexes(index_state);
+  heap_close(feedback_rel, RowExclusiveLock);
+  pfree(tuples);
+}
+
+// Slots that the current transaction has inserted, in the order of their
+// claims. The nesting level of the claiming subtransaction never decreases
+// along the array, so the claims of a subtransaction form its suffix.
+typedef struct kde_feedback_claim {
+  uint64 position;
+  int nest_level;
+} kde_feedback_claim_t;
+
+static kde_feedback_claim_t* claims = NULL;
+static int nr_of_claims = 0;
+static int max_claims = 0;
+static bool claim_callbacks_registered = false;
+
+// Helper function to release the consumed slots at the tail of the ring.
+static void release_consumed_slots(void) {
+  volatile kde_feedback_queue_t* queue = feedback_queue;
+  SpinLockAcquire(&(queue->mutex));
+  while (queue->tail < queue->head &&
+         get_slot(queue->tail)->state == SLOT_CONSUMED) {
+    get_slot(queue->tail++)->state = SLOT_FREE;
+  }
+  SpinLockRelease(&(queue->mutex));
+}
+
+// Helper function to resolve all claims from the given one on. Committed
+// slots are consumed, the slots of aborted (sub)transactions are handed back
+// to the worker.
+static void resolve_claims(int first, bool committed) {
+  volatile kde_feedback_queue_t* queue = feedback_queue;
+  Latch* worker_latch;
+  int i;
+  if (first >= nr_of_claims) return;
+  for (i = first; i < nr_of_claims; ++i) {
+    get_slot(claims[i].position)->state =
+        committed ? SLOT_CONSUMED : SLOT_READY;
+  }
+  nr_of_claims = first;
+  if (committed) {
+    release_consumed_slots();
+    return;
+  }
+  SpinLockAcquire(&(queue->mutex));
+  worker_latch = queue->worker_latch;
+  SpinLockRelease(&(queue->mutex));
+  if (worker_latch) SetLatch(worker_latch);
+}
+
+static void kde_feedback_xact_callback(XactEvent event, void* arg) {
+  if (event == XACT_EVENT_COMMIT || event == XACT_EVENT_PREPARE) {
+    resolve_claims(0, true);
+  } else if (event == XACT_EVENT_ABORT) {
+    resolve_claims(0, false);
+  }
+}
+
+static void kde_feedback_subxact_callback(
+    SubXactEvent event, SubTransactionId subid, SubTransactionId parent_subid,
+    void* arg) {
+  int level = GetCurrentTransactionNestLevel();
+  int first = nr_of_claims;
+  while (first > 0 && claims[first - 1].nest_level >= level) first--;
+  if (event == SUBXACT_EVENT_ABORT_SUB) {
+    resolve_claims(first, false);
+  } else if (event == SUBXACT_EVENT_COMMIT_SUB) {
+    // The parent transaction takes over the claims.
+    for (; first < nr_of_claims; ++first) claims[first].nest_level = level - 1;
+  }
+}
+
+// Helper function to remember that the current transaction inserted a slot.
+static void claim_slot(uint64 position) {
+  if (!claim_callbacks_registered) {
+    RegisterXactCallback(kde_feedback_xact_callback, NULL);
+    RegisterSubXactCallback(kde_feedback_subxact_callback, NULL);
+    claim_callbacks_registered = true;
+  }
+  if (nr_of_claims == max_claims) {
+    max_claims = max_claims ? 2 * max_claims : KDE_FEEDBACK_BATCH_SIZE;
+    claims = claims ?
+        repalloc(claims, sizeof(kde_feedback_claim_t) * max_claims) :
+        MemoryContextAlloc(
+            TopMemoryContext, sizeof(kde_feedback_claim_t) * max_claims);
+  }
+  get_slot(position)->state = SLOT_CLAIMED;
+  claims[nr_of_claims].position = position;
+  claims[nr_of_claims].nest_level = GetCurrentTransactionNestLevel();
+  nr_of_claims++;
+}
+
+// Helper function to insert all ready records of the current database.
+// Sets other_databases if there are ready records that we cannot serve.
+//
+// Returns the number of inserted records.
+static unsigned int drain_queue(bool* other_databases) {
+  volatile kde_feedback_queue_t* queue = feedback_queue;
+  unsigned int i, drained = 0;
+  uint64 position, head;
+  uint64 batch_positions[KDE_FEEDBACK_BATCH_SIZE];
+  kde_feedback_record_t* batch =
+      palloc(sizeof(kde_feedback_record_t) * KDE_FEEDBACK_BATCH_SIZE);
+  *other_databases = false;
+  LWLockAcquire(KdeFeedbackQueueLock, LW_EXCLUSIVE);
+  SpinLockAcquire(&(queue->mutex));
+  position = queue->tail;
+  head = queue->head;
+  SpinLockRelease(&(queue->mutex));
+  while (position < head) {
+    unsigned int batch_size = 0;
+    for (; position < head && batch_size < KDE_FEEDBACK_BATCH_SIZE;
+         ++position) {
+      volatile kde_feedback_slot_t* slot = get_slot(position);
+      if (slot->state != SLOT_READY) continue;
+      pg_read_barrier();
+      if (slot->record.database != MyDatabaseId) {
+        *other_databases = true;
+        continue;
+      }
+      memcpy(&(batch[batch_size]), (void*) &(slot->record),
+             sizeof(kde_feedback_record_t));
+      batch_positions[batch_size++] = position;
+    }
+    kde_insert_feedback(batch, batch_size);
+    // The slots are consumed once our transaction commits.
+    for (i = 0; i < batch_size; ++i) claim_slot(batch_positions[i]);
+    drained += batch_size;
+  }
+  LWLockRelease(KdeFeedbackQueueLock);
+  pfree(batch);
+  return drained;
+}
+
+void kde_drain_feedback_queue(void) {
+  bool other_databases;
+  if (feedback_queue == NULL) return;
+  if (drain_queue(&other_databases) == 0) return;
+  // Make the new records visible to the following queries.
+  CommandCounterIncrement();
+  if (ActiveSnapshotSet()) UpdateActiveSnapshotCommandId();
+}
+
+// Helper function to find the database of the oldest ready record.
+static Oid next_database(void) {
+  volatile kde_feedback_queue_t* queue = feedback_queue;
+  Oid database = InvalidOid;
+  uint64 position, head;
+  LWLockAcquire(KdeFeedbackQueueLock, LW_SHARED);
+  SpinLockAcquire(&(queue->mutex));
+  position = queue->tail;
+  head = queue->head;
+  SpinLockRelease(&(queue->mutex));
+  for (; position < head; ++position) {
+    volatile kde_feedback_slot_t* slot = get_slot(position);
+    if (slot->state != SLOT_READY) continue;
+    pg_read_barrier();
+    database = slot->record.database;
+    break;
+  }
+  LWLockRelease(KdeFeedbackQueueLock);
+  return database;
+}
+
+// Helper function to drop all ready records of a database that we cannot
+// connect to (e.g., because it was dropped in the meantime).
+static void discard_database(Oid database) {
+  volatile kde_feedback_queue_t* queue = feedback_queue;
+  uint64 position, head, discarded = 0;
+  LWLockAcquire(KdeFeedbackQueueLock, LW_EXCLUSIVE);
+  SpinLockAcquire(&(queue->mutex));
+  position = queue->tail;
+  head = queue->head;
+  SpinLockRelease(&(queue->mutex));
+  for (; position < head; ++position) {
+    volatile kde_feedback_slot_t* slot = get_slot(position);
+    if (slot->state != SLOT_READY) continue;
+    pg_read_barrier();
+    if (slot->record.database != database) continue;
+    slot->state = SLOT_CONSUMED;
+    discarded++;
+  }
+  SpinLockAcquire(&(queue->mutex));
+  queue->dropped += discarded;
+  SpinLockRelease(&(queue->mutex));
+  release_consumed_slots();
+  LWLockRelease(KdeFeedbackQueueLock);
+  if (discarded > 0) {
+    ereport(LOG,
+            (errmsg("discarded " UINT64_FORMAT " KDE feedback records of "
+                    "database %u, which cannot be connected to",
+                    discarded, database)));
+  }
+}
+static void kde_feedback_worker_sigterm(SIGNAL_ARGS) {
+  int save_errno = errno;
+  got_sigterm = true;
+  if (MyProc) SetLatch(&MyProc->procLatch);
+  errno = save_errno;
+}
+
+static void kde_detach_feedback_worker(int code, Datum arg) {
+  volatile kde_feedback_queue_t* queue = feedback_queue;
+  SpinLockAcquire(&(queue->mutex));
+  if (queue->worker_latch == &MyProc->procLatch) queue->worker_latch = NULL;
+  SpinLockRelease(&(queue->mutex));
+}
+
+/*
+ * Main function of the feedback worker.
+ */
+static void kde_feedback_worker_main(Datum main_arg) {
+  volatile kde_feedback_queue_t* queue = feedback_queue;
+  Oid database;
+  int rc;
+  pqsignal(SIGTERM, kde_feedback_worker_sigterm);
+  BackgroundWorkerUnblockSignals();
+  // Announce ourselves, so backends can wake us up. If our predecessor died
+  // while connecting, its database cannot be served anymore.
+  SpinLockAcquire(&(queue->mutex));
+  queue->worker_latch = &MyProc->procLatch;
+  database = queue->connecting_database;
+  queue->connecting_database = InvalidOid;
+  SpinLockRelease(&(queue->mutex));
+  on_shmem_exit(kde_detach_feedback_worker, 0);
+  if (OidIsValid(database)) discard_database(database);
+
+  while (!got_sigterm) {
+    if (!OidIsValid(MyDatabaseId)) {
+      database = next_database();
+      if (OidIsValid(database)) {
+        // Connecting to a database that no longer exists is FATAL, so leave
+        // a note for our successor.
+        SpinLockAcquire(&(queue->mutex));
+        queue->connecting_database = database;
+        SpinLockRelease(&(queue->mutex));
+        BackgroundWorkerInitializeConnectionByOid(database, NULL);
+        SpinLockAcquire(&(queue->mutex));
+        queue->connecting_database = InvalidOid;
+        SpinLockRelease(&(queue->mutex));
+        continue;
+      }
+    } else {
+      bool other_databases;
+      unsigned int drained;
+      SetCurrentStatementStartTimestamp();
+      StartTransactionCommand();
+      pgstat_report_activity(STATE_RUNNING, "inserting KDE feedback");
+      drained = drain_queue(&other_databases);
+      CommitTransactionCommand();
+      pgstat_report_activity(STATE_IDLE, NULL);
+      if (drained > 0) continue;
+      if (other_databases) {
+        // We are bound to our database. Exit with code 0, so the postmaster
+        // restarts us right away to serve the remaining records.
+        proc_exit(0);
+      }
+    }
+    rc = WaitLatch(&MyProc->procLatch,
+                       WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+                       10 * 1000L);
+    ResetLatch(&MyProc->procLatch);
+    if (rc & WL_POSTMASTER_DEATH) proc_exit(1);
+  }
+  proc_exit(0);
+}
+
+void kde_register_feedback_worker(void) {
+  BackgroundWorker worker;
+  if (kde_feedback_queue_size == 0) return;
+  MemSet(&worker, 0, sizeof(BackgroundWorker));
+  snprintf(worker.bgw_name, BGW_MAXLEN, "kde feedback collection");
+  worker.bgw_flags =
+      BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
+  worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+  worker.bgw_restart_time = 10;
+  worker.bgw_main = kde_feedback_worker_main;
+  RegisterBackgroundWorker(&worker);
+}
+
+Datum kde_get_feedback_stats(PG_FUNCTION_ARGS) {
+  volatile kde_feedback_queue_t* queue = feedback_queue;
+  Datum datum_array[3];
+  int64 enqueued = 0, dropped = 0, pending = 0;
+  if (queue != NULL) {
+    SpinLockAcquire(&(queue->mutex));
+    enqueued = queue->enqueued;
+    dropped = queue->dropped;
+    pending = queue->head - queue->tail;
+    SpinLockRelease(&(queue->mutex));
+  }
+  datum_array[0] = Int64GetDatum(enqueued);
+  datum_array[1] = Int64GetDatum(dropped);
+  datum_array[2] = Int64GetDatum(pending);
+  PG_RETURN_ARRAYTYPE_P(
+      construct_array(
+          datum_array, 3, INT8OID, sizeof(int64), FLOAT8PASSBYVAL, 'd'));
+}
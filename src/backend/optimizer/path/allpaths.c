@@ -162,6 +162,11 @@ set_base_rel_sizes(PlannerInfo *root)
 {
 	Index		rti;
 
+#ifdef USE_OPENCL
+	/* Let the KDE estimators evaluate all restrictions in one batch */
+	clauselist_prefetch_kde_selectivities(root);
+#endif
+
 	for (rti = 1; rti < root->simple_rel_array_size; rti++)
 	{
 		RelOptInfo *rel = root->simple_rel_array[rti];
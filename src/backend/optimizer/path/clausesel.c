@@ -50,6 +50,159 @@ static void addRangeClause(RangeQueryClause **rqlist, Node *clause,
  *		ROUTINES TO COMPUTE SELECTIVITIES
  ****************************************************************************/
 
+#ifdef USE_OPENCL
+/*
+ * kde_collect_range_request -
+ *	  Adds the range restrictions on float columns of a single base relation
+ *	  to the KDE request, and returns the number of collected clauses.
+ *
+ * If mark_clauses is set, the collected clauses are flagged as T_Invalid, so
+ * that the regular estimation skips them.
+ */
+static unsigned int
+kde_collect_range_request(PlannerInfo *root, List *clauses, int varRelid,
+						  ocl_estimator_request_t *request, bool mark_clauses)
+{
+  ListCell   *l;
+  unsigned int known_clauses = 0;
+
+  /* Walk each clause, extracting required information from each */
+  foreach(l, clauses) {
+    Node     *clause = (Node *) lfirst(l);
+    if (IsA(clause, RestrictInfo)) {
+      // Variable Definitions
+      RestrictInfo *rinfo;
+      VariableStatData vardata;
+      Node     *other;
+      bool    varonleft;
+      double   constval;
+      Oid     relation;
+      AttrNumber  colno;
+      char*   opname;
+      union { Datum orig; double dval; } Datum2Double;
+      // Check if this is a restriction clause:
+      rinfo = (RestrictInfo *) clause;
+      if (rinfo->pseudoconstant) {
+            continue;
+      }
+      clause = (Node *) rinfo->clause;
+      if (!IsA(clause, OpExpr)) {
+        // Unsupported clause.
+        continue;
+      }
+      // Extract the operator information:
+      if (!get_restriction_variable(root, ((OpExpr *)clause)->args, varRelid, &vardata, &other, &varonleft)) {
+        // Undefined clause.
+        continue;
+      }
+      // Check that this is a valid operator (lt or gt):
+      if (varonleft) {
+        opname = get_opname(((OpExpr *)clause)->opno);
+      } else {
+        opname = get_opname(get_commutator(((OpExpr *)clause)->opno));
+      }
+      // Check that we have a constant on one side.
+      if (!IsA(other, Const)) {
+        ReleaseVariableStats(vardata);
+        continue;
+      }
+      // Check that we have a singular base relation on the left side.
+      if (vardata.rel->reloptkind != RELOPT_BASEREL) {
+        ReleaseVariableStats(vardata);
+        continue;
+      }
+      // Check that the base relation is the same as before.
+      relation = root->simple_rte_array[bms_singleton_member(vardata.rel->relids)]->relid;
+      if (request->table_identifier != 0 && request->table_identifier != relation) {
+        ReleaseVariableStats(vardata);
+        continue;
+      } else
+        request->table_identifier = relation;
+      // Check that this a selection on a float column.
+      if (((Const *) other)->consttype != FLOAT4OID && ((Const *) other)->consttype != FLOAT8OID) {
+        ReleaseVariableStats(vardata);
+        continue;
+      }
+      // Extract the float value of the attribute.
+      Datum2Double.orig = ((Const *) other)->constvalue;
+      constval = Datum2Double.dval;
+      // Extract the column number.
+      colno = ((Var*)vardata.var)->varattno;
+      // Now insert the range information
+      if (strcmp(opname, "<") == 0) {
+        ocl_updateRequest(request, colno, NULL, false, &constval, false);
+      } else if (strcmp(opname, "<=") == 0) {
+          ocl_updateRequest(request, colno, NULL, true, &constval, false);
+      } else if (strcmp(opname, ">") == 0) {
+          ocl_updateRequest(request, colno, &constval, false, NULL, false);
+      } else if (strcmp(opname, ">=") == 0) {
+          ocl_updateRequest(request, colno, &constval, true, NULL, false);
+      } else if (strcmp(opname, "=") == 0) {
+        ocl_updateRequest(request, colno, &constval, true, &constval, true);
+      } else {
+        // Unsupported operation.
+        ReleaseVariableStats(vardata);
+        continue;
+      }
+      known_clauses++;
+      // Flag the node as invalid, so it is not used in estimation.
+      if (mark_clauses) ((Node *)lfirst(l))->type = T_Invalid;
+      // Clean up
+      ReleaseVariableStats(vardata);
+    }
+  }
+  return known_clauses;
+}
+
+/*
+ * clauselist_prefetch_kde_selectivities -
+ *	  Estimates the restrictions of all base relations of the query with a
+ *	  single batched KDE evaluation per table.
+ *
+ * The KDE estimators memoize the estimates, so the following calls of
+ * clauselist_selectivity for the single relations find them in the cache.
+ * This pays off if the query scans the same table several times (e.g. in a
+ * self-join), so we only batch if there are at least two requests.
+ */
+void
+clauselist_prefetch_kde_selectivities(PlannerInfo *root)
+{
+  Index rti;
+  unsigned int i, nr_of_requests = 0;
+  ocl_estimator_request_t *requests;
+  Selectivity *selectivities;
+  bool *estimated;
+
+  if (!ocl_useBatchedEstimation() || root->simple_rel_array_size <= 2)
+    return;
+  requests = palloc0(sizeof(ocl_estimator_request_t) *
+                     root->simple_rel_array_size);
+  for (rti = 1; rti < root->simple_rel_array_size; rti++) {
+    RelOptInfo *rel = root->simple_rel_array[rti];
+    ocl_estimator_request_t *request = &(requests[nr_of_requests]);
+    if (rel == NULL || rel->reloptkind != RELOPT_BASEREL ||
+        rel->rtekind != RTE_RELATION || rel->baserestrictinfo == NIL)
+      continue;
+    /* This must match the call in set_baserel_size_estimates. */
+    kde_collect_range_request(root, rel->baserestrictinfo, 0, request, false);
+    if (request->table_identifier == 0) continue;
+    nr_of_requests++;
+  }
+  if (nr_of_requests >= 2) {
+    selectivities = palloc(sizeof(Selectivity) * nr_of_requests);
+    estimated = palloc(sizeof(bool) * nr_of_requests);
+    ocl_estimateSelectivityBatch(
+        requests, nr_of_requests, selectivities, estimated);
+    pfree(selectivities);
+    pfree(estimated);
+  }
+  for (i = 0; i < nr_of_requests; ++i) {
+    if (requests[i].ranges) free(requests[i].ranges);
+  }
+  pfree(requests);
+}
+#endif
+
 /*
  * clauselist_selectivity -
  *	  Compute the selectivity of an implicitly-ANDed list of boolean
@@ -113,96 +266,9 @@ clauselist_selectivity(PlannerInfo *root,
   if (ocl_useKDE() || stholes_enabled()) {
     /* Estimator request, that is used to aggregate the range requests */
     ocl_estimator_request_t ocl_request;
-    unsigned int total_clauses = 0;
-    unsigned int known_clauses = 0;
     memset(&ocl_request, 0, sizeof(ocl_estimator_request_t));
 
-    /* Now walk each clause, extracting required information from each */
-    foreach(l, clauses) {
-      Node     *clause = (Node *) lfirst(l);
-      total_clauses++;
-      if (IsA(clause, RestrictInfo)) {
-        // Variable Definitions
-        RestrictInfo *rinfo;
-        VariableStatData vardata;
-        Node     *other;
-        bool    varonleft;
-        double   constval;
-        Oid     relation;
-        AttrNumber  colno;
-        char*   opname;
-        union { Datum orig; double dval; } Datum2Double;
-        // Check if this is a restriction clause:
-        rinfo = (RestrictInfo *) clause;
-        if (rinfo->pseudoconstant) {
-              continue;
-        }
-        clause = (Node *) rinfo->clause;
-        if (!IsA(clause, OpExpr)) {
-          // Unsupported clause.
-          continue;
-        }
-        // Extract the operator information:
-        if (!get_restriction_variable(root, ((OpExpr *)clause)->args, varRelid, &vardata, &other, &varonleft)) {
-          // Undefined clause.
-          continue;
-        }
-        // Check that this is a valid operator (lt or gt):
-        if (varonleft) {
-          opname = get_opname(((OpExpr *)clause)->opno);
-        } else {
-          opname = get_opname(get_commutator(((OpExpr *)clause)->opno));
-        }
-        // Check that we have a constant on one side.
-        if (!IsA(other, Const)) {
-          ReleaseVariableStats(vardata);
-          continue;
-        }
-        // Check that we have a singular base relation on the left side.
-        if (vardata.rel->reloptkind != RELOPT_BASEREL) {
-          ReleaseVariableStats(vardata);
-          continue;
-        }
-        // Check that the base relation is the same as before.
-        relation = root->simple_rte_array[bms_singleton_member(vardata.rel->relids)]->relid;
-        if (ocl_request.table_identifier != 0 && ocl_request.table_identifier != relation) {
-          ReleaseVariableStats(vardata);
-          continue;
-        } else
-          ocl_request.table_identifier = relation;
-        // Check that this a selection on a float column.
-        if (((Const *) other)->consttype != FLOAT4OID && ((Const *) other)->consttype != FLOAT8OID) {
-          ReleaseVariableStats(vardata);
-          continue;
-        }
-        // Extract the float value of the attribute.
-        Datum2Double.orig = ((Const *) other)->constvalue;
-        constval = Datum2Double.dval;
-        // Extract the column number.
-        colno = ((Var*)vardata.var)->varattno;
-        // Now insert the range information
-        if (strcmp(opname, "<") == 0) {
-          ocl_updateRequest(&ocl_request, colno, NULL, false, &constval, false);
-        } else if (strcmp(opname, "<=") == 0) {
-            ocl_updateRequest(&ocl_request, colno, NULL, true, &constval, false);
-        } else if (strcmp(opname, ">") == 0) {
-            ocl_updateRequest(&ocl_request, colno, &constval, false, NULL, false);
-        } else if (strcmp(opname, ">=") == 0) {
-            ocl_updateRequest(&ocl_request, colno, &constval, true, NULL, false);
-        } else if (strcmp(opname, "=") == 0) {
-          ocl_updateRequest(&ocl_request, colno, &constval, true, &constval, true);
-        } else {
-          // Unsupported operation.
-          ReleaseVariableStats(vardata);
-          continue;
-        }
-        known_clauses++;
-        // Flag the node as invalid, so it is not used in estimation.
-        ((Node *)lfirst(l))->type = T_Invalid;
-        // Clean up
-        ReleaseVariableStats(vardata);
-      }
-    }
+    kde_collect_range_request(root, clauses, varRelid, &ocl_request, true);
     // If we have identified a request, try to run it on the device:
     if (ocl_request.table_identifier) {
       if (ocl_useKDE()) {
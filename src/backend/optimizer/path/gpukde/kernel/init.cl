@@ -24,3 +24,10 @@ __kernel void init(
     T value) {
   data[get_global_id(0)] = value;
 }
+
+// Converts a buffer to single precision.
+__kernel void convert_to_float(
+    __global const T* data,
+    __global float* result) {
+  result[get_global_id(0)] = data[get_global_id(0)];
+}
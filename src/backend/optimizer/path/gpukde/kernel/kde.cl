@@ -43,7 +43,7 @@ __kernel void epanechnikov_kde(
 		local_result /= h*h*h;
 		local_result *= (lo < up);
 		// Apply the boundary cases: 
-		//res *= is_complete ? (4.0 / 3.0) : local_result;
+		res *= is_complete ? (4.0 / 3.0) : local_result;
 	}
 	result[get_global_id(0)] = res;
 }
@@ -84,6 +84,353 @@ __kernel void gauss_kde(
 	result[get_global_id(0)] = res;
 }
 
+// Computes the factors of a single dimension of the Gauss kernel, so they can
+// be cached for queries that share the bounds in this dimension.
+__kernel void gauss_kde_factor(
+	__global const T* const data,
+	__global T* const factors,
+	__global const T* const range,
+	__global const T* const bandwidth,
+	__global const T* const mean,
+	__global const T* const sdev,
+	unsigned int dimension,
+	unsigned int factor_offset
+) {
+#ifndef LOG_BANDWIDTH
+  T h = bandwidth[dimension];
+#else
+  T h = exp(bandwidth[dimension]);
+#endif
+  T bw = h == 0 ? 0 : 1.0 / (M_SQRT2 * h);
+  T val = data[D*get_global_id(0) + dimension];
+  T lo = (range[2*dimension] - mean[dimension]) / sdev[dimension] - val;
+  T up = (range[2*dimension+1] - mean[dimension]) / sdev[dimension] - val;
+  T local_result = erf(up * bw) - erf(lo * bw);
+  factors[factor_offset + get_global_id(0)] =
+      bw == 0 ? (sign(up) - sign(lo)) : local_result;
+}
+
+// Multiplies the (cached) factors of all dimensions to the local contributions.
+__kernel void multiply_kde_factors(
+	__global const T* const factors,
+	__global const unsigned int* const slots,
+	__global T* const result,
+	unsigned int rows_in_sample
+) {
+  T res = 1.0;
+  for (unsigned int i=0; i<D; ++i) {
+    res *= factors[slots[i] * rows_in_sample + get_global_id(0)];
+  }
+  result[get_global_id(0)] = res;
+}
+
+// Helper function that loads the tile of sample points and the normalized
+// query bounds of the work group into local memory.
+void load_batch_tiles(
+	__global const T* const data,
+	unsigned int rows_in_sample,
+	__global const T* const ranges,
+	unsigned int nr_of_queries,
+	__global const T* const mean,
+	__global const T* const sdev,
+	__local T* const sample_tile,
+	__local T* const query_tile
+) {
+  unsigned int local_id = get_local_id(1) * get_local_size(0) + get_local_id(0);
+  unsigned int group_size = get_local_size(0) * get_local_size(1);
+  // The sample points handled by this work group are stored consecutively.
+  unsigned int sample_start = get_group_id(0) * get_local_size(0) * D;
+  for (unsigned int i = local_id; i < get_local_size(0) * D; i += group_size) {
+    sample_tile[i] = sample_start + i < rows_in_sample * D ?
+        data[sample_start + i] : 0;
+  }
+  // Same for the query bounds.
+  unsigned int query_start = get_group_id(1) * get_local_size(1);
+  for (unsigned int i = local_id; i < get_local_size(1) * 2 * D; i += group_size) {
+    unsigned int dim = (i % (2 * D)) / 2;
+    query_tile[i] = query_start + i / (2 * D) < nr_of_queries ?
+        (ranges[query_start * 2 * D + i] - mean[dim]) / sdev[dim] : 0;
+  }
+}
+
+// Helper function that sums up the contributions of each query (i.e. each
+// row of the work group) and writes one partial result per query.
+void reduce_batch_segments(
+	T contribution,
+	unsigned int nr_of_queries,
+	__local T* const scratch,
+	__global T* const partial_results
+) {
+  unsigned int row_start = get_local_id(1) * get_local_size(0);
+  scratch[row_start + get_local_id(0)] = contribution;
+  barrier(CLK_LOCAL_MEM_FENCE);
+  // The row length is a power of two.
+  for (unsigned int stride = get_local_size(0) / 2; stride > 0; stride >>= 1) {
+    if (get_local_id(0) < stride) {
+      scratch[row_start + get_local_id(0)] +=
+          scratch[row_start + get_local_id(0) + stride];
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+  }
+  if (get_local_id(0) == 0 && get_global_id(1) < nr_of_queries) {
+    partial_results[get_global_id(1) * get_num_groups(0) + get_group_id(0)] =
+        scratch[row_start];
+  }
+}
+
+// Evaluates a batch of queries using the Epanechnikov Kernel. Dimension 0 of
+// the NDRange runs over the sample, dimension 1 over the queries.
+__kernel void epanechnikov_kde_batch(
+	__global const T* const data,
+	unsigned int rows_in_sample,
+	__global const T* const ranges,
+	unsigned int nr_of_queries,
+	__global const T* const bandwidth,
+	__global const T* const mean,
+	__global const T* const sdev,
+	__local T* const sample_tile,
+	__local T* const query_tile,
+	__local T* const scratch,
+	__global T* const partial_results,
+	__global const T* const weights
+) {
+  __local T bw[D];
+  if (get_local_id(1) == 0 && get_local_id(0) < D) {
+    bw[get_local_id(0)] = bandwidth[get_local_id(0)];
+  }
+  load_batch_tiles(
+      data, rows_in_sample, ranges, nr_of_queries, mean, sdev,
+      sample_tile, query_tile);
+  barrier(CLK_LOCAL_MEM_FENCE);
+  T res = 0;
+  if (get_global_id(0) < rows_in_sample && get_global_id(1) < nr_of_queries) {
+    res = 1.0;
+    for (unsigned int i=0; i<D; ++i) {
+      T val = sample_tile[get_local_id(0) * D + i];
+      T h = bw[i];
+      T lo = query_tile[get_local_id(1) * 2 * D + 2 * i];
+      T up = query_tile[get_local_id(1) * 2 * D + 2 * i + 1];
+      char is_complete = (lo <= (val-h)) && (up >= (val+h));
+      lo = max(lo, val-h);
+      up = min(val+h, up);
+      T local_result = (h*h - val*val)*(up - lo);
+      local_result += val * (up*up - lo*lo);
+      local_result -= (up*up*up - lo*lo*lo) / 3.0;
+      local_result /= h*h*h;
+      local_result *= (lo < up);
+      res *= is_complete ? (4.0 / 3.0) : local_result;
+    }
+    if (weights) res *= weights[get_global_id(0)];
+  }
+  reduce_batch_segments(res, nr_of_queries, scratch, partial_results);
+}
+
+// Evaluates a batch of queries using the Gauss Kernel. Dimension 0 of the
+// NDRange runs over the sample, dimension 1 over the queries.
+__kernel void gauss_kde_batch(
+	__global const T* const data,
+	unsigned int rows_in_sample,
+	__global const T* const ranges,
+	unsigned int nr_of_queries,
+	__global const T* const bandwidth,
+	__global const T* const mean,
+	__global const T* const sdev,
+	__local T* const sample_tile,
+	__local T* const query_tile,
+	__local T* const scratch,
+	__global T* const partial_results,
+	__global const T* const weights
+) {
+  __local T bw[D];
+  if (get_local_id(1) == 0 && get_local_id(0) < D) {
+#ifndef LOG_BANDWIDTH
+    T h = bandwidth[get_local_id(0)];
+#else
+    T h = exp(bandwidth[get_local_id(0)]);
+#endif
+    bw[get_local_id(0)] = h == 0 ? 0 : 1.0 / (M_SQRT2 * h);
+  }
+  load_batch_tiles(
+      data, rows_in_sample, ranges, nr_of_queries, mean, sdev,
+      sample_tile, query_tile);
+  barrier(CLK_LOCAL_MEM_FENCE);
+  T res = 0;
+  if (get_global_id(0) < rows_in_sample && get_global_id(1) < nr_of_queries) {
+    res = 1.0;
+    for (unsigned int i=0; i<D; ++i) {
+      T val = sample_tile[get_local_id(0) * D + i];
+      T lo = query_tile[get_local_id(1) * 2 * D + 2 * i] - val;
+      T up = query_tile[get_local_id(1) * 2 * D + 2 * i + 1] - val;
+      T local_result = erf(up * bw[i]) - erf(lo * bw[i]);
+      res *= bw[i] == 0 ? (sign(up) - sign(lo)) : local_result;
+    }
+    if (weights) res *= weights[get_global_id(0)];
+  }
+  reduce_batch_segments(res, nr_of_queries, scratch, partial_results);
+}
+
+// Sums up the partial results of a batch evaluation, one thread per query.
+__kernel void sum_kde_batch(
+	__global const T* const partial_results,
+	unsigned int partials_per_query,
+	__global T* const result,
+	T normalization_factor
+) {
+  T sum = 0;
+  for (unsigned int i=0; i<partials_per_query; ++i) {
+    sum += partial_results[get_global_id(0) * partials_per_query + i];
+  }
+  result[get_global_id(0)] = sum * normalization_factor;
+}
+
+// Helper function that checks whether the bounding box of a bucket, extended
+// by the support of the kernel, intersects the (normalized) query.
+char bucket_intersects_query(
+	__global const T* const bounds,
+	__local const T* const lo,
+	__local const T* const up,
+	__local const T* const support
+) {
+  char intersects = 1;
+  for (unsigned int i=0; i<D; ++i) {
+    T bucket_lo = bounds[2*D*get_group_id(0) + 2*i] - support[i];
+    T bucket_up = bounds[2*D*get_group_id(0) + 2*i + 1] + support[i];
+    intersects &= (bucket_lo <= up[i]) && (bucket_up >= lo[i]);
+  }
+  return intersects;
+}
+
+// Helper function that sums up the contributions of a bucket and writes one
+// result per bucket.
+void reduce_bucket(
+	T contribution,
+	__local T* const scratch,
+	__global T* const result
+) {
+  scratch[get_local_id(0)] = contribution;
+  barrier(CLK_LOCAL_MEM_FENCE);
+  // The bucket size is a power of two.
+  for (unsigned int stride = get_local_size(0) / 2; stride > 0; stride >>= 1) {
+    if (get_local_id(0) < stride) {
+      scratch[get_local_id(0)] += scratch[get_local_id(0) + stride];
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+  }
+  if (get_local_id(0) == 0) result[get_group_id(0)] = scratch[0];
+}
+
+// Evaluates the Epanechnikov Kernel on the bucketed sample of the spatial
+// index. Each work group handles one bucket and skips it entirely if no point
+// in the bucket can contribute to the query.
+__kernel void epanechnikov_kde_pruned(
+	__global const T* const data,
+	__global const T* const bounds,
+	__global const unsigned int* const counts,
+	__global T* const result,
+	__global const T* const range,
+	__global const T* const bandwidth,
+	__global const T* const mean,
+	__global const T* const sdev,
+	const T cutoff,
+	__local T* const scratch
+) {
+  __local T bw[D];
+  __local T lo[D];
+  __local T up[D];
+  __local char intersects;
+  if (get_local_id(0) < D) {
+    unsigned int i = get_local_id(0);
+    bw[i] = bandwidth[i];
+    lo[i] = (range[2*i] - mean[i]) / sdev[i];
+    up[i] = (range[2*i + 1] - mean[i]) / sdev[i];
+  }
+  barrier(CLK_LOCAL_MEM_FENCE);
+  // The kernel has compact support, so the cutoff is not needed.
+  if (get_local_id(0) == 0) {
+    intersects = bucket_intersects_query(bounds, lo, up, bw);
+  }
+  barrier(CLK_LOCAL_MEM_FENCE);
+  if (!intersects) {
+    if (get_local_id(0) == 0) result[get_group_id(0)] = 0;
+    return;
+  }
+  T res = 0;
+  if (get_local_id(0) < counts[get_group_id(0)]) {
+    res = 1.0;
+    for (unsigned int i=0; i<D; ++i) {
+      T val = data[D*get_global_id(0) + i];
+      T h = bw[i];
+      T l = lo[i];
+      T u = up[i];
+      char is_complete = (l <= (val-h)) && (u >= (val+h));
+      l = max(l, val-h);
+      u = min(val+h, u);
+      T local_result = (h*h - val*val)*(u - l);
+      local_result += val * (u*u - l*l);
+      local_result -= (u*u*u - l*l*l) / 3.0;
+      local_result /= h*h*h;
+      local_result *= (l < u);
+      res *= is_complete ? (4.0 / 3.0) : local_result;
+    }
+  }
+  reduce_bucket(res, scratch, result);
+}
+
+// Evaluates the Gauss Kernel on the bucketed sample of the spatial index.
+// Buckets that are more than cutoff bandwidths away from the query are
+// skipped.
+__kernel void gauss_kde_pruned(
+	__global const T* const data,
+	__global const T* const bounds,
+	__global const unsigned int* const counts,
+	__global T* const result,
+	__global const T* const range,
+	__global const T* const bandwidth,
+	__global const T* const mean,
+	__global const T* const sdev,
+	const T cutoff,
+	__local T* const scratch
+) {
+  __local T bw[D];
+  __local T support[D];
+  __local T lo[D];
+  __local T up[D];
+  __local char intersects;
+  if (get_local_id(0) < D) {
+    unsigned int i = get_local_id(0);
+#ifndef LOG_BANDWIDTH
+    T h = bandwidth[i];
+#else
+    T h = exp(bandwidth[i]);
+#endif
+    bw[i] = h == 0 ? 0 : 1.0 / (M_SQRT2 * h);
+    support[i] = cutoff * h;
+    lo[i] = (range[2*i] - mean[i]) / sdev[i];
+    up[i] = (range[2*i + 1] - mean[i]) / sdev[i];
+  }
+  barrier(CLK_LOCAL_MEM_FENCE);
+  if (get_local_id(0) == 0) {
+    intersects = bucket_intersects_query(bounds, lo, up, support);
+  }
+  barrier(CLK_LOCAL_MEM_FENCE);
+  if (!intersects) {
+    if (get_local_id(0) == 0) result[get_group_id(0)] = 0;
+    return;
+  }
+  T res = 0;
+  if (get_local_id(0) < counts[get_group_id(0)]) {
+    res = 1.0;
+    for (unsigned int i=0; i<D; ++i) {
+      T val = data[D*get_global_id(0) + i];
+      T l = lo[i] - val;
+      T u = up[i] - val;
+      T local_result = erf(u * bw[i]) - erf(l * bw[i]);
+      res *= bw[i] == 0 ? (sign(u) - sign(l)) : local_result;
+    }
+  }
+  reduce_bucket(res, scratch, result);
+}
+
 // Used to extract all values for a single dimension from the data sample.
 __kernel void extract_dimension(
   __global const T* const data,
@@ -95,6 +442,15 @@ __kernel void extract_dimension(
   result[get_global_id(0)] = my_value;
 }
 
+// Used to square the local contributions for the variance of progressive estimates.
+__kernel void square_contributions(
+  __global const T* const contributions,
+  __global T* const squares
+) {
+  T my_value = contributions[get_global_id(0)];
+  squares[get_global_id(0)] = my_value * my_value;
+}
+
 // Used to compute the local contributions to the variance.
 __kernel void precompute_variance(
   __global T* data,
@@ -112,11 +468,14 @@ __kernel void set_scotts_bandwidth(
   __global T* bandwidth_buffer,
   unsigned int selected_dimension,
   unsigned int dimensions,
-  unsigned int points_in_sample
+  unsigned int points_in_sample,
+  unsigned int represented_points
 ) {
   T var = variance_buffer[selected_dimension] / (points_in_sample - 1);
+  // A compacted sample summarizes more points than it stores, which is what
+  // the rate of the rule depends on.
   T bandwidth = var * pow(
-    4.0 / ((dimensions + 2.0) * points_in_sample), 1.0/(dimensions + 4.0));
+    4.0 / ((dimensions + 2.0) * represented_points), 1.0/(dimensions + 4.0));
 #ifndef LOG_BANDWIDTH
   bandwidth_buffer[selected_dimension] = bandwidth;
 #else
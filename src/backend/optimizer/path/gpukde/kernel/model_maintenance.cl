@@ -57,9 +57,11 @@ __kernel void applyGradient(
 	  local_gradient[k] *= (k==j) ? factor1 : factor2;                    \
 	}                                                                     \
       }                                                                       \
-      estimate += local_contribution;                                         \
+      /* Points of a compacted sample carry a weight. */                      \
+      T weight = weights ? weights[i] : 1.0;                                  \
+      estimate += weight * local_contribution;                                \
       for (unsigned int j=0; j<D; ++j) {                                      \
-	gradient_scratch[D * get_local_id(0) + j] += local_gradient[j];       \
+	gradient_scratch[D * get_local_id(0) + j] += weight * local_gradient[j]; \
       }                                                                       \
     }                                                                         \
     estimate /= pow((T)2.0, D) * nr_of_data_points;                           \
@@ -99,9 +101,11 @@ __kernel void applyGradient(
 	  local_gradient[k] *= (k==j) ? factor1 : factor2;                    \
 	}                                                                     \
       }                                                                       \
-      estimate += local_contribution;                                         \
+      /* Points of a compacted sample carry a weight. */                      \
+      T weight = weights ? weights[i] : 1.0;                                  \
+      estimate += weight * local_contribution;                                \
       for (unsigned int j=0; j<D; ++j) {                                      \
-	gradient_scratch[D * get_local_id(0) + j] += local_gradient[j];       \
+	gradient_scratch[D * get_local_id(0) + j] += weight * local_gradient[j]; \
       }                                                                       \
     }                                                                         \
     estimate /= pow((T)2.0, D) * nr_of_data_points;                           \
@@ -125,7 +129,8 @@ __kernel void computeBatchGradientAbsolute(
     unsigned int gradient_stride,
     unsigned int nrows,  /* Number of rows in table */
     __global const T* const mean,
-    __global const T* const sdev
+    __global const T* const sdev,
+    __global const T* const weights
   ) {
   // First, we compute the error-independent parts of the gradient.
   BATCH_GRADIENT_COMMON();
@@ -157,7 +162,8 @@ __kernel void computeBatchGradientRelative(
     unsigned int gradient_stride,
     unsigned int nrows,  /* Number of rows in table */
     __global const T* const mean,
-    __global const T* const sdev
+    __global const T* const sdev,
+    __global const T* const weights
   ) {
   // First, we compute the error-independent parts of the gradient.
   BATCH_GRADIENT_COMMON();
@@ -189,7 +195,8 @@ __kernel void computeBatchGradientSquaredRelative(
     unsigned int gradient_stride,
     unsigned int nrows,  /* Number of rows in table */
     __global const T* const mean,
-    __global const T* const sdev
+    __global const T* const sdev,
+    __global const T* const weights
   ) {
   // First, we compute the error-independent parts of the gradient.
   BATCH_GRADIENT_COMMON();
@@ -221,7 +228,8 @@ __kernel void computeBatchGradientQuadratic(
     unsigned int gradient_stride,
     unsigned int nrows,  /* Number of rows in table */
     __global const T* const mean,
-    __global const T* const sdev
+    __global const T* const sdev,
+    __global const T* const weights
   ) {
   // First, we compute the error-independent parts of the gradient.
   BATCH_GRADIENT_COMMON();
@@ -253,7 +261,8 @@ __kernel void computeBatchGradientQ(
     unsigned int gradient_stride,
     unsigned int nrows,  /* Number of rows in table */
     __global const T* const mean,
-    __global const T* const sdev
+    __global const T* const sdev,
+    __global const T* const weights
   ) {
   // First, we compute the error-independent parts of the gradient.
   BATCH_GRADIENT_COMMON();
@@ -44,48 +44,6 @@ __kernel void update_sample_quality_metrics(
   karma[get_global_id(0)] = fmin(karma[get_global_id(0)], karma_limit);   
 }
 
-__kernel void get_point_deletion_bitmap(
-    __global const T* const data,
-    __constant const T* const point,
-    __local T* lp,
-    __local unsigned int* hit,
-    __global unsigned char* const hitmap
-  ) {
-  unsigned char result = 0;
-
-  if(get_local_id(0) < D){
-    lp[get_local_id(0)] = point[get_local_id(0)];
-  }
-  barrier(CLK_LOCAL_MEM_FENCE);
-  
-  
-  unsigned int temp = 1;
-  for(unsigned int i = 0; i < D; i++){
-    if(data[D*get_global_id(0) +i] != lp[i]){
-      temp = 0;
-    }
-  }
-  hit[get_local_id(0)] = temp << get_local_id(0) % 8;
-  
-  barrier(CLK_LOCAL_MEM_FENCE);
-  
-  if(get_local_id(0) % 8 < 4){
-    hit[get_local_id(0)] |= hit[get_local_id(0)+4];
-  }
-
-  barrier(CLK_LOCAL_MEM_FENCE);
-  
-  if(get_local_id(0) % 8 < 2){
-    hit[get_local_id(0)] |= hit[get_local_id(0)+2];
-  }
-
-  barrier(CLK_LOCAL_MEM_FENCE);
-  
-  if(get_local_id(0) % 8 < 1){
-    hitmap[get_group_id(0)*get_local_size(0)/8 + get_local_id(0) / 8] = (hit[get_local_id(0)] | hit[get_local_id(0)+1]) & 0xFF;
-  }
-}
-
 __kernel void get_karma_threshold_bitmap(
     __global const T* const karma,
     __global const T* const local_results,
@@ -144,3 +102,14 @@ __kernel void get_karma_threshold_bitmap(
     hitmap[get_group_id(0)*get_local_size(0)/8 + get_local_id(0) / 8] = (hit[get_local_id(0)] | hit[get_local_id(0)+1]) & 0xFF;
   }
 }
+
+// Writes a batch of new items to the given positions in the sample.
+__kernel void scatter_sample_items(
+    __global T* const data,
+    __global const unsigned int* const positions,
+    __global const T* const items
+  ) {
+  unsigned int item = get_global_id(0) / D;
+  unsigned int dim = get_global_id(0) % D;
+  data[D*positions[item] + dim] = items[get_global_id(0)];
+}
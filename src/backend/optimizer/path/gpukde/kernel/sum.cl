@@ -9,6 +9,19 @@
   #define TYPE_DEFINED_
 #endif /* TYPE_DEFINED */
 
+// Adds value to the running sum agg. In single precision, we use Kahan
+// summation to compensate for the rounding errors of long sequential sums.
+void accumulate(T* agg, T* compensation, T value) {
+#if (TYPE == 4)
+   T y = value - *compensation;
+   T t = *agg + y;
+   *compensation = (t - *agg) - y;
+   *agg = t;
+#else
+   *agg += value;
+#endif
+}
+
 __kernel void sum_seq(
    __global const T* const data,
    const unsigned int data_offset,
@@ -17,30 +30,41 @@ __kernel void sum_seq(
    const unsigned int result_offset
 ){
    T agg = 0;
+   T compensation = 0;
    for (unsigned i=0; i<elements; ++i) {
-     agg += data[data_offset + i];
+     accumulate(&agg, &compensation, data[data_offset + i]);
    }
    result[result_offset] = agg;
 }
 
+// Returns the i-th value of data, scaled by its weight if weights are given.
+T weighted_value(
+   __global const T* data, __global const T* weights, unsigned int i) {
+   return weights ? data[i] * weights[i] : data[i];
+}
+
 __kernel void sum_par(
    __global const T* data,
    __local T* scratch,
    __global T* result,
    unsigned int values_per_thread,
-   unsigned int nr_of_values
+   unsigned int nr_of_values,
+   __global const T* weights
 ){
    unsigned int local_id = get_local_id(0);
    unsigned int global_id = get_global_id(0);
    // Each thread first does a sequential aggregation within a register.
    T agg = 0;
+   T compensation = 0;
    #ifdef DEVICE_GPU
       // On the GPU we use a strided access pattern, so that the GPU
       // can coalesce memory access.
       unsigned int group_start = get_local_size(0)*values_per_thread*get_group_id(0);
       for (unsigned int i=0; i < values_per_thread; ++i) {
         unsigned int pos = group_start + i*get_local_size(0) + local_id;
-        agg += pos < nr_of_values ? data[pos] : 0;
+        accumulate(
+            &agg, &compensation,
+            pos < nr_of_values ? weighted_value(data, weights, pos) : 0);
       }
    #elif defined DEVICE_CPU
       // On the CPU we use a sequential access pattern to keep cache misses
@@ -48,7 +72,7 @@ __kernel void sum_par(
       for (unsigned int i=0; i < values_per_thread; ++i) {
         unsigned int pos = values_per_thread * global_id + i;
         if (pos < nr_of_values) {
-          agg += data[pos];
+          accumulate(&agg, &compensation, weighted_value(data, weights, pos));
         }
       }
    #endif
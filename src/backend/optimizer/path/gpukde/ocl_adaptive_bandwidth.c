@@ -12,11 +12,13 @@
 
 #include "ocl_estimator.h"
 #include "ocl_error_metrics.h"
+#include "ocl_factor_cache.h"
+#include "ocl_grid_estimator.h"
+#include "ocl_selectivity_cache.h"
 #include "ocl_utilities.h"
 
 cl_kernel init_zero = NULL;
 cl_kernel init_one = NULL;
-cl_kernel computePartialGradient = NULL;  
 cl_kernel finalizeKernel = NULL;
 cl_kernel accumulate = NULL;
 cl_kernel updateModel = NULL;
@@ -47,7 +49,7 @@ static void ocl_initializeVsgdBuffersForOnlineLearning(
   size_t global_size = estimator->nr_of_dimensions;
 
   // Initialize the accumulator buffers and fill them with zero.
-  descriptor->gradient_accumulator = clCreateBuffer(
+  descriptor->gradient_accumulator = ocl_createBuffer(
       context->context, CL_MEM_READ_WRITE,
       sizeof(kde_float_t) * estimator->nr_of_dimensions, NULL, &err);
   Assert(err == CL_SUCCESS);
@@ -58,7 +60,7 @@ static void ocl_initializeVsgdBuffersForOnlineLearning(
       context->queue, init_zero, 1, NULL, &global_size, NULL, 0, NULL, NULL);
   Assert(err == CL_SUCCESS);
 
-  descriptor->squared_gradient_accumulator = clCreateBuffer(
+  descriptor->squared_gradient_accumulator = ocl_createBuffer(
       context->context, CL_MEM_READ_WRITE,
       sizeof(kde_float_t) * estimator->nr_of_dimensions, NULL, &err);
   Assert(err == CL_SUCCESS);
@@ -70,7 +72,7 @@ static void ocl_initializeVsgdBuffersForOnlineLearning(
       context->queue, init_zero, 1, NULL, &global_size, NULL, 0, NULL, NULL);
   Assert(err == CL_SUCCESS);
   
-  descriptor->hessian_accumulator = clCreateBuffer(
+  descriptor->hessian_accumulator = ocl_createBuffer(
       context->context, CL_MEM_READ_WRITE,
       sizeof(kde_float_t) * estimator->nr_of_dimensions, NULL, &err);
   Assert(err == CL_SUCCESS);
@@ -81,7 +83,7 @@ static void ocl_initializeVsgdBuffersForOnlineLearning(
       context->queue, init_zero, 1, NULL, &global_size, NULL, 0, NULL, NULL);
   Assert(err == CL_SUCCESS);
 
-  descriptor->squared_hessian_accumulator = clCreateBuffer(
+  descriptor->squared_hessian_accumulator = ocl_createBuffer(
       context->context, CL_MEM_READ_WRITE,
       sizeof(kde_float_t) * estimator->nr_of_dimensions, NULL, &err);
   Assert(err == CL_SUCCESS);
@@ -93,7 +95,7 @@ static void ocl_initializeVsgdBuffersForOnlineLearning(
   Assert(err == CL_SUCCESS);
   
   // Initialize the running average buffers with zero.
-  descriptor->running_gradient_average = clCreateBuffer(
+  descriptor->running_gradient_average = ocl_createBuffer(
       context->context, CL_MEM_READ_WRITE,
       sizeof(kde_float_t) * estimator->nr_of_dimensions, NULL, &err);
   Assert(err == CL_SUCCESS);
@@ -107,7 +109,7 @@ static void ocl_initializeVsgdBuffersForOnlineLearning(
       context->queue, init_one, 1, NULL, &global_size, NULL, 0, NULL, NULL);
   Assert(err == CL_SUCCESS);
 
-  descriptor->running_squared_gradient_average = clCreateBuffer(
+  descriptor->running_squared_gradient_average = ocl_createBuffer(
       context->context, CL_MEM_READ_WRITE,
       sizeof(kde_float_t) * estimator->nr_of_dimensions, NULL, &err);
   Assert(err == CL_SUCCESS);
@@ -119,7 +121,7 @@ static void ocl_initializeVsgdBuffersForOnlineLearning(
       context->queue, init_zero, 1, NULL, &global_size, NULL, 0, NULL, NULL);
   Assert(err == CL_SUCCESS);
 
-  descriptor->running_hessian_average = clCreateBuffer(
+  descriptor->running_hessian_average = ocl_createBuffer(
       context->context, CL_MEM_READ_WRITE,
       sizeof(kde_float_t) * estimator->nr_of_dimensions, NULL, &err);
   Assert(err == CL_SUCCESS);
@@ -130,7 +132,7 @@ static void ocl_initializeVsgdBuffersForOnlineLearning(
       context->queue, init_zero, 1, NULL, &global_size, NULL, 0, NULL, NULL);
   Assert(err == CL_SUCCESS);
 
-  descriptor->running_squared_hessian_average = clCreateBuffer(
+  descriptor->running_squared_hessian_average = ocl_createBuffer(
       context->context, CL_MEM_READ_WRITE,
       sizeof(kde_float_t) * estimator->nr_of_dimensions, NULL, &err);
   err = clSetKernelArg(
@@ -142,7 +144,7 @@ static void ocl_initializeVsgdBuffersForOnlineLearning(
   Assert(err == CL_SUCCESS);
   
   // Initialize the time constant buffer to two.
-  descriptor->current_time_constant = clCreateBuffer(
+  descriptor->current_time_constant = ocl_createBuffer(
       context->context, CL_MEM_READ_WRITE,
       sizeof(kde_float_t) * estimator->nr_of_dimensions, NULL, &err);
   Assert(err == CL_SUCCESS);
@@ -154,15 +156,15 @@ static void ocl_initializeVsgdBuffersForOnlineLearning(
   Assert(err == CL_SUCCESS);
 
   // Allocate the buffers to compute temporary gradients.
-  descriptor->temp_gradient_buffer = clCreateBuffer(
+  descriptor->temp_gradient_buffer = ocl_createBuffer(
       context->context, CL_MEM_READ_WRITE,
       sizeof(kde_float_t) * estimator->nr_of_dimensions, NULL, &err);
   Assert(err == CL_SUCCESS);
-  descriptor->temp_shifted_gradient_buffer= clCreateBuffer(
+  descriptor->temp_shifted_gradient_buffer= ocl_createBuffer(
       context->context, CL_MEM_READ_WRITE,
       sizeof(kde_float_t) * estimator->nr_of_dimensions, NULL, &err);
   Assert(err == CL_SUCCESS);
-  descriptor->temp_shifted_result_buffer = clCreateBuffer(
+  descriptor->temp_shifted_result_buffer = ocl_createBuffer(
       context->context, CL_MEM_READ_WRITE, sizeof(kde_float_t), NULL, &err);
   Assert(err == CL_SUCCESS);
 
@@ -170,25 +172,46 @@ static void ocl_initializeVsgdBuffersForOnlineLearning(
   clFinish(context->queue);
 }
 
-/**
- * Schedule the computation of the gradient at the current bandwidth. We
- * also compute a shifted gradient (by a small delta) to estimate the Hessian
- * curvature.
- */
-static void ocl_prepareVsgdOnlineLearningStep(ocl_estimator_t* estimator) {
+// Helper function to release the gradient workspace of vsgd-fd learning.
+static void ocl_releaseVsgdGradientWorkspace(ocl_estimator_t* estimator) {
   unsigned int i;
   cl_int err = CL_SUCCESS;
-  ocl_context_t* context = ocl_getContext();
-  cl_mem null_buffer = NULL;
   ocl_bandwidth_optimization_t* descriptor = estimator->bandwidth_optimization;
-
-  // Ensure that all required buffers are set up.
-  if (descriptor->gradient_accumulator == NULL) {
-    ocl_initializeVsgdBuffersForOnlineLearning(estimator);
+  unsigned int d = estimator->nr_of_dimensions;
+  if (descriptor->compute_partial_gradient == NULL) return;
+  for (i=0; i<2*d; ++i) {
+    err |= clReleaseMemObject(descriptor->gradient_summation_buffers[i]);
   }
+  for (i=0; i<2*d + 1; ++i) {
+    releaseAggregationDescriptor(descriptor->gradient_summation_descriptors[i]);
+  }
+  free(descriptor->gradient_summation_buffers);
+  free(descriptor->gradient_summation_descriptors);
+  free(descriptor->gradient_summation_events);
+  err |= clReleaseMemObject(descriptor->partial_gradient_buffer);
+  err |= clReleaseMemObject(descriptor->partial_shifted_gradient_buffer);
+  err |= clReleaseMemObject(descriptor->partial_shifted_result_buffer);
+  err |= clReleaseKernel(descriptor->compute_partial_gradient);
+  Assert(err == CL_SUCCESS);
+  descriptor->compute_partial_gradient = NULL;
+  descriptor->gradient_summation_buffers = NULL;
+  descriptor->gradient_summation_descriptors = NULL;
+  descriptor->gradient_summation_events = NULL;
+  descriptor->partial_gradient_buffer = NULL;
+  descriptor->partial_shifted_gradient_buffer = NULL;
+  descriptor->partial_shifted_result_buffer = NULL;
+  descriptor->gradient_rows = 0;
+}
 
-  cl_event* summation_events = palloc(
-      sizeof(cl_event) * (2 * estimator->nr_of_dimensions + 1));
+// Helper function to set up the kernel, buffers and summation descriptors
+// that compute the (shifted) gradient for the current sample size.
+static void ocl_initializeVsgdGradientWorkspace(ocl_estimator_t* estimator) {
+  unsigned int i;
+  cl_int err = CL_SUCCESS;
+  ocl_context_t* context = ocl_getContext();
+  ocl_bandwidth_optimization_t* descriptor = estimator->bandwidth_optimization;
+  unsigned int d = estimator->nr_of_dimensions;
+  ocl_releaseVsgdGradientWorkspace(estimator);
 
   // Compute the required stride size for the partial gradient buffers.
   size_t stride_size = sizeof(kde_float_t) * estimator->rows_in_sample;
@@ -202,138 +225,190 @@ static void ocl_prepareVsgdOnlineLearningStep(ocl_estimator_t* estimator) {
   unsigned int result_stride_elements = stride_size / sizeof(kde_float_t);
 
   // Figure out the optimal local size for the partial gradient kernel.
-  if (computePartialGradient == NULL) {
-    computePartialGradient = ocl_getKernel(
-        "computePartialGradient", estimator->nr_of_dimensions);
-  }
+  descriptor->compute_partial_gradient = ocl_getKernel(
+      "computePartialGradient", d);
   // We start with the maximum supporter local size.
-  size_t local_size;
   err = clGetKernelWorkGroupInfo(
-      computePartialGradient, context->device, CL_KERNEL_WORK_GROUP_SIZE,
-      sizeof(size_t), &local_size, NULL);
+      descriptor->compute_partial_gradient, context->device,
+      CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t),
+      &(descriptor->partial_gradient_localsize), NULL);
   Assert(err == CL_SUCCESS);
   // Then we cap this to the local memory requirements.
   size_t available_local_memory;
   err = clGetKernelWorkGroupInfo(
-      computePartialGradient, context->device, CL_KERNEL_LOCAL_MEM_SIZE,
-      sizeof(size_t), &available_local_memory, NULL);
+      descriptor->compute_partial_gradient, context->device,
+      CL_KERNEL_LOCAL_MEM_SIZE, sizeof(size_t), &available_local_memory, NULL);
   Assert(err == CL_SUCCESS);
   available_local_memory = context->local_mem_size - available_local_memory;
-  local_size = Min(
-      local_size,
-      available_local_memory / (sizeof(kde_float_t) * estimator->nr_of_dimensions));
+  descriptor->partial_gradient_localsize = Min(
+      descriptor->partial_gradient_localsize,
+      available_local_memory / (sizeof(kde_float_t) * d));
   // And finally ensure that the local size is a multiple of the preferred size.
   size_t preferred_local_size_multiple;
   err = clGetKernelWorkGroupInfo(
-      computePartialGradient, context->device,
+      descriptor->compute_partial_gradient, context->device,
       CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE,
       sizeof(size_t), &preferred_local_size_multiple, NULL);
   Assert(err == CL_SUCCESS);
-  local_size = preferred_local_size_multiple
-      * (local_size / preferred_local_size_multiple);
-
+  descriptor->partial_gradient_localsize = preferred_local_size_multiple
+      * (descriptor->partial_gradient_localsize / preferred_local_size_multiple);
   // Ensure that the global size is big enough to accomodate all sample items.
-  size_t global_size = local_size * (estimator->rows_in_sample / local_size);
-  if (global_size < estimator->rows_in_sample) global_size += local_size;
+  descriptor->partial_gradient_globalsize =
+      descriptor->partial_gradient_localsize
+      * (estimator->rows_in_sample / descriptor->partial_gradient_localsize);
+  if (descriptor->partial_gradient_globalsize < estimator->rows_in_sample) {
+    descriptor->partial_gradient_globalsize +=
+        descriptor->partial_gradient_localsize;
+  }
 
-    // Schedule the computation of the partial gradient for the current bandwidth.
-  cl_event partial_gradient_event = NULL;
-  cl_mem partial_gradient_buffer = clCreateBuffer(
+  // Allocate the buffers for the partial gradient contributions.
+  descriptor->partial_gradient_buffer = ocl_createBuffer(
+      context->context, CL_MEM_READ_WRITE, stride_size * d, NULL, &err);
+  Assert(err == CL_SUCCESS);
+  descriptor->partial_shifted_gradient_buffer = ocl_createBuffer(
+      context->context, CL_MEM_READ_WRITE, stride_size * d, NULL, &err);
+  Assert(err == CL_SUCCESS);
+  descriptor->partial_shifted_result_buffer = ocl_createBuffer(
       context->context, CL_MEM_READ_WRITE,
-      stride_size * estimator->nr_of_dimensions, NULL, &err);
-  
+      sizeof(kde_float_t) * estimator->rows_in_sample, NULL, &err);
+  Assert(err == CL_SUCCESS);
+
   // Set the common parameters for the partial gradient computations.
   err |= clSetKernelArg(
-      computePartialGradient, 0, sizeof(cl_mem), &(estimator->sample_buffer));
+      descriptor->compute_partial_gradient, 0, sizeof(cl_mem),
+      &(estimator->sample_buffer));
   err |= clSetKernelArg(
-      computePartialGradient, 1, sizeof(unsigned int),
+      descriptor->compute_partial_gradient, 1, sizeof(unsigned int),
       &(estimator->rows_in_sample));
   err |= clSetKernelArg(
-      computePartialGradient, 2, sizeof(cl_mem), &(estimator->input_buffer));
+      descriptor->compute_partial_gradient, 2, sizeof(cl_mem),
+      &(estimator->input_buffer));
   err |= clSetKernelArg(
-      computePartialGradient, 3, sizeof(cl_mem),
+      descriptor->compute_partial_gradient, 3, sizeof(cl_mem),
       &(estimator->bandwidth_buffer));
   err |= clSetKernelArg(
-      computePartialGradient, 5, available_local_memory, NULL);
+      descriptor->compute_partial_gradient, 5, available_local_memory, NULL);
   err |= clSetKernelArg(
-      computePartialGradient, 7, sizeof(unsigned int), &result_stride_elements);
+      descriptor->compute_partial_gradient, 7, sizeof(unsigned int),
+      &result_stride_elements);
   err |= clSetKernelArg(
-      computePartialGradient, 4, sizeof(cl_mem), &null_buffer);
+      descriptor->compute_partial_gradient, 9, sizeof(cl_mem),
+      &(estimator->mean_buffer));
   err |= clSetKernelArg(
-      computePartialGradient, 6, sizeof(cl_mem), &partial_gradient_buffer);
+      descriptor->compute_partial_gradient, 10, sizeof(cl_mem),
+      &(estimator->sdev_buffer));
+  Assert(err == CL_SUCCESS);
+
+  // Prepare the summation of the partial gradient contributions.
+  descriptor->gradient_summation_buffers = calloc(2 * d, sizeof(cl_mem));
+  descriptor->gradient_summation_descriptors = calloc(
+      2 * d + 1, sizeof(ocl_aggregation_descriptor_t*));
+  descriptor->gradient_summation_events = calloc(2 * d + 1, sizeof(cl_event));
+  for (i=0; i<d; ++i) {
+    cl_buffer_region region;
+    region.size = stride_size;
+    region.origin = i * stride_size;
+    descriptor->gradient_summation_buffers[i] = ocl_createSubBuffer(
+        descriptor->partial_gradient_buffer, CL_MEM_READ_ONLY,
+        CL_BUFFER_CREATE_TYPE_REGION, &region, &err);
+    Assert(err == CL_SUCCESS);
+    descriptor->gradient_summation_buffers[d + i] = ocl_createSubBuffer(
+        descriptor->partial_shifted_gradient_buffer, CL_MEM_READ_ONLY,
+        CL_BUFFER_CREATE_TYPE_REGION, &region, &err);
+    Assert(err == CL_SUCCESS);
+    descriptor->gradient_summation_descriptors[i] =
+        prepareWeightedSumDescriptor(
+            descriptor->gradient_summation_buffers[i],
+            estimator->weight_buffer, estimator->rows_in_sample,
+            descriptor->temp_gradient_buffer, i);
+    descriptor->gradient_summation_descriptors[d + i] =
+        prepareWeightedSumDescriptor(
+            descriptor->gradient_summation_buffers[d + i],
+            estimator->weight_buffer, estimator->rows_in_sample,
+            descriptor->temp_shifted_gradient_buffer, i);
+  }
+  // The last descriptor sums up the local result contributions for the
+  // shifted bandwidth.
+  descriptor->gradient_summation_descriptors[2 * d] =
+      prepareWeightedSumDescriptor(
+          descriptor->partial_shifted_result_buffer, estimator->weight_buffer,
+          estimator->rows_in_sample, descriptor->temp_shifted_result_buffer, 0);
+  descriptor->gradient_rows = estimator->rows_in_sample;
+}
+
+/**
+ * Schedule the computation of the gradient at the current bandwidth. We
+ * also compute a shifted gradient (by a small delta) to estimate the Hessian
+ * curvature.
+ */
+static void ocl_prepareVsgdOnlineLearningStep(ocl_estimator_t* estimator) {
+  unsigned int i;
+  cl_int err = CL_SUCCESS;
+  ocl_context_t* context = ocl_getContext();
+  cl_mem null_buffer = NULL;
+  ocl_bandwidth_optimization_t* descriptor = estimator->bandwidth_optimization;
+  unsigned int d = estimator->nr_of_dimensions;
+
+  // Ensure that all required buffers are set up.
+  if (descriptor->gradient_accumulator == NULL) {
+    ocl_initializeVsgdBuffersForOnlineLearning(estimator);
+  }
+  if (descriptor->gradient_rows != estimator->rows_in_sample) {
+    ocl_initializeVsgdGradientWorkspace(estimator);
+  }
+  cl_event* summation_events = descriptor->gradient_summation_events;
+
+  // Schedule the computation of the partial gradient for the current bandwidth.
+  cl_event partial_gradient_event = NULL;
   err |= clSetKernelArg(
-      computePartialGradient, 8, sizeof(cl_mem), &null_buffer);
+      descriptor->compute_partial_gradient, 4, sizeof(cl_mem), &null_buffer);
   err |= clSetKernelArg(
-      computePartialGradient, 9, sizeof(cl_mem), &(estimator->mean_buffer));
+      descriptor->compute_partial_gradient, 6, sizeof(cl_mem),
+      &(descriptor->partial_gradient_buffer));
   err |= clSetKernelArg(
-      computePartialGradient, 10, sizeof(cl_mem), &(estimator->sdev_buffer));
+      descriptor->compute_partial_gradient, 8, sizeof(cl_mem), &null_buffer);
   Assert(err == CL_SUCCESS);
-  
   err = clEnqueueNDRangeKernel(
-      context->queue, computePartialGradient, 1, NULL,
-      &global_size, &local_size, 0, NULL, &partial_gradient_event);
+      context->queue, descriptor->compute_partial_gradient, 1, NULL,
+      &(descriptor->partial_gradient_globalsize),
+      &(descriptor->partial_gradient_localsize), 0, NULL,
+      &partial_gradient_event);
   Assert(err == CL_SUCCESS);
-  
+
   // Now schedule the summation of the partial gradient computations.
-  for (i=0; i<estimator->nr_of_dimensions; ++i) {
-    cl_buffer_region region;
-    region.size = stride_size;
-    region.origin = i * stride_size;
-    cl_mem gradient_sub_buffer = clCreateSubBuffer(
-        partial_gradient_buffer, CL_MEM_READ_ONLY,
-        CL_BUFFER_CREATE_TYPE_REGION, &region, &err);
-    summation_events[i] = sumOfArray(
-        gradient_sub_buffer, estimator->rows_in_sample,
-        descriptor->temp_gradient_buffer, i, partial_gradient_event);
-    err = clReleaseMemObject(gradient_sub_buffer);
-    Assert(err == CL_SUCCESS);
+  for (i=0; i<d; ++i) {
+    summation_events[i] = predefinedSumOfArray(
+        descriptor->gradient_summation_descriptors[i], partial_gradient_event);
   }
   err = clReleaseEvent(partial_gradient_event);
   Assert(err == CL_SUCCESS);
   
   // Schedule the computation of the partial gradient for the shifted bandwidth.
   cl_event partial_shifted_gradient_event = NULL;
-  cl_mem partial_shifted_gradient_buffer = clCreateBuffer(
-      context->context, CL_MEM_READ_WRITE,
-      stride_size * estimator->nr_of_dimensions, NULL, &err);
-  Assert(err == CL_SUCCESS);
-  cl_mem partial_shifted_result_buffer = clCreateBuffer(
-      context->context, CL_MEM_READ_WRITE,
-      sizeof(kde_float_t) * estimator->rows_in_sample, NULL, &err);
-  Assert(err == CL_SUCCESS);
-  err |= clSetKernelArg(computePartialGradient, 4, sizeof(cl_mem),
+  err |= clSetKernelArg(
+      descriptor->compute_partial_gradient, 4, sizeof(cl_mem),
       &(descriptor->running_gradient_average));
-  err |= clSetKernelArg(computePartialGradient, 6, sizeof(cl_mem),
-      &partial_shifted_gradient_buffer);
-  err |= clSetKernelArg(computePartialGradient, 8, sizeof(cl_mem),
-      &partial_shifted_result_buffer);
+  err |= clSetKernelArg(
+      descriptor->compute_partial_gradient, 6, sizeof(cl_mem),
+      &(descriptor->partial_shifted_gradient_buffer));
+  err |= clSetKernelArg(
+      descriptor->compute_partial_gradient, 8, sizeof(cl_mem),
+      &(descriptor->partial_shifted_result_buffer));
   Assert(err == CL_SUCCESS);
-  
-  err = clEnqueueNDRangeKernel(context->queue, computePartialGradient, 1,
-      NULL, &global_size, &local_size, 0, NULL,
+  err = clEnqueueNDRangeKernel(
+      context->queue, descriptor->compute_partial_gradient, 1, NULL,
+      &(descriptor->partial_gradient_globalsize),
+      &(descriptor->partial_gradient_localsize), 0, NULL,
       &partial_shifted_gradient_event);
+  Assert(err == CL_SUCCESS);
 
-  // Schedule the summation of the partial shifted gradient contributions.
-  for (i=0; i<estimator->nr_of_dimensions; ++i) {
-    cl_buffer_region region;
-    region.size = stride_size;
-    region.origin = i * stride_size;
-    cl_mem shifted_gradient_sub_buffer = clCreateSubBuffer(
-        partial_shifted_gradient_buffer, CL_MEM_READ_ONLY,
-        CL_BUFFER_CREATE_TYPE_REGION, &region, &err);
-    Assert(err == CL_SUCCESS);
-    summation_events[estimator->nr_of_dimensions + i] = sumOfArray(
-        shifted_gradient_sub_buffer, estimator->rows_in_sample,
-        descriptor->temp_shifted_gradient_buffer, i,
+  // Schedule the summation of the partial shifted gradient contributions and
+  // of the local result contributions for the shifted gradient.
+  for (i=0; i<=d; ++i) {
+    summation_events[d + i] = predefinedSumOfArray(
+        descriptor->gradient_summation_descriptors[d + i],
         partial_shifted_gradient_event);
-    err = clReleaseMemObject(shifted_gradient_sub_buffer);
-    Assert(err == CL_SUCCESS);
   }
-  // Also schedule the kernel that computes the sum of local result contributions
-  // for the shifted gradient.
-  summation_events[2 * estimator->nr_of_dimensions] = sumOfArray(
-      partial_shifted_result_buffer, estimator->rows_in_sample,
-      descriptor->temp_shifted_result_buffer, 0, partial_shifted_gradient_event);
   err = clReleaseEvent(partial_shifted_gradient_event);
   Assert(err == CL_SUCCESS);
 
@@ -366,14 +441,6 @@ static void ocl_prepareVsgdOnlineLearningStep(ocl_estimator_t* estimator) {
     err = clReleaseEvent(summation_events[i]);
     Assert(err == CL_SUCCESS);
   }
-  pfree(summation_events);
-  if (partial_gradient_buffer)
-    err |= clReleaseMemObject(partial_gradient_buffer);
-  if (partial_shifted_gradient_buffer)
-    err |= clReleaseMemObject(partial_shifted_gradient_buffer);
-  if (partial_shifted_result_buffer)
-    err |= clReleaseMemObject(partial_shifted_result_buffer);
-  Assert(err == CL_SUCCESS);
 }
 
 static void ocl_runVsgdOnlineLearningStep(
@@ -592,7 +659,7 @@ static void ocl_initializeRMSProp(
     stride_size /= 8;
   }
   unsigned int result_stride_elements = stride_size / sizeof(kde_float_t);
-  descriptor->partial_gradient_buffer = clCreateBuffer(
+  descriptor->partial_gradient_buffer = ocl_createBuffer(
       context->context, CL_MEM_READ_WRITE,
       stride_size * estimator->nr_of_dimensions, NULL, &err);
   Assert(err == CL_SUCCESS);
@@ -665,7 +732,7 @@ static void ocl_initializeRMSProp(
   /*
    * Initialize the partial gradient summation.
    */
-  descriptor->gradient_buffer = clCreateBuffer(
+  descriptor->gradient_buffer = ocl_createBuffer(
       context->context, CL_MEM_READ_WRITE,
       estimator->nr_of_dimensions * sizeof(kde_float_t), NULL, &err);
   Assert(err == CL_SUCCESS);
@@ -679,19 +746,21 @@ static void ocl_initializeRMSProp(
     cl_buffer_region region;
     region.size = stride_size;
     region.origin = i * stride_size;
-    descriptor->gradient_summation_buffers[i] = clCreateSubBuffer(
+    descriptor->gradient_summation_buffers[i] = ocl_createSubBuffer(
         descriptor->partial_gradient_buffer, CL_MEM_READ_ONLY,
         CL_BUFFER_CREATE_TYPE_REGION, &region, NULL);
-    descriptor->gradient_summation_descriptors[i] = prepareSumDescriptor(
-        descriptor->gradient_summation_buffers[i], estimator->rows_in_sample,
-        descriptor->gradient_buffer, i);
+    descriptor->gradient_summation_descriptors[i] =
+        prepareWeightedSumDescriptor(
+            descriptor->gradient_summation_buffers[i],
+            estimator->weight_buffer, estimator->rows_in_sample,
+            descriptor->gradient_buffer, i);
   }
 
   /*
    * Initialize the gradient accumulation.
    */
   // Allocate and zero-initialize the gradient accumulator.
-  descriptor->gradient_accumulator_buffer = clCreateBuffer(
+  descriptor->gradient_accumulator_buffer = ocl_createBuffer(
       context->context, CL_MEM_READ_WRITE,
       sizeof(kde_float_t) * estimator->nr_of_dimensions, NULL, &err);
   Assert(err == CL_SUCCESS);
@@ -722,15 +791,15 @@ static void ocl_initializeRMSProp(
    * Initialize the learning rate adjustment buffers (will be initialized
    * when the first mini-batch is accumulated.)
    */
-  descriptor->last_gradient_buffer = clCreateBuffer(
+  descriptor->last_gradient_buffer = ocl_createBuffer(
       context->context, CL_MEM_READ_WRITE,
       sizeof(kde_float_t) * estimator->nr_of_dimensions, NULL, &err);
   Assert(err == CL_SUCCESS);
-  descriptor->running_squared_gradient_average_buffer = clCreateBuffer(
+  descriptor->running_squared_gradient_average_buffer = ocl_createBuffer(
         context->context, CL_MEM_READ_WRITE,
         sizeof(kde_float_t) * estimator->nr_of_dimensions, NULL, &err);
   Assert(err == CL_SUCCESS);
-  descriptor->learning_rate_buffer = clCreateBuffer(
+  descriptor->learning_rate_buffer = ocl_createBuffer(
         context->context, CL_MEM_READ_WRITE,
         sizeof(kde_float_t) * estimator->nr_of_dimensions, NULL, &err);
   Assert(err == CL_SUCCESS);
@@ -911,34 +980,54 @@ static void ocl_runRmspropOnlineLearningStep(
   Assert(err == CL_SUCCESS);
 }
 
-void ocl_runOnlineLearningStep(
-    ocl_estimator_t* estimator, double selectivity) {
-  if (!kde_enable_adaptive_bandwidth) return;
-
+// Helper function to schedule the gradient computation for the query bounds
+// of the last estimate.
+static void ocl_prepareOnlineLearningStep(ocl_estimator_t* estimator) {
+  cl_int err PG_USED_FOR_ASSERTS_ONLY = CL_SUCCESS;
+  ocl_context_t* context = ocl_getContext();
+  CREATE_TIMER();
+  // The device copy of the query bounds might belong to a later estimate (or
+  // to none, if the estimate was cached or computed on the host).
+  err = clEnqueueWriteBuffer(
+      context->queue, estimator->input_buffer, CL_TRUE, 0,
+      2 * sizeof(kde_float_t) * estimator->nr_of_dimensions,
+      estimator->last_query, 0, NULL, NULL);
+  Assert(err == CL_SUCCESS);
+  estimator->stats->maintenance_transfer_to_device++;
   if(kde_online_optimization_algorithm == VSGD_FD) {
-    ocl_runVsgdOnlineLearningStep(estimator, selectivity);
-  } else if (kde_online_optimization_algorithm == RMSPROP) {
-    ocl_runRmspropOnlineLearningStep(estimator, selectivity);
+    ocl_prepareVsgdOnlineLearningStep(estimator);
+  } else if(kde_online_optimization_algorithm == RMSPROP) {
+    ocl_prepareRmspropOnlineLearningStep(estimator);
   } else {
     fprintf(
         stderr, "I do not know this optimization algorithm: %i\n",
         kde_online_optimization_algorithm);
   }
+  RECORD_TIMER(KDE_PHASE_MAINTENANCE);
 }
 
-void ocl_prepareOnlineLearningStep(ocl_estimator_t* estimator) {
+void ocl_runOnlineLearningStep(
+    ocl_estimator_t* estimator, double selectivity) {
   if (!kde_enable_adaptive_bandwidth) return;
-  CREATE_TIMER();
+  if (estimator->last_query == NULL) return;
+  // Compute the gradient for the query that received the feedback.
+  ocl_prepareOnlineLearningStep(estimator);
+  // The bandwidth will change on the device.
+  estimator->host_bandwidth_valid = false;
+  ocl_countGridChanges(estimator, 1);
+  ocl_invalidateFactorCache(estimator);
+  ocl_clearSelectivityCache(estimator);
+  ocl_markEstimatorDirty(estimator);
+
   if(kde_online_optimization_algorithm == VSGD_FD) {
-    ocl_prepareVsgdOnlineLearningStep(estimator);
-  } else if(kde_online_optimization_algorithm == RMSPROP) {
-    ocl_prepareRmspropOnlineLearningStep(estimator);
+    ocl_runVsgdOnlineLearningStep(estimator, selectivity);
+  } else if (kde_online_optimization_algorithm == RMSPROP) {
+    ocl_runRmspropOnlineLearningStep(estimator, selectivity);
   } else {
     fprintf(
         stderr, "I do not know this optimization algorithm: %i\n",
         kde_online_optimization_algorithm);
   }
-  LOG_TIMER("Model Maintenance");
 }
 
 void ocl_releaseBandwidthOptimizatztionBuffers(ocl_estimator_t* estimator) {
@@ -948,6 +1037,7 @@ void ocl_releaseBandwidthOptimizatztionBuffers(ocl_estimator_t* estimator) {
   if (estimator->bandwidth_optimization->rmsprop_descriptor) {
     ocl_releaseRMSProp(estimator);
   }
+  ocl_releaseVsgdGradientWorkspace(estimator);
 
   // Release the buffers.
   if (descriptor->gradient_accumulator) {
@@ -64,22 +64,27 @@ typedef struct ocl_bandwidth_optimization {
   cl_mem temp_shifted_gradient_buffer;
   cl_mem temp_shifted_result_buffer;
   double learning_boost_rate;
-  // Fields for describing aggregation operations.
+  /* Workspace for computing the gradients, sized for gradient_rows points */
+  unsigned int gradient_rows;
+  cl_kernel compute_partial_gradient;
+  size_t partial_gradient_localsize;
+  size_t partial_gradient_globalsize;
   cl_mem partial_gradient_buffer;
+  cl_mem partial_shifted_gradient_buffer;
+  cl_mem partial_shifted_result_buffer;
+  // Summation sub-buffers and descriptors: d for the gradient, d for the
+  // shifted gradient, and a final descriptor for the shifted result.
+  cl_mem* gradient_summation_buffers;
+  ocl_aggregation_descriptor_t** gradient_summation_descriptors;
+  cl_event* gradient_summation_events;
 } ocl_bandwidth_optimization_t;
 
 void ocl_allocateBandwidthOptimizatztionBuffers(ocl_estimator_t* estimator);
 void ocl_releaseBandwidthOptimizatztionBuffers(ocl_estimator_t* estimator);
 
-/**
- * Schedule the computation of required gradients for the online learning step.
- *
- * Returns an event to wait for the gradient computation to complete.
- */
-void ocl_prepareOnlineLearningStep(ocl_estimator_t* estimator);
-
 /*
- * Run a single online optimization step with adaptive learning rate.
+ * Run a single online optimization step with adaptive learning rate. The
+ * gradient is computed for the query bounds of the last estimate.
  */
 void ocl_runOnlineLearningStep(
     ocl_estimator_t* estimator, double observed_selectivity);
@@ -0,0 +1,151 @@
+/*
+ * ocl_coreset.c
+ */
+
+#include "ocl_coreset.h"
+
+#ifdef USE_OPENCL
+
+#include <float.h>
+#include <math.h>
+#include <stdlib.h>
+
+// GUC configuration variable.
+int kde_coreset_size = 0;
+
+unsigned int ocl_coresetSize(unsigned int sample_size) {
+  if (kde_coreset_size <= 0 || (unsigned int)kde_coreset_size >= sample_size) {
+    return sample_size;
+  }
+  return kde_coreset_size;
+}
+
+// Helper function to find the centroid that is closest to the given point.
+static unsigned int closestCentroid(
+    const kde_float_t* point, const double* centroids,
+    unsigned int nr_of_centroids, unsigned int nr_of_dimensions,
+    double* distance) {
+  unsigned int i, j;
+  unsigned int closest = 0;
+  double closest_distance = DBL_MAX;
+  for (i = 0; i < nr_of_centroids; ++i) {
+    const double* centroid = &(centroids[i * nr_of_dimensions]);
+    double current_distance = 0;
+    for (j = 0; j < nr_of_dimensions && current_distance < closest_distance;
+         ++j) {
+      double delta = point[j] - centroid[j];
+      current_distance += delta * delta;
+    }
+    if (current_distance < closest_distance) {
+      closest = i;
+      closest_distance = current_distance;
+    }
+  }
+  *distance = closest_distance;
+  return closest;
+}
+
+void ocl_compactSample(
+    kde_float_t* sample, unsigned int rows_in_sample,
+    unsigned int nr_of_dimensions, unsigned int coreset_size,
+    kde_float_t* weights) {
+  unsigned int i, j, iteration;
+  unsigned int d = nr_of_dimensions;
+  // The sample is stored in random order, so the first points are a random
+  // choice of initial centroids.
+  double* centroids = malloc(sizeof(double) * coreset_size * d);
+  unsigned int* assignment = malloc(sizeof(unsigned int) * rows_in_sample);
+  double* sums = malloc(sizeof(double) * coreset_size * d);
+  unsigned int* counts = malloc(sizeof(unsigned int) * coreset_size);
+  double error = 0;
+  for (i = 0; i < coreset_size * d; ++i) centroids[i] = sample[i];
+  for (j = 0; j < rows_in_sample; ++j) assignment[j] = coreset_size;
+  for (iteration = 0; iteration < OCL_CORESET_MAX_ITERATIONS; ++iteration) {
+    // Assign every point to its closest centroid.
+    unsigned int changes = 0;
+    error = 0;
+    for (j = 0; j < rows_in_sample; ++j) {
+      double distance;
+      unsigned int closest = closestCentroid(
+          &(sample[j * d]), centroids, coreset_size, d, &distance);
+      if (closest != assignment[j]) {
+        assignment[j] = closest;
+        changes++;
+      }
+      error += distance;
+    }
+    if (changes == 0 || iteration == OCL_CORESET_MAX_ITERATIONS - 1) break;
+    // Move every centroid to the mean of its cluster. Empty clusters keep
+    // their centroid and end up with a weight of zero.
+    memset(sums, 0, sizeof(double) * coreset_size * d);
+    memset(counts, 0, sizeof(unsigned int) * coreset_size);
+    for (j = 0; j < rows_in_sample; ++j) {
+      counts[assignment[j]]++;
+      for (i = 0; i < d; ++i) {
+        sums[assignment[j] * d + i] += sample[j * d + i];
+      }
+    }
+    for (j = 0; j < coreset_size; ++j) {
+      if (counts[j] == 0) continue;
+      for (i = 0; i < d; ++i) {
+        centroids[j * d + i] = sums[j * d + i] / counts[j];
+      }
+    }
+  }
+  // Weight every centroid by the size of its cluster, scaled such that the
+  // weights have an average of one.
+  memset(counts, 0, sizeof(unsigned int) * coreset_size);
+  for (j = 0; j < rows_in_sample; ++j) counts[assignment[j]]++;
+  for (j = 0; j < coreset_size; ++j) {
+    weights[j] = (double)counts[j] * coreset_size / rows_in_sample;
+    for (i = 0; i < d; ++i) sample[j * d + i] = centroids[j * d + i];
+  }
+  if (ocl_isDebug()) {
+    fprintf(stderr, "\tCompacted the sample into %i weighted points after %i "
+            "iterations (mean squared distance: %e).\n", coreset_size,
+            iteration + 1, error / rows_in_sample);
+  }
+  free(centroids);
+  free(assignment);
+  free(sums);
+  free(counts);
+}
+
+void ocl_resetReplacedCoresetWeights(
+    ocl_estimator_t* estimator, unsigned int nr_of_positions,
+    const unsigned int* positions) {
+  unsigned int i;
+  ocl_context_t* context = ocl_getContext();
+  cl_int err PG_USED_FOR_ASSERTS_ONLY = CL_SUCCESS;
+  unsigned int n = estimator->rows_in_sample;
+  double rows = estimator->represented_rows;
+  kde_float_t* weights = palloc(sizeof(kde_float_t) * n);
+  err = clEnqueueReadBuffer(
+      context->queue, estimator->weight_buffer, CL_TRUE, 0,
+      sizeof(kde_float_t) * n, weights, 0, NULL, NULL);
+  Assert(err == CL_SUCCESS);
+  estimator->stats->maintenance_transfer_to_host++;
+  // Convert the weights to the number of rows each point summarizes, and
+  // count every replaced point as a single row.
+  for (i = 0; i < n; ++i) weights[i] *= rows / n;
+  for (i = 0; i < nr_of_positions; ++i) {
+    rows += 1.0 - weights[positions[i]];
+    weights[positions[i]] = 1.0;
+  }
+  rows = Max(1.0, rint(rows));
+  // And scale them back to an average of one.
+  for (i = 0; i < n; ++i) weights[i] *= n / rows;
+  err = clEnqueueWriteBuffer(
+      context->queue, estimator->weight_buffer, CL_TRUE, 0,
+      sizeof(kde_float_t) * n, weights, 0, NULL, NULL);
+  Assert(err == CL_SUCCESS);
+  estimator->stats->maintenance_transfer_to_device++;
+  // Keep the host copy of the native backend in sync.
+  if (estimator->host_weights) {
+    for (i = 0; i < n; ++i) estimator->host_weights[i] = weights[i];
+  }
+  estimator->represented_rows = (unsigned int)rows;
+  pfree(weights);
+}
+
+#endif /* USE_OPENCL */
@@ -0,0 +1,58 @@
+/*
+ * ocl_coreset.h
+ *
+ *  Model compaction for kde_coreset_size. Instead of storing the raw sample,
+ *  ANALYZE draws kde_samplesize rows and summarizes them by a smaller set of
+ *  weighted points, which are computed by (Lloyd's) k-means on the normalized
+ *  sample: every point of the model is the centroid of a cluster of sample
+ *  rows and is weighted by the size of the cluster. Estimation and model
+ *  maintenance scale with the number of stored points, while the model keeps
+ *  most of the accuracy of the larger sample.
+ *
+ *  The weights are kept in the weight buffer of the estimator and are scaled
+ *  to an average of one, so the weighted sum of the per-point contributions
+ *  is normalized by the number of stored points just like an unweighted sum.
+ *  Sample maintenance replaces stored points by new rows in place. A new row
+ *  only stands for itself, so it is weighted like a cluster of size one: the
+ *  rows summarized by the replaced point are dropped from represented_rows,
+ *  and all weights are rescaled to keep their average of one.
+ */
+
+#ifndef OCL_CORESET_H_
+#define OCL_CORESET_H_
+
+#include "ocl_estimator.h"
+
+#ifdef USE_OPENCL
+
+/*
+ * Maximum number of k-means iterations during the compaction.
+ */
+#define OCL_CORESET_MAX_ITERATIONS 10
+
+/*
+ * Returns the number of points that a model built from a sample of the given
+ * size stores.
+ */
+unsigned int ocl_coresetSize(unsigned int sample_size);
+
+/*
+ * Compacts the normalized sample (item-major, rows_in_sample points) into
+ * coreset_size weighted points. The compacted points are written to the
+ * first coreset_size items of sample, their weights to weights.
+ */
+void ocl_compactSample(
+    kde_float_t* sample, unsigned int rows_in_sample,
+    unsigned int nr_of_dimensions, unsigned int coreset_size,
+    kde_float_t* weights);
+
+/*
+ * Updates the weights of a compacted model after the points at the given
+ * positions were replaced by single rows (see above).
+ */
+void ocl_resetReplacedCoresetWeights(
+    ocl_estimator_t* estimator, unsigned int nr_of_positions,
+    const unsigned int* positions);
+
+#endif /* USE_OPENCL */
+#endif /* OCL_CORESET_H_ */
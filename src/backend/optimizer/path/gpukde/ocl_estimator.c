@@ -8,9 +8,22 @@
  */
 
 #include "ocl_adaptive_bandwidth.h"
+#include "ocl_coreset.h"
 #include "ocl_estimator.h"
+#include "ocl_factor_cache.h"
+#include "ocl_grid_estimator.h"
 #include "ocl_model_maintenance.h"
+#include "ocl_native_estimator.h"
+#include "ocl_optimization_worker.h"
+#include "ocl_progressive_estimator.h"
+#include "ocl_replacement_pool.h"
+#include "ocl_sample_file.h"
 #include "ocl_sample_maintenance.h"
+#include "ocl_sample_tids.h"
+#include "ocl_selectivity_cache.h"
+#include "ocl_shared_registry.h"
+#include "ocl_single_precision.h"
+#include "ocl_spatial_index.h"
 #include "ocl_utilities.h"
 
 #ifdef USE_OPENCL
@@ -20,6 +33,7 @@
 #include <math.h>
 #include <stdlib.h>
 #include <sys/time.h>
+#include <unistd.h>
 
 #include "miscadmin.h"
 #include "access/heapam.h"
@@ -40,15 +54,39 @@ extern bool ocl_use_gpu;
 extern bool kde_enable;
 extern int kde_samplesize;
 extern int kde_sample_maintenance_option;
+extern bool kde_enable_adaptive_bandwidth;
+extern bool kde_enable_bandwidth_optimization;
 
 ocl_kernel_type_t global_kernel_type = GAUSS;
 
+// GUC configuration variables.
+int kde_kernel = GAUSS;
+int kde_backend = OPENCL_BACKEND;
+extern int kde_estimation_precision;
+extern bool kde_enable_spatial_pruning;
+extern bool kde_enable_progressive_estimation;
+extern int kde_selectivity_cache_size;
+
 // Estimator registration.
 ocl_estimator_registry_t* registry = NULL;
 
-// Helper functions to allocate / release an estimator.
+// Models that this backend has written in the current transaction. The new
+// versions are published to the shared registry once the transaction commits.
+// Every write creates a new sample file, so we also remember which file has
+// to be removed on commit (the previous one) and on abort (the new one).
+typedef struct ocl_pending_publication {
+  Oid table;
+  char* new_sample_file;
+  char* old_sample_file;    // NULL if the model was not in the catalog yet.
+} ocl_pending_publication_t;
+static ocl_pending_publication_t* pending_publications = NULL;
+static unsigned int nr_of_pending_publications = 0;
+
+// Helper functions to allocate / release an estimator. Weighted estimators
+// get a weight buffer, which uses weight_host_ptr if given.
 static ocl_estimator_t* allocateEstimator(
-    Oid relation, int32 column_map, unsigned int sample_size) {
+    Oid relation, int32 column_map, unsigned int sample_size,
+    kde_float_t* sample_host_ptr, bool weighted, kde_float_t* weight_host_ptr) {
   unsigned int i;
   cl_int err = CL_SUCCESS;
   ocl_estimator_t* result = calloc(1, sizeof(ocl_estimator_t));
@@ -66,39 +104,52 @@ static ocl_estimator_t* allocateEstimator(
   // Now allocate the required buffers.
   ocl_context_t* context = ocl_getContext();
   result->rows_in_sample = sample_size;
-  // Allocate the sample buffer.
+  result->represented_rows = sample_size;
+  // Allocate the sample buffer. If we got a host copy of the sample, the
+  // buffer uses it directly instead of allocating device memory.
   result->sample_buffer_size = ocl_sizeOfSampleItem(result) * sample_size;
-  result->sample_buffer = clCreateBuffer(
-      context->context, CL_MEM_READ_WRITE,
-      result->sample_buffer_size, NULL, &err);
+  result->sample_buffer = ocl_createBuffer(
+      context->context,
+      sample_host_ptr ? CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR :
+                        CL_MEM_READ_WRITE,
+      result->sample_buffer_size, sample_host_ptr, &err);
   Assert(err == CL_SUCCESS);
+  // Allocate the buffer to store the weights of a compacted sample.
+  if (weighted) {
+    result->weight_buffer = ocl_createBuffer(
+        context->context,
+        weight_host_ptr ? CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR :
+                          CL_MEM_READ_WRITE,
+        sizeof(kde_float_t) * sample_size, weight_host_ptr, &err);
+    Assert(err == CL_SUCCESS);
+  }
   // Allocate the buffer to store sample mean.
-  result->mean_buffer = clCreateBuffer(
+  result->mean_buffer = ocl_createBuffer(
       context->context, CL_MEM_READ_WRITE,
       result->nr_of_dimensions * sizeof(kde_float_t), NULL, &err);
   Assert(err == CL_SUCCESS);
   // Allocate the buffer to store sample standard deviation.
-  result->sdev_buffer = clCreateBuffer(
+  result->sdev_buffer = ocl_createBuffer(
       context->context, CL_MEM_READ_WRITE,
       result->nr_of_dimensions * sizeof(kde_float_t), NULL, &err);
   Assert(err == CL_SUCCESS);
   // Allocate the buffer to store local results per sample point.
-  result->local_results_buffer = clCreateBuffer(
+  result->local_results_buffer = ocl_createBuffer(
       context->context, CL_MEM_READ_WRITE,
       sizeof(kde_float_t) * sample_size, NULL, &err);
   Assert(err == CL_SUCCESS);
   // Allocate the buffer to store the final result.
-  result->result_buffer = clCreateBuffer(
+  result->result_buffer = ocl_createBuffer(
       context->context, CL_MEM_READ_WRITE,
       sizeof(kde_float_t), NULL, &err);
   Assert(err == CL_SUCCESS);
   // Allocate the input buffer.
-  result->input_buffer = clCreateBuffer(
+  result->input_buffer = ocl_createBuffer(
       context->context, CL_MEM_READ_WRITE,
       2 * sizeof(kde_float_t) * result->nr_of_dimensions, NULL, &err);
   Assert(err == CL_SUCCESS);
   // Allocate the bandwidth buffer.
-  result->bandwidth_buffer = clCreateBuffer(
+  result->bandwidth_buffer = ocl_createBuffer(
       context->context, CL_MEM_READ_WRITE,
       sizeof(kde_float_t) * result->nr_of_dimensions, NULL, &err);
   Assert(err == CL_SUCCESS);
@@ -124,9 +175,9 @@ static ocl_estimator_t* allocateEstimator(
       result->kde_kernel, 5, sizeof(cl_mem), &(result->sdev_buffer));
   Assert(err == CL_SUCCESS);
   // Prepare the sum descriptor.
-  result->sum_descriptor = prepareSumDescriptor(
-      result->local_results_buffer, result->rows_in_sample,
-      result->result_buffer, 0);
+  result->sum_descriptor = prepareWeightedSumDescriptor(
+      result->local_results_buffer, result->weight_buffer,
+      result->rows_in_sample, result->result_buffer, 0);
   result->stats = (ocl_stats_t*) calloc(1,sizeof(ocl_stats_t));
 
   result->mean_host_buffer = (kde_float_t*) calloc(result->nr_of_dimensions,sizeof(kde_float_t));
@@ -138,10 +189,95 @@ static ocl_estimator_t* allocateEstimator(
   return result;
 }
 
+/*
+ * Device buffers and kernels of batched estimates and sample updates. The
+ * buffers only grow, so once they fit the largest batch, neither path creates
+ * any OpenCL objects.
+ */
+typedef struct ocl_workspace {
+  // Batched estimation.
+  cl_kernel batch_kde_kernel;
+  cl_kernel batch_sum_kernel;
+  ocl_kernel_type_t batch_kernel_type;
+  cl_mem batch_range_buffer;
+  cl_mem batch_result_buffer;
+  unsigned int batch_query_capacity;
+  cl_mem batch_partial_buffer;
+  size_t batch_partial_capacity;
+  // Transfer of updated sample points.
+  cl_kernel scatter_kernel;
+  cl_mem scatter_position_buffer;
+  cl_mem scatter_item_buffer;
+  unsigned int scatter_capacity;
+} ocl_workspace_t;
+
+// Helper function to fetch (and allocate if necessary) the workspace.
+static ocl_workspace_t* getWorkspace(ocl_estimator_t* estimator) {
+  if (estimator->workspace == NULL) {
+    estimator->workspace = calloc(1, sizeof(ocl_workspace_t));
+  }
+  return estimator->workspace;
+}
+
+// Helper function to replace a workspace buffer by a buffer of the given size.
+static void resizeWorkspaceBuffer(
+    cl_mem* buffer, cl_mem_flags flags, size_t size) {
+  cl_int err = CL_SUCCESS;
+  if (*buffer) {
+    err = clReleaseMemObject(*buffer);
+    Assert(err == CL_SUCCESS);
+  }
+  *buffer = ocl_createBuffer(
+      ocl_getContext()->context, flags, size, NULL, &err);
+  Assert(err == CL_SUCCESS);
+}
+
+static void releaseWorkspace(ocl_estimator_t* estimator) {
+  cl_int err = CL_SUCCESS;
+  ocl_workspace_t* workspace = estimator->workspace;
+  if (workspace == NULL) return;
+  if (workspace->batch_kde_kernel) {
+    err |= clReleaseKernel(workspace->batch_kde_kernel);
+  }
+  if (workspace->batch_sum_kernel) {
+    err |= clReleaseKernel(workspace->batch_sum_kernel);
+  }
+  if (workspace->batch_range_buffer) {
+    err |= clReleaseMemObject(workspace->batch_range_buffer);
+  }
+  if (workspace->batch_result_buffer) {
+    err |= clReleaseMemObject(workspace->batch_result_buffer);
+  }
+  if (workspace->batch_partial_buffer) {
+    err |= clReleaseMemObject(workspace->batch_partial_buffer);
+  }
+  if (workspace->scatter_kernel) {
+    err |= clReleaseKernel(workspace->scatter_kernel);
+  }
+  if (workspace->scatter_position_buffer) {
+    err |= clReleaseMemObject(workspace->scatter_position_buffer);
+  }
+  if (workspace->scatter_item_buffer) {
+    err |= clReleaseMemObject(workspace->scatter_item_buffer);
+  }
+  Assert(err == CL_SUCCESS);
+  free(workspace);
+  estimator->workspace = NULL;
+}
+
 static void freeEstimator(ocl_estimator_t* estimator) {
+  unsigned int i;
   // Release all buffers.
   cl_int err = CL_SUCCESS;
   if (estimator->sample_buffer) clReleaseMemObject(estimator->sample_buffer);
+  if (estimator->weight_buffer) clReleaseMemObject(estimator->weight_buffer);
+  if (estimator->sample_file_mapping) {
+    // The sample buffer uses the mapping, wait until the device is done.
+    clFinish(ocl_getContext()->queue);
+    ocl_unmapSampleFile(
+        estimator->sample_file_mapping, estimator->sample_file_mapping_size);
+  }
+  if (estimator->last_query) free(estimator->last_query);
   if (estimator->mean_host_buffer) free(estimator->mean_host_buffer);
   if (estimator->sdev_host_buffer) free(estimator->sdev_host_buffer);
   if (estimator->mean_buffer) clReleaseMemObject(estimator->mean_buffer);
@@ -164,6 +300,25 @@ static void freeEstimator(ocl_estimator_t* estimator) {
   // Release the column map.
   if (estimator->column_order) free(estimator->column_order);
   releaseAggregationDescriptor(estimator->sum_descriptor);
+  if (estimator->dimension_sum_descriptors) {
+    for (i = 0; i < estimator->nr_of_dimensions; ++i) {
+      if (estimator->dimension_sum_descriptors[i]) {
+        releaseAggregationDescriptor(estimator->dimension_sum_descriptors[i]);
+      }
+    }
+    free(estimator->dimension_sum_descriptors);
+  }
+  // Release the host copies of the native backend.
+  ocl_nativeReleaseBuffers(estimator);
+  ocl_releaseSinglePrecisionBuffers(estimator);
+  ocl_releaseSpatialIndex(estimator);
+  ocl_releaseProgressiveEstimator(estimator);
+  ocl_releaseGridEstimator(estimator);
+  ocl_releaseFactorCache(estimator);
+  ocl_releaseSampleTids(estimator);
+  ocl_releaseReplacementPool(estimator);
+  ocl_releaseSelectivityCache(estimator);
+  releaseWorkspace(estimator);
   // Release the required buffers for the optimization.
   ocl_releaseSampleMaintenanceBuffers(estimator);
   ocl_releaseBandwidthOptimizatztionBuffers(estimator);
@@ -173,7 +328,7 @@ static void freeEstimator(ocl_estimator_t* estimator) {
 
 static ocl_estimator_t* ocl_buildEstimatorFromCatalogEntry(
     Relation kde_rel, HeapTuple tuple) {
-  unsigned int i,j;
+  unsigned int i;
   cl_int err = CL_SUCCESS;
   Datum datum;
   ArrayType* array;
@@ -191,18 +346,52 @@ static ocl_estimator_t* ocl_buildEstimatorFromCatalogEntry(
                          RelationGetDescr(kde_rel), &isNull);
   unsigned int sample_size = DatumGetInt32(datum);
 
+  // >> Map the sample file. The file stores the normalized sample in device
+  // layout, so the mapping directly backs the device sample buffer.
+  datum = heap_getattr(
+      tuple, Anum_pg_kdemodels_sample_file, RelationGetDescr(kde_rel), &isNull);
+  if (isNull) return NULL;
+  char* file_name = TextDatumGetCString(datum);
+  ocl_sample_file_t file;
+  if (!ocl_mapSampleFile(file_name, &file)) return NULL;
+
+  // >> Check that the file and the bandwidth match the column map of the
+  // catalog entry. Otherwise, we skip the entry, so the next ANALYZE
+  // rebuilds the model instead of reading past the stored payload.
+  unsigned int nr_of_dimensions = 0;
+  for (i = 0; i < 32; ++i) {
+    if ((uint32)column_map & (0x1U << i)) nr_of_dimensions++;
+  }
+  datum = heap_getattr(tuple, Anum_pg_kdemodels_bandwidth,
+                       RelationGetDescr(kde_rel), &isNull);
+  array = isNull ? NULL : DatumGetArrayTypeP(datum);
+  if (file.header->nr_of_dimensions != nr_of_dimensions ||
+      file.header->rows_in_sample != sample_size ||
+      array == NULL || ARR_NDIM(array) != 1 || ARR_HASNULL(array) ||
+      ARR_ELEMTYPE(array) != FLOAT8OID ||
+      ARR_DIMS(array)[0] != (int)nr_of_dimensions) {
+    ereport(WARNING,
+            (errmsg("KDE model in sample file \"%s\" does not match the "
+                    "catalog", file_name),
+             errhint("Run ANALYZE on the table to rebuild the model.")));
+    ocl_unmapSampleFile(file.mapping, file.mapping_size);
+    return NULL;
+  }
+
   // >> Allocate the descriptor.
   ocl_estimator_t* estimator = allocateEstimator(
-      table, column_map, sample_size);
+      table, column_map, sample_size, file.sample, file.weights != NULL,
+      file.weights);
+  estimator->sample_file_mapping = file.mapping;
+  estimator->sample_file_mapping_size = file.mapping_size;
+  if (file.weights) estimator->represented_rows = file.header->represented_rows;
+  ocl_resetSampleTids(estimator, file.tids);
 
   datum = heap_getattr(tuple, Anum_pg_kdemodels_rowcount_table,
                          RelationGetDescr(kde_rel), &isNull);
   estimator->rows_in_table = DatumGetInt32(datum);
   
-  // >> Read the bandwidth and push it to the device.
-  datum = heap_getattr(tuple, Anum_pg_kdemodels_bandwidth,
-                       RelationGetDescr(kde_rel), &isNull);
-  array = DatumGetArrayTypeP(datum);
+  // >> Push the (validated) bandwidth to the device.
   if (sizeof(kde_float_t) == sizeof(float)) {
     // The system catalog stores double, but we expect float.
     kde_float_t* tmp_buffer = palloc(
@@ -225,141 +414,42 @@ static ocl_estimator_t* ocl_buildEstimatorFromCatalogEntry(
     Assert(err == CL_SUCCESS);
   }
 
-  // >> Read the sample.
-  datum = heap_getattr(
-      tuple, Anum_pg_kdemodels_sample_file, RelationGetDescr(kde_rel), &isNull);
-  char* file_name = TextDatumGetCString(datum);
-  FILE* file = fopen(file_name, "rb");
-  if (file == NULL) {
-    fprintf(stderr, "Error opening sample file %s\n", file_name);
-    return NULL;
-  }
-  double* sample_buffer = palloc(
-      sizeof(double) * estimator->nr_of_dimensions * estimator->rows_in_sample);
-  size_t read_elements = fread(
-      sample_buffer, sizeof(double) * estimator->nr_of_dimensions,
-      estimator->rows_in_sample, file);
-
-  if (read_elements != estimator->rows_in_sample) {
-    fprintf(stderr, "Error reading sample from file %s\n", file_name);
-    fclose(file);
-    pfree(sample_buffer);
-    return NULL;
-  }
-
-
-  // Read the sample karma.
-  double* karma_buffer = palloc(
-      sizeof(double) * estimator->rows_in_sample);
-  read_elements = fread(
-      karma_buffer, sizeof(double),
-      estimator->rows_in_sample, file);
-  if (read_elements != estimator->rows_in_sample) {
-    fprintf(stderr, "Error reading sample from file %s\n", file_name);
-    fclose(file);
-    pfree(sample_buffer);
-    return NULL;
-  }
-
-  double* mean_buffer = calloc(
-      sizeof(double),estimator->nr_of_dimensions);
-  read_elements = fread(
-      mean_buffer, sizeof(double) * estimator->nr_of_dimensions,
-      1, file);
-
-  double* sdev_buffer = calloc(
-      sizeof(double),estimator->nr_of_dimensions);
-  read_elements = fread(
-      sdev_buffer, sizeof(double) * estimator->nr_of_dimensions,
-      1, file);
-
-  normalize(sample_buffer,estimator->rows_in_sample,estimator->nr_of_dimensions,mean_buffer,sdev_buffer);
-
-  // Now push sample and sample metrics to the device.
-  if (sizeof(kde_float_t) == sizeof(float)) {
-    kde_float_t* sample_transfer_buffer = palloc(
-        sizeof(kde_float_t) * estimator->nr_of_dimensions *
-        estimator->rows_in_sample);
-    kde_float_t* karma_transfer_buffer = palloc(
-        sizeof(kde_float_t) * estimator->rows_in_sample);
-    kde_float_t* mean_transfer_buffer = calloc(
-        sizeof(kde_float_t),estimator->nr_of_dimensions);
-    kde_float_t* sdev_transfer_buffer = calloc(
-        sizeof(kde_float_t),estimator->nr_of_dimensions);
-
-
-    for( j=0; j < estimator->rows_in_sample; ++j){
-      karma_transfer_buffer[j] = karma_buffer[j];
-      for ( i=0; i<estimator->nr_of_dimensions; ++i ) {
-        sample_transfer_buffer[j*estimator->nr_of_dimensions+i] =
-            sample_buffer[j*estimator->nr_of_dimensions+i];
-      }
-    }
-    for ( i=0; i<estimator->nr_of_dimensions; ++i ) {
-      mean_transfer_buffer[i] = mean_buffer[i];
-      sdev_transfer_buffer[i] = sdev_buffer[i];
-    }
-    err |= clEnqueueWriteBuffer(
-        context->queue, estimator->sample_buffer, CL_TRUE, 0,
-        ocl_sizeOfSampleItem(estimator) * estimator->rows_in_sample,
-        sample_transfer_buffer, 0, NULL, NULL);
-    err |= clEnqueueWriteBuffer(
-        context->queue, estimator->mean_buffer, CL_TRUE, 0,
-        ocl_sizeOfSampleItem(estimator),
-        mean_transfer_buffer, 0, NULL, NULL);
-    err |= clEnqueueWriteBuffer(
-        context->queue, estimator->sdev_buffer, CL_TRUE, 0,
-        ocl_sizeOfSampleItem(estimator),
-        sdev_transfer_buffer, 0, NULL, NULL);
-    err |= clEnqueueWriteBuffer(
-        context->queue, estimator->sample_optimization->sample_karma_buffer,
-        CL_TRUE, 0, sizeof(kde_float_t) * estimator->rows_in_sample,
-        karma_transfer_buffer, 0, NULL, NULL);
-    Assert(err == CL_SUCCESS);
-    
-    pfree(sample_transfer_buffer);
-    pfree(karma_transfer_buffer);
-    free(estimator->sdev_host_buffer);
-    free(estimator->mean_host_buffer);
-    estimator->sdev_host_buffer = sdev_transfer_buffer;
-    estimator->mean_host_buffer = mean_transfer_buffer;
-    free(mean_transfer_buffer);
-    free(sdev_transfer_buffer);
-    free(mean_buffer);
-    free(sdev_buffer);
-  } else if (sizeof(kde_float_t) == sizeof(double)) {
-    err |= clEnqueueWriteBuffer(
-        context->queue, estimator->sample_buffer, CL_TRUE, 0,
-        ocl_sizeOfSampleItem(estimator) * estimator->rows_in_sample,
-        sample_buffer, 0, NULL, NULL);
-    err |= clEnqueueWriteBuffer(
-        context->queue, estimator->mean_buffer, CL_TRUE, 0,
-        ocl_sizeOfSampleItem(estimator),
-        mean_buffer, 0, NULL, NULL);
-    err |= clEnqueueWriteBuffer(
-        context->queue, estimator->sdev_buffer, CL_TRUE, 0,
-        ocl_sizeOfSampleItem(estimator),
-        sdev_buffer, 0, NULL, NULL);
-    err |= clEnqueueWriteBuffer(
-        context->queue, estimator->sample_optimization->sample_karma_buffer,
-        CL_TRUE, 0, sizeof(kde_float_t) * estimator->rows_in_sample,
-        karma_buffer, 0, NULL, NULL);
-    Assert(err == CL_SUCCESS);
-    free(estimator->sdev_host_buffer);
-    free(estimator->mean_host_buffer);
-    estimator->sdev_host_buffer = sdev_buffer;
-    estimator->mean_host_buffer = mean_buffer;
+  // >> Push the sample metrics and the karma to the device.
+  for ( i=0; i<estimator->nr_of_dimensions; ++i ) {
+    estimator->mean_host_buffer[i] = file.header->mean[i];
+    estimator->sdev_host_buffer[i] = file.header->sdev[i];
   }
-  pfree(sample_buffer);
-  pfree(karma_buffer);
+  err |= clEnqueueWriteBuffer(
+      context->queue, estimator->mean_buffer, CL_FALSE, 0,
+      ocl_sizeOfSampleItem(estimator), estimator->mean_host_buffer,
+      0, NULL, NULL);
+  err |= clEnqueueWriteBuffer(
+      context->queue, estimator->sdev_buffer, CL_FALSE, 0,
+      ocl_sizeOfSampleItem(estimator), estimator->sdev_host_buffer,
+      0, NULL, NULL);
+  err |= clEnqueueWriteBuffer(
+      context->queue, estimator->sample_optimization->sample_karma_buffer,
+      CL_FALSE, 0, sizeof(kde_float_t) * estimator->rows_in_sample,
+      file.karma, 0, NULL, NULL);
+  Assert(err == CL_SUCCESS);
   // Wait for all transfers to finish.
   clFinish(context->queue);
   // We are done.
   return estimator;
 }
 
-static void ocl_updateEstimatorInCatalog(ocl_estimator_t* estimator) {
-  unsigned int i,j;
+void ocl_markEstimatorDirty(ocl_estimator_t* estimator) {
+  estimator->dirty = true;
+  // A pending write no longer covers all changes.
+  estimator->write_pending = false;
+}
+
+/*
+ * Writes a model to the catalog. Returns false if the sample file could not
+ * be written, in which case the catalog is left untouched.
+ */
+static bool ocl_updateEstimatorInCatalog(ocl_estimator_t* estimator) {
+  unsigned int i;
   cl_int err = CL_SUCCESS;
   HeapTuple tuple;
   Datum* array_datums = palloc(sizeof(Datum) * estimator->nr_of_dimensions);
@@ -396,14 +486,17 @@ static void ocl_updateEstimatorInCatalog(ocl_estimator_t* estimator) {
   // >> Write the bandwidth.
   kde_float_t* host_bandwidth = palloc(
       estimator->nr_of_dimensions * sizeof(kde_float_t));
-  clEnqueueReadBuffer(
+  // Wait for pending model updates, so we only time the transfers.
+  err = clFinish(context->queue);
+  Assert(err == CL_SUCCESS);
+  TIME_TRANSFER(err = clEnqueueReadBuffer(
       context->queue, estimator->bandwidth_buffer, CL_TRUE, 0,
       estimator->nr_of_dimensions * sizeof(kde_float_t), host_bandwidth,
-      0, NULL, NULL);
+      0, NULL, NULL));
+  Assert(err == CL_SUCCESS);
   for (i = 0; i < estimator->nr_of_dimensions; ++i) {
     array_datums[i] = Float8GetDatum(host_bandwidth[i]);
   }
-  pfree(host_bandwidth);
   array = construct_array(array_datums, estimator->nr_of_dimensions,
                           FLOAT8OID, sizeof(float8), FLOAT8PASSBYVAL, 'i');
   values[Anum_pg_kdemodels_bandwidth-1] = PointerGetDatum(array);
@@ -413,60 +506,61 @@ static void ocl_updateEstimatorInCatalog(ocl_estimator_t* estimator) {
       ocl_sizeOfSampleItem(estimator) * estimator->rows_in_sample);
   kde_float_t* karma_buffer = palloc(
       sizeof(kde_float_t) * estimator->rows_in_sample);
-  err |= clEnqueueReadBuffer(
+  kde_float_t* weight_buffer = NULL;
+  if (estimator->weight_buffer) {
+    weight_buffer = palloc(sizeof(kde_float_t) * estimator->rows_in_sample);
+    TIME_TRANSFER(err |= clEnqueueReadBuffer(
+        context->queue, estimator->weight_buffer, CL_TRUE, 0,
+        sizeof(kde_float_t) * estimator->rows_in_sample, weight_buffer,
+        0, NULL, NULL));
+  }
+  TIME_TRANSFER(err |= clEnqueueReadBuffer(
       context->queue, estimator->sample_buffer, CL_TRUE, 0,
       ocl_sizeOfSampleItem(estimator) * estimator->rows_in_sample,
-      sample_buffer, 0, NULL, NULL);
-  err |= clEnqueueReadBuffer(
+      sample_buffer, 0, NULL, NULL));
+  TIME_TRANSFER(err |= clEnqueueReadBuffer(
       context->queue, estimator->sample_optimization->sample_karma_buffer,
       CL_TRUE, 0, sizeof(kde_float_t) * estimator->rows_in_sample,
-      karma_buffer, 0, NULL, NULL);
+      karma_buffer, 0, NULL, NULL));
   Assert(err == CL_SUCCESS);
-  // Open the sample file for this table.
+  // The file name contains our transaction id, so we never overwrite the
+  // sample of the committed model (or that of a concurrent writer) before
+  // the catalog entry that points to our file is committed.
   char sample_file_name[1024];
-  sprintf(sample_file_name, "%s/pg_kde_samples/rel%i_kde.sample",
-          DataDir, estimator->table);
-  FILE* sample_file = fopen(sample_file_name, "wb");
-  // Now store all buffers to the location.
-  invnormalize(sample_buffer,estimator->rows_in_sample,estimator->nr_of_dimensions,estimator->mean_host_buffer,estimator->sdev_host_buffer);
-  if (sizeof(kde_float_t) == sizeof(double)) {
-    fwrite(sample_buffer, sizeof(kde_float_t)*estimator->nr_of_dimensions,
-           estimator->rows_in_sample, sample_file);
-    fwrite(karma_buffer, sizeof(kde_float_t),
-           estimator->rows_in_sample, sample_file);
-  } else {
-    double* sample_transfer_buffer = palloc(
-        sizeof(double) * estimator->nr_of_dimensions * estimator->rows_in_sample);
-    double* karma_transfer_buffer = palloc(
-        sizeof(double) * estimator->rows_in_sample);
-    for( j=0; j < estimator->rows_in_sample; ++j){
-      karma_transfer_buffer[j] = karma_buffer[j];
-      for ( i=0; i<estimator->nr_of_dimensions; ++i ) {
-        sample_transfer_buffer[j*estimator->nr_of_dimensions+i] =
-            sample_buffer[j*estimator->nr_of_dimensions+i];
-      }
-    }  
-    fwrite(sample_transfer_buffer, sizeof(double)*estimator->nr_of_dimensions,
-           estimator->rows_in_sample, sample_file);
-    fwrite(karma_transfer_buffer, sizeof(double),
-           estimator->rows_in_sample, sample_file);
-    pfree(sample_transfer_buffer);
-    pfree(karma_transfer_buffer);
-  }
-  fclose(sample_file);
+  sprintf(sample_file_name, "%s/pg_kde_samples/rel%i_%x_%u_kde.sample",
+          DataDir, estimator->table, estimator->columns,
+          GetCurrentTransactionId());
+  bool written = ocl_writeSampleFile(
+      estimator, sample_file_name, sample_buffer, karma_buffer,
+      ocl_getSampleTids(estimator), weight_buffer, host_bandwidth);
+  pfree(host_bandwidth);
   pfree(sample_buffer);
   pfree(karma_buffer);
+  if (weight_buffer) pfree(weight_buffer);
+  if (!written) {
+    // Keep the model dirty, so the write is retried later.
+    ereport(WARNING,
+            (errmsg("could not write KDE sample file \"%s\"",
+                    sample_file_name)));
+    pfree(array_datums);
+    return false;
+  }
   values[Anum_pg_kdemodels_sample_file-1] = CStringGetTextDatum(
       sample_file_name);
 
   // Ok, we constructed the tuple. Now try to find whether the estimator is
-  // already present in the catalog.
+  // already present in the catalog. Models are identified by their table and
+  // their column set.
   Relation kdeRel = heap_open(KdeModelRelationID, RowExclusiveLock);
-  ScanKeyData key[1];
+  ScanKeyData key[2];
   ScanKeyInit(
       &key[0], Anum_pg_kdemodels_table, BTEqualStrategyNumber, F_OIDEQ,
       ObjectIdGetDatum(estimator->table));
-  HeapScanDesc scan = heap_beginscan(kdeRel, SnapshotNow, 1, key);
+  ScanKeyInit(
+      &key[1], Anum_pg_kdemodels_columns, BTEqualStrategyNumber, F_INT4EQ,
+      Int32GetDatum(estimator->columns));
+  HeapScanDesc scan = heap_beginscan(kdeRel, SnapshotNow, 2, key);
+  char* old_sample_file = NULL;
   tuple = heap_getnext(scan, ForwardScanDirection);
   if (!HeapTupleIsValid(tuple)) {
     // This is a new estimator. Insert it into the table.
@@ -476,6 +570,17 @@ static void ocl_updateEstimatorInCatalog(ocl_estimator_t* estimator) {
     simple_heap_insert(kdeRel, tuple);
   } else {
     // This is an existing estimator. Update the corresponding tuple.
+    bool isNull;
+    Datum old_file_datum = heap_getattr(
+        tuple, Anum_pg_kdemodels_sample_file, RelationGetDescr(kdeRel),
+        &isNull);
+    if (!isNull) {
+      char* old_file = TextDatumGetCString(old_file_datum);
+      if (strcmp(old_file, sample_file_name) != 0) {
+        old_sample_file = strdup(old_file);
+      }
+      pfree(old_file);
+    }
     HeapTuple newtuple = heap_modify_tuple(
         tuple, RelationGetDescr(kdeRel), values, nulls, repl);
     simple_heap_update(kdeRel, &tuple->t_self, newtuple);
@@ -484,21 +589,128 @@ static void ocl_updateEstimatorInCatalog(ocl_estimator_t* estimator) {
   }
   heap_close(kdeRel, RowExclusiveLock);
 
+  // Publish the new model version once the catalog change becomes visible.
+  pending_publications = realloc(
+      pending_publications,
+      sizeof(ocl_pending_publication_t) * (nr_of_pending_publications + 1));
+  pending_publications[nr_of_pending_publications].table = estimator->table;
+  pending_publications[nr_of_pending_publications].new_sample_file =
+      strdup(sample_file_name);
+  pending_publications[nr_of_pending_publications].old_sample_file =
+      old_sample_file;
+  nr_of_pending_publications++;
+
+  // The model becomes clean once the transaction commits.
+  estimator->write_pending = true;
+
   // Clean up.
   pfree(array_datums);
+  return true;
+}
+
+/*
+ * Helper function to add a model to the model list of a table. The list is
+ * ordered by decreasing dimensionality. If the list already contains a model
+ * for the same column set, it is unlinked and returned in replaced.
+ *
+ * Returns the new head of the list.
+ */
+static ocl_estimator_t* insertModel(
+    ocl_estimator_t* models, ocl_estimator_t* estimator,
+    ocl_estimator_t** replaced) {
+  ocl_estimator_t** pos = &models;
+  *replaced = NULL;
+  for (; *pos; pos = &((*pos)->next)) {
+    if ((*pos)->columns != estimator->columns) continue;
+    *replaced = *pos;
+    *pos = (*replaced)->next;
+    (*replaced)->next = NULL;
+    break;
+  }
+  pos = &models;
+  while (*pos && (*pos)->nr_of_dimensions >= estimator->nr_of_dimensions) {
+    pos = &((*pos)->next);
+  }
+  estimator->next = *pos;
+  *pos = estimator;
+  return models;
+}
+
+static void ocl_freeEstimator(ocl_estimator_t* estimator, bool materialize);
+
+// Helper function to load all models of a single table from the catalog.
+static ocl_estimator_t* ocl_loadEstimatorFromCatalog(Oid table) {
+  ocl_estimator_t* models = NULL;
+  Relation kdeRel = heap_open(KdeModelRelationID, AccessShareLock);
+  ScanKeyData key[1];
+  ScanKeyInit(
+      &key[0], Anum_pg_kdemodels_table, BTEqualStrategyNumber, F_OIDEQ,
+      ObjectIdGetDatum(table));
+  HeapScanDesc scan = heap_beginscan(kdeRel, SnapshotNow, 1, key);
+  HeapTuple tuple;
+  while ((tuple = heap_getnext(scan, ForwardScanDirection)) != NULL) {
+    ocl_estimator_t* estimator = ocl_buildEstimatorFromCatalogEntry(
+        kdeRel, tuple);
+    if (estimator == NULL) continue;
+    ocl_estimator_t* replaced;
+    models = insertModel(models, estimator, &replaced);
+    ocl_freeEstimator(replaced, false);
+  }
+  heap_endscan(scan);
+  heap_close(kdeRel, AccessShareLock);
+  return models;
 }
 
 // Helper function to compute an actual estimate by the estimator.
 static double rangeKDE(
     ocl_context_t* ctxt, ocl_estimator_t* estimator, kde_float_t* query) {
+  unsigned int i;
   CREATE_TIMER();
+  if (kde_backend == NATIVE_BACKEND) {
+    // Bypass the OpenCL runtime and compute the estimate on the host.
+    double native_result = ocl_nativeRangeKDE(estimator, query);
+    RECORD_TIMER(KDE_PHASE_ESTIMATION);
+    return native_result;
+  }
+  // Model maintenance needs the per-point results in double precision, so
+  // we only use the alternative paths if nobody consumes them.
+  bool device_state_needed = kde_enable_adaptive_bandwidth ||
+      kde_sample_maintenance_option == TKR ||
+      kde_sample_maintenance_option == PKR;
+  // The single-precision, pruned and progressive paths do not support the
+  // weights of a compacted sample.
+  bool weighted = estimator->weight_buffer != NULL;
+  if (kde_backend == GRID_BACKEND && !device_state_needed &&
+      ocl_gridSupportsModel(estimator)) {
+    // Look the estimate up in the precomputed grid.
+    double grid_result = ocl_gridRangeKDE(estimator, query);
+    RECORD_TIMER(KDE_PHASE_ESTIMATION);
+    return grid_result;
+  }
+  if (kde_estimation_precision == SINGLE_PRECISION && !device_state_needed &&
+      !weighted) {
+    double single_result = ocl_singlePrecisionRangeKDE(estimator, query);
+    RECORD_TIMER(KDE_PHASE_ESTIMATION);
+    return single_result;
+  }
+  if (kde_enable_spatial_pruning && !device_state_needed && !weighted) {
+    double pruned_result = ocl_spatialIndexRangeKDE(estimator, query);
+    RECORD_TIMER(KDE_PHASE_ESTIMATION);
+    return pruned_result;
+  }
+  if (kde_enable_progressive_estimation && !device_state_needed &&
+      !weighted) {
+    double progressive_result = ocl_progressiveRangeKDE(estimator, query);
+    RECORD_TIMER(KDE_PHASE_ESTIMATION);
+    return progressive_result;
+  }
   // Transfer the query bounds to the device.
   cl_event input_transfer_event;
   cl_int err = CL_SUCCESS;
-  err = clEnqueueWriteBuffer(
-      ctxt->queue, estimator->input_buffer, CL_FALSE,
+  TIME_TRANSFER(err = clEnqueueWriteBuffer(
+      ctxt->queue, estimator->input_buffer, CL_TRUE,
       0, 2 * sizeof(kde_float_t) * estimator->nr_of_dimensions, query,
-      0, NULL, &input_transfer_event);
+      0, NULL, &input_transfer_event));
   estimator->stats->estimation_transfer_to_device++;
   Assert(err == CL_SUCCESS);
   // Select kernel and normalization factor based on the kernel type.
@@ -511,27 +723,29 @@ static double rangeKDE(
     normalization_factor = pow(0.5, estimator->nr_of_dimensions);
   }
   // Compute the local contributions.
-  size_t global_size = estimator->rows_in_sample;
-  cl_event kde_event;
+  cl_event wait_events[2];
+  unsigned int nr_of_wait_events = 0;
+  wait_events[nr_of_wait_events++] = input_transfer_event;
   if (estimator->bandwidth_optimization->optimization_event) {
-    cl_event wait_events[2];
-    wait_events[0] = estimator->bandwidth_optimization->optimization_event;
-    wait_events[1] = input_transfer_event;
-    err = clEnqueueNDRangeKernel(
-        ctxt->queue, estimator->kde_kernel, 1, NULL, &global_size,
-        NULL, 2, wait_events, &kde_event);
-    Assert(err == CL_SUCCESS);
-    err = clReleaseEvent(estimator->bandwidth_optimization->optimization_event);
-    Assert(err == CL_SUCCESS);
+    wait_events[nr_of_wait_events++] =
+        estimator->bandwidth_optimization->optimization_event;
     estimator->bandwidth_optimization->optimization_event = NULL;
+  }
+  cl_event kde_event;
+  if (ocl_useFactorCache()) {
+    kde_event = ocl_factorCacheKDE(
+        estimator, query, nr_of_wait_events, wait_events);
   } else {
+    size_t global_size = estimator->rows_in_sample;
     err = clEnqueueNDRangeKernel(
         ctxt->queue, estimator->kde_kernel, 1, NULL, &global_size,
-        NULL, 1, &input_transfer_event, &kde_event);
+        NULL, nr_of_wait_events, wait_events, &kde_event);
+    Assert(err == CL_SUCCESS);
+  }
+  for (i = 0; i < nr_of_wait_events; ++i) {
+    err = clReleaseEvent(wait_events[i]);
     Assert(err == CL_SUCCESS);
   }
-  err = clReleaseEvent(input_transfer_event);
-  Assert(err == CL_SUCCESS);
   // Compute the final estimation by summing up the local contributions.
   cl_event sum_event = predefinedSumOfArray(
       estimator->sum_descriptor, kde_event);
@@ -539,18 +753,222 @@ static double rangeKDE(
   Assert(err == CL_SUCCESS);
   // Transfer the summed up contributions back, and normalize them.
   kde_float_t result;
-  err = clEnqueueReadBuffer(
+  err = clWaitForEvents(1, &sum_event);
+  Assert(err == CL_SUCCESS);
+  TIME_TRANSFER(err = clEnqueueReadBuffer(
       ctxt->queue, estimator->result_buffer, CL_TRUE, 0,
-      sizeof(kde_float_t), &result, 1, &sum_event, NULL);
+      sizeof(kde_float_t), &result, 0, NULL, NULL));
   estimator->stats->estimation_transfer_to_host++;
   Assert(err == CL_SUCCESS);
   err = clReleaseEvent(sum_event);
   Assert(err == CL_SUCCESS);
   result *= normalization_factor / estimator->rows_in_sample;
-  LOG_TIMER("Estimation");
+  RECORD_TIMER(KDE_PHASE_ESTIMATION);
   return result;
 }
 
+/*
+ * Number of sample points that a work group of the batched estimation kernel
+ * keeps in local memory. Must be a power of two, since the kernel reduces
+ * each row of the tile by halving it. Devices that do not support work groups
+ * of this size get the largest power of two that fits.
+ */
+#define KDE_BATCH_TILE_SIZE 64
+
+// Helper function to check whether rangeKDEBatch computes the same estimates
+// as rangeKDE would with the current settings. The batched kernel always
+// evaluates the full sample in double precision, so it can not stand in for
+// the single-precision, pruned or progressive paths (which are not used for
+// compacted samples anyway), and it looks the estimates up in the grid even
+// if model maintenance needs them computed on the device.
+static bool batchMatchesRangeKDE(ocl_estimator_t* estimator) {
+  bool device_state_needed = kde_enable_adaptive_bandwidth ||
+      kde_sample_maintenance_option == TKR ||
+      kde_sample_maintenance_option == PKR;
+  if (kde_backend == NATIVE_BACKEND) return true;
+  if (kde_backend == GRID_BACKEND && ocl_gridSupportsModel(estimator)) {
+    return !device_state_needed;
+  }
+  if (estimator->weight_buffer != NULL) return true;
+  return kde_estimation_precision != SINGLE_PRECISION &&
+      !kde_enable_spatial_pruning && !kde_enable_progressive_estimation;
+}
+
+// Helper function to compute the estimates for a batch of queries.
+static void rangeKDEBatch(
+    ocl_context_t* ctxt, ocl_estimator_t* estimator,
+    const kde_float_t* queries, unsigned int nr_of_queries, double* results) {
+  unsigned int i;
+  CREATE_TIMER();
+  if (kde_backend == NATIVE_BACKEND) {
+    ocl_nativeRangeKDEBatch(estimator, queries, nr_of_queries, results);
+    RECORD_TIMER(KDE_PHASE_ESTIMATION);
+    return;
+  }
+  if (kde_backend == GRID_BACKEND && ocl_gridSupportsModel(estimator)) {
+    for (i = 0; i < nr_of_queries; ++i) {
+      results[i] = ocl_gridRangeKDE(
+          estimator, &(queries[2 * estimator->nr_of_dimensions * i]));
+    }
+    RECORD_TIMER(KDE_PHASE_ESTIMATION);
+    return;
+  }
+  cl_int err = CL_SUCCESS;
+  unsigned int d = estimator->nr_of_dimensions;
+  ocl_workspace_t* workspace = getWorkspace(estimator);
+  if (workspace->batch_kde_kernel == NULL ||
+      workspace->batch_kernel_type != global_kernel_type) {
+    if (workspace->batch_kde_kernel) {
+      err = clReleaseKernel(workspace->batch_kde_kernel);
+      Assert(err == CL_SUCCESS);
+    }
+    workspace->batch_kde_kernel = ocl_getKernel(
+        global_kernel_type == EPANECHNIKOV ?
+            "epanechnikov_kde_batch" : "gauss_kde_batch", d);
+    workspace->batch_kernel_type = global_kernel_type;
+  }
+  if (workspace->batch_sum_kernel == NULL) {
+    workspace->batch_sum_kernel = ocl_getKernel("sum_kde_batch", d);
+  }
+  cl_kernel kde_kernel = workspace->batch_kde_kernel;
+  cl_kernel sum_kernel = workspace->batch_sum_kernel;
+  // Each row of a work group evaluates one query against a tile of the
+  // sample, so we fit as many queries into a work group as possible.
+  size_t local_size[2];
+  size_t max_local_size;
+  err |= clGetKernelWorkGroupInfo(
+      kde_kernel, ctxt->device, CL_KERNEL_WORK_GROUP_SIZE,
+      sizeof(size_t), &max_local_size, NULL);
+  size_t used_local_memory;
+  err |= clGetKernelWorkGroupInfo(
+      kde_kernel, ctxt->device, CL_KERNEL_LOCAL_MEM_SIZE,
+      sizeof(size_t), &used_local_memory, NULL);
+  Assert(err == CL_SUCCESS);
+  local_size[0] = KDE_BATCH_TILE_SIZE;
+  while (local_size[0] > 1 && local_size[0] > max_local_size) {
+    local_size[0] /= 2;
+  }
+  local_size[1] = Max(1, Min(nr_of_queries, max_local_size / local_size[0]));
+  while (local_size[1] > 1 && used_local_memory + sizeof(kde_float_t) * (
+      local_size[0] * d + local_size[1] * 2 * d +
+      local_size[0] * local_size[1]) > ctxt->local_mem_size) {
+    local_size[1]--;
+  }
+  size_t global_size[2];
+  global_size[0] = local_size[0] *
+      ((estimator->rows_in_sample + local_size[0] - 1) / local_size[0]);
+  global_size[1] = local_size[1] *
+      ((nr_of_queries + local_size[1] - 1) / local_size[1]);
+  unsigned int partials_per_query = global_size[0] / local_size[0];
+  // Grow the buffers for the query bounds and the (partial) results.
+  if (nr_of_queries > workspace->batch_query_capacity) {
+    workspace->batch_query_capacity = Max(
+        nr_of_queries, 2 * workspace->batch_query_capacity);
+    resizeWorkspaceBuffer(
+        &(workspace->batch_range_buffer), CL_MEM_READ_ONLY,
+        sizeof(kde_float_t) * 2 * d * workspace->batch_query_capacity);
+    resizeWorkspaceBuffer(
+        &(workspace->batch_result_buffer), CL_MEM_READ_WRITE,
+        sizeof(kde_float_t) * workspace->batch_query_capacity);
+  }
+  size_t nr_of_partials = (size_t)partials_per_query * nr_of_queries;
+  if (nr_of_partials > workspace->batch_partial_capacity) {
+    workspace->batch_partial_capacity = Max(
+        nr_of_partials, 2 * workspace->batch_partial_capacity);
+    resizeWorkspaceBuffer(
+        &(workspace->batch_partial_buffer), CL_MEM_READ_WRITE,
+        sizeof(kde_float_t) * workspace->batch_partial_capacity);
+  }
+  cl_mem range_buffer = workspace->batch_range_buffer;
+  cl_mem partial_buffer = workspace->batch_partial_buffer;
+  cl_mem result_buffer = workspace->batch_result_buffer;
+  // Transfer the query bounds to the device.
+  cl_event wait_events[2];
+  unsigned int nr_of_wait_events = 1;
+  TIME_TRANSFER(err = clEnqueueWriteBuffer(
+      ctxt->queue, range_buffer, CL_TRUE,
+      0, sizeof(kde_float_t) * 2 * d * nr_of_queries, queries,
+      0, NULL, &(wait_events[0])));
+  estimator->stats->estimation_transfer_to_device++;
+  Assert(err == CL_SUCCESS);
+  if (estimator->bandwidth_optimization->optimization_event) {
+    wait_events[nr_of_wait_events++] =
+        estimator->bandwidth_optimization->optimization_event;
+    estimator->bandwidth_optimization->optimization_event = NULL;
+  }
+  // Compute the partial sums for all queries.
+  err |= clSetKernelArg(
+      kde_kernel, 0, sizeof(cl_mem), &(estimator->sample_buffer));
+  err |= clSetKernelArg(
+      kde_kernel, 1, sizeof(unsigned int), &(estimator->rows_in_sample));
+  err |= clSetKernelArg(kde_kernel, 2, sizeof(cl_mem), &range_buffer);
+  err |= clSetKernelArg(kde_kernel, 3, sizeof(unsigned int), &nr_of_queries);
+  err |= clSetKernelArg(
+      kde_kernel, 4, sizeof(cl_mem), &(estimator->bandwidth_buffer));
+  err |= clSetKernelArg(
+      kde_kernel, 5, sizeof(cl_mem), &(estimator->mean_buffer));
+  err |= clSetKernelArg(
+      kde_kernel, 6, sizeof(cl_mem), &(estimator->sdev_buffer));
+  err |= clSetKernelArg(
+      kde_kernel, 7, sizeof(kde_float_t) * local_size[0] * d, NULL);
+  err |= clSetKernelArg(
+      kde_kernel, 8, sizeof(kde_float_t) * local_size[1] * 2 * d, NULL);
+  err |= clSetKernelArg(
+      kde_kernel, 9, sizeof(kde_float_t) * local_size[0] * local_size[1],
+      NULL);
+  err |= clSetKernelArg(kde_kernel, 10, sizeof(cl_mem), &partial_buffer);
+  err |= clSetKernelArg(
+      kde_kernel, 11, sizeof(cl_mem), &(estimator->weight_buffer));
+  Assert(err == CL_SUCCESS);
+  cl_event kde_event;
+  err = clEnqueueNDRangeKernel(
+      ctxt->queue, kde_kernel, 2, NULL, global_size, local_size,
+      nr_of_wait_events, wait_events, &kde_event);
+  Assert(err == CL_SUCCESS);
+  for (i = 0; i < nr_of_wait_events; ++i) {
+    err = clReleaseEvent(wait_events[i]);
+    Assert(err == CL_SUCCESS);
+  }
+  // Sum up the partial results of each query and normalize them.
+  kde_float_t normalization_factor;
+  if (global_kernel_type == EPANECHNIKOV) {
+    normalization_factor = pow(0.75, d);
+  } else {
+    normalization_factor = pow(0.5, d);
+  }
+  normalization_factor /= estimator->rows_in_sample;
+  err |= clSetKernelArg(sum_kernel, 0, sizeof(cl_mem), &partial_buffer);
+  err |= clSetKernelArg(
+      sum_kernel, 1, sizeof(unsigned int), &partials_per_query);
+  err |= clSetKernelArg(sum_kernel, 2, sizeof(cl_mem), &result_buffer);
+  err |= clSetKernelArg(
+      sum_kernel, 3, sizeof(kde_float_t), &normalization_factor);
+  Assert(err == CL_SUCCESS);
+  size_t sum_global_size = nr_of_queries;
+  cl_event sum_event;
+  err = clEnqueueNDRangeKernel(
+      ctxt->queue, sum_kernel, 1, NULL, &sum_global_size, NULL,
+      1, &kde_event, &sum_event);
+  Assert(err == CL_SUCCESS);
+  // Transfer the estimates back.
+  kde_float_t* device_results = palloc(sizeof(kde_float_t) * nr_of_queries);
+  err = clWaitForEvents(1, &sum_event);
+  Assert(err == CL_SUCCESS);
+  TIME_TRANSFER(err = clEnqueueReadBuffer(
+      ctxt->queue, result_buffer, CL_TRUE, 0,
+      sizeof(kde_float_t) * nr_of_queries, device_results,
+      0, NULL, NULL));
+  estimator->stats->estimation_transfer_to_host++;
+  Assert(err == CL_SUCCESS);
+  for (i = 0; i < nr_of_queries; ++i) results[i] = device_results[i];
+  // We are done, clean up.
+  pfree(device_results);
+  err |= clReleaseEvent(kde_event);
+  err |= clReleaseEvent(sum_event);
+  Assert(err == CL_SUCCESS);
+  RECORD_TIMER(KDE_PHASE_ESTIMATION);
+}
+
 /*
  *  Static helper function to release the resources held by a single estimator.
  *
@@ -559,24 +977,45 @@ static double rangeKDE(
  */
 static void ocl_freeEstimator(ocl_estimator_t* estimator, bool materialize) {
   if (estimator == NULL) return;
-  // Remove the estimator from the registry.
-  if (registry) {
-    registry->estimator_bitmap[estimator->table / 8] ^= (0x1 << (estimator->table % 8));
-  }
   // Write all changes to stable storage.
   if (materialize) ocl_updateEstimatorInCatalog(estimator);
   // Finally, release the remaining buffers.
   freeEstimator(estimator);
 }
 
+// Helper function to release all models in the model list of a table.
+static void ocl_freeModels(ocl_estimator_t* models) {
+  while (models) {
+    ocl_estimator_t* next = models->next;
+    ocl_freeEstimator(models, false);
+    models = next;
+  }
+}
+
+// Helper function to store the model list of a table in the registry.
+static void registerModels(Oid relation, ocl_estimator_t* models) {
+  directory_insert(registry->estimator_directory, &relation, models);
+  registry->estimator_bitmap[relation / 8] |= (0x1 << (relation % 8));
+}
+
 static void ocl_releaseRegistry() {
   if (!registry) return;
   unsigned int i;
-  // Update all registered estimators within the system catalogue.
+  // Write the changed estimators back to the system catalogue. Unchanged
+  // models are already up to date, and models that were superseded by a newer
+  // version from another backend are dropped, so we don't overwrite the newer
+  // model.
   for (i=0; i<registry->estimator_directory->entries; ++i) {
     ocl_estimator_t* estimator = (ocl_estimator_t*)directory_valueAt(
         registry->estimator_directory, i);
-    ocl_freeEstimator(estimator,true);
+    while (estimator) {
+      ocl_estimator_t* next = estimator->next;
+      bool materialize = estimator->dirty &&
+          estimator->model_version ==
+              ocl_getSharedModelVersion(estimator->table);
+      ocl_freeEstimator(estimator, materialize);
+      estimator = next;
+    }
   }
   // Now release the registry.
   directory_release(registry->estimator_directory, false);
@@ -584,10 +1023,31 @@ static void ocl_releaseRegistry() {
   registry = NULL;
 }
 
+// Helper function to count the models that changed since they were written.
+static unsigned int countDirtyModels() {
+  unsigned int i;
+  unsigned int dirty_models = 0;
+  for (i=0; i<registry->estimator_directory->entries; ++i) {
+    ocl_estimator_t* estimator = (ocl_estimator_t*)directory_valueAt(
+        registry->estimator_directory, i);
+    for (; estimator; estimator = estimator->next) {
+      if (estimator->dirty) dirty_models++;
+    }
+  }
+  return dirty_models;
+}
+
 static void
 ocl_cleanUpRegistry(int code, Datum arg) {
   if (!registry) return;
-  fprintf(stderr, "Cleaning up OpenCL and materializing KDE models.\n");
+  unsigned int dirty_models = countDirtyModels();
+  if (dirty_models == 0) {
+    // Nothing to write back, so we don't need a transaction.
+    ocl_releaseRegistry();
+    return;
+  }
+  fprintf(stderr, "Cleaning up OpenCL and materializing %i changed KDE "
+          "models.\n", dirty_models);
   // Open a new transaction to ensure that we can write back any changes.
   AbortOutOfAnyTransaction();
   StartTransactionCommand();
@@ -596,37 +1056,132 @@ ocl_cleanUpRegistry(int code, Datum arg) {
 }
 
 
+// Transaction callback that publishes all models written by this transaction.
+// Written models become clean on commit and their previous sample files are
+// removed. On abort, the new sample files are removed and we drop our local
+// copies of the written models, so they are reloaded from the catalog.
+static void
+ocl_publishPendingModels(XactEvent event, void* arg) {
+  unsigned int i;
+  if (nr_of_pending_publications == 0) return;
+  if (event == XACT_EVENT_PRE_COMMIT || event == XACT_EVENT_PRE_PREPARE) return;
+  for (i=0; i<nr_of_pending_publications; ++i) {
+    ocl_pending_publication_t* publication = &(pending_publications[i]);
+    uint64 version = 0;
+    if (event == XACT_EVENT_COMMIT) {
+      version = ocl_publishSharedModelVersion(publication->table);
+      // Backends that have mapped the previous file keep their mapping.
+      if (publication->old_sample_file) {
+        unlink(publication->old_sample_file);
+      }
+    } else if (event == XACT_EVENT_ABORT) {
+      // A prepared transaction may still commit, so it keeps both files.
+      unlink(publication->new_sample_file);
+    }
+    free(publication->new_sample_file);
+    if (publication->old_sample_file) free(publication->old_sample_file);
+    if (registry == NULL) continue;
+    ocl_estimator_t* estimator = NULL;
+    if (registry->estimator_bitmap[publication->table / 8] &
+        (0x1 << (publication->table % 8))) {
+      estimator = DIRECTORY_FETCH(
+          registry->estimator_directory, &(publication->table),
+          ocl_estimator_t);
+    }
+    if (event != XACT_EVENT_COMMIT) {
+      // Our copies contain the rolled back changes.
+      if (estimator == NULL) continue;
+      directory_remove(
+          registry->estimator_directory, &(publication->table), false);
+      registry->estimator_bitmap[publication->table / 8] &=
+          ~(0x1 << (publication->table % 8));
+      ocl_freeModels(estimator);
+      continue;
+    }
+    for (; estimator; estimator = estimator->next) {
+      // Our own copy is the published model, so tag it with the new version.
+      estimator->model_version = version;
+      if (estimator->write_pending) estimator->dirty = false;
+      estimator->write_pending = false;
+    }
+  }
+  free(pending_publications);
+  pending_publications = NULL;
+  nr_of_pending_publications = 0;
+}
+
 // Helper function to initialize the registry.
 static void ocl_initializeRegistry() {
+  static bool callbacks_registered = false;
   if (registry) return; // Don't reinitialize.
   if (IsBootstrapProcessingMode()) return; // Don't initialize during bootstrap.
   if (ocl_getContext() == NULL) return; // Don't run without OpenCl.
 
-  // Allocate a new descriptor.
+  // Allocate a new descriptor. Models are loaded lazily on first access.
   registry = calloc(1, sizeof(ocl_estimator_registry_t));
   registry->estimator_bitmap = calloc(1, 4 * 1024 * 1024); // Enough for ~32M tables.
   registry->estimator_directory = directory_init(sizeof(Oid), 20);
 
-  // Now open the KDE estimator table, read in all stored estimators and
-  // register their descriptors.
-  Relation kdeRel = heap_open(KdeModelRelationID, RowExclusiveLock);
-  HeapScanDesc scan = heap_beginscan(kdeRel, SnapshotNow, 0, NULL);
-  HeapTuple tuple;
-  while ((tuple = heap_getnext(scan, ForwardScanDirection)) != NULL) {
-    ocl_estimator_t* estimator = ocl_buildEstimatorFromCatalogEntry(
-        kdeRel, tuple);
-    if (estimator == NULL) continue;
-    // Register the estimator.
-    directory_insert(
-        registry->estimator_directory, &(estimator->table), estimator);
-    registry->estimator_bitmap[estimator->table / 8] |=
-        (0x1 << estimator->table % 8);
+  // If we are the first backend after a server start, announce all models
+  // from the catalog in the shared registry. We only need the table ids here.
+  if (!ocl_isSharedRegistryLoaded()) {
+    unsigned int nr_of_tables = 0;
+    unsigned int max_tables = 32;
+    Oid* tables = palloc(sizeof(Oid) * max_tables);
+    Relation kdeRel = heap_open(KdeModelRelationID, AccessShareLock);
+    HeapScanDesc scan = heap_beginscan(kdeRel, SnapshotNow, 0, NULL);
+    HeapTuple tuple;
+    while ((tuple = heap_getnext(scan, ForwardScanDirection)) != NULL) {
+      if (nr_of_tables == max_tables) {
+        max_tables *= 2;
+        tables = repalloc(tables, sizeof(Oid) * max_tables);
+      }
+      tables[nr_of_tables++] = ((Form_pg_kdemodels) GETSTRUCT(tuple))->table;
+    }
+    heap_endscan(scan);
+    heap_close(kdeRel, AccessShareLock);
+    ocl_populateSharedRegistry(tables, nr_of_tables);
+    pfree(tables);
   }
-  heap_endscan(scan);
-  heap_close(kdeRel, RowExclusiveLock);
+
+  if (callbacks_registered) return;
+  // Register a callback that publishes new model versions on commit.
+  RegisterXactCallback(ocl_publishPendingModels, NULL);
   // Finally, register a cleanup function to ensure we write any estimator
   // changes back to the catalogue.
   on_shmem_exit(ocl_cleanUpRegistry, 0);
+  callbacks_registered = true;
+}
+
+/*
+ * Helper function to fetch the current models for the given table.
+ *
+ * If another backend has published a newer version of the models than the
+ * ones we hold locally, the local copies are replaced by the published ones.
+ */
+static ocl_estimator_t* ocl_attachEstimator(Oid relation) {
+  ocl_estimator_t* estimator = NULL;
+  if (registry->estimator_bitmap[relation / 8] & (0x1 << (relation % 8))) {
+    estimator = DIRECTORY_FETCH(
+        registry->estimator_directory, &relation, ocl_estimator_t);
+  }
+  uint64 version = ocl_getSharedModelVersion(relation);
+  if (version == 0) return estimator; // No published model for this table.
+  if (estimator && estimator->model_version == version) return estimator;
+  // Our copy is missing or outdated, load the published version.
+  ocl_estimator_t* new_estimator = ocl_loadEstimatorFromCatalog(relation);
+  if (new_estimator == NULL) return estimator;
+  ocl_estimator_t* model;
+  for (model = new_estimator; model; model = model->next) {
+    model->model_version = version;
+  }
+  ocl_freeModels(estimator);
+  registerModels(relation, new_estimator);
+  if (ocl_isDebug()) {
+    fprintf(stderr, "Attached KDE model version %lu for table %i.\n",
+            (unsigned long)version, relation);
+  }
+  return new_estimator;
 }
 
 // Helper function to fetch (and initialize if it does not exist) the registry
@@ -715,35 +1270,24 @@ int ocl_updateRequest(
   return 1;
 }
 
-int ocl_estimateSelectivity(const ocl_estimator_request_t* request,
-    Selectivity* selectivity) {
-  struct timeval start;
-  gettimeofday(&start, NULL);
+/*
+ * Helper function to extract the query bounds (2*d values) of a request.
+ * Returns false if the request cannot be answered by the estimator.
+ */
+static bool ocl_extractQueryBounds(
+    const ocl_estimator_t* estimator, const ocl_estimator_request_t* request,
+    kde_float_t* row_ranges) {
   unsigned int i;
-  // Fetch the OpenCL context, initializing it if requested.
-  ocl_context_t* ctxt = ocl_getContext();
-  if (ctxt == NULL) return 0;
-  // Make sure that the registry is initialized
-  if (registry == NULL) ocl_initializeRegistry();
-  // Check the registry, whether we have an estimator for the requested table.
-  if (!(registry->estimator_bitmap[request->table_identifier / 8]
-      & (0x1 << request->table_identifier % 8)))
-    return 0;
-  ocl_estimator_t* estimator = DIRECTORY_FETCH(registry->estimator_directory,
-      &(request->table_identifier), ocl_estimator_t);
-  if (estimator == NULL) return 0;
   // Check if the request can potentially be answered by the estimator:
-  if (request->range_count > estimator->nr_of_dimensions) return 0;
+  if (request->range_count > estimator->nr_of_dimensions) return false;
   // Now check if all columns in the request are covered by the estimator:
   int request_columns = 0;
   for (i = 0; i < request->range_count; ++i) {
     request_columns |= 0x1 << request->ranges[i].colno;
   }
-  if ((estimator->columns | request_columns) != estimator->columns) return 0;
-  // Extract the query bounds to prepare an estimation request.
-  kde_float_t* row_ranges; 
-  posix_memalign((void**)&row_ranges, 128,
-      2 * sizeof(kde_float_t) * estimator->nr_of_dimensions);
+  if ((estimator->columns | request_columns) != estimator->columns) {
+    return false;
+  }
   for (i = 0; i < estimator->nr_of_dimensions; ++i) {
     row_ranges[2 * i] = -1.0 * INFINITY;
     row_ranges[2 * i + 1] = INFINITY;
@@ -759,11 +1303,80 @@ int ocl_estimateSelectivity(const ocl_estimator_request_t* request,
       row_ranges[2 * range_pos + 1] += 0.001;
     }
   }
-  // Compute the selectivity.
-  *selectivity = rangeKDE(ctxt, estimator, row_ranges);
-  free(row_ranges);
+  return true;
+}
+
+/*
+ * Helper function to select the model that answers a request. We pick the
+ * model with the fewest dimensions that covers all requested columns, since
+ * the estimation cost grows with the dimensionality of the model.
+ */
+static ocl_estimator_t* ocl_selectEstimator(
+    ocl_estimator_t* models, const ocl_estimator_request_t* request) {
+  unsigned int i;
+  int32 request_columns = 0;
+  for (i = 0; i < request->range_count; ++i) {
+    request_columns |= 0x1 << request->ranges[i].colno;
+  }
+  // The models are ordered by decreasing dimensionality, so the last covering
+  // model is the smallest one.
+  ocl_estimator_t* selected = NULL;
+  for (; models; models = models->next) {
+    if ((models->columns | request_columns) == models->columns) {
+      selected = models;
+    }
+  }
+  return selected;
+}
+
+int ocl_estimateSelectivity(const ocl_estimator_request_t* request,
+    Selectivity* selectivity) {
+  struct timeval start;
+  gettimeofday(&start, NULL);
+  // Fetch the OpenCL context, initializing it if requested.
+  ocl_context_t* ctxt = ocl_getContext();
+  if (ctxt == NULL) return 0;
+  // Make sure that the registry is initialized
+  if (registry == NULL) ocl_initializeRegistry();
+  if (registry == NULL) return 0;
+  // Check the registry, whether we have an estimator for the requested table.
+  ocl_estimator_t* models = ocl_attachEstimator(request->table_identifier);
+  ocl_estimator_t* estimator = ocl_selectEstimator(models, request);
+  if (estimator == NULL) return 0;
+  // Extract the query bounds to prepare an estimation request.
+  kde_float_t* row_ranges; 
+  posix_memalign((void**)&row_ranges, 128,
+      2 * sizeof(kde_float_t) * estimator->nr_of_dimensions);
+  if (!ocl_extractQueryBounds(estimator, request, row_ranges)) {
+    free(row_ranges);
+    return 0;
+  }
+  // The planner asks for the same ranges repeatedly, so check whether we have
+  // already computed this estimate. Karma based sample maintenance works on
+  // the per-point results of the last device estimate, so in that case we can
+  // only re-use the most recent estimate.
+  bool device_state_needed = kde_sample_maintenance_option == TKR ||
+      kde_sample_maintenance_option == PKR;
+  bool cached = ocl_lookupSelectivityCache(
+      estimator, row_ranges, device_state_needed, selectivity);
+  if (!cached) {
+    // Compute the selectivity.
+    *selectivity = rangeKDE(ctxt, estimator, row_ranges);
+    ocl_insertSelectivityCache(estimator, row_ranges, *selectivity, true);
+  }
+  // Only the model that produced the estimate receives the feedback.
+  for (; models; models = models->next) models->open_estimation = false;
   estimator->last_selectivity = *selectivity;
   estimator->open_estimation = true;
+  // Remember the query bounds, online learning computes the gradient for them
+  // once (and if) the feedback arrives.
+  if (estimator->last_query == NULL) {
+    estimator->last_query = malloc(
+        2 * sizeof(kde_float_t) * estimator->nr_of_dimensions);
+  }
+  memcpy(estimator->last_query, row_ranges,
+         2 * sizeof(kde_float_t) * estimator->nr_of_dimensions);
+  free(row_ranges);
   // Print timing:
   if (ocl_isDebug()) {
     struct timeval now;
@@ -772,14 +1385,80 @@ int ocl_estimateSelectivity(const ocl_estimator_request_t* request,
     long useconds = now.tv_usec - start.tv_usec;
     long mtime = ((seconds) * 1000 + useconds / 1000.0) + 0.5;
     ocl_dumpRequest(request);
-    fprintf(stderr, "Estimated selectivity: %f, took: %ld ms.\n", *selectivity,
-        mtime);
+    fprintf(stderr, "Estimated selectivity: %f%s, took: %ld ms.\n",
+        *selectivity, cached ? " (cached)" : "", mtime);
   }
-  // Schedule all steps for the online bandwidth updates.
-  ocl_prepareOnlineLearningStep(estimator);
   return 1;
 }
 
+int ocl_estimateSelectivityBatch(
+    const ocl_estimator_request_t* requests, unsigned int nr_of_requests,
+    Selectivity* selectivities, bool* estimated) {
+  unsigned int i, j;
+  int answered = 0;
+  for (i = 0; i < nr_of_requests; ++i) estimated[i] = false;
+  // Fetch the OpenCL context, initializing it if requested.
+  ocl_context_t* ctxt = ocl_getContext();
+  if (ctxt == NULL) return 0;
+  // Make sure that the registry is initialized
+  if (registry == NULL) ocl_initializeRegistry();
+  if (registry == NULL) return 0;
+  bool* handled = palloc0(sizeof(bool) * nr_of_requests);
+  for (i = 0; i < nr_of_requests; ++i) {
+    if (handled[i]) continue;
+    // Collect all requests that are answered by the same model and that are
+    // not cached yet.
+    Oid table = requests[i].table_identifier;
+    ocl_estimator_t* models = ocl_attachEstimator(table);
+    ocl_estimator_t* estimator = ocl_selectEstimator(models, &(requests[i]));
+    unsigned int range_size = estimator ?
+        2 * estimator->nr_of_dimensions : 0;
+    kde_float_t* queries = palloc(
+        sizeof(kde_float_t) * Max(1, range_size * nr_of_requests));
+    unsigned int* positions = palloc(sizeof(unsigned int) * nr_of_requests);
+    unsigned int nr_of_queries = 0;
+    for (j = i; j < nr_of_requests; ++j) {
+      if (handled[j] || requests[j].table_identifier != table) continue;
+      if (ocl_selectEstimator(models, &(requests[j])) != estimator) continue;
+      handled[j] = true;
+      if (estimator == NULL) continue;
+      kde_float_t* query = &(queries[range_size * nr_of_queries]);
+      if (!ocl_extractQueryBounds(estimator, &(requests[j]), query)) continue;
+      estimated[j] = true;
+      answered++;
+      if (ocl_lookupSelectivityCache(
+          estimator, query, false, &(selectivities[j]))) continue;
+      positions[nr_of_queries++] = j;
+    }
+    // Now evaluate the remaining requests in a single pass.
+    if (nr_of_queries > 0) {
+      double* results = palloc(sizeof(double) * nr_of_queries);
+      if (batchMatchesRangeKDE(estimator)) {
+        rangeKDEBatch(ctxt, estimator, queries, nr_of_queries, results);
+      } else {
+        for (j = 0; j < nr_of_queries; ++j) {
+          results[j] = rangeKDE(
+              ctxt, estimator, &(queries[range_size * j]));
+        }
+      }
+      for (j = 0; j < nr_of_queries; ++j) {
+        selectivities[positions[j]] = results[j];
+        ocl_insertSelectivityCache(
+            estimator, &(queries[range_size * j]), results[j], false);
+      }
+      pfree(results);
+    }
+    if (ocl_isDebug() && estimator) {
+      fprintf(stderr, "Evaluated %i batched requests for table %i.\n",
+              nr_of_queries, table);
+    }
+    pfree(queries);
+    pfree(positions);
+  }
+  pfree(handled);
+  return answered;
+}
+
 unsigned int ocl_maxSampleSize(unsigned int dimensionality) {
   return kde_samplesize;
 }
@@ -827,12 +1506,37 @@ void invnormalize(kde_float_t* sample, unsigned int sample_size, unsigned int di
   }
 }
 
+/*
+ * Shuffles the sample items (Fisher-Yates). ANALYZE returns the sample in
+ * physical order, but progressive estimates rely on every prefix of the
+ * sample being a random subsample. If tids is given, the source rows of the
+ * items are shuffled along.
+ */
+static void shuffleSample(
+    kde_float_t* sample, ItemPointerData* tids, unsigned int sample_size,
+    unsigned int dimensionality) {
+  unsigned int i, d;
+  for (i = sample_size; i > 1; --i) {
+    unsigned int j = random() % i;
+    for (d = 0; d < dimensionality; ++d) {
+      kde_float_t tmp = sample[(i - 1) * dimensionality + d];
+      sample[(i - 1) * dimensionality + d] = sample[j * dimensionality + d];
+      sample[j * dimensionality + d] = tmp;
+    }
+    if (tids) {
+      ItemPointerData tmp_tid = tids[i - 1];
+      tids[i - 1] = tids[j];
+      tids[j] = tmp_tid;
+    }
+  }
+}
+
 void ocl_constructEstimator(
     Relation rel, unsigned int rows_in_table, unsigned int dimensionality,
     AttrNumber* attributes, unsigned int sample_size, HeapTuple* sample) {
   unsigned int i;
   cl_int err = CL_SUCCESS;
-  CREATE_TIMER(); 
+  CREATE_TIMER();
 
   if (dimensionality > 15) {
       fprintf(stderr, "We only support models for up to 15 dimensions!\n");
@@ -862,18 +1566,21 @@ void ocl_constructEstimator(
   for (i = 0; i < dimensionality; ++i) {
     column_map |= 0x1 << attributes[i];
   }
-  // And allocate the new estimator.
+  // The model stores fewer points than the sample if it is compacted.
+  unsigned int model_size = ocl_coresetSize(sample_size);
+  // And allocate the new estimator. It replaces an existing model for the
+  // same columns, models on other column sets of this table are kept.
   ocl_estimator_t* estimator = allocateEstimator(
-      rel->rd_node.relNode, column_map, sample_size);
-  ocl_estimator_t* old_estimator = directory_insert(
-      registry->estimator_directory, &(rel->rd_node.relNode), estimator);
-  // If there was an existing estimator, release it.
-  if (old_estimator) {
-    ocl_freeEstimator(old_estimator, false);
-  }
+      rel->rd_node.relNode, column_map, model_size, NULL,
+      model_size < sample_size, NULL);
+  ocl_estimator_t* models = ocl_attachEstimator(rel->rd_node.relNode);
+  ocl_estimator_t* old_estimator;
+  models = insertModel(models, estimator, &old_estimator);
+  ocl_freeEstimator(old_estimator, false);
   // Register the estimator.
-  registry->estimator_bitmap[rel->rd_node.relNode / 8] |= (0x1
-      << rel->rd_node.relNode % 8);
+  registerModels(rel->rd_node.relNode, models);
+  // Until the new model is published, treat it as the current version.
+  estimator->model_version = ocl_getSharedModelVersion(rel->rd_node.relNode);
   estimator->rows_in_table = rows_in_table;
   /*
    * OK, we set up the estimator. Prepare the sample for shipping it to the
@@ -883,13 +1590,35 @@ void ocl_constructEstimator(
       ocl_sizeOfSampleItem(estimator) * sample_size);
 
 
+  ItemPointerData* tids = malloc(sizeof(ItemPointerData) * sample_size);
   for (i = 0; i < sample_size; ++i) {
     // Extract the item.
     ocl_extractSampleTuple(estimator, rel, sample[i],
         &(host_buffer[i * estimator->nr_of_dimensions]));
+    tids[i] = sample[i]->t_self;
   }
+  shuffleSample(host_buffer, tids, sample_size, estimator->nr_of_dimensions);
 
   normalize(host_buffer,sample_size,estimator->nr_of_dimensions,estimator->mean_host_buffer,estimator->sdev_host_buffer);
+  if (estimator->weight_buffer) {
+    // Summarize the sample by a smaller set of weighted points.
+    kde_float_t* weights = malloc(sizeof(kde_float_t) * model_size);
+    ocl_compactSample(
+        host_buffer, sample_size, estimator->nr_of_dimensions, model_size,
+        weights);
+    err |= clEnqueueWriteBuffer(
+        ctxt->queue, estimator->weight_buffer, CL_TRUE, 0,
+        model_size * sizeof(kde_float_t), weights, 0, NULL, NULL);
+    Assert(err == CL_SUCCESS);
+    free(weights);
+    estimator->represented_rows = sample_size;
+    sample_size = model_size;
+    // The weighted points are not drawn from a single row.
+    ocl_resetSampleTids(estimator, NULL);
+  } else {
+    ocl_resetSampleTids(estimator, tids);
+  }
+  free(tids);
   // Allocate a buffer of ones to initialize karma and contribution.
   kde_float_t* zero_buffer = (kde_float_t*) calloc(
       sizeof(kde_float_t),sample_size);
@@ -918,9 +1647,18 @@ void ocl_constructEstimator(
   // Wait for the initialization to finish.
   err = clFinish(ocl_getContext()->queue);
   Assert(err == CL_SUCCESS);
-  // And hand the optimization over to the model optimization.
-  ocl_runModelOptimization(estimator);
-  LOG_TIMER("Model Construction");
+  // And hand the optimization over to the model optimization. If the
+  // optimization worker is running, we only set the rule-of-thumb bandwidth
+  // here and let the worker optimize the model after we have committed.
+  if (kde_enable_bandwidth_optimization &&
+      ocl_scheduleModelOptimization(estimator->table, estimator->columns)) {
+    ocl_setRuleOfThumbBandwidth(estimator);
+  } else {
+    ocl_runModelOptimization(estimator);
+  }
+  // Write the new model to the catalog, so it is published to all backends.
+  ocl_updateEstimatorInCatalog(estimator);
+  RECORD_TIMER(KDE_PHASE_CONSTRUCTION);
 }
 
 
@@ -939,6 +1677,14 @@ void assign_kde_samplesize(int newval, void *extra) {
   }
 }
 
+void assign_kde_kernel(int newval, void *extra) {
+  if (newval != global_kernel_type) {
+    ocl_releaseRegistry();
+    ocl_releaseContext();
+    global_kernel_type = newval;
+  }
+}
+
 void assign_kde_enable(bool newval, void *extra) {
   if (newval != kde_enable) {
     ocl_releaseRegistry();
@@ -950,20 +1696,46 @@ bool ocl_useKDE(void) {
   return kde_enable;
 }
 
+bool ocl_useBatchedEstimation(void) {
+  // Batched estimates only pay off through the selectivity cache, and model
+  // maintenance needs the per-point results of the estimate it refines.
+  return ocl_useKDE() && kde_selectivity_cache_size > 0 &&
+      !kde_enable_adaptive_bandwidth &&
+      kde_sample_maintenance_option != TKR &&
+      kde_sample_maintenance_option != PKR;
+}
+
 ocl_estimator_t* ocl_getEstimator(Oid relation) {
   if (!ocl_useKDE()){
     return NULL;
   }
-  ocl_estimator_registry_t* registry = ocl_getRegistry();
-  if (registry == NULL){
+  if (ocl_getRegistry() == NULL){
     return NULL;
   }
-  // Check the bitmap whether we have an estimator for this relation.
-  if (!(registry->estimator_bitmap[relation / 8] & (0x1 << (relation % 8)))){
-    return NULL;
+  return ocl_attachEstimator(relation);
+}
+
+ocl_estimator_t* ocl_getEstimatorForColumns(Oid relation, int32 columns) {
+  ocl_estimator_t* estimator = ocl_getEstimator(relation);
+  for (; estimator; estimator = estimator->next) {
+    if (estimator->columns == columns) return estimator;
   }
-  return DIRECTORY_FETCH(
-      registry->estimator_directory, &relation, ocl_estimator_t);
+  return NULL;
+}
+
+void ocl_runScheduledModelOptimization(
+    Oid relation, int32 columns, int feedback_window) {
+  if (ocl_getRegistry() == NULL) return;
+  ocl_estimator_t* estimator = ocl_attachEstimator(relation);
+  while (estimator && estimator->columns != columns) {
+    estimator = estimator->next;
+  }
+  if (estimator == NULL) return;
+  if (!ocl_optimizeBandwidth(estimator, feedback_window)) return;
+  // Don't overwrite a model that was rebuilt while we were optimizing, the
+  // rebuild has scheduled its own optimization.
+  if (ocl_getSharedModelVersion(relation) != estimator->model_version) return;
+  ocl_updateEstimatorInCatalog(estimator);
 }
 
 size_t ocl_sizeOfSampleItem(ocl_estimator_t* estimator) {
@@ -974,7 +1746,7 @@ unsigned int ocl_maxRowsInSample(ocl_estimator_t* estimator) {
   return estimator->sample_buffer_size / ocl_sizeOfSampleItem(estimator);
 }
 
-static void scaleSampleEntry(ocl_estimator_t* estimator,kde_float_t* data_item){
+void ocl_scaleSampleEntry(ocl_estimator_t* estimator,kde_float_t* data_item){
   int i = 0;
   for(i = 0; i < estimator->nr_of_dimensions; i++){
     data_item[i] = (data_item[i]-estimator->mean_host_buffer[i])/estimator->sdev_host_buffer[i];
@@ -988,12 +1760,23 @@ void ocl_pushEntryToSampleBufer(
   kde_float_t zero = 0.0;
   size_t transfer_size = ocl_sizeOfSampleItem(estimator);
   size_t offset = position * transfer_size;
-  scaleSampleEntry(estimator,data_item);
+  ocl_scaleSampleEntry(estimator,data_item);
 
-  err |= clEnqueueWriteBuffer(
-      context->queue, estimator->sample_buffer, CL_FALSE,
-      offset, transfer_size, data_item, 0, NULL, NULL);
+  TIME_TRANSFER(err |= clEnqueueWriteBuffer(
+      context->queue, estimator->sample_buffer, CL_TRUE,
+      offset, transfer_size, data_item, 0, NULL, NULL));
   Assert(err == CL_SUCCESS);
+  if (estimator->weight_buffer) {
+    unsigned int replaced_position = position;
+    ocl_resetReplacedCoresetWeights(estimator, 1, &replaced_position);
+  }
+  ocl_nativeUpdateSampleItem(estimator, position, data_item);
+  ocl_spatialIndexUpdateSampleItem(estimator, position, data_item);
+  ocl_invalidateSinglePrecisionSample(estimator);
+  ocl_countGridChanges(estimator, 1);
+  ocl_invalidateFactorCache(estimator);
+  ocl_clearSelectivityCache(estimator);
+  ocl_markEstimatorDirty(estimator);
   // Initialize the metrics (both to one, so newly sampled items are not immediately replaced)
   if(kde_sample_maintenance_option == TKR || kde_sample_maintenance_option == PKR){
     err |= clEnqueueWriteBuffer(
@@ -1007,6 +1790,82 @@ void ocl_pushEntryToSampleBufer(
   Assert(err == CL_SUCCESS);
 }
 
+void ocl_scatterEntriesToSampleBuffer(
+    ocl_estimator_t* estimator, unsigned int nr_of_entries,
+    unsigned int* positions, kde_float_t* data_items) {
+  unsigned int i;
+  if (nr_of_entries == 0) return;
+  ocl_context_t* context = ocl_getContext();
+  cl_int err = CL_SUCCESS;
+  kde_float_t zero = 0.0;
+  unsigned int d = estimator->nr_of_dimensions;
+  for (i = 0; i < nr_of_entries; ++i) {
+    ocl_scaleSampleEntry(estimator, &(data_items[i * d]));
+    ocl_nativeUpdateSampleItem(estimator, positions[i], &(data_items[i * d]));
+    ocl_spatialIndexUpdateSampleItem(
+        estimator, positions[i], &(data_items[i * d]));
+  }
+  ocl_invalidateSinglePrecisionSample(estimator);
+  ocl_countGridChanges(estimator, nr_of_entries);
+  ocl_invalidateFactorCache(estimator);
+  ocl_clearSelectivityCache(estimator);
+  ocl_markEstimatorDirty(estimator);
+  // Transfer positions and items in one go ...
+  ocl_workspace_t* workspace = getWorkspace(estimator);
+  if (nr_of_entries > workspace->scatter_capacity) {
+    workspace->scatter_capacity = Max(
+        nr_of_entries, 2 * workspace->scatter_capacity);
+    resizeWorkspaceBuffer(
+        &(workspace->scatter_position_buffer), CL_MEM_READ_ONLY,
+        sizeof(unsigned int) * workspace->scatter_capacity);
+    resizeWorkspaceBuffer(
+        &(workspace->scatter_item_buffer), CL_MEM_READ_ONLY,
+        ocl_sizeOfSampleItem(estimator) * workspace->scatter_capacity);
+  }
+  cl_mem position_buffer = workspace->scatter_position_buffer;
+  cl_mem item_buffer = workspace->scatter_item_buffer;
+  TIME_TRANSFER(err |= clEnqueueWriteBuffer(
+      context->queue, position_buffer, CL_TRUE, 0,
+      sizeof(unsigned int) * nr_of_entries, positions, 0, NULL, NULL));
+  TIME_TRANSFER(err |= clEnqueueWriteBuffer(
+      context->queue, item_buffer, CL_TRUE, 0,
+      ocl_sizeOfSampleItem(estimator) * nr_of_entries, data_items,
+      0, NULL, NULL));
+  Assert(err == CL_SUCCESS);
+  estimator->stats->maintenance_transfer_to_device += 2;
+  if (estimator->weight_buffer) {
+    ocl_resetReplacedCoresetWeights(estimator, nr_of_entries, positions);
+  }
+  // ... and let the device write them to their positions in the sample.
+  if (workspace->scatter_kernel == NULL) {
+    workspace->scatter_kernel = ocl_getKernel("scatter_sample_items", d);
+  }
+  cl_kernel scatter_kernel = workspace->scatter_kernel;
+  err |= clSetKernelArg(
+      scatter_kernel, 0, sizeof(cl_mem), &(estimator->sample_buffer));
+  err |= clSetKernelArg(scatter_kernel, 1, sizeof(cl_mem), &position_buffer);
+  err |= clSetKernelArg(scatter_kernel, 2, sizeof(cl_mem), &item_buffer);
+  Assert(err == CL_SUCCESS);
+  size_t global_size = nr_of_entries * d;
+  err = clEnqueueNDRangeKernel(
+      context->queue, scatter_kernel, 1, NULL, &global_size, NULL,
+      0, NULL, NULL);
+  Assert(err == CL_SUCCESS);
+  // Initialize the metrics of the new items.
+  if(kde_sample_maintenance_option == TKR || kde_sample_maintenance_option == PKR){
+    for (i = 0; i < nr_of_entries; ++i) {
+      err |= clEnqueueWriteBuffer(
+          context->queue, estimator->sample_optimization->sample_karma_buffer,
+          CL_FALSE, positions[i] * sizeof(kde_float_t), sizeof(kde_float_t),
+          &zero, 0, NULL, NULL);
+    }
+    Assert(err == CL_SUCCESS);
+  }
+  // The workspace buffers are reused by the next update.
+  err = clFinish(context->queue);
+  Assert(err == CL_SUCCESS);
+}
+
 void ocl_extractSampleTuple(
     ocl_estimator_t* estimator, Relation rel,
     HeapTuple tuple, kde_float_t* target) {
@@ -1031,6 +1890,7 @@ void ocl_extractSampleTuple(
 
 // Helper stored procedure to import a model sample from a given file.
 Datum ocl_importKDESample(PG_FUNCTION_ARGS) {
+  unsigned int i;
   Oid table_oid = PG_GETARG_OID(0);
   (void)table_oid;
   char *file_name = text_to_cstring(PG_GETARG_TEXT_PP(1));
@@ -1099,6 +1959,9 @@ Datum ocl_importKDESample(PG_FUNCTION_ARGS) {
     PG_RETURN_BOOL(false);
   }
 
+  shuffleSample(
+      sample_buffer, NULL, estimator->rows_in_sample,
+      estimator->nr_of_dimensions);
   normalize(sample_buffer,estimator->rows_in_sample,estimator->nr_of_dimensions,estimator->mean_host_buffer,estimator->sdev_host_buffer);
   // Push the new sample to the estimator.
   ocl_context_t* context = ocl_getContext();
@@ -1108,6 +1971,28 @@ Datum ocl_importKDESample(PG_FUNCTION_ARGS) {
       estimator->rows_in_sample * ocl_sizeOfSampleItem(estimator),
       sample_buffer, 0, NULL, NULL);
   Assert(err == CL_SUCCESS);
+  if (estimator->weight_buffer) {
+    // The imported points are unweighted.
+    kde_float_t* weights = malloc(
+        estimator->rows_in_sample * sizeof(kde_float_t));
+    for (i = 0; i < estimator->rows_in_sample; ++i) weights[i] = 1.0;
+    err = clEnqueueWriteBuffer(
+        context->queue, estimator->weight_buffer, CL_TRUE, 0,
+        estimator->rows_in_sample * sizeof(kde_float_t), weights,
+        0, NULL, NULL);
+    Assert(err == CL_SUCCESS);
+    free(weights);
+    estimator->represented_rows = estimator->rows_in_sample;
+  }
+  // The imported points have no source rows.
+  ocl_resetSampleTids(estimator, NULL);
+  ocl_nativeInvalidateSample(estimator);
+  ocl_invalidateSinglePrecisionSample(estimator);
+  ocl_invalidateSpatialIndex(estimator);
+  ocl_invalidateGridEstimator(estimator);
+  ocl_invalidateFactorCache(estimator);
+  ocl_clearSelectivityCache(estimator);
+  ocl_markEstimatorDirty(estimator);
   free(sample_buffer);
 
   PG_RETURN_BOOL(true);
@@ -1259,6 +2144,11 @@ Datum ocl_setKDEBandwidth(PG_FUNCTION_ARGS) {
       sizeof(kde_float_t) * estimator->nr_of_dimensions,
       new_bandwidth, 0, NULL, NULL);
   Assert(err == CL_SUCCESS);
+  estimator->host_bandwidth_valid = false;
+  ocl_invalidateGridEstimator(estimator);
+  ocl_invalidateFactorCache(estimator);
+  ocl_clearSelectivityCache(estimator);
+  ocl_markEstimatorDirty(estimator);
   // We are done, clean up.
   free(new_bandwidth);
   PG_RETURN_BOOL(true);
@@ -1347,7 +2237,7 @@ Datum ocl_getStats(PG_FUNCTION_ARGS){
             errmsg("no KDE estimator exists for table %i", table_oid)));
     PG_RETURN_BOOL(false);
   }
-  Datum* datum_array = palloc(sizeof(Datum) * 10);
+  Datum* datum_array = palloc(sizeof(Datum) * 13);
   datum_array[0] = Int64GetDatum(estimator->stats->nr_of_estimations);
   datum_array[1] = Int64GetDatum(estimator->stats->nr_of_insertions);
   datum_array[2] = Int64GetDatum(estimator->stats->nr_of_deletions);
@@ -1358,10 +2248,13 @@ Datum ocl_getStats(PG_FUNCTION_ARGS){
   datum_array[7] = Int64GetDatum(estimator->stats->maintenance_transfer_to_device);
   datum_array[8] = Int64GetDatum(estimator->stats->maintenance_transfer_to_host);
   datum_array[9] = Int64GetDatum(estimator->stats->maintenance_transfer_time);
+  datum_array[10] = Int64GetDatum(estimator->stats->selectivity_cache_hits);
+  datum_array[11] = Int64GetDatum(estimator->stats->selectivity_cache_misses);
+  datum_array[12] = Int64GetDatum(ocl_getAllocationCount());
   
   PG_RETURN_ARRAYTYPE_P(
       construct_array(
-          datum_array, 10,
+          datum_array, 13,
           INT8OID, sizeof(long), true, 'i'));
 }  
 
@@ -18,6 +18,11 @@
 // Forward declaration for sample and model maintenance data structures.
 struct ocl_sample_optimization;
 struct ocl_bandwidth_optimization;
+struct ocl_selectivity_cache;
+struct ocl_single_precision;
+struct ocl_spatial_index;
+struct ocl_sample_tids;
+struct ocl_replacement_pool;
 
 typedef struct ocl_stats{
   long estimation_transfer_to_device;
@@ -33,6 +38,9 @@ typedef struct ocl_stats{
   long nr_of_estimations;
   long nr_of_deletions;
   long nr_of_insertions;
+
+  long selectivity_cache_hits;
+  long selectivity_cache_misses;
 } ocl_stats_t; 
 
 /*
@@ -52,10 +60,14 @@ typedef struct ocl_estimator {
   unsigned int rows_in_sample;  // Current number of tuples in the sample.
   size_t sample_buffer_size;    // Size of the sample buffer in bytes.
   cl_mem sample_buffer;         // Buffer to store the data sample.
+  void* sample_file_mapping;    // Mapped sample file backing the sample buffer.
+  size_t sample_file_mapping_size;
   cl_mem mean_buffer;           // Buffer to store the sample mean (dev)
   cl_mem sdev_buffer;           // Buffer to store the sample standard deviation (dev)
   kde_float_t* mean_host_buffer;       // Buffer to store the sample mean (host)
   kde_float_t* sdev_host_buffer;       // Buffer to store the sample standard deviation (host)
+  cl_mem weight_buffer;         // Weights of a compacted sample (NULL if unweighted).
+  unsigned int represented_rows; // Number of rows the sample summarizes.
      
   /* Fields for the estimator. */
   cl_mem input_buffer;          // Buffer to store query bounds.
@@ -63,38 +75,87 @@ typedef struct ocl_estimator {
   cl_mem result_buffer;         // Buffer to store the final estimate.
   cl_kernel kde_kernel;         // Kernel to compute the estimate.
   ocl_aggregation_descriptor_t* sum_descriptor; // Descriptor for the final summation operation.
+  ocl_aggregation_descriptor_t** dimension_sum_descriptors; // Per-dimension sums of Scott's rule.
   /* Model optimization structures */
   struct ocl_bandwidth_optimization* bandwidth_optimization;
   struct ocl_sample_optimization* sample_optimization;
   struct ocl_stats* stats;
+  /* Host-side copies for the native estimation backend. */
+  double* host_sample;          // Dimension-major copy of the sample.
+  double* host_weights;         // Copy of the weights (NULL if unweighted).
+  double* host_bandwidth;       // Copy of the bandwidth.
+  bool host_bandwidth_valid;    // False if the device bandwidth has changed.
+  double* host_local_results;   // Per-point contributions of the last estimate.
+  /* Float copies for the single-precision estimation path. */
+  struct ocl_single_precision* single_precision;
+  /* Bucketed copy of the sample for spatial pruning. */
+  struct ocl_spatial_index* spatial_index;
+  /* Buffers for progressive estimates on a prefix of the sample. */
+  struct ocl_progressive_estimator* progressive;
+  /* Summed-area table for the grid estimation backend. */
+  struct ocl_grid_estimator* grid;
+  /* Cached per-dimension factors of the Gauss kernel. */
+  struct ocl_factor_cache* factor_cache;
+  /* Source rows of the sample points. */
+  struct ocl_sample_tids* sample_tids;
+  /* Pre-drawn rows for replacing sample points. */
+  struct ocl_replacement_pool* replacement_pool;
+  /* Memoized selectivity estimates. */
+  struct ocl_selectivity_cache* selectivity_cache;
+  /* Reusable buffers and kernels of batched estimates and sample updates. */
+  struct ocl_workspace* workspace;
+  /* Version of the model as published in the shared registry. */
+  uint64 model_version;
+  /* Set if the model has changed since it was written to the catalog. */
+  bool dirty;
+  /* Set if the model was written in the current transaction and has not
+   * changed since. The model only becomes clean once the write commits. */
+  bool write_pending;
   /* Runtime information */
   bool open_estimation;     // Set to true if this estimator has produced a valid estimation for which we are still awaiting feedback.
   double last_selectivity;  // Stores the last selectivity computed by this estimator.
+  kde_float_t* last_query;  // Query bounds (2*d values) of the last estimate.
+  /* Next model for the same table (ordered by decreasing dimensionality). */
+  struct ocl_estimator* next;
 } ocl_estimator_t;
 
-/*
- * SELECTOR FOR THE KERNEL TYPE.
- */
-typedef enum ocl_kernel_type {
-  GAUSS,
-  EPANECHNIKOV
-} ocl_kernel_type_t;
-
 /*
  * Registry of all known estimators.
  */
 typedef struct ocl_estimator_registry {
   // This encodes in a bitmap for which oids we have estimators.
   char* estimator_bitmap;
-  // This stores an OID->estimator mapping.
+  // This stores an OID->estimator mapping. Tables can have several models on
+  // different column sets, which are chained via ocl_estimator_t.next.
 	directory_t estimator_directory;
 } ocl_estimator_registry_t;
 
 /*
- * Fetch an estimator for a relation (We allow one estimator per relation).
+ * Fetch the estimators for a relation. A relation can have one estimator per
+ * column set (ANALYZE with a column list builds a model over the listed
+ * columns). The returned estimator has the most columns, all other models are
+ * reachable via ocl_estimator_t.next.
  */
 ocl_estimator_t* ocl_getEstimator(Oid relation);
 
+/*
+ * Fetch the estimator for exactly the given column set of a relation.
+ */
+ocl_estimator_t* ocl_getEstimatorForColumns(Oid relation, int32 columns);
+
+/*
+ * Entry function of the optimization worker: optimizes the bandwidth of the
+ * published model over the given columns and writes it back to the catalog.
+ * The new model is published once the current transaction commits.
+ */
+void ocl_runScheduledModelOptimization(
+    Oid relation, int32 columns, int feedback_window);
+
+/*
+ * Marks a model as changed since it was last written to the catalog.
+ */
+void ocl_markEstimatorDirty(ocl_estimator_t* estimator);
+
 // #########################################################################
 // ################## FUNCTIONS FOR SAMPLE MANAGEMENT ######################
 
@@ -131,6 +192,24 @@ void ocl_extractSampleTuple(ocl_estimator_t* estimator, Relation rel,
 void ocl_pushEntryToSampleBufer(ocl_estimator_t* estimator, int position,
                                 kde_float_t* data_item);
 
+/*
+ * scatterEntriesToSampleBuffer
+ *
+ * Batched variant of pushEntryToSampleBuffer: writes nr_of_entries items
+ * (d values each) to the given positions using a single transfer. Positions
+ * must be unique. The items are normalized in place.
+ */
+void ocl_scatterEntriesToSampleBuffer(
+    ocl_estimator_t* estimator, unsigned int nr_of_entries,
+    unsigned int* positions, kde_float_t* data_items);
+
+/*
+ * scaleSampleEntry
+ *
+ * Normalizes the given item with the sample mean and standard deviation.
+ */
+void ocl_scaleSampleEntry(ocl_estimator_t* estimator, kde_float_t* data_item);
+
 /*
  * Normalize data to zero mean / unit variance
  *
@@ -0,0 +1,181 @@
+/*
+ * ocl_factor_cache.c
+ */
+
+#include "ocl_factor_cache.h"
+
+#ifdef USE_OPENCL
+
+#include <stdlib.h>
+
+extern ocl_kernel_type_t global_kernel_type;
+
+// GUC configuration variable.
+bool kde_enable_factor_cache = false;
+
+bool ocl_useFactorCache(void) {
+  // Only the Gauss kernel is evaluated as a product of per-dimension factors.
+  return kde_enable_factor_cache && global_kernel_type == GAUSS;
+}
+
+// Helper function to allocate the buffers of the factor cache.
+static ocl_factor_cache_t* getCache(ocl_estimator_t* estimator) {
+  ocl_context_t* context;
+  cl_int err = CL_SUCCESS;
+  unsigned int d = estimator->nr_of_dimensions;
+  unsigned int nr_of_slots = d * OCL_FACTOR_CACHE_SLOTS_PER_DIMENSION;
+  ocl_factor_cache_t* cache;
+  if (estimator->factor_cache) return estimator->factor_cache;
+  context = ocl_getContext();
+  cache = calloc(1, sizeof(ocl_factor_cache_t));
+  cache->entries = calloc(nr_of_slots, sizeof(ocl_factor_cache_entry_t));
+  cache->slots = calloc(d, sizeof(unsigned int));
+  cache->factor_buffer = ocl_createBuffer(
+      context->context, CL_MEM_READ_WRITE,
+      sizeof(kde_float_t) * nr_of_slots * estimator->rows_in_sample,
+      NULL, &err);
+  Assert(err == CL_SUCCESS);
+  cache->slot_buffer = ocl_createBuffer(
+      context->context, CL_MEM_READ_ONLY, sizeof(unsigned int) * d,
+      NULL, &err);
+  Assert(err == CL_SUCCESS);
+  // The kernel arguments that depend on the query are set per invocation.
+  cache->factor_kernel = ocl_getKernel("gauss_kde_factor", d);
+  err |= clSetKernelArg(
+      cache->factor_kernel, 0, sizeof(cl_mem), &(estimator->sample_buffer));
+  err |= clSetKernelArg(
+      cache->factor_kernel, 1, sizeof(cl_mem), &(cache->factor_buffer));
+  err |= clSetKernelArg(
+      cache->factor_kernel, 2, sizeof(cl_mem), &(estimator->input_buffer));
+  err |= clSetKernelArg(
+      cache->factor_kernel, 3, sizeof(cl_mem), &(estimator->bandwidth_buffer));
+  err |= clSetKernelArg(
+      cache->factor_kernel, 4, sizeof(cl_mem), &(estimator->mean_buffer));
+  err |= clSetKernelArg(
+      cache->factor_kernel, 5, sizeof(cl_mem), &(estimator->sdev_buffer));
+  cache->multiply_kernel = ocl_getKernel("multiply_kde_factors", d);
+  err |= clSetKernelArg(
+      cache->multiply_kernel, 0, sizeof(cl_mem), &(cache->factor_buffer));
+  err |= clSetKernelArg(
+      cache->multiply_kernel, 1, sizeof(cl_mem), &(cache->slot_buffer));
+  err |= clSetKernelArg(
+      cache->multiply_kernel, 2, sizeof(cl_mem),
+      &(estimator->local_results_buffer));
+  err |= clSetKernelArg(
+      cache->multiply_kernel, 3, sizeof(unsigned int),
+      &(estimator->rows_in_sample));
+  Assert(err == CL_SUCCESS);
+  estimator->factor_cache = cache;
+  return cache;
+}
+
+/*
+ * Helper function to find the slot that caches the given bounds for a
+ * dimension. Returns false and the slot that should be overwritten if the
+ * bounds are not cached.
+ */
+static bool lookupSlot(
+    ocl_factor_cache_t* cache, unsigned int dimension,
+    kde_float_t lower_bound, kde_float_t upper_bound, unsigned int* slot) {
+  unsigned int i;
+  unsigned int first = dimension * OCL_FACTOR_CACHE_SLOTS_PER_DIMENSION;
+  unsigned int victim = first;
+  for (i = first; i < first + OCL_FACTOR_CACHE_SLOTS_PER_DIMENSION; ++i) {
+    ocl_factor_cache_entry_t* entry = &(cache->entries[i]);
+    if (entry->valid && entry->lower_bound == lower_bound &&
+        entry->upper_bound == upper_bound) {
+      entry->last_used = ++cache->clock;
+      *slot = i;
+      return true;
+    }
+    // Prefer empty slots, then the least recently used one.
+    if (!entry->valid) {
+      if (cache->entries[victim].valid) victim = i;
+    } else if (cache->entries[victim].valid &&
+               entry->last_used < cache->entries[victim].last_used) {
+      victim = i;
+    }
+  }
+  cache->entries[victim].lower_bound = lower_bound;
+  cache->entries[victim].upper_bound = upper_bound;
+  cache->entries[victim].last_used = ++cache->clock;
+  cache->entries[victim].valid = true;
+  *slot = victim;
+  return false;
+}
+
+cl_event ocl_factorCacheKDE(
+    ocl_estimator_t* estimator, const kde_float_t* query,
+    unsigned int nr_of_wait_events, cl_event* wait_events) {
+  unsigned int i;
+  ocl_context_t* context = ocl_getContext();
+  cl_int err = CL_SUCCESS;
+  unsigned int d = estimator->nr_of_dimensions;
+  ocl_factor_cache_t* cache = getCache(estimator);
+  size_t global_size = estimator->rows_in_sample;
+  // The multiplication waits for all recomputed factors and the slot map.
+  cl_event* events = palloc(sizeof(cl_event) * (d + 1));
+  unsigned int nr_of_events = 0;
+  cl_event multiply_event;
+  for (i = 0; i < d; ++i) {
+    unsigned int slot;
+    unsigned int factor_offset;
+    if (lookupSlot(cache, i, query[2 * i], query[2 * i + 1], &slot)) {
+      cache->slots[i] = slot;
+      continue;
+    }
+    cache->slots[i] = slot;
+    factor_offset = slot * estimator->rows_in_sample;
+    err |= clSetKernelArg(
+        cache->factor_kernel, 6, sizeof(unsigned int), &i);
+    err |= clSetKernelArg(
+        cache->factor_kernel, 7, sizeof(unsigned int), &factor_offset);
+    err |= clEnqueueNDRangeKernel(
+        context->queue, cache->factor_kernel, 1, NULL, &global_size, NULL,
+        nr_of_wait_events, wait_events, &(events[nr_of_events++]));
+    Assert(err == CL_SUCCESS);
+  }
+  err = clEnqueueWriteBuffer(
+      context->queue, cache->slot_buffer, CL_FALSE, 0,
+      sizeof(unsigned int) * d, cache->slots,
+      nr_of_wait_events, wait_events, &(events[nr_of_events++]));
+  estimator->stats->estimation_transfer_to_device++;
+  Assert(err == CL_SUCCESS);
+  err = clEnqueueNDRangeKernel(
+      context->queue, cache->multiply_kernel, 1, NULL, &global_size, NULL,
+      nr_of_events, events, &multiply_event);
+  Assert(err == CL_SUCCESS);
+  for (i = 0; i < nr_of_events; ++i) {
+    err = clReleaseEvent(events[i]);
+    Assert(err == CL_SUCCESS);
+  }
+  pfree(events);
+  return multiply_event;
+}
+
+void ocl_invalidateFactorCache(ocl_estimator_t* estimator) {
+  unsigned int i;
+  ocl_factor_cache_t* cache = estimator->factor_cache;
+  if (cache == NULL) return;
+  for (i = 0; i < estimator->nr_of_dimensions *
+       OCL_FACTOR_CACHE_SLOTS_PER_DIMENSION; ++i) {
+    cache->entries[i].valid = false;
+  }
+}
+
+void ocl_releaseFactorCache(ocl_estimator_t* estimator) {
+  ocl_factor_cache_t* cache = estimator->factor_cache;
+  cl_int err = CL_SUCCESS;
+  if (cache == NULL) return;
+  err |= clReleaseMemObject(cache->factor_buffer);
+  err |= clReleaseMemObject(cache->slot_buffer);
+  err |= clReleaseKernel(cache->factor_kernel);
+  err |= clReleaseKernel(cache->multiply_kernel);
+  Assert(err == CL_SUCCESS);
+  free(cache->entries);
+  free(cache->slots);
+  free(cache);
+  estimator->factor_cache = NULL;
+}
+
+#endif /* USE_OPENCL */
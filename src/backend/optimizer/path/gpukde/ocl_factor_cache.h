@@ -0,0 +1,72 @@
+/*
+ * ocl_factor_cache.h
+ *
+ *  Per-dimension factor cache for kde_enable_factor_cache. The Gauss kernel
+ *  computes the contribution of a sample point as the product of one factor
+ *  erf(up*bw) - erf(lo*bw) per dimension. Planner calls often only change
+ *  the bounds of a few dimensions, so the estimator keeps the factor vectors
+ *  (one factor per sample point) of recently used bounds on the device. A
+ *  query only recomputes the factors of dimensions whose bounds are not in
+ *  the cache, and multiplies the cached vectors for all others.
+ *
+ *  Cached factors depend on the sample and the bandwidth, so the cache is
+ *  flushed whenever either of them changes.
+ */
+
+#ifndef OCL_FACTOR_CACHE_H_
+#define OCL_FACTOR_CACHE_H_
+
+#include "ocl_estimator.h"
+
+#ifdef USE_OPENCL
+
+/*
+ * Number of cached factor vectors per dimension.
+ */
+#define OCL_FACTOR_CACHE_SLOTS_PER_DIMENSION 4
+
+typedef struct ocl_factor_cache_entry {
+  kde_float_t lower_bound;
+  kde_float_t upper_bound;
+  unsigned long last_used;      // Used to evict the least recently used slot.
+  bool valid;
+} ocl_factor_cache_entry_t;
+
+typedef struct ocl_factor_cache {
+  ocl_factor_cache_entry_t* entries; // One entry per slot, grouped by dimension.
+  unsigned int* slots;          // Slot used for each dimension by the query.
+  unsigned long clock;
+  cl_mem factor_buffer;         // Factor vectors of all slots.
+  cl_mem slot_buffer;           // Device copy of slots.
+  cl_kernel factor_kernel;
+  cl_kernel multiply_kernel;
+} ocl_factor_cache_t;
+
+/*
+ * Returns true if the factor cache can be used for the current kernel.
+ */
+bool ocl_useFactorCache(void);
+
+/*
+ * Computes the local contributions of all sample points for the query bounds
+ * that have been transferred to the input buffer of the estimator. The
+ * query bounds are passed again as cache keys. The returned event signals
+ * once the local results buffer has been written.
+ */
+cl_event ocl_factorCacheKDE(
+    ocl_estimator_t* estimator, const kde_float_t* query,
+    unsigned int nr_of_wait_events, cl_event* wait_events);
+
+/*
+ * Flushes all cached factors. Must be called whenever the sample or the
+ * bandwidth of the model changes.
+ */
+void ocl_invalidateFactorCache(ocl_estimator_t* estimator);
+
+/*
+ * Releases all buffers of the factor cache.
+ */
+void ocl_releaseFactorCache(ocl_estimator_t* estimator);
+
+#endif /* USE_OPENCL */
+#endif /* OCL_FACTOR_CACHE_H_ */
@@ -0,0 +1,361 @@
+/*
+ * ocl_grid_estimator.c
+ */
+
+#include "ocl_grid_estimator.h"
+
+#ifdef USE_OPENCL
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ocl_adaptive_bandwidth.h"
+
+extern ocl_kernel_type_t global_kernel_type;
+
+/*
+ * The grid extends this many standard deviations beyond the sample for the
+ * Gauss kernel, so the mass outside of the grid is negligible.
+ */
+#define GAUSS_SUPPORT 6.0
+
+bool ocl_gridSupportsModel(ocl_estimator_t* estimator) {
+  return estimator->nr_of_dimensions <= OCL_GRID_MAX_DIMENSIONS;
+}
+
+// Helper function to abort if the grid does not fit into memory.
+static void reportOutOfMemory(void) {
+  ereport(ERROR,
+          (errcode(ERRCODE_OUT_OF_MEMORY),
+           errmsg("out of memory while building the KDE grid")));
+}
+
+// Helper function to compute the cdf of the one-dimensional kernel.
+static double kernelCDF(double x, double h) {
+  if (h == 0) return x < 0 ? 0.0 : (x > 0 ? 1.0 : 0.5);
+  if (global_kernel_type == EPANECHNIKOV) {
+    double u = Max(-1.0, Min(1.0, x / h));
+    return 0.5 + 0.75 * (u - u * u * u / 3.0);
+  }
+  return 0.5 * erfc(-x / (M_SQRT2 * h));
+}
+
+/*
+ * In-place radix-2 FFT (Cooley-Tukey) of a complex sequence. The length must
+ * be a power of two.
+ */
+static void fft(double* re, double* im, unsigned int n, bool inverse) {
+  unsigned int i, j, k, len;
+  // Bit-reversal permutation.
+  for (i = 1, j = 0; i < n; ++i) {
+    unsigned int bit = n >> 1;
+    for (; j & bit; bit >>= 1) j ^= bit;
+    j ^= bit;
+    if (i < j) {
+      double tmp = re[i]; re[i] = re[j]; re[j] = tmp;
+      tmp = im[i]; im[i] = im[j]; im[j] = tmp;
+    }
+  }
+  // Butterflies.
+  for (len = 2; len <= n; len <<= 1) {
+    double angle = (inverse ? 2.0 : -2.0) * M_PI / len;
+    double wr = cos(angle);
+    double wi = sin(angle);
+    for (i = 0; i < n; i += len) {
+      double cr = 1.0;
+      double ci = 0.0;
+      for (k = 0; k < len / 2; ++k) {
+        unsigned int a = i + k;
+        unsigned int b = i + k + len / 2;
+        double tr = re[b] * cr - im[b] * ci;
+        double ti = re[b] * ci + im[b] * cr;
+        double next_cr;
+        re[b] = re[a] - tr;
+        im[b] = im[a] - ti;
+        re[a] += tr;
+        im[a] += ti;
+        next_cr = cr * wr - ci * wi;
+        ci = cr * wi + ci * wr;
+        cr = next_cr;
+      }
+    }
+  }
+  if (inverse) {
+    for (i = 0; i < n; ++i) {
+      re[i] /= n;
+      im[i] /= n;
+    }
+  }
+}
+
+/*
+ * Helper function to convolve the cells along one dimension with the mass
+ * that the kernel assigns to each cell offset. Returns false if the buffers
+ * could not be allocated.
+ */
+static bool convolveDimension(
+    double* cells, unsigned int resolution, unsigned int dimensions,
+    unsigned int dimension, double cell_width, double h) {
+  unsigned int i, j, line;
+  // The kernel covers the offsets -(G-1) ... G-1, pad to avoid wrap-around.
+  unsigned int padded = 1;
+  unsigned int stride = 1;
+  unsigned int nr_of_lines = 1;
+  double *kernel_re, *kernel_im, *re, *im;
+  while (padded < 3 * resolution - 2) padded <<= 1;
+  kernel_re = calloc(padded, sizeof(double));
+  kernel_im = calloc(padded, sizeof(double));
+  re = malloc(sizeof(double) * padded);
+  im = malloc(sizeof(double) * padded);
+  if (!kernel_re || !kernel_im || !re || !im) {
+    free(kernel_re);
+    free(kernel_im);
+    free(re);
+    free(im);
+    return false;
+  }
+  for (j = 0; j < 2 * resolution - 1; ++j) {
+    double offset = ((double)j - (resolution - 1)) * cell_width;
+    kernel_re[j] = kernelCDF(offset + 0.5 * cell_width, h) -
+        kernelCDF(offset - 0.5 * cell_width, h);
+  }
+  fft(kernel_re, kernel_im, padded, false);
+  // Now convolve every line of cells along the dimension.
+  for (i = 0; i < dimension; ++i) stride *= resolution;
+  for (i = 1; i < dimensions; ++i) nr_of_lines *= resolution;
+  for (line = 0; line < nr_of_lines; ++line) {
+    // Index of the first cell of this line.
+    unsigned int base = (line / stride) * stride * resolution + line % stride;
+    memset(re, 0, sizeof(double) * padded);
+    memset(im, 0, sizeof(double) * padded);
+    for (j = 0; j < resolution; ++j) re[j] = cells[base + j * stride];
+    fft(re, im, padded, false);
+    for (j = 0; j < padded; ++j) {
+      double r = re[j] * kernel_re[j] - im[j] * kernel_im[j];
+      im[j] = re[j] * kernel_im[j] + im[j] * kernel_re[j];
+      re[j] = r;
+    }
+    fft(re, im, padded, true);
+    for (j = 0; j < resolution; ++j) {
+      cells[base + j * stride] = re[j + resolution - 1];
+    }
+  }
+  free(re);
+  free(im);
+  free(kernel_re);
+  free(kernel_im);
+  return true;
+}
+
+// Helper function to (re-)build the summed-area table of the estimator.
+static void buildGrid(ocl_estimator_t* estimator, ocl_grid_estimator_t* grid) {
+  unsigned int i, j, k;
+  ocl_context_t* context = ocl_getContext();
+  cl_int err = CL_SUCCESS;
+  unsigned int d = estimator->nr_of_dimensions;
+  unsigned int n = estimator->rows_in_sample;
+  // Fetch the sample and the bandwidth from the device.
+  kde_float_t* sample = palloc(ocl_sizeOfSampleItem(estimator) * n);
+  kde_float_t* bandwidth = palloc(sizeof(kde_float_t) * d);
+  cl_event optimization_event =
+      estimator->bandwidth_optimization->optimization_event;
+  kde_float_t* point_weights = NULL;
+  double h[OCL_GRID_MAX_DIMENSIONS];
+  unsigned int g, nr_of_cells, nr_of_corners, stride;
+  double* cells;
+  err |= clEnqueueReadBuffer(
+      context->queue, estimator->sample_buffer, CL_TRUE, 0,
+      ocl_sizeOfSampleItem(estimator) * n, sample, 0, NULL, NULL);
+  err |= clEnqueueReadBuffer(
+      context->queue, estimator->bandwidth_buffer, CL_TRUE, 0,
+      sizeof(kde_float_t) * d, bandwidth,
+      optimization_event ? 1 : 0,
+      optimization_event ? &optimization_event : NULL, NULL);
+  Assert(err == CL_SUCCESS);
+  if (optimization_event) {
+    // The blocking read has waited for the update, so we are done with it.
+    err = clReleaseEvent(optimization_event);
+    Assert(err == CL_SUCCESS);
+    estimator->bandwidth_optimization->optimization_event = NULL;
+  }
+  estimator->stats->estimation_transfer_to_host += 2;
+  // Points of a compacted sample are binned with their weight.
+  if (estimator->weight_buffer) {
+    point_weights = palloc(sizeof(kde_float_t) * n);
+    err = clEnqueueReadBuffer(
+        context->queue, estimator->weight_buffer, CL_TRUE, 0,
+        sizeof(kde_float_t) * n, point_weights, 0, NULL, NULL);
+    Assert(err == CL_SUCCESS);
+    estimator->stats->estimation_transfer_to_host++;
+  }
+  for (i = 0; i < d; ++i) {
+    h[i] = bandwidth[i];
+    if (global_kernel_type == GAUSS && kde_bandwidth_representation == LOG_BW) {
+      h[i] = exp(h[i]);
+    }
+  }
+  // Choose the grid such that it covers the support of all kernels.
+  grid->resolution = Min(
+      OCL_GRID_MAX_RESOLUTION, (unsigned int)(
+          pow(OCL_GRID_MAX_CELLS, 1.0 / d) + 1e-9));
+  g = grid->resolution;
+  for (i = 0; i < d; ++i) {
+    double lo = sample[i];
+    double up = sample[i];
+    double support;
+    for (j = 1; j < n; ++j) {
+      lo = Min(lo, sample[j * d + i]);
+      up = Max(up, sample[j * d + i]);
+    }
+    support = global_kernel_type == GAUSS ? GAUSS_SUPPORT * h[i] : h[i];
+    grid->lower[i] = lo - support;
+    grid->cell_width[i] = (up - lo + 2 * support) / g;
+    if (grid->cell_width[i] <= 0) grid->cell_width[i] = 1.0 / g;
+  }
+  // Linear binning: every point distributes its weight to the 2^d closest
+  // cell centers.
+  nr_of_cells = 1;
+  for (i = 0; i < d; ++i) nr_of_cells *= g;
+  cells = calloc(nr_of_cells, sizeof(double));
+  if (cells == NULL) reportOutOfMemory();
+  for (j = 0; j < n; ++j) {
+    unsigned int cell[OCL_GRID_MAX_DIMENSIONS];
+    double fraction[OCL_GRID_MAX_DIMENSIONS];
+    for (i = 0; i < d; ++i) {
+      double t = (sample[j * d + i] - grid->lower[i]) / grid->cell_width[i];
+      t = Max(0.0, Min(g - 1.0, t - 0.5));
+      cell[i] = Min(g - 2, (unsigned int)t);
+      fraction[i] = t - cell[i];
+    }
+    for (k = 0; k < (0x1u << d); ++k) {
+      unsigned int index = 0;
+      unsigned int stride = 1;
+      double weight = point_weights ? point_weights[j] : 1.0;
+      for (i = 0; i < d; ++i) {
+        bool upper = (k >> i) & 0x1;
+        weight *= upper ? fraction[i] : 1.0 - fraction[i];
+        index += (cell[i] + (upper ? 1 : 0)) * stride;
+        stride *= g;
+      }
+      if (weight > 0) cells[index] += weight;
+    }
+  }
+  pfree(sample);
+  pfree(bandwidth);
+  if (point_weights) pfree(point_weights);
+  // Spread the bins with the kernel, one dimension at a time.
+  for (i = 0; i < d; ++i) {
+    if (!convolveDimension(cells, g, d, i, grid->cell_width[i], h[i])) {
+      free(cells);
+      reportOutOfMemory();
+    }
+  }
+  // And build the summed-area table over the (g+1)^d cell corners.
+  nr_of_corners = 1;
+  for (i = 0; i < d; ++i) nr_of_corners *= g + 1;
+  grid->valid = false;
+  if (grid->table) free(grid->table);
+  grid->table = calloc(nr_of_corners, sizeof(double));
+  if (grid->table == NULL) {
+    free(cells);
+    reportOutOfMemory();
+  }
+  for (j = 0; j < nr_of_cells; ++j) {
+    unsigned int index = 0;
+    unsigned int stride = 1;
+    unsigned int rest = j;
+    for (i = 0; i < d; ++i) {
+      index += (rest % g + 1) * stride;
+      rest /= g;
+      stride *= g + 1;
+    }
+    // FFT round-off can produce tiny negative masses.
+    grid->table[index] = Max(cells[j], 0.0);
+  }
+  free(cells);
+  stride = 1;
+  for (i = 0; i < d; ++i) {
+    for (j = 0; j < nr_of_corners; ++j) {
+      if ((j / stride) % (g + 1) == 0) continue;
+      grid->table[j] += grid->table[j - stride];
+    }
+    stride *= g + 1;
+  }
+  grid->valid = true;
+  grid->changes = 0;
+}
+
+double ocl_gridRangeKDE(ocl_estimator_t* estimator, const kde_float_t* query) {
+  unsigned int i, k;
+  unsigned int d = estimator->nr_of_dimensions;
+  ocl_grid_estimator_t* grid = estimator->grid;
+  unsigned int g;
+  unsigned int corner[OCL_GRID_MAX_DIMENSIONS][4];
+  double weight[OCL_GRID_MAX_DIMENSIONS][4];
+  double result = 0;
+  if (grid == NULL) {
+    grid = calloc(1, sizeof(ocl_grid_estimator_t));
+    if (grid == NULL) reportOutOfMemory();
+    estimator->grid = grid;
+  }
+  if (!grid->valid ||
+      grid->changes > OCL_GRID_STALENESS * estimator->rows_in_sample) {
+    buildGrid(estimator, grid);
+  }
+  g = grid->resolution;
+  // For each dimension, the cdf at the query bounds is interpolated between
+  // two corners, so we get four (corner, weight) pairs per dimension.
+  for (i = 0; i < d; ++i) {
+    unsigned int b;
+    for (b = 0; b < 2; ++b) {
+      double bound = (query[2 * i + b] - estimator->mean_host_buffer[i]) /
+          estimator->sdev_host_buffer[i];
+      double t = (bound - grid->lower[i]) / grid->cell_width[i];
+      unsigned int c;
+      double fraction;
+      double sign = b == 0 ? -1.0 : 1.0;
+      t = Max(0.0, Min((double)g, t));
+      c = Min(g - 1, (unsigned int)t);
+      fraction = t - c;
+      corner[i][2 * b] = c;
+      weight[i][2 * b] = sign * (1.0 - fraction);
+      corner[i][2 * b + 1] = c + 1;
+      weight[i][2 * b + 1] = sign * fraction;
+    }
+  }
+  // Inclusion-exclusion over the interpolated corners.
+  for (k = 0; k < (0x1u << (2 * d)); ++k) {
+    unsigned int index = 0;
+    unsigned int stride = 1;
+    double w = 1.0;
+    for (i = 0; i < d && w != 0; ++i) {
+      unsigned int choice = (k >> (2 * i)) & 0x3;
+      w *= weight[i][choice];
+      index += corner[i][choice] * stride;
+      stride *= g + 1;
+    }
+    if (w != 0) result += w * grid->table[index];
+  }
+  result /= estimator->rows_in_sample;
+  return Max(0.0, Min(1.0, result));
+}
+
+void ocl_invalidateGridEstimator(ocl_estimator_t* estimator) {
+  if (estimator->grid == NULL) return;
+  estimator->grid->valid = false;
+}
+
+void ocl_countGridChanges(ocl_estimator_t* estimator, unsigned int changes) {
+  if (estimator->grid == NULL) return;
+  estimator->grid->changes += changes;
+}
+
+void ocl_releaseGridEstimator(ocl_estimator_t* estimator) {
+  if (estimator->grid == NULL) return;
+  if (estimator->grid->table) free(estimator->grid->table);
+  free(estimator->grid);
+  estimator->grid = NULL;
+}
+
+#endif /* USE_OPENCL */
@@ -0,0 +1,84 @@
+/*
+ * ocl_grid_estimator.h
+ *
+ *  Binned estimation backend for kde_backend = grid. For models with at most
+ *  OCL_GRID_MAX_DIMENSIONS columns, the estimator precomputes the
+ *  probability mass of the KDE model on a regular grid: the sample is
+ *  linearly binned onto the grid cells, the bins are convolved with the
+ *  probability mass that the (separable) kernel assigns to each cell offset
+ *  using FFTs, and the result is stored as a summed-area table over the cell
+ *  corners. A range query is then answered on the host by inclusion-
+ *  exclusion over the table, interpolating linearly between the corners.
+ *
+ *  The table is rebuilt lazily on the next estimate whenever the model is
+ *  replaced or its bandwidth is reset. Small changes by sample maintenance
+ *  and online learning are only counted, and the table is rebuilt once they
+ *  add up to OCL_GRID_STALENESS of the sample, so a stream of single-point
+ *  updates does not trigger a full rebuild per query.
+ */
+
+#ifndef OCL_GRID_ESTIMATOR_H_
+#define OCL_GRID_ESTIMATOR_H_
+
+#include "ocl_estimator.h"
+
+#ifdef USE_OPENCL
+
+/*
+ * Maximum dimensionality of models that are estimated on the grid.
+ */
+#define OCL_GRID_MAX_DIMENSIONS 4
+
+/*
+ * Upper bound on the number of grid cells of a model and on the number of
+ * cells per dimension.
+ */
+#define OCL_GRID_MAX_CELLS (1 << 20)
+#define OCL_GRID_MAX_RESOLUTION 4096
+
+/*
+ * Fraction of the sample that may change before the grid is rebuilt.
+ */
+#define OCL_GRID_STALENESS 0.05
+
+typedef struct ocl_grid_estimator {
+  unsigned int resolution;      // Number of cells per dimension.
+  double lower[OCL_GRID_MAX_DIMENSIONS];      // Lower grid edge (normalized).
+  double cell_width[OCL_GRID_MAX_DIMENSIONS]; // Cell width (normalized).
+  double* table;                // Summed-area table over the cell corners.
+  bool valid;                   // False if the table has to be rebuilt.
+  unsigned int changes;         // Small model changes since the last build.
+} ocl_grid_estimator_t;
+
+/*
+ * Returns true if the given model can be estimated on the grid.
+ */
+bool ocl_gridSupportsModel(ocl_estimator_t* estimator);
+
+/*
+ * Computes the selectivity estimate for the given (unnormalized) query bounds
+ * from the grid. Other than the regular path, this does not compute any
+ * per-point contributions for model maintenance.
+ */
+double ocl_gridRangeKDE(ocl_estimator_t* estimator, const kde_float_t* query);
+
+/*
+ * Marks the grid as outdated. Must be called whenever the sample or the
+ * bandwidth of the model is replaced.
+ */
+void ocl_invalidateGridEstimator(ocl_estimator_t* estimator);
+
+/*
+ * Records small changes to the model, i.e. the given number of replaced
+ * sample points or a single online learning step. The grid is rebuilt once
+ * the changes exceed OCL_GRID_STALENESS of the sample.
+ */
+void ocl_countGridChanges(ocl_estimator_t* estimator, unsigned int changes);
+
+/*
+ * Releases the grid of the estimator.
+ */
+void ocl_releaseGridEstimator(ocl_estimator_t* estimator);
+
+#endif /* USE_OPENCL */
+#endif /* OCL_GRID_ESTIMATOR_H_ */
@@ -15,7 +15,10 @@
 #include "ocl_adaptive_bandwidth.h"
 #include "ocl_error_metrics.h"
 #include "ocl_estimator.h"
+#include "ocl_factor_cache.h"
+#include "ocl_grid_estimator.h"
 #include "ocl_sample_maintenance.h"
+#include "ocl_selectivity_cache.h"
 #include "ocl_utilities.h"
 
 // Optimization routines.
@@ -24,6 +27,7 @@
 
 #include "catalog/pg_kdefeedback.h"
 #include "executor/spi.h"
+#include "kde_feedback/kde_feedback_queue.h"
 #include "optimizer/path/gpukde/ocl_estimator_api.h"
 #include "storage/lock.h"
 
@@ -42,10 +46,13 @@ void ocl_notifyModelMaintenanceOfSelectivity(
     Oid relation, double selected, double allrows) {
   CREATE_TIMER();
 
-  // Check if we have an estimator for this relation.
+  // Check if we have an estimator for this relation. If the relation has
+  // several models, the feedback belongs to the one that produced the estimate.
   ocl_estimator_t* estimator = ocl_getEstimator(relation);
-  if (estimator == NULL) return;
-  if (!estimator->open_estimation) return;  // No registered estimation.
+  while (estimator && !estimator->open_estimation) {
+    estimator = estimator->next;
+  }
+  if (estimator == NULL) return;  // No registered estimation.
 
   double selectivity = selected / allrows;
   estimator->rows_in_table = allrows;
@@ -63,7 +70,7 @@ void ocl_notifyModelMaintenanceOfSelectivity(
 
   // We are done.
   estimator->open_estimation = false;
-  LOG_TIMER("Model Maintenance");
+  RECORD_TIMER(KDE_PHASE_MAINTENANCE);
 }
 
 // ############################################################
@@ -141,9 +148,11 @@ static unsigned int ocl_extractLatestFeedbackRecordsFromCatalog(
 // Helper function that extracts feedback for the given estimator and
 // pushes it to the device.
 static unsigned int ocl_prepareFeedback(
-    ocl_estimator_t* estimator, cl_mem* device_ranges,
+    ocl_estimator_t* estimator, int feedback_window, cl_mem* device_ranges,
     cl_mem* device_selectivities) {
   cl_int err = CL_SUCCESS;
+  // Records that still wait for the feedback worker are needed right away.
+  kde_drain_feedback_queue();
   // First, we have to count how many matching feedback records are available
   // for this estimator in the query feedback table.
   if (SPI_connect() != SPI_OK_CONNECT) {
@@ -171,11 +180,10 @@ static unsigned int ocl_prepareFeedback(
 
   // Adjust the number of records according to the specified window size.
   int used_records;
-  if (kde_bandwidth_optimization_feedback_window == -1)
+  if (feedback_window == -1)
     used_records = available_records;
   else
-    used_records = Min(available_records,
-                       kde_bandwidth_optimization_feedback_window);
+    used_records = Min(available_records, feedback_window);
   fprintf(stderr, "> Checking the %i latest feedback records.\n", used_records);
 
   // Allocate arrays and fetch the actual feedback data.
@@ -193,7 +201,7 @@ static unsigned int ocl_prepareFeedback(
   fprintf(stderr, "> Found %i valid records, pushing to device.\n",
           actual_records);
   ocl_context_t* context = ocl_getContext();
-  *device_ranges = clCreateBuffer(
+  *device_ranges = ocl_createBuffer(
       context->context, CL_MEM_READ_WRITE,
       sizeof(kde_float_t) * 2 * actual_records * estimator->nr_of_dimensions,
       NULL, &err);
@@ -206,7 +214,7 @@ static unsigned int ocl_prepareFeedback(
   estimator->stats->optimization_transfer_to_device++;
   Assert(err == CL_SUCCESS);
   
-  *device_selectivities = clCreateBuffer(
+  *device_selectivities = ocl_createBuffer(
       context->context, CL_MEM_READ_WRITE,
       sizeof(kde_float_t) * actual_records, NULL, &err);
   Assert(err == CL_SUCCESS);
@@ -367,6 +375,8 @@ static double computeGradient(
       gradient_kernel, 13, sizeof(cl_mem), &(estimator->mean_buffer));
   err |= clSetKernelArg(
       gradient_kernel, 14, sizeof(cl_mem), &(estimator->sdev_buffer));
+  err |= clSetKernelArg(
+      gradient_kernel, 15, sizeof(cl_mem), &(estimator->weight_buffer));
   Assert(err == CL_SUCCESS);
   
   // Compute the gradient for each observation.
@@ -476,16 +486,22 @@ static void ocl_setScottsBandwidth(ocl_estimator_t* estimator) {
   kde_float_t* variances = malloc(
       sizeof(kde_float_t) * estimator->nr_of_dimensions);
   cl_mem* buffers = malloc(sizeof(cl_mem) * estimator->nr_of_dimensions);
-  cl_mem averages = clCreateBuffer(
+  cl_mem averages = ocl_createBuffer(
       context->context, CL_MEM_READ_WRITE,
       sizeof(kde_float_t) * estimator->nr_of_dimensions, NULL, &err);
   Assert(err == CL_SUCCESS);
   cl_event* events = malloc(sizeof(cl_event) * estimator->nr_of_dimensions);
+  // The sums of different dimensions run concurrently, so every dimension
+  // gets its own descriptor. The two sums of a dimension are chained.
+  if (estimator->dimension_sum_descriptors == NULL) {
+    estimator->dimension_sum_descriptors = calloc(
+        estimator->nr_of_dimensions, sizeof(ocl_aggregation_descriptor_t*));
+  }
   size_t sample_size = estimator->rows_in_sample;
   size_t dimensions = estimator->nr_of_dimensions;
   for (i=0; i<estimator->nr_of_dimensions; ++i) {
     // Allocate all required buffers.
-    buffers[i] = clCreateBuffer(
+    buffers[i] = ocl_createBuffer(
         context->context, CL_MEM_READ_WRITE,
         sizeof(kde_float_t) * estimator->rows_in_sample, NULL, &err);
     Assert(err == CL_SUCCESS);
@@ -504,9 +520,11 @@ static void ocl_setScottsBandwidth(ocl_estimator_t* estimator) {
         context->queue, extractComponents, 1, NULL, &sample_size, NULL,
         0, NULL, &extraction_event);
     Assert(err == CL_SUCCESS);
-    // Now we sum them up, so we can compute the average.
-    cl_event average_summation_event = sumOfArray(
-        buffers[i], estimator->rows_in_sample, averages, i, extraction_event);
+    // Now we sum them up, so we can compute the average. The weights of a
+    // compacted sample sum up to the number of sample points.
+    cl_event average_summation_event = weightedSumOfArray(
+        &(estimator->dimension_sum_descriptors[i]), buffers[i], estimator->weight_buffer, estimator->rows_in_sample,
+        averages, i, extraction_event);
     // Alright, we can compute the variance contributions from each point.
     cl_kernel precomputeVariance = ocl_getKernel("precompute_variance", 0);
     err |= clSetKernelArg(precomputeVariance, 0, sizeof(cl_mem), &(buffers[i]));
@@ -521,8 +539,9 @@ static void ocl_setScottsBandwidth(ocl_estimator_t* estimator) {
     Assert(err == CL_SUCCESS);
     
     // We now sum up the single contributions to compute the variance.
-    cl_event variance_summation_event = sumOfArray(
-        buffers[i], estimator->rows_in_sample, averages, i, variance_event);
+    cl_event variance_summation_event = weightedSumOfArray(
+        &(estimator->dimension_sum_descriptors[i]), buffers[i], estimator->weight_buffer, estimator->rows_in_sample,
+        averages, i, variance_event);
     // Finally, we can compute and store the bandwidth for this value.
     cl_kernel finalizeBandwidth = ocl_getKernel("set_scotts_bandwidth", 0);
     err |= clSetKernelArg(finalizeBandwidth, 0, sizeof(cl_mem), &averages);
@@ -533,6 +552,8 @@ static void ocl_setScottsBandwidth(ocl_estimator_t* estimator) {
         &(estimator->nr_of_dimensions));
     err |= clSetKernelArg(finalizeBandwidth, 4, sizeof(unsigned int),
         &(estimator->rows_in_sample));
+    err |= clSetKernelArg(finalizeBandwidth, 5, sizeof(unsigned int),
+        &(estimator->represented_rows));
     Assert(err == CL_SUCCESS);
     
     err = clEnqueueNDRangeKernel(
@@ -563,13 +584,29 @@ static void ocl_setScottsBandwidth(ocl_estimator_t* estimator) {
   free(events);
 }
 
+void ocl_setRuleOfThumbBandwidth(ocl_estimator_t* estimator) {
+  if (estimator == NULL) return;
+  ocl_setScottsBandwidth(estimator);
+  estimator->host_bandwidth_valid = false;
+  ocl_invalidateGridEstimator(estimator);
+  ocl_invalidateFactorCache(estimator);
+  ocl_clearSelectivityCache(estimator);
+  ocl_markEstimatorDirty(estimator);
+}
+
 void ocl_runModelOptimization(ocl_estimator_t* estimator) {
   if (estimator == NULL) return;
-  cl_int err = CL_SUCCESS;
   // Set the rule-of-thumb bandwidth to initialize the estimator.
-  ocl_setScottsBandwidth(estimator);
+  ocl_setRuleOfThumbBandwidth(estimator);
   // Now check if we do a full bandwidth optimization.
   if (!kde_enable_bandwidth_optimization) return;
+  ocl_optimizeBandwidth(
+      estimator, kde_bandwidth_optimization_feedback_window);
+}
+
+bool ocl_optimizeBandwidth(ocl_estimator_t* estimator, int feedback_window) {
+  if (estimator == NULL) return false;
+  cl_int err = CL_SUCCESS;
   if (ocl_isDebug()) {
     fprintf(
         stderr, "Beginning model optimization for estimator on table %i\n",
@@ -579,8 +616,8 @@ void ocl_runModelOptimization(ocl_estimator_t* estimator) {
   // to the device.
   cl_mem device_ranges, device_selectivites;
   unsigned int feedback_records = ocl_prepareFeedback(
-      estimator, &device_ranges, &device_selectivites);
-  if (feedback_records == 0) return;
+      estimator, feedback_window, &device_ranges, &device_selectivites);
+  if (feedback_records == 0) return false;
 
   // We need to transfer the bandwidth to the host.
   kde_float_t* fbandwidth = palloc(
@@ -604,7 +641,7 @@ void ocl_runModelOptimization(ocl_estimator_t* estimator) {
   params.nr_of_observations = feedback_records;
   params.observed_ranges = device_ranges;
   params.observed_selectivities = device_selectivites;
-  params.error_accumulator_buffer = clCreateBuffer(
+  params.error_accumulator_buffer = ocl_createBuffer(
       context->context, CL_MEM_READ_WRITE,
       sizeof(kde_float_t) * feedback_records, NULL, &err);
   Assert(err == CL_SUCCESS);
@@ -622,16 +659,16 @@ void ocl_runModelOptimization(ocl_estimator_t* estimator) {
         * context->required_mem_alignment;
     params.stride_size /= 8;
   }
-  params.gradient_accumulator_buffer = clCreateBuffer(
+  params.gradient_accumulator_buffer = ocl_createBuffer(
       context->context, CL_MEM_READ_WRITE,
       estimator->nr_of_dimensions * params.stride_size,
       NULL, &err);
   Assert(err == CL_SUCCESS);
-  params.gradient_buffer = clCreateBuffer(
+  params.gradient_buffer = ocl_createBuffer(
       context->context, CL_MEM_READ_WRITE,
       estimator->nr_of_dimensions * sizeof(kde_float_t), NULL, &err);
   Assert(err == CL_SUCCESS);
-  params.error_buffer = clCreateBuffer(
+  params.error_buffer = ocl_createBuffer(
       context->context, CL_MEM_READ_WRITE, sizeof(kde_float_t), NULL, &err);
   Assert(err == CL_SUCCESS);
   // Prepare the summation buffers.
@@ -648,7 +685,7 @@ void ocl_runModelOptimization(ocl_estimator_t* estimator) {
     cl_buffer_region region;
     region.size = params.stride_size;
     region.origin = i * params.stride_size;
-    params.summation_buffers[i] = clCreateSubBuffer(
+    params.summation_buffers[i] = ocl_createSubBuffer(
         params.gradient_accumulator_buffer, CL_MEM_READ_ONLY,
         CL_BUFFER_CREATE_TYPE_REGION, &region, &err);
     Assert(err == CL_SUCCESS);
@@ -736,6 +773,11 @@ void ocl_runModelOptimization(ocl_estimator_t* estimator) {
       fbandwidth, 0, NULL, NULL);
   estimator->stats->optimization_transfer_to_device++;
   Assert(err == CL_SUCCESS);
+  estimator->host_bandwidth_valid = false;
+  ocl_invalidateGridEstimator(estimator);
+  ocl_invalidateFactorCache(estimator);
+  ocl_clearSelectivityCache(estimator);
+  ocl_markEstimatorDirty(estimator);
   // Clean up.
   pfree(fbandwidth);
   lbfgs_free(bandwidth);
@@ -754,4 +796,5 @@ void ocl_runModelOptimization(ocl_estimator_t* estimator) {
   err |= clReleaseMemObject(device_ranges);
   err |= clReleaseMemObject(device_selectivites);
   Assert(err == CL_SUCCESS);
+  return true;
 }
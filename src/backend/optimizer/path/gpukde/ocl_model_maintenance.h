@@ -15,4 +15,12 @@
 // optimization over these records to pick the optimal bandwidth.
 void ocl_runModelOptimization(ocl_estimator_t* estimator);
 
+// Initializes the bandwidth of the estimator using Scott's rule of thumb.
+void ocl_setRuleOfThumbBandwidth(ocl_estimator_t* estimator);
+
+// Runs the numerical bandwidth optimization over the latest feedback_window
+// feedback records (-1 for all records), starting from the current bandwidth.
+// Returns false if no feedback was available and the bandwidth is unchanged.
+bool ocl_optimizeBandwidth(ocl_estimator_t* estimator, int feedback_window);
+
 #endif /* OCL_MODEL_MAINTENANCE_H_ */
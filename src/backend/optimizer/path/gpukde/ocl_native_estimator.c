@@ -0,0 +1,329 @@
+/*
+ * ocl_native_estimator.c
+ */
+
+#include "ocl_native_estimator.h"
+
+#ifdef USE_OPENCL
+
+#include <math.h>
+#include <stdlib.h>
+
+#include "ocl_adaptive_bandwidth.h"
+#include "ocl_sample_maintenance.h"
+
+extern ocl_kernel_type_t global_kernel_type;
+extern int kde_sample_maintenance_option;
+
+/*
+ * Number of sample points that are processed together. All inner loops run
+ * over a block of points with unit stride, so the compiler can vectorize them.
+ */
+#define NATIVE_BLOCK_SIZE 256
+
+/*
+ * Adding this constant rounds a double below 2^51 to the nearest integer,
+ * which ends up in the low bits of the mantissa.
+ */
+#define NATIVE_ROUNDING_SHIFTER 6755399441055744.0
+
+/*
+ * Fast exponential function for the (non-positive) arguments of erfc. Uses a
+ * Cody-Waite range reduction and a Taylor polynomial on [-ln2/2, ln2/2]. The
+ * function only uses selects and avoids calls into libm, so it can be
+ * vectorized.
+ */
+static inline double native_exp(double x) {
+  union { double d; int64 i; } shifted, scale;
+  double k, r, p;
+  x = x < -700.0 ? -700.0 : x;
+  x = x > 700.0 ? 700.0 : x;
+  // Round x / ln2 to the nearest integer k without calling floor.
+  shifted.d = x * M_LOG2E + NATIVE_ROUNDING_SHIFTER;
+  k = shifted.d - NATIVE_ROUNDING_SHIFTER;
+  r = x - k * 6.93145751953125E-1;
+  r -= k * 1.42860682030941723212E-6;
+  p = 1.0 + r * (1.0 + r * (1.0 / 2 + r * (1.0 / 6 + r * (1.0 / 24 +
+      r * (1.0 / 120 + r * (1.0 / 720 + r * (1.0 / 5040 + r * (1.0 / 40320 +
+      r * (1.0 / 362880 + r * (1.0 / 3628800 + r * (1.0 / 39916800)))))))))));
+  // Scale by 2^k by constructing the exponent bits directly. The low bits of
+  // the shifted value hold k, everything above is shifted out.
+  scale.i = (shifted.i + 1023) << 52;
+  return p * scale.d;
+}
+
+/*
+ * Complementary error function for non-negative arguments, using the Chebyshev
+ * fit from Numerical Recipes (fractional error below 1.2e-7 everywhere).
+ */
+static inline double native_erfc(double z) {
+  double t = 1.0 / (1.0 + 0.5 * z);
+  return t * native_exp(-z * z - 1.26551223 + t * (1.00002368 +
+      t * (0.37409196 + t * (0.09678418 + t * (-0.18628806 +
+      t * (0.27886807 + t * (-1.13520398 + t * (1.48851587 +
+      t * (-0.82215223 + t * 0.17087277)))))))));
+}
+
+/*
+ * Computes erf(b) - erf(a) for a <= b. We work with erfc, so the difference
+ * stays accurate if both bounds are in the same tail. The signs of the bounds
+ * pick the case arithmetically: sb - sa is zero if both bounds are in the same
+ * tail and two otherwise, so the function has no branches.
+ */
+static inline double native_erfDiff(double a, double b) {
+  double sa = copysign(1.0, a);
+  double sb = copysign(1.0, b);
+  return (sb - sa) + sa * native_erfc(fabs(a)) - sb * native_erfc(fabs(b));
+}
+
+// Helper function to make sure the host sample is in sync with the device.
+static void syncHostSample(ocl_estimator_t* estimator) {
+  unsigned int i, j;
+  ocl_context_t* context;
+  cl_int err PG_USED_FOR_ASSERTS_ONLY = CL_SUCCESS;
+  unsigned int d = estimator->nr_of_dimensions;
+  unsigned int n = estimator->rows_in_sample;
+  kde_float_t* device_sample;
+  if (estimator->host_sample) return;
+  context = ocl_getContext();
+  device_sample = palloc(ocl_sizeOfSampleItem(estimator) * n);
+  err = clEnqueueReadBuffer(
+      context->queue, estimator->sample_buffer, CL_TRUE, 0,
+      ocl_sizeOfSampleItem(estimator) * n, device_sample, 0, NULL, NULL);
+  Assert(err == CL_SUCCESS);
+  estimator->stats->estimation_transfer_to_host++;
+  // Transpose into dimension-major layout.
+  estimator->host_sample = malloc(sizeof(double) * d * n);
+  for (i = 0; i < n; ++i) {
+    for (j = 0; j < d; ++j) {
+      estimator->host_sample[j * n + i] = device_sample[i * d + j];
+    }
+  }
+  pfree(device_sample);
+  // A compacted sample also needs the weights of its points.
+  if (estimator->weight_buffer) {
+    kde_float_t* device_weights = palloc(sizeof(kde_float_t) * n);
+    err = clEnqueueReadBuffer(
+        context->queue, estimator->weight_buffer, CL_TRUE, 0,
+        sizeof(kde_float_t) * n, device_weights, 0, NULL, NULL);
+    Assert(err == CL_SUCCESS);
+    estimator->stats->estimation_transfer_to_host++;
+    estimator->host_weights = malloc(sizeof(double) * n);
+    for (i = 0; i < n; ++i) estimator->host_weights[i] = device_weights[i];
+    pfree(device_weights);
+  }
+}
+
+// Helper function to make sure the host bandwidth is in sync with the device.
+static void syncHostBandwidth(ocl_estimator_t* estimator) {
+  unsigned int i;
+  ocl_context_t* context;
+  cl_int err PG_USED_FOR_ASSERTS_ONLY = CL_SUCCESS;
+  unsigned int d = estimator->nr_of_dimensions;
+  kde_float_t* device_bandwidth;
+  cl_event optimization_event;
+  if (estimator->host_bandwidth_valid) return;
+  context = ocl_getContext();
+  device_bandwidth = palloc(sizeof(kde_float_t) * d);
+  // Make sure that pending bandwidth updates are finished.
+  optimization_event = estimator->bandwidth_optimization->optimization_event;
+  err = clEnqueueReadBuffer(
+      context->queue, estimator->bandwidth_buffer, CL_TRUE, 0,
+      sizeof(kde_float_t) * d, device_bandwidth,
+      optimization_event ? 1 : 0,
+      optimization_event ? &optimization_event : NULL, NULL);
+  Assert(err == CL_SUCCESS);
+  estimator->stats->estimation_transfer_to_host++;
+  if (estimator->host_bandwidth == NULL) {
+    estimator->host_bandwidth = malloc(sizeof(double) * d);
+  }
+  for (i = 0; i < d; ++i) {
+    estimator->host_bandwidth[i] = device_bandwidth[i];
+  }
+  pfree(device_bandwidth);
+  estimator->host_bandwidth_valid = true;
+}
+
+// Computes the per-point contributions for the Gauss kernel.
+static void gaussContributions(
+    const double* sample, unsigned int n, unsigned int d,
+    const double* lo, const double* up, const double* bw,
+    double* results, unsigned int offset, unsigned int len) {
+  unsigned int i, j;
+  for (j = 0; j < len; ++j) results[j] = 1.0;
+  for (i = 0; i < d; ++i) {
+    const double* x = sample + i * n + offset;
+    double l = lo[i];
+    double u = up[i];
+    double b = bw[i];
+    if (b == 0) {
+      for (j = 0; j < len; ++j) {
+        double sl = (l - x[j] > 0) - (l - x[j] < 0);
+        double su = (u - x[j] > 0) - (u - x[j] < 0);
+        results[j] *= su - sl;
+      }
+    } else {
+      for (j = 0; j < len; ++j) {
+        results[j] *= native_erfDiff((l - x[j]) * b, (u - x[j]) * b);
+      }
+    }
+  }
+}
+
+// Computes the per-point contributions for the Epanechnikov kernel.
+static void epanechnikovContributions(
+    const double* sample, unsigned int n, unsigned int d,
+    const double* lo, const double* up, const double* bw,
+    double* results, unsigned int offset, unsigned int len) {
+  unsigned int i, j;
+  for (j = 0; j < len; ++j) results[j] = 1.0;
+  for (i = 0; i < d; ++i) {
+    const double* x = sample + i * n + offset;
+    double h = bw[i];
+    double h3 = h * h * h;
+    for (j = 0; j < len; ++j) {
+      // Integrate over the part of the support [-h, h] (relative to the point)
+      // that lies within the query. Working relative to the point avoids the
+      // cancellation for points far from zero, and a completely contained
+      // support yields 4/3.
+      double l = Min(Max(lo[i] - x[j], -h), h);
+      double u = Max(Min(up[i] - x[j], h), -h);
+      double local_result = h * h * (u - l) - (u * u * u - l * l * l) / 3.0;
+      results[j] *= Max(local_result, 0.0) / h3;
+    }
+  }
+}
+
+/*
+ * Helper function to compute an estimate on the host. If contributions is set,
+ * the per-point contributions are stored in it.
+ */
+static double nativeEstimate(
+    ocl_estimator_t* estimator, const kde_float_t* query,
+    double* contributions) {
+  unsigned int i, j;
+  unsigned int d = estimator->nr_of_dimensions;
+  unsigned int n = estimator->rows_in_sample;
+  double lo[d], up[d], bw[d];
+  kde_float_t normalization_factor;
+  double block_results[NATIVE_BLOCK_SIZE];
+  double result = 0;
+  syncHostSample(estimator);
+  syncHostBandwidth(estimator);
+  // Normalize the query bounds and prepare the per-dimension bandwidth.
+  for (i = 0; i < d; ++i) {
+    double h;
+    lo[i] = (query[2 * i] - estimator->mean_host_buffer[i]) /
+        estimator->sdev_host_buffer[i];
+    up[i] = (query[2 * i + 1] - estimator->mean_host_buffer[i]) /
+        estimator->sdev_host_buffer[i];
+    h = estimator->host_bandwidth[i];
+    if (global_kernel_type == GAUSS) {
+      if (kde_bandwidth_representation == LOG_BW) h = exp(h);
+      bw[i] = h == 0 ? 0 : 1.0 / (M_SQRT2 * h);
+    } else {
+      bw[i] = h;
+    }
+  }
+  if (global_kernel_type == EPANECHNIKOV) {
+    normalization_factor = pow(0.75, d);
+  } else {
+    normalization_factor = pow(0.5, d);
+  }
+  // Now evaluate the sample block by block.
+  for (i = 0; i < n; i += NATIVE_BLOCK_SIZE) {
+    unsigned int len = Min(NATIVE_BLOCK_SIZE, n - i);
+    double* results = contributions ? contributions + i : block_results;
+    double block_sum = 0;
+    if (global_kernel_type == EPANECHNIKOV) {
+      epanechnikovContributions(
+          estimator->host_sample, n, d, lo, up, bw, results, i, len);
+    } else {
+      gaussContributions(
+          estimator->host_sample, n, d, lo, up, bw, results, i, len);
+    }
+    if (estimator->host_weights) {
+      const double* weights = estimator->host_weights + i;
+      for (j = 0; j < len; ++j) block_sum += weights[j] * results[j];
+    } else {
+      for (j = 0; j < len; ++j) block_sum += results[j];
+    }
+    result += block_sum;
+  }
+  return result * normalization_factor / n;
+}
+
+double ocl_nativeRangeKDE(ocl_estimator_t* estimator, kde_float_t* query) {
+  unsigned int i;
+  unsigned int n = estimator->rows_in_sample;
+  // The karma-based sample maintenance needs the per-point contributions.
+  bool keep_contributions = kde_sample_maintenance_option == TKR ||
+      kde_sample_maintenance_option == PKR;
+  double result;
+  if (keep_contributions && estimator->host_local_results == NULL) {
+    estimator->host_local_results = malloc(sizeof(double) * n);
+  }
+  result = nativeEstimate(
+      estimator, query,
+      keep_contributions ? estimator->host_local_results : NULL);
+  if (keep_contributions) {
+    // Ship the contributions to the device for the karma update.
+    ocl_context_t* context = ocl_getContext();
+    cl_int err PG_USED_FOR_ASSERTS_ONLY = CL_SUCCESS;
+    if (sizeof(kde_float_t) == sizeof(double)) {
+      err = clEnqueueWriteBuffer(
+          context->queue, estimator->local_results_buffer, CL_TRUE, 0,
+          sizeof(kde_float_t) * n, estimator->host_local_results,
+          0, NULL, NULL);
+    } else {
+      kde_float_t* transfer_buffer = palloc(sizeof(kde_float_t) * n);
+      for (i = 0; i < n; ++i) {
+        transfer_buffer[i] = estimator->host_local_results[i];
+      }
+      err = clEnqueueWriteBuffer(
+          context->queue, estimator->local_results_buffer, CL_TRUE, 0,
+          sizeof(kde_float_t) * n, transfer_buffer, 0, NULL, NULL);
+      pfree(transfer_buffer);
+    }
+    Assert(err == CL_SUCCESS);
+    estimator->stats->estimation_transfer_to_device++;
+  }
+  return result;
+}
+
+void ocl_nativeRangeKDEBatch(
+    ocl_estimator_t* estimator, const kde_float_t* queries,
+    unsigned int nr_of_queries, double* results) {
+  unsigned int i;
+  for (i = 0; i < nr_of_queries; ++i) {
+    results[i] = nativeEstimate(
+        estimator, &(queries[2 * estimator->nr_of_dimensions * i]), NULL);
+  }
+}
+
+void ocl_nativeUpdateSampleItem(
+    ocl_estimator_t* estimator, int position, const kde_float_t* item) {
+  unsigned int i;
+  if (estimator->host_sample == NULL) return;
+  for (i = 0; i < estimator->nr_of_dimensions; ++i) {
+    estimator->host_sample[i * estimator->rows_in_sample + position] = item[i];
+  }
+}
+
+void ocl_nativeInvalidateSample(ocl_estimator_t* estimator) {
+  if (estimator->host_sample) free(estimator->host_sample);
+  if (estimator->host_weights) free(estimator->host_weights);
+  estimator->host_sample = NULL;
+  estimator->host_weights = NULL;
+}
+
+void ocl_nativeReleaseBuffers(ocl_estimator_t* estimator) {
+  ocl_nativeInvalidateSample(estimator);
+  if (estimator->host_bandwidth) free(estimator->host_bandwidth);
+  if (estimator->host_local_results) free(estimator->host_local_results);
+  estimator->host_bandwidth = NULL;
+  estimator->host_local_results = NULL;
+  estimator->host_bandwidth_valid = false;
+}
+
+#endif /* USE_OPENCL */
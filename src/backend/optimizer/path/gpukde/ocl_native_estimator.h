@@ -0,0 +1,51 @@
+/*
+ * ocl_native_estimator.h
+ *
+ *  Host-side implementation of the KDE estimation pipeline (kde kernel +
+ *  summation) that bypasses the OpenCL runtime. The native path operates on
+ *  a dimension-major copy of the sample that is kept in sync with the device
+ *  sample buffer.
+ */
+
+#ifndef OCL_NATIVE_ESTIMATOR_H_
+#define OCL_NATIVE_ESTIMATOR_H_
+
+#include "ocl_estimator.h"
+
+#ifdef USE_OPENCL
+
+/*
+ * Computes the selectivity estimate for the given (unnormalized) query bounds
+ * on the host.
+ */
+double ocl_nativeRangeKDE(ocl_estimator_t* estimator, kde_float_t* query);
+
+/*
+ * Computes the selectivity estimates for a batch of query bounds (2*d values
+ * per query) on the host. Other than ocl_nativeRangeKDE, this does not keep
+ * the per-point contributions for model maintenance.
+ */
+void ocl_nativeRangeKDEBatch(
+    ocl_estimator_t* estimator, const kde_float_t* queries,
+    unsigned int nr_of_queries, double* results);
+
+/*
+ * Updates the host copy of the sample item at the given position. The item
+ * must already be normalized. This is a no-op if there is no host copy.
+ */
+void ocl_nativeUpdateSampleItem(
+    ocl_estimator_t* estimator, int position, const kde_float_t* item);
+
+/*
+ * Drops the host copy of the sample, it will be re-fetched from the device on
+ * the next native estimate.
+ */
+void ocl_nativeInvalidateSample(ocl_estimator_t* estimator);
+
+/*
+ * Releases all host buffers of the native estimator.
+ */
+void ocl_nativeReleaseBuffers(ocl_estimator_t* estimator);
+
+#endif /* USE_OPENCL */
+#endif /* OCL_NATIVE_ESTIMATOR_H_ */
@@ -0,0 +1,262 @@
+/*
+ * ocl_optimization_worker.c
+ */
+
+#include "ocl_optimization_worker.h"
+
+#ifdef USE_OPENCL
+
+#include <signal.h>
+#include <stdlib.h>
+
+#include "ocl_estimator.h"
+
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "access/xact.h"
+#include "commands/dbcommands.h"
+#include "optimizer/path/gpukde/ocl_estimator_api.h"
+#include "postmaster/bgworker.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/lwlock.h"
+#include "storage/proc.h"
+#include "storage/shmem.h"
+#include "utils/snapmgr.h"
+
+// GUC configuration variable.
+bool kde_optimization_worker = false;
+
+extern int kde_bandwidth_optimization_feedback_window;
+extern int kde_error_metric;
+extern int kde_bandwidth_representation;
+
+/*
+ * A single optimization request. Besides the model, we remember the session
+ * settings of the requesting backend that affect the optimization.
+ */
+typedef struct ocl_optimization_job {
+  Oid database;
+  char database_name[NAMEDATALEN];
+  Oid table;
+  int32 columns;                // Column map identifying the model.
+  int feedback_window;
+  int error_metric;
+  int bandwidth_representation;
+} ocl_optimization_job_t;
+
+/*
+ * Shared queue of pending optimization jobs, in FIFO order.
+ */
+typedef struct ocl_optimization_queue {
+  Latch* worker_latch;          // Latch of the worker, NULL if not running.
+  unsigned int nr_of_jobs;
+  ocl_optimization_job_t jobs[OCL_MAX_OPTIMIZATION_JOBS];
+} ocl_optimization_queue_t;
+
+static ocl_optimization_queue_t* optimization_queue = NULL;
+
+// Jobs that were scheduled by the current transaction.
+static ocl_optimization_job_t* pending_jobs = NULL;
+static unsigned int nr_of_pending_jobs = 0;
+
+// Set by the SIGTERM handler of the worker.
+static volatile sig_atomic_t got_sigterm = false;
+
+Size ocl_optimizationQueueShmemSize(void) {
+  return MAXALIGN(sizeof(ocl_optimization_queue_t));
+}
+
+void ocl_optimizationQueueShmemInit(void) {
+  bool found;
+  optimization_queue = ShmemInitStruct(
+      "KDE Optimization Queue", sizeof(ocl_optimization_queue_t), &found);
+  if (!found) {
+    optimization_queue->worker_latch = NULL;
+    optimization_queue->nr_of_jobs = 0;
+  }
+}
+
+// Helper function to add a job to the shared queue. If the model is already
+// queued, we only refresh the settings of the existing job.
+static bool enqueueJob(const ocl_optimization_job_t* job) {
+  unsigned int i;
+  for (i = 0; i < optimization_queue->nr_of_jobs; ++i) {
+    ocl_optimization_job_t* queued = &(optimization_queue->jobs[i]);
+    if (queued->database == job->database && queued->table == job->table &&
+        queued->columns == job->columns) {
+      *queued = *job;
+      return true;
+    }
+  }
+  if (optimization_queue->nr_of_jobs == OCL_MAX_OPTIMIZATION_JOBS) return false;
+  optimization_queue->jobs[optimization_queue->nr_of_jobs++] = *job;
+  return true;
+}
+
+// Transaction callback that hands the scheduled jobs over to the worker once
+// the new models are visible in the catalog.
+static void ocl_queuePendingJobs(XactEvent event, void* arg) {
+  unsigned int i;
+  if (nr_of_pending_jobs == 0) return;
+  if (event == XACT_EVENT_PRE_COMMIT || event == XACT_EVENT_PRE_PREPARE) return;
+  if (event == XACT_EVENT_COMMIT) {
+    Latch* worker_latch;
+    LWLockAcquire(KdeOptimizationQueueLock, LW_EXCLUSIVE);
+    for (i = 0; i < nr_of_pending_jobs; ++i) {
+      if (!enqueueJob(&(pending_jobs[i]))) {
+        fprintf(stderr, "KDE optimization queue is full, keeping the "
+                "rule-of-thumb bandwidth for table %i.\n",
+                pending_jobs[i].table);
+      }
+    }
+    worker_latch = optimization_queue->worker_latch;
+    LWLockRelease(KdeOptimizationQueueLock);
+    if (worker_latch) SetLatch(worker_latch);
+  }
+  free(pending_jobs);
+  pending_jobs = NULL;
+  nr_of_pending_jobs = 0;
+}
+
+bool ocl_scheduleModelOptimization(Oid table, int32 columns) {
+  static bool callback_registered = false;
+  char* database_name;
+  ocl_optimization_job_t* job;
+  if (!kde_optimization_worker || optimization_queue == NULL) return false;
+  if (!callback_registered) {
+    RegisterXactCallback(ocl_queuePendingJobs, NULL);
+    callback_registered = true;
+  }
+  // We cannot access the catalog after commit, so resolve the database name
+  // right away.
+  database_name = get_database_name(MyDatabaseId);
+  if (database_name == NULL) return false;
+  pending_jobs = realloc(
+      pending_jobs, sizeof(ocl_optimization_job_t) * (nr_of_pending_jobs + 1));
+  job = &(pending_jobs[nr_of_pending_jobs++]);
+  job->database = MyDatabaseId;
+  strlcpy(job->database_name, database_name, NAMEDATALEN);
+  job->table = table;
+  job->columns = columns;
+  job->feedback_window = kde_bandwidth_optimization_feedback_window;
+  job->error_metric = kde_error_metric;
+  job->bandwidth_representation = kde_bandwidth_representation;
+  pfree(database_name);
+  return true;
+}
+
+// Helper function to remove the next job for our database from the queue.
+// If we are not yet connected, any job qualifies. Sets other_databases if
+// there are jobs left that we cannot serve.
+static bool dequeueJob(ocl_optimization_job_t* job, bool* other_databases) {
+  unsigned int i;
+  bool found = false;
+  LWLockAcquire(KdeOptimizationQueueLock, LW_EXCLUSIVE);
+  for (i = 0; i < optimization_queue->nr_of_jobs; ++i) {
+    if (OidIsValid(MyDatabaseId) &&
+        optimization_queue->jobs[i].database != MyDatabaseId) continue;
+    *job = optimization_queue->jobs[i];
+    memmove(&(optimization_queue->jobs[i]), &(optimization_queue->jobs[i + 1]),
+            sizeof(ocl_optimization_job_t) *
+            (optimization_queue->nr_of_jobs - i - 1));
+    optimization_queue->nr_of_jobs--;
+    found = true;
+    break;
+  }
+  *other_databases = !found && optimization_queue->nr_of_jobs > 0;
+  LWLockRelease(KdeOptimizationQueueLock);
+  return found;
+}
+
+// Helper function to run a single job in its own transaction.
+static void runJob(const ocl_optimization_job_t* job) {
+  char activity[64];
+  if (job->bandwidth_representation != kde_bandwidth_representation) {
+    // The representation is baked into the compiled programs, so we cannot
+    // switch it for a single job.
+    fprintf(stderr, "Skipping KDE optimization for table %i: bandwidth "
+            "representation differs from the server setting.\n", job->table);
+    return;
+  }
+  snprintf(activity, sizeof(activity),
+           "optimizing KDE bandwidth of table %u", job->table);
+  SetCurrentStatementStartTimestamp();
+  StartTransactionCommand();
+  PushActiveSnapshot(GetTransactionSnapshot());
+  pgstat_report_activity(STATE_RUNNING, activity);
+  kde_error_metric = job->error_metric;
+  ocl_runScheduledModelOptimization(
+      job->table, job->columns, job->feedback_window);
+  PopActiveSnapshot();
+  // Committing publishes the new bandwidth to all backends.
+  CommitTransactionCommand();
+  pgstat_report_activity(STATE_IDLE, NULL);
+}
+
+static void ocl_optimizationWorkerSigterm(SIGNAL_ARGS) {
+  int save_errno = errno;
+  got_sigterm = true;
+  if (MyProc) SetLatch(&MyProc->procLatch);
+  errno = save_errno;
+}
+
+static void ocl_detachOptimizationWorker(int code, Datum arg) {
+  LWLockAcquire(KdeOptimizationQueueLock, LW_EXCLUSIVE);
+  if (optimization_queue->worker_latch == &MyProc->procLatch) {
+    optimization_queue->worker_latch = NULL;
+  }
+  LWLockRelease(KdeOptimizationQueueLock);
+}
+
+/*
+ * Main function of the optimization worker.
+ */
+static void ocl_optimizationWorkerMain(Datum main_arg) {
+  pqsignal(SIGTERM, ocl_optimizationWorkerSigterm);
+  BackgroundWorkerUnblockSignals();
+  // Announce ourselves, so backends can wake us up.
+  LWLockAcquire(KdeOptimizationQueueLock, LW_EXCLUSIVE);
+  optimization_queue->worker_latch = &MyProc->procLatch;
+  LWLockRelease(KdeOptimizationQueueLock);
+  on_shmem_exit(ocl_detachOptimizationWorker, 0);
+
+  while (!got_sigterm) {
+    ocl_optimization_job_t job;
+    bool other_databases;
+    int rc;
+    if (dequeueJob(&job, &other_databases)) {
+      if (!OidIsValid(MyDatabaseId)) {
+        BackgroundWorkerInitializeConnection(job.database_name, NULL);
+      }
+      runJob(&job);
+      continue;
+    }
+    if (other_databases) {
+      // We are bound to our database. Exit with code 0, so the postmaster
+      // restarts us right away to serve the remaining jobs.
+      proc_exit(0);
+    }
+    rc = WaitLatch(&MyProc->procLatch,
+                   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+                   10 * 1000L);
+    ResetLatch(&MyProc->procLatch);
+    if (rc & WL_POSTMASTER_DEATH) proc_exit(1);
+  }
+  proc_exit(0);
+}
+
+void ocl_registerOptimizationWorker(void) {
+  BackgroundWorker worker;
+  if (!kde_optimization_worker) return;
+  MemSet(&worker, 0, sizeof(BackgroundWorker));
+  snprintf(worker.bgw_name, BGW_MAXLEN, "kde bandwidth optimization");
+  worker.bgw_flags =
+      BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
+  worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+  worker.bgw_restart_time = 10;
+  worker.bgw_main = ocl_optimizationWorkerMain;
+  RegisterBackgroundWorker(&worker);
+}
+
+#endif /* USE_OPENCL */
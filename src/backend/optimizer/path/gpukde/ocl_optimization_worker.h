@@ -0,0 +1,44 @@
+/*
+ * ocl_optimization_worker.h
+ *
+ *  Background worker that runs the numerical bandwidth optimization outside
+ *  of ANALYZE. Model construction only initializes the bandwidth with Scott's
+ *  rule and schedules an optimization job. Once the constructing transaction
+ *  commits, the job is put into a shared-memory queue, from where the worker
+ *  picks it up, optimizes the bandwidth against the collected query feedback
+ *  and writes the result back to pg_kdemodels. The new bandwidth is then
+ *  published to all backends through the shared model registry.
+ *
+ *  Background workers are bound to a single database, so the worker restarts
+ *  itself whenever only jobs for other databases are left in the queue.
+ */
+
+#ifndef OCL_OPTIMIZATION_WORKER_H_
+#define OCL_OPTIMIZATION_WORKER_H_
+
+#include "postgres.h"
+
+#ifdef USE_OPENCL
+
+/*
+ * Maximum number of optimization jobs that can be queued.
+ */
+#define OCL_MAX_OPTIMIZATION_JOBS 64
+
+/*
+ * Schedules a bandwidth optimization for the model over the given columns of
+ * the given table. The job is handed over to the worker once the current
+ * transaction commits.
+ *
+ * Returns false if the worker is disabled, in which case the caller has to
+ * run the optimization itself.
+ */
+bool ocl_scheduleModelOptimization(Oid table, int32 columns);
+
+/*
+ * Registers the optimization worker with the postmaster (if enabled).
+ */
+void ocl_registerOptimizationWorker(void);
+
+#endif /* USE_OPENCL */
+#endif /* OCL_OPTIMIZATION_WORKER_H_ */
@@ -0,0 +1,169 @@
+/*
+ * ocl_progressive_estimator.c
+ */
+
+#include "ocl_progressive_estimator.h"
+
+#ifdef USE_OPENCL
+
+#include <math.h>
+#include <stdlib.h>
+
+#include "ocl_adaptive_bandwidth.h"
+
+extern ocl_kernel_type_t global_kernel_type;
+
+/*
+ * Quantile of the standard normal distribution for the two-sided 95%
+ * confidence interval of the estimate.
+ */
+#define CONFIDENCE_QUANTILE 1.96
+
+// GUC configuration variables.
+bool kde_enable_progressive_estimation = false;
+double kde_progressive_estimation_tolerance = 0.01;
+
+// Helper function to allocate the buffers of the progressive path.
+static ocl_progressive_estimator_t* getState(ocl_estimator_t* estimator) {
+  ocl_context_t* context;
+  cl_int err = CL_SUCCESS;
+  ocl_progressive_estimator_t* state;
+  if (estimator->progressive) return estimator->progressive;
+  context = ocl_getContext();
+  state = calloc(1, sizeof(ocl_progressive_estimator_t));
+  state->squares_buffer = ocl_createBuffer(
+      context->context, CL_MEM_READ_WRITE,
+      sizeof(kde_float_t) * estimator->rows_in_sample, NULL, &err);
+  Assert(err == CL_SUCCESS);
+  state->moments_buffer = ocl_createBuffer(
+      context->context, CL_MEM_READ_WRITE, sizeof(kde_float_t) * 2, NULL, &err);
+  Assert(err == CL_SUCCESS);
+  state->square_kernel = ocl_getKernel("square_contributions", 0);
+  err |= clSetKernelArg(
+      state->square_kernel, 0, sizeof(cl_mem),
+      &(estimator->local_results_buffer));
+  err |= clSetKernelArg(
+      state->square_kernel, 1, sizeof(cl_mem), &(state->squares_buffer));
+  Assert(err == CL_SUCCESS);
+  estimator->progressive = state;
+  return state;
+}
+
+/*
+ * Helper function to check whether the estimate from the first evaluated
+ * sample points is accurate enough. The sample points are drawn without
+ * replacement from the sample, so the standard error shrinks to zero once
+ * the full sample has been evaluated.
+ */
+static bool isAccurateEnough(
+    ocl_estimator_t* estimator, const kde_float_t* moments,
+    unsigned int evaluated, double normalization_factor) {
+  double mean, variance, standard_error, estimate, reference;
+  if (evaluated < 2) return false;
+  mean = moments[0] / evaluated;
+  variance = (moments[1] - evaluated * mean * mean) / (evaluated - 1);
+  // Guard against rounding errors for (almost) constant contributions.
+  variance = Max(variance, 0.0);
+  standard_error = sqrt(
+      variance / evaluated *
+      (1.0 - (double)evaluated / estimator->rows_in_sample));
+  estimate = mean * normalization_factor;
+  // Errors below a single row of the table do not matter to the planner.
+  reference = Max(estimate, 1.0 / Max(estimator->rows_in_table, 1));
+  return CONFIDENCE_QUANTILE * standard_error * normalization_factor <=
+      kde_progressive_estimation_tolerance * reference;
+}
+
+double ocl_progressiveRangeKDE(
+    ocl_estimator_t* estimator, const kde_float_t* query) {
+  unsigned int i;
+  ocl_context_t* context = ocl_getContext();
+  cl_int err = CL_SUCCESS;
+  ocl_progressive_estimator_t* state = getState(estimator);
+  // Collect everything the first kde kernel has to wait for.
+  cl_event events[2];
+  unsigned int nr_of_events = 0;
+  double normalization_factor;
+  kde_float_t moments[2];
+  unsigned int evaluated = 0;
+  size_t chunk_size = Min(
+      OCL_PROGRESSIVE_INITIAL_CHUNK, estimator->rows_in_sample);
+  err = clEnqueueWriteBuffer(
+      context->queue, estimator->input_buffer, CL_FALSE, 0,
+      2 * sizeof(kde_float_t) * estimator->nr_of_dimensions, query,
+      0, NULL, &(events[nr_of_events++]));
+  estimator->stats->estimation_transfer_to_device++;
+  Assert(err == CL_SUCCESS);
+  if (estimator->bandwidth_optimization->optimization_event) {
+    events[nr_of_events++] =
+        estimator->bandwidth_optimization->optimization_event;
+    estimator->bandwidth_optimization->optimization_event = NULL;
+  }
+  if (global_kernel_type == EPANECHNIKOV) {
+    normalization_factor = pow(0.75, estimator->nr_of_dimensions);
+  } else {
+    normalization_factor = pow(0.5, estimator->nr_of_dimensions);
+  }
+  // Evaluate the sample in chunks, every chunk doubles the prefix.
+  for (;;) {
+    size_t offset = evaluated;
+    cl_event kde_event;
+    cl_event square_event;
+    cl_event sum_events[2];
+    err = clEnqueueNDRangeKernel(
+        context->queue, estimator->kde_kernel, 1, &offset, &chunk_size, NULL,
+        nr_of_events, events, &kde_event);
+    Assert(err == CL_SUCCESS);
+    for (i = 0; i < nr_of_events; ++i) {
+      err = clReleaseEvent(events[i]);
+      Assert(err == CL_SUCCESS);
+    }
+    nr_of_events = 0;
+    err = clEnqueueNDRangeKernel(
+        context->queue, state->square_kernel, 1, &offset, &chunk_size, NULL,
+        1, &kde_event, &square_event);
+    Assert(err == CL_SUCCESS);
+    evaluated += chunk_size;
+    // Sum up the contributions and their squares for the whole prefix.
+    sum_events[0] = sumOfArray(
+        &(state->sum_descriptors[0]), estimator->local_results_buffer,
+        evaluated, state->moments_buffer, 0, kde_event);
+    sum_events[1] = sumOfArray(
+        &(state->sum_descriptors[1]), state->squares_buffer, evaluated,
+        state->moments_buffer, 1, square_event);
+    err |= clReleaseEvent(kde_event);
+    err |= clReleaseEvent(square_event);
+    err |= clEnqueueReadBuffer(
+        context->queue, state->moments_buffer, CL_TRUE, 0,
+        2 * sizeof(kde_float_t), moments, 2, sum_events, NULL);
+    estimator->stats->estimation_transfer_to_host++;
+    err |= clReleaseEvent(sum_events[0]);
+    err |= clReleaseEvent(sum_events[1]);
+    Assert(err == CL_SUCCESS);
+    if (evaluated == estimator->rows_in_sample) break;
+    if (isAccurateEnough(
+        estimator, moments, evaluated, normalization_factor)) break;
+    chunk_size = Min(evaluated, estimator->rows_in_sample - evaluated);
+  }
+  return moments[0] * normalization_factor / evaluated;
+}
+
+void ocl_releaseProgressiveEstimator(ocl_estimator_t* estimator) {
+  ocl_progressive_estimator_t* state = estimator->progressive;
+  cl_int err = CL_SUCCESS;
+  if (state == NULL) return;
+  err |= clReleaseMemObject(state->squares_buffer);
+  err |= clReleaseMemObject(state->moments_buffer);
+  err |= clReleaseKernel(state->square_kernel);
+  Assert(err == CL_SUCCESS);
+  if (state->sum_descriptors[0]) {
+    releaseAggregationDescriptor(state->sum_descriptors[0]);
+  }
+  if (state->sum_descriptors[1]) {
+    releaseAggregationDescriptor(state->sum_descriptors[1]);
+  }
+  free(state);
+  estimator->progressive = NULL;
+}
+
+#endif /* USE_OPENCL */
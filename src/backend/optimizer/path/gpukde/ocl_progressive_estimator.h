@@ -0,0 +1,49 @@
+/*
+ * ocl_progressive_estimator.h
+ *
+ *  Progressive estimation path for kde_enable_progressive_estimation. The
+ *  sample is stored in random order, so every prefix of the sample buffer is
+ *  a random subsample of the model. Instead of integrating the full sample,
+ *  the estimator evaluates a growing prefix (doubling its length in every
+ *  step) and keeps the sum and the sum of squares of the per-point
+ *  contributions. It stops as soon as the confidence interval of the
+ *  estimate is narrower than kde_progressive_estimation_tolerance relative to
+ *  the estimate.
+ */
+
+#ifndef OCL_PROGRESSIVE_ESTIMATOR_H_
+#define OCL_PROGRESSIVE_ESTIMATOR_H_
+
+#include "ocl_estimator.h"
+
+#ifdef USE_OPENCL
+
+/*
+ * Number of sample points that are evaluated in the first step.
+ */
+#define OCL_PROGRESSIVE_INITIAL_CHUNK 1024
+
+typedef struct ocl_progressive_estimator {
+  cl_mem squares_buffer;        // Squared contribution of each sample point.
+  cl_mem moments_buffer;        // Sum and sum of squares of the prefix.
+  cl_kernel square_kernel;
+  // Descriptors for summing up the contributions and their squares.
+  ocl_aggregation_descriptor_t* sum_descriptors[2];
+} ocl_progressive_estimator_t;
+
+/*
+ * Computes the selectivity estimate for the given (unnormalized) query bounds
+ * from a prefix of the sample. Other than the regular path, this only
+ * computes the per-point contributions of the evaluated prefix, so they
+ * can not be used for model maintenance.
+ */
+double ocl_progressiveRangeKDE(
+    ocl_estimator_t* estimator, const kde_float_t* query);
+
+/*
+ * Releases all buffers of the progressive estimation path.
+ */
+void ocl_releaseProgressiveEstimator(ocl_estimator_t* estimator);
+
+#endif /* USE_OPENCL */
+#endif /* OCL_PROGRESSIVE_ESTIMATOR_H_ */
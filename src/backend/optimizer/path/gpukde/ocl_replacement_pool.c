@@ -0,0 +1,163 @@
+/*
+ * ocl_replacement_pool.c
+ */
+
+#include "ocl_replacement_pool.h"
+
+#ifdef USE_OPENCL
+
+#include "ocl_utilities.h"
+#include "optimizer/path/gpukde/ocl_estimator_api.h"
+
+#include "access/htup_details.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+// GUC configuration variable.
+int kde_replacement_pool_size = 64;
+
+// Upper bound on the number of blocks that are visited per candidate in a
+// single refill batch.
+#define OCL_REPLACEMENT_POOL_MAX_BLOCKS_PER_ROW 16
+
+// Helper function to fetch (and allocate if necessary) the pool.
+static ocl_replacement_pool_t* getState(ocl_estimator_t* estimator) {
+  ocl_replacement_pool_t* pool = estimator->replacement_pool;
+  if (pool && pool->capacity == (unsigned int)kde_replacement_pool_size) {
+    return pool;
+  }
+  // The pool size has changed, start over.
+  ocl_releaseReplacementPool(estimator);
+  pool = calloc(1, sizeof(ocl_replacement_pool_t));
+  pool->capacity = kde_replacement_pool_size;
+  pool->items = malloc(ocl_sizeOfSampleItem(estimator) * pool->capacity);
+  pool->tids = malloc(sizeof(ItemPointerData) * pool->capacity);
+  pool->max_blocks = OCL_REPLACEMENT_POOL_MAX_BLOCKS_PER_ROW * pool->capacity;
+  pool->blocks = malloc(sizeof(BlockNumber) * pool->max_blocks);
+  pool->acceptance_rate = 1.0;
+  estimator->replacement_pool = pool;
+  return pool;
+}
+
+// Helper function to draw and prefetch the blocks of the next refill batch.
+// The number of blocks is chosen such that a single batch is expected to
+// fill the pool.
+static void prefetchBlocks(ocl_replacement_pool_t* pool, Relation rel) {
+  double nr_of_blocks = ceil(pool->capacity / pool->acceptance_rate);
+  if (nr_of_blocks > pool->max_blocks) nr_of_blocks = pool->max_blocks;
+  pool->nr_of_blocks = ocl_drawSampleBlocks(
+      rel, pool->blocks, (int) nr_of_blocks);
+  if (pool->nr_of_blocks == 0) {
+    elog(ERROR, "cannot draw replacement rows from an empty table");
+  }
+}
+
+// Helper function to fill an empty pool.
+static void refillPool(
+    ocl_estimator_t* estimator, ocl_replacement_pool_t* pool, Relation rel) {
+  unsigned int i;
+  unsigned int d = estimator->nr_of_dimensions;
+  unsigned int accepted_rows = 0;
+  unsigned int visited_blocks = 0;
+  kde_float_t* item;
+  Assert(pool->nr_of_candidates == 0);
+  while (accepted_rows < pool->capacity) {
+    HeapTuple* rows;
+    int nr_of_rows;
+    if (pool->nr_of_blocks == 0) prefetchBlocks(pool, rel);
+    rows = palloc(sizeof(HeapTuple) * pool->nr_of_blocks);
+    nr_of_rows = ocl_createSampleFromBlocks(
+        rel, pool->blocks, pool->nr_of_blocks, rows);
+    visited_blocks += pool->nr_of_blocks;
+    pool->nr_of_blocks = 0;
+    for (i = 0; i < nr_of_rows; ++i) {
+      // Keep a uniform subset of the accepted rows (reservoir sampling).
+      unsigned int slot = accepted_rows++;
+      if (slot >= pool->capacity) slot = random() % accepted_rows;
+      if (slot < pool->capacity) {
+        ocl_extractSampleTuple(estimator, rel, rows[i], &(pool->items[slot * d]));
+        pool->tids[slot] = rows[i]->t_self;
+      }
+      heap_freetuple(rows[i]);
+    }
+    pfree(rows);
+  }
+  pool->acceptance_rate = accepted_rows / (double) visited_blocks;
+  // The rows were read in block order, so shuffle them.
+  item = palloc(ocl_sizeOfSampleItem(estimator));
+  for (i = pool->capacity - 1; i > 0; --i) {
+    unsigned int j = random() % (i + 1);
+    ItemPointerData tid = pool->tids[i];
+    memcpy(item, &(pool->items[i * d]), sizeof(kde_float_t) * d);
+    memcpy(&(pool->items[i * d]), &(pool->items[j * d]), sizeof(kde_float_t) * d);
+    memcpy(&(pool->items[j * d]), item, sizeof(kde_float_t) * d);
+    pool->tids[i] = pool->tids[j];
+    pool->tids[j] = tid;
+  }
+  pfree(item);
+  pool->nr_of_candidates = pool->capacity;
+  if (ocl_isDebug()) {
+    fprintf(stderr, "\tRefilled the replacement pool: %i rows from %i blocks.\n",
+            accepted_rows, visited_blocks);
+  }
+}
+
+void ocl_drawReplacementRow(
+    ocl_estimator_t* estimator, Relation rel, kde_float_t* item,
+    ItemPointer tid) {
+  ocl_replacement_pool_t* pool;
+  unsigned int slot;
+  if (kde_replacement_pool_size <= 0) {
+    // Without a pool, draw a single random row.
+    HeapTuple sample_point;
+    double total_rows;
+    ocl_releaseReplacementPool(estimator);
+    ocl_createSample(rel, &sample_point, &total_rows, 1);
+    ocl_extractSampleTuple(estimator, rel, sample_point, item);
+    *tid = sample_point->t_self;
+    heap_freetuple(sample_point);
+    return;
+  }
+  pool = getState(estimator);
+  if (pool->nr_of_candidates == 0) refillPool(estimator, pool, rel);
+  slot = --(pool->nr_of_candidates);
+  memcpy(item, &(pool->items[slot * estimator->nr_of_dimensions]),
+         ocl_sizeOfSampleItem(estimator));
+  *tid = pool->tids[slot];
+  // Once half of the pool is used up, issue the reads of the next refill.
+  if (pool->nr_of_candidates <= pool->capacity / 2 && pool->nr_of_blocks == 0) {
+    prefetchBlocks(pool, rel);
+  }
+}
+
+void ocl_dropReplacementRow(ocl_estimator_t* estimator, ItemPointer tid) {
+  unsigned int i = 0;
+  ocl_replacement_pool_t* pool = estimator->replacement_pool;
+  if (pool == NULL) return;
+  while (i < pool->nr_of_candidates) {
+    unsigned int last;
+    if (!ItemPointerEquals(&(pool->tids[i]), tid)) {
+      ++i;
+      continue;
+    }
+    // The candidates are in random order, so fill the gap with the last one.
+    last = --(pool->nr_of_candidates);
+    memcpy(&(pool->items[i * estimator->nr_of_dimensions]),
+           &(pool->items[last * estimator->nr_of_dimensions]),
+           ocl_sizeOfSampleItem(estimator));
+    pool->tids[i] = pool->tids[last];
+  }
+}
+
+void ocl_releaseReplacementPool(ocl_estimator_t* estimator) {
+  ocl_replacement_pool_t* pool = estimator->replacement_pool;
+  if (pool == NULL) return;
+  free(pool->items);
+  free(pool->tids);
+  free(pool->blocks);
+  free(pool);
+  estimator->replacement_pool = NULL;
+}
+
+#endif /* USE_OPENCL */
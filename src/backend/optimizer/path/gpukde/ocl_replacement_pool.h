@@ -0,0 +1,59 @@
+/*
+ * ocl_replacement_pool.h
+ *
+ *  Pool of pre-drawn replacement rows for sample maintenance. Replacing a
+ *  sample point (CAR deletions, TKR, PKR and PRR) needs a uniformly random
+ *  row of the table, which costs at least one random block read. Instead of
+ *  drawing the rows one at a time, every model keeps up to
+ *  kde_replacement_pool_size extracted rows around. The pool is refilled in
+ *  batches: the random blocks are drawn, sorted and prefetched as soon as
+ *  half of the pool is used up, and read in file order once the pool runs
+ *  empty. Since all rows of a batch are independent draws, the pool is
+ *  shuffled after every refill, so the order of the reads does not bias
+ *  the replacements.
+ *
+ *  Candidates whose row is deleted are dropped from the pool.
+ */
+
+#ifndef OCL_REPLACEMENT_POOL_H_
+#define OCL_REPLACEMENT_POOL_H_
+
+#include "ocl_estimator.h"
+
+#ifdef USE_OPENCL
+
+#include "storage/itemptr.h"
+#include "utils/rel.h"
+
+typedef struct ocl_replacement_pool {
+  kde_float_t* items;             // Extracted candidates (item-major).
+  ItemPointerData* tids;          // Source rows of the candidates.
+  unsigned int capacity;
+  unsigned int nr_of_candidates;
+  // Sorted and prefetched blocks for the next refill.
+  BlockNumber* blocks;
+  unsigned int nr_of_blocks;
+  unsigned int max_blocks;
+  double acceptance_rate;         // Fraction of visited blocks yielding a row.
+} ocl_replacement_pool_t;
+
+/*
+ * Fetches a uniformly random row of the table to replace a sample point. The
+ * extracted row is written to item and its TID to tid.
+ */
+void ocl_drawReplacementRow(
+    ocl_estimator_t* estimator, Relation rel, kde_float_t* item,
+    ItemPointer tid);
+
+/*
+ * Removes the given row from the replacement pool of the estimator.
+ */
+void ocl_dropReplacementRow(ocl_estimator_t* estimator, ItemPointer tid);
+
+/*
+ * Releases the replacement pool of the estimator.
+ */
+void ocl_releaseReplacementPool(ocl_estimator_t* estimator);
+
+#endif /* USE_OPENCL */
+#endif /* OCL_REPLACEMENT_POOL_H_ */
@@ -0,0 +1,231 @@
+/*
+ * ocl_sample_file.c
+ */
+
+#include "ocl_sample_file.h"
+
+#ifdef USE_OPENCL
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "storage/fd.h"
+
+// Helper function to round a file offset up to the next page boundary.
+static uint64 alignOffset(uint64 offset) {
+  return ((offset + OCL_SAMPLE_FILE_ALIGNMENT - 1) / OCL_SAMPLE_FILE_ALIGNMENT)
+      * OCL_SAMPLE_FILE_ALIGNMENT;
+}
+
+// Helper function to compute the checksum over the header and all sections.
+static pg_crc32 computeChecksum(
+    const ocl_sample_file_header_t* header, const kde_float_t* sample,
+    const kde_float_t* karma, const ItemPointerData* tids,
+    const kde_float_t* weights) {
+  ocl_sample_file_header_t tmp = *header;
+  pg_crc32 crc;
+  tmp.checksum = 0;
+  INIT_CRC32(crc);
+  COMP_CRC32(crc, &tmp, sizeof(ocl_sample_file_header_t));
+  COMP_CRC32(crc, sample, sizeof(kde_float_t) * header->nr_of_dimensions *
+             header->rows_in_sample);
+  COMP_CRC32(crc, karma, sizeof(kde_float_t) * header->rows_in_sample);
+  COMP_CRC32(crc, tids, sizeof(ItemPointerData) * header->rows_in_sample);
+  if (weights) {
+    COMP_CRC32(crc, weights, sizeof(kde_float_t) * header->rows_in_sample);
+  }
+  FIN_CRC32(crc);
+  return crc;
+}
+
+// Helper function to write a section followed by zero padding up to the
+// given offset.
+static bool writeSection(
+    FILE* f, const void* data, size_t size, uint64 end_offset) {
+  static const char padding[OCL_SAMPLE_FILE_ALIGNMENT];
+  size_t padding_size;
+  if (size > 0 && fwrite(data, size, 1, f) != 1) return false;
+  padding_size = end_offset - ftell(f);
+  if (padding_size > 0 && fwrite(padding, padding_size, 1, f) != 1) {
+    return false;
+  }
+  return true;
+}
+
+// Helper function to make the rename of a sample file durable by syncing its
+// directory.
+static void syncDirectory(const char* file_name) {
+  char directory[1100];
+  char* separator;
+  int fd;
+  strlcpy(directory, file_name, sizeof(directory));
+  separator = strrchr(directory, '/');
+  if (separator == NULL) return;
+  *separator = '\0';
+  fd = open(directory, O_RDONLY);
+  if (fd < 0) return;
+  if (pg_fsync(fd) != 0) {
+    fprintf(stderr, "Error syncing sample directory %s\n", directory);
+  }
+  close(fd);
+}
+
+bool ocl_writeSampleFile(
+    ocl_estimator_t* estimator, const char* file_name,
+    const kde_float_t* sample, const kde_float_t* karma,
+    const ItemPointerData* tids, const kde_float_t* weights,
+    const kde_float_t* bandwidth) {
+  unsigned int i;
+  ocl_sample_file_header_t header;
+  size_t sample_size = ocl_sizeOfSampleItem(estimator) *
+      estimator->rows_in_sample;
+  size_t karma_size = sizeof(kde_float_t) * estimator->rows_in_sample;
+  size_t tids_size = sizeof(ItemPointerData) * estimator->rows_in_sample;
+  char tmp_file_name[1100];
+  FILE* f;
+  bool success;
+  memset(&header, 0, sizeof(header));
+  header.magic = OCL_SAMPLE_FILE_MAGIC;
+  header.format_version = OCL_SAMPLE_FILE_VERSION;
+  header.float_width = sizeof(kde_float_t);
+  header.nr_of_dimensions = estimator->nr_of_dimensions;
+  header.rows_in_sample = estimator->rows_in_sample;
+  header.rows_in_table = estimator->rows_in_table;
+  header.model_version = estimator->model_version;
+  header.represented_rows = estimator->represented_rows;
+  for (i = 0; i < estimator->nr_of_dimensions; ++i) {
+    header.mean[i] = estimator->mean_host_buffer[i];
+    header.sdev[i] = estimator->sdev_host_buffer[i];
+    header.bandwidth[i] = bandwidth[i];
+  }
+  header.sample_offset = alignOffset(sizeof(ocl_sample_file_header_t));
+  header.karma_offset = alignOffset(header.sample_offset + sample_size);
+  header.tids_offset = alignOffset(header.karma_offset + karma_size);
+  header.file_size = alignOffset(header.tids_offset + tids_size);
+  if (weights) {
+    // Weights have the same size as the karma.
+    header.weights_offset = header.file_size;
+    header.file_size = alignOffset(header.weights_offset + karma_size);
+  }
+  header.checksum = computeChecksum(&header, sample, karma, tids, weights);
+
+  // Write to a temporary file first and rename it into place, so concurrent
+  // backends never map a partially written sample.
+  snprintf(tmp_file_name, sizeof(tmp_file_name), "%s.%i.tmp",
+           file_name, (int)getpid());
+  f = fopen(tmp_file_name, "wb");
+  if (f == NULL) {
+    fprintf(stderr, "Error opening sample file %s\n", tmp_file_name);
+    return false;
+  }
+  success = writeSection(
+      f, &header, sizeof(header), header.sample_offset);
+  success &= writeSection(f, sample, sample_size, header.karma_offset);
+  success &= writeSection(f, karma, karma_size, header.tids_offset);
+  success &= writeSection(
+      f, tids, tids_size,
+      weights ? header.weights_offset : header.file_size);
+  if (weights) {
+    success &= writeSection(f, weights, karma_size, header.file_size);
+  }
+  success &= fflush(f) == 0;
+  success &= pg_fsync(fileno(f)) == 0;
+  success &= fclose(f) == 0;
+  if (success) success = rename(tmp_file_name, file_name) == 0;
+  if (!success) {
+    fprintf(stderr, "Error writing sample file %s\n", file_name);
+    unlink(tmp_file_name);
+    return false;
+  }
+  syncDirectory(file_name);
+  return true;
+}
+
+bool ocl_mapSampleFile(const char* file_name, ocl_sample_file_t* file) {
+  int fd;
+  struct stat file_stat;
+  void* mapping;
+  const ocl_sample_file_header_t* header;
+  bool valid;
+  kde_float_t *sample, *karma, *weights = NULL;
+  ItemPointerData* tids;
+  memset(file, 0, sizeof(ocl_sample_file_t));
+  fd = open(file_name, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Error opening sample file %s\n", file_name);
+    return false;
+  }
+  if (fstat(fd, &file_stat) != 0 ||
+      (size_t)file_stat.st_size < sizeof(ocl_sample_file_header_t)) {
+    fprintf(stderr, "Error reading sample file %s\n", file_name);
+    close(fd);
+    return false;
+  }
+  // We map the file privately, so the device may update the sample in place
+  // without changing the file.
+  mapping = mmap(NULL, file_stat.st_size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    fprintf(stderr, "Error mapping sample file %s\n", file_name);
+    return false;
+  }
+  header = mapping;
+  // Check that the file matches our format and is complete.
+  valid = header->magic == OCL_SAMPLE_FILE_MAGIC &&
+      header->format_version == OCL_SAMPLE_FILE_VERSION &&
+      header->float_width == sizeof(kde_float_t) &&
+      header->nr_of_dimensions <= OCL_SAMPLE_FILE_MAX_DIMENSIONS &&
+      header->file_size == (uint64)file_stat.st_size &&
+      header->sample_offset % OCL_SAMPLE_FILE_ALIGNMENT == 0 &&
+      header->karma_offset % OCL_SAMPLE_FILE_ALIGNMENT == 0 &&
+      header->sample_offset + sizeof(kde_float_t) *
+          header->nr_of_dimensions * header->rows_in_sample
+          <= header->karma_offset &&
+      header->tids_offset % OCL_SAMPLE_FILE_ALIGNMENT == 0 &&
+      header->karma_offset + sizeof(kde_float_t) * header->rows_in_sample
+          <= header->tids_offset &&
+      header->tids_offset + sizeof(ItemPointerData) * header->rows_in_sample
+          <= header->file_size &&
+      header->weights_offset % OCL_SAMPLE_FILE_ALIGNMENT == 0 &&
+      (header->weights_offset == 0 ||
+       (header->weights_offset >= header->tids_offset +
+            sizeof(ItemPointerData) * header->rows_in_sample &&
+        header->weights_offset + sizeof(kde_float_t) * header->rows_in_sample
+            <= header->file_size));
+  if (!valid) {
+    fprintf(stderr, "Sample file %s has an unknown format, please re-run "
+            "ANALYZE to rebuild the model.\n", file_name);
+    munmap(mapping, file_stat.st_size);
+    return false;
+  }
+  sample = (kde_float_t*)((char*)mapping + header->sample_offset);
+  karma = (kde_float_t*)((char*)mapping + header->karma_offset);
+  tids = (ItemPointerData*)((char*)mapping + header->tids_offset);
+  if (header->weights_offset) {
+    weights = (kde_float_t*)((char*)mapping + header->weights_offset);
+  }
+  if (computeChecksum(header, sample, karma, tids, weights) !=
+      header->checksum) {
+    fprintf(stderr, "Checksum mismatch in sample file %s\n", file_name);
+    munmap(mapping, file_stat.st_size);
+    return false;
+  }
+  file->mapping = mapping;
+  file->mapping_size = file_stat.st_size;
+  file->header = header;
+  file->sample = sample;
+  file->karma = karma;
+  file->tids = tids;
+  file->weights = weights;
+  return true;
+}
+
+void ocl_unmapSampleFile(void* mapping, size_t mapping_size) {
+  if (mapping == NULL) return;
+  munmap(mapping, mapping_size);
+}
+
+#endif /* USE_OPENCL */
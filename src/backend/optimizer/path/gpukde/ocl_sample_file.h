@@ -0,0 +1,99 @@
+/*
+ * ocl_sample_file.h
+ *
+ *  On-disk format for the samples of KDE models in $PGDATA/pg_kde_samples.
+ *
+ *  A sample file consists of a fixed header page followed by the sample, the
+ *  sample karma, the source rows of the sample points (see ocl_sample_tids.h)
+ *  and, for compacted models (see ocl_coreset.h), the weights of the sample
+ *  points. Every section starts on a page boundary, so the file can
+ *  be mapped into memory and the sample section can be handed to OpenCL as
+ *  host memory without copying. The sample is stored normalized, in the same
+ *  item-major layout that is used on the device.
+ *
+ *  The header stores the format version, the width of the stored floats, the
+ *  model parameters (mean, standard deviation and bandwidth) and a CRC over
+ *  the whole file, so we never load a truncated or outdated file.
+ */
+
+#ifndef OCL_SAMPLE_FILE_H_
+#define OCL_SAMPLE_FILE_H_
+
+#include "ocl_estimator.h"
+
+#ifdef USE_OPENCL
+
+#include "storage/itemptr.h"
+#include "utils/pg_crc.h"
+
+#define OCL_SAMPLE_FILE_MAGIC 0x4b444553 // "KDES"
+#define OCL_SAMPLE_FILE_VERSION 3
+#define OCL_SAMPLE_FILE_ALIGNMENT 4096
+
+/*
+ * Models use at most 32 columns (see ocl_estimator_t.columns).
+ */
+#define OCL_SAMPLE_FILE_MAX_DIMENSIONS 32
+
+typedef struct ocl_sample_file_header {
+  uint32 magic;
+  uint32 format_version;
+  uint32 float_width;           // sizeof(kde_float_t) of the writer.
+  uint32 nr_of_dimensions;
+  uint32 rows_in_sample;
+  uint32 rows_in_table;
+  uint64 model_version;         // Version the model was derived from.
+  uint64 sample_offset;         // Offsets of the page-aligned sections.
+  uint64 karma_offset;
+  uint64 tids_offset;
+  uint64 weights_offset;        // Zero if the sample is unweighted.
+  uint64 file_size;
+  uint32 represented_rows;      // Rows summarized by a weighted sample.
+  double mean[OCL_SAMPLE_FILE_MAX_DIMENSIONS];
+  double sdev[OCL_SAMPLE_FILE_MAX_DIMENSIONS];
+  double bandwidth[OCL_SAMPLE_FILE_MAX_DIMENSIONS];
+  pg_crc32 checksum;            // CRC of the file with this field zeroed.
+} ocl_sample_file_header_t;
+
+/*
+ * A sample file that is mapped into memory. The mapping is private, so
+ * writes to the sample (e.g. by sample maintenance) never reach the file.
+ */
+typedef struct ocl_sample_file {
+  void* mapping;
+  size_t mapping_size;
+  const ocl_sample_file_header_t* header;
+  kde_float_t* sample;          // Page-aligned, normalized sample.
+  kde_float_t* karma;           // Page-aligned sample karma.
+  ItemPointerData* tids;        // Page-aligned source rows.
+  kde_float_t* weights;         // Page-aligned weights, NULL if unweighted.
+} ocl_sample_file_t;
+
+/*
+ * Writes the given (normalized) sample, karma, source rows and weights (NULL
+ * for an unweighted sample) of the estimator to a new sample file. The file
+ * is written to a temporary location and renamed into place, so concurrent
+ * readers either see the old or the new file.
+ *
+ * Returns false if the file could not be written.
+ */
+bool ocl_writeSampleFile(
+    ocl_estimator_t* estimator, const char* file_name,
+    const kde_float_t* sample, const kde_float_t* karma,
+    const ItemPointerData* tids, const kde_float_t* weights,
+    const kde_float_t* bandwidth);
+
+/*
+ * Maps the given sample file into memory and validates its header and
+ * checksum. Returns false if the file is missing, was written in a different
+ * format or is corrupted.
+ */
+bool ocl_mapSampleFile(const char* file_name, ocl_sample_file_t* file);
+
+/*
+ * Releases the mapping of a sample file.
+ */
+void ocl_unmapSampleFile(void* mapping, size_t mapping_size);
+
+#endif /* USE_OPENCL */
+#endif /* OCL_SAMPLE_FILE_H_ */
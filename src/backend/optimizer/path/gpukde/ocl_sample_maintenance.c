@@ -15,6 +15,8 @@
 #include "commands/vacuum.h"
 #include "access/heapam.h"
 #include "ocl_sample_maintenance.h"
+#include "ocl_replacement_pool.h"
+#include "ocl_sample_tids.h"
 
 #include "storage/bufpage.h"
 #include "storage/procarray.h"
@@ -41,56 +43,6 @@ double kde_sample_maintenance_karma_limit;
 int kde_sample_maintenance_period;
 int kde_sample_maintenance_option;
 
-static void ocl_prepareDeletionDescriptor(ocl_estimator_t* estimator, ocl_sample_optimization_t* sample_optimization){  
-  ocl_deletion_descriptor_t * desc = calloc(1, sizeof(ocl_deletion_descriptor_t));
-  ocl_context_t* ctxt = ocl_getContext();
-  
-  int err = 0;
-  size_t global_size = estimator->rows_in_sample;
-  
-  desc->deletion_kernel = ocl_getKernel(
-    "get_point_deletion_bitmap", estimator->nr_of_dimensions);
-  
-  size_t max_size;
-  err |= clGetKernelWorkGroupInfo(
-        desc->deletion_kernel, ctxt->device, CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE,
-        sizeof(size_t), &(desc->local_size), NULL);
-  Assert(err == CL_SUCCESS);
-  err |= clGetKernelWorkGroupInfo(
-        desc->deletion_kernel, ctxt->device, CL_KERNEL_WORK_GROUP_SIZE,
-        sizeof(size_t), &(max_size), NULL);
-  Assert(err == CL_SUCCESS);
-
-  //Workgroup size has to be at least and a multiple of 8
-  if(global_size % desc->local_size != 0 || desc->local_size < 8){
-	desc->local_size = 8;
-  }
-
-  err |= clSetKernelArg(
-    desc->deletion_kernel, 0, sizeof(cl_mem), &(estimator->sample_buffer));
-  err |= clSetKernelArg(
-    desc->deletion_kernel, 1, sizeof(cl_mem), &(sample_optimization->deleted_point));
-  err |= clSetKernelArg(
-    desc->deletion_kernel, 2, sizeof(kde_float_t)*estimator->nr_of_dimensions, NULL);
-  err |= clSetKernelArg(
-    desc->deletion_kernel, 3, sizeof(unsigned int)*desc->local_size, NULL);  
-  err |= clSetKernelArg(
-    desc->deletion_kernel, 4, sizeof(cl_mem), &(sample_optimization->sample_hitmap));   
-  
-  Assert(err == CL_SUCCESS);
-
-  sample_optimization->del_desc = desc;
-}
-
-static void ocl_releaseDeletionDescriptor(ocl_deletion_descriptor_t* del_desc){
-  cl_int err = 0;  
-  
-  err = clReleaseKernel(del_desc->deletion_kernel);
-  Assert(err == CL_SUCCESS);
-  
-  free(del_desc);
-}
-
 static void ocl_prepareTkrDescriptor(ocl_estimator_t* estimator, ocl_sample_optimization_t* sample_optimization){  
   ocl_tkr_descriptor_t * desc = calloc(1, sizeof(ocl_tkr_descriptor_t));
   ocl_context_t* ctxt = ocl_getContext();
@@ -158,36 +110,31 @@ void ocl_allocateSampleMaintenanceBuffers(ocl_estimator_t* estimator) {
   ocl_sample_optimization_t* descriptor = calloc(
       1, sizeof(ocl_sample_optimization_t));
   // Allocate two new buffers that we use for storing sample information.
-  descriptor->sample_karma_buffer = clCreateBuffer(
+  descriptor->sample_karma_buffer = ocl_createBuffer(
       context->context, CL_MEM_READ_WRITE,
       sizeof(kde_float_t) * estimator->rows_in_sample, NULL, &err);
   Assert(err == CL_SUCCESS);  
   
-  descriptor->sample_hitmap = clCreateBuffer(
+  descriptor->sample_hitmap = ocl_createBuffer(
       context->context, CL_MEM_READ_WRITE,
       sizeof(unsigned char) * (estimator->rows_in_sample/8), NULL, &err);
   Assert(err == CL_SUCCESS);  
   
-  descriptor->deleted_point = clCreateBuffer(
-      context->context, CL_MEM_READ_WRITE,
-      sizeof(kde_float_t) * estimator->nr_of_dimensions, NULL, &err);
-  Assert(err == CL_SUCCESS);
-
     // Allocate device memory for indices and values.
-  descriptor->min_idx = clCreateBuffer(
+  descriptor->min_idx = ocl_createBuffer(
           context->context, CL_MEM_READ_WRITE,
           sizeof(unsigned int), NULL, &err);
   Assert(err == CL_SUCCESS);
   
-  descriptor->min_val = clCreateBuffer(
+  descriptor->min_val = ocl_createBuffer(
           context->context, CL_MEM_READ_WRITE,
           sizeof(kde_float_t), NULL, &err);
   Assert(err == CL_SUCCESS);
   
-  if(kde_sample_maintenance_option == CAR){
-    ocl_prepareDeletionDescriptor(estimator, descriptor);
-  }
-  else if(kde_sample_maintenance_option == TKR) {
+  descriptor->quality_kernel = ocl_getKernel(
+      "update_sample_quality_metrics", estimator->nr_of_dimensions);
+
+  if(kde_sample_maintenance_option == TKR) {
     ocl_prepareTkrDescriptor(estimator, descriptor);
   }
   
@@ -207,10 +154,6 @@ void ocl_releaseSampleMaintenanceBuffers(ocl_estimator_t* estimator) {
       err = clReleaseMemObject(descriptor->sample_hitmap);
       Assert(err == CL_SUCCESS);
     }
-    if (descriptor->deleted_point) {
-      err = clReleaseMemObject(descriptor->deleted_point);
-      Assert(err == CL_SUCCESS);
-    }
     if (descriptor->min_idx) {
       err = clReleaseMemObject(descriptor->min_idx);
       Assert(err == CL_SUCCESS);
@@ -219,8 +162,9 @@ void ocl_releaseSampleMaintenanceBuffers(ocl_estimator_t* estimator) {
       err = clReleaseMemObject(descriptor->min_val);
       Assert(err == CL_SUCCESS);
     }    
-    if(descriptor->del_desc){ 
-      ocl_releaseDeletionDescriptor(descriptor->del_desc);
+    if (descriptor->quality_kernel) {
+      err = clReleaseKernel(descriptor->quality_kernel);
+      Assert(err == CL_SUCCESS);
     }
     if(descriptor->tkr_desc){ 
       ocl_releaseTkrDescriptor(descriptor->tkr_desc);
@@ -245,9 +189,9 @@ static int getMinPenaltyIndex(
   err = clWaitForEvents(1,&event);
   Assert(err == CL_SUCCESS);
   gettimeofday(&tvBegin,NULL);
-  err |= clEnqueueReadBuffer(
+  TIME_TRANSFER(err |= clEnqueueReadBuffer(
       ctxt->queue, estimator->sample_optimization->min_idx, CL_TRUE, 0, sizeof(unsigned int),
-      &index, 1, &event, NULL);
+      &index, 1, &event, NULL));
   gettimeofday(&tvEnd,NULL);
   estimator->stats->maintenance_transfer_time += (tvEnd.tv_sec - tvBegin.tv_sec) * 1000 * 1000;
   estimator->stats->maintenance_transfer_time += (tvEnd.tv_usec - tvBegin.tv_usec);
@@ -271,11 +215,11 @@ static unsigned int *getMinPenaltyIndexBelowThreshold(
   kde_float_t val;
   
   //Allocate device memory for indices and values.
-  cl_mem min_idx = clCreateBuffer(
+  cl_mem min_idx = ocl_createBuffer(
           ctxt->context, CL_MEM_READ_WRITE,
           sizeof(unsigned int), NULL, &err);
   Assert(err == CL_SUCCESS);
-  cl_mem min_val = clCreateBuffer(
+  cl_mem min_val = ocl_createBuffer(
           ctxt->context, CL_MEM_READ_WRITE,
           sizeof(kde_float_t), NULL, &err);
   Assert(err == CL_SUCCESS);
@@ -349,8 +293,7 @@ static void trigger_periodic_random_replacement(ocl_estimator_t* estimator){
       (estimator->stats->nr_of_estimations % kde_sample_maintenance_period) == 0 ){
     kde_float_t* item;
 
-    HeapTuple sample_point;
-    double total_rows;
+    ItemPointerData sample_tid;
   
     struct timeval tvBegin, tvEnd;
     
@@ -364,156 +307,293 @@ static void trigger_periodic_random_replacement(ocl_estimator_t* estimator){
         return;
       }*/
       item = palloc(ocl_sizeOfSampleItem(estimator));
-      ocl_createSample(onerel,&sample_point,&total_rows,1);
-      ocl_extractSampleTuple(estimator, onerel, sample_point,item);
+      ocl_drawReplacementRow(estimator, onerel, item, &sample_tid);
       gettimeofday(&tvBegin,NULL);
       ocl_pushEntryToSampleBufer(estimator, insert_position, item);
       gettimeofday(&tvEnd,NULL);
       estimator->stats->maintenance_transfer_time += (tvEnd.tv_sec - tvBegin.tv_sec) * 1000 * 1000;
       estimator->stats->maintenance_transfer_time += (tvEnd.tv_usec - tvBegin.tv_usec);
       estimator->stats->maintenance_transfer_to_device++;
+      ocl_setSampleTid(estimator, insert_position, &sample_tid);
       
       
-      heap_freetuple(sample_point);
       pfree(item);
       relation_close(onerel, ShareUpdateExclusiveLock);
     }
   }
 }
 
-void ocl_notifySampleMaintenanceOfInsertion(Relation rel, HeapTuple new_tuple) {
-  // Check whether we have a table for this relation.
-  ocl_estimator_t* estimator = ocl_getEstimator(rel->rd_id);
-  if (estimator == NULL) return;
+/*
+ * Buffer that collects the sample changes of a single statement, so they can
+ * be applied to the device sample in one go. Tables with several models get
+ * one buffer per model, chained via next.
+ */
+typedef struct ocl_sample_change_buffer {
+  Oid table;                      // Table of the estimator.
+  int32 columns;                  // Column set of the estimator.
+  struct ocl_sample_change_buffer* next;
+  unsigned int nr_of_dimensions;  // Dimensionality of the estimator.
+  unsigned int rows_in_sample;    // Sample size of the estimator.
+  // Pending writes to the sample, at most one per sample position.
+  int* write_slot;                // Maps sample positions to pending writes.
+  unsigned int* write_positions;
+  kde_float_t* write_items;
+  ItemPointerData* write_tids;    // Source rows of the written items.
+  unsigned int nr_of_writes;
+  // Sample positions whose source row has been deleted.
+  bool* deleted;
+  unsigned int nr_of_deletions;
+} ocl_sample_change_buffer_t;
+
+// Helper function to fetch (and allocate if necessary) the change buffer.
+static ocl_sample_change_buffer_t* getChangeBuffer(
+    ocl_estimator_t* estimator, void** changes) {
+  unsigned int i;
+  ocl_sample_change_buffer_t* buffer = *changes;
+  for (; buffer; buffer = buffer->next) {
+    if (buffer->columns == estimator->columns) return buffer;
+  }
+  buffer = palloc0(sizeof(ocl_sample_change_buffer_t));
+  buffer->table = estimator->table;
+  buffer->columns = estimator->columns;
+  buffer->next = *changes;
+  buffer->nr_of_dimensions = estimator->nr_of_dimensions;
+  buffer->rows_in_sample = estimator->rows_in_sample;
+  buffer->write_slot = palloc(sizeof(int) * estimator->rows_in_sample);
+  for (i = 0; i < estimator->rows_in_sample; ++i) buffer->write_slot[i] = -1;
+  buffer->write_positions = palloc(
+      sizeof(unsigned int) * estimator->rows_in_sample);
+  buffer->write_items = palloc(
+      ocl_sizeOfSampleItem(estimator) * estimator->rows_in_sample);
+  buffer->write_tids = palloc(
+      sizeof(ItemPointerData) * estimator->rows_in_sample);
+  buffer->deleted = palloc0(sizeof(bool) * estimator->rows_in_sample);
+  *changes = buffer;
+  return buffer;
+}
+
+// Helper function to release a change buffer.
+static void releaseChangeBuffer(ocl_sample_change_buffer_t* buffer) {
+  pfree(buffer->write_slot);
+  pfree(buffer->write_positions);
+  pfree(buffer->write_items);
+  pfree(buffer->write_tids);
+  pfree(buffer->deleted);
+  pfree(buffer);
+}
 
+// Helper function to schedule a write of the given item to the sample. Later
+// writes to the same position replace earlier ones.
+static void stageSampleWrite(
+    ocl_sample_change_buffer_t* buffer, unsigned int position,
+    const kde_float_t* item, ItemPointer tid) {
+  int slot = buffer->write_slot[position];
+  if (slot < 0) {
+    slot = buffer->nr_of_writes++;
+    buffer->write_slot[position] = slot;
+    buffer->write_positions[slot] = position;
+  }
+  memcpy(&(buffer->write_items[slot * buffer->nr_of_dimensions]), item,
+         sizeof(kde_float_t) * buffer->nr_of_dimensions);
+  buffer->write_tids[slot] = *tid;
+}
+
+// Helper function to remember a sample position whose row was deleted.
+static void stageSampleDeletion(
+    ocl_sample_change_buffer_t* buffer, unsigned int position) {
+  if (buffer->deleted[position]) return;
+  buffer->deleted[position] = true;
+  buffer->nr_of_deletions++;
+}
+
+// Helper function to stage the changes of an insertion for a single model.
+static void notifyModelOfInsertion(
+    ocl_estimator_t* estimator, Relation rel, HeapTuple new_tuple,
+    void** changes) {
   estimator->rows_in_table++;
+  ocl_markEstimatorDirty(estimator);
   estimator->stats->nr_of_insertions++;
   
   if (kde_sample_maintenance_option != CAR) return;
-  struct timeval tvBegin, tvEnd;
 
-  // First, check whether we still have size in the sample.
-  if (kde_sample_maintenance_option == CAR) {
-    // The sample is full, use CAR.
-    int replacements = getBinomial(estimator->rows_in_sample, 1.0 / estimator->rows_in_table);
-    if (replacements > 0) {
-      size_t map_size = sizeof(unsigned char)*((estimator->rows_in_sample+8-1)/8);
-      kde_float_t* item = palloc(ocl_sizeOfSampleItem(estimator));
-      unsigned char* index_map = (unsigned char*) palloc0(map_size);
-      
-      ocl_extractSampleTuple(estimator, rel, new_tuple, item);
-     
-      index_map = floydSampling(index_map,estimator->rows_in_sample, replacements);
-      int i = 0;
-      for (; i < map_size; i++) {
-	int j = 0;
-	while(index_map[i]){
-	  if(index_map[i] & 1){
-	    gettimeofday(&tvBegin,NULL);
-	    ocl_pushEntryToSampleBufer(estimator, i * 8 + j, item);
-	    gettimeofday(&tvEnd,NULL);
-	    estimator->stats->maintenance_transfer_time += (tvEnd.tv_sec - tvBegin.tv_sec) * 1000 * 1000;
-	    estimator->stats->maintenance_transfer_time += (tvEnd.tv_usec - tvBegin.tv_usec);
-	    estimator->stats->maintenance_transfer_to_device++;
-	  }
-	  index_map[i] = index_map[i] >> 1;
-	  j++;
-	}
+  // The sample is full, use CAR.
+  int replacements = getBinomial(estimator->rows_in_sample, 1.0 / estimator->rows_in_table);
+  if (replacements > 0) {
+    ocl_sample_change_buffer_t* buffer = getChangeBuffer(estimator, changes);
+    size_t map_size = sizeof(unsigned char)*((estimator->rows_in_sample+8-1)/8);
+    kde_float_t* item = palloc(ocl_sizeOfSampleItem(estimator));
+    unsigned char* index_map = (unsigned char*) palloc0(map_size);
+
+    ocl_extractSampleTuple(estimator, rel, new_tuple, item);
+
+    index_map = floydSampling(index_map,estimator->rows_in_sample, replacements);
+    int i = 0;
+    for (; i < map_size; i++) {
+      int j = 0;
+      while(index_map[i]){
+        if(index_map[i] & 1){
+          stageSampleWrite(buffer, i * 8 + j, item, &(new_tuple->t_self));
+        }
+        index_map[i] = index_map[i] >> 1;
+        j++;
       }
-      pfree(item);
-      pfree(index_map);
     }
+    pfree(item);
+    pfree(index_map);
   }
 }
 
-void ocl_notifySampleMaintenanceOfDeletion(Relation rel, ItemPointer tupleid) {
+void ocl_notifySampleMaintenanceOfInsertion(
+    Relation rel, HeapTuple new_tuple, void** changes) {
+  // Check whether we have a table for this relation.
   ocl_estimator_t* estimator = ocl_getEstimator(rel->rd_id);
   if (estimator == NULL) return;
-  struct timeval tvBegin, tvEnd;
+  void* local_changes = NULL;
+  if (changes == NULL) changes = &local_changes;
+  for (; estimator; estimator = estimator->next) {
+    notifyModelOfInsertion(estimator, rel, new_tuple, changes);
+  }
+  // Without a statement-level buffer, apply the changes right away.
+  if (local_changes) ocl_flushSampleMaintenance(rel, local_changes);
+}
 
+// Helper function to stage the changes of a deletion for a single model.
+static void notifyModelOfDeletion(
+    ocl_estimator_t* estimator, Relation rel, ItemPointer tupleid,
+    void** changes) {
   // For now, we just use this to update the table counts.
   estimator->rows_in_table--;
+  ocl_markEstimatorDirty(estimator);
   estimator->stats->nr_of_deletions++;
+  // The deleted row must not replace any sample point later on.
+  ocl_dropReplacementRow(estimator, tupleid);
 
   if(kde_sample_maintenance_option == CAR){
-    ocl_context_t* ctxt = ocl_getContext();
-    size_t global_size = estimator->rows_in_sample;
-    size_t bitmap_size = estimator->rows_in_sample / 8;
-    HeapTupleData deltuple;
-    deltuple.t_self = *tupleid;
-    Buffer		delbuffer;
-    int err = 0;
-    
-    kde_float_t* tuple_buffer = (kde_float_t *) palloc(estimator->nr_of_dimensions * (sizeof(kde_float_t)));
-    
-    heap_fetch(rel, SnapshotAny,&deltuple, &delbuffer, false, NULL);
-    ocl_extractSampleTuple(estimator,rel,&deltuple,tuple_buffer);
-    Assert(BufferIsValid(delbuffer));
-    ReleaseBuffer(delbuffer);
-     
-    unsigned int i = 0;
-    cl_event hitmap_event;
-    
-    
-    unsigned char* hitmap = (unsigned char*) palloc(bitmap_size*sizeof(unsigned char));
-    
-    gettimeofday(&tvBegin,NULL);
-    err |= clEnqueueWriteBuffer(
-      ctxt->queue, estimator->sample_optimization->deleted_point, CL_TRUE, 0,
-      ocl_sizeOfSampleItem(estimator),
-      tuple_buffer, 0, NULL, NULL);
-    gettimeofday(&tvEnd,NULL);
-    estimator->stats->maintenance_transfer_time += (tvEnd.tv_sec - tvBegin.tv_sec) * 1000 * 1000;
-    estimator->stats->maintenance_transfer_time += (tvEnd.tv_usec - tvBegin.tv_usec);
-    estimator->stats->maintenance_transfer_to_device++;
-    Assert(err == CL_SUCCESS);
-    
-    err = clEnqueueNDRangeKernel(
-      ctxt->queue, estimator->sample_optimization->del_desc->deletion_kernel, 1, NULL, &global_size,
-      &(estimator->sample_optimization->del_desc->local_size), 0, NULL, &hitmap_event);
-    Assert(err == CL_SUCCESS);
-    
-    err = clWaitForEvents(1,&hitmap_event);
-    Assert(err == CL_SUCCESS);
-    gettimeofday(&tvBegin,NULL);
-    err = clEnqueueReadBuffer(
-      ctxt->queue, estimator->sample_optimization->sample_hitmap, CL_TRUE, 0, sizeof(char) * bitmap_size,
-      hitmap, 1, &hitmap_event, NULL);
-    gettimeofday(&tvEnd,NULL);
-    estimator->stats->maintenance_transfer_time += (tvEnd.tv_sec - tvBegin.tv_sec) * 1000 * 1000;
-    estimator->stats->maintenance_transfer_time += (tvEnd.tv_usec - tvBegin.tv_usec);
-    estimator->stats->maintenance_transfer_to_host++;
-    Assert(err == CL_SUCCESS);
-    err = clReleaseEvent(hitmap_event);
-    Assert(err == CL_SUCCESS);
+    // Look up the sample points that were drawn from the deleted row.
+    int position = ocl_findSampleTid(estimator, tupleid);
+    if (position < 0) return;
+    ocl_sample_change_buffer_t* buffer = getChangeBuffer(estimator, changes);
+    for (; position >= 0;
+         position = ocl_nextSampleTidPosition(estimator, position)) {
+      stageSampleDeletion(buffer, position);
+    }
+  }
+}
 
-    //We have got work todo. Get structures to obtain random rows.
-    kde_float_t* item = palloc(ocl_sizeOfSampleItem(estimator));
-    HeapTuple sample_point;
+void ocl_notifySampleMaintenanceOfDeletion(
+    Relation rel, ItemPointer tupleid, void** changes) {
+  ocl_estimator_t* estimator = ocl_getEstimator(rel->rd_id);
+  if (estimator == NULL) return;
+  void* local_changes = NULL;
+  if (changes == NULL) changes = &local_changes;
+  for (; estimator; estimator = estimator->next) {
+    notifyModelOfDeletion(estimator, rel, tupleid, changes);
+  }
+  // Without a statement-level buffer, apply the changes right away.
+  if (local_changes) ocl_flushSampleMaintenance(rel, local_changes);
+}
 
-    double total_rows;
-    
-    for(i=0; i < bitmap_size; i++){
-      int j=0;
-      while(hitmap[i]){
-	if(hitmap[i] & 1){
-	  ocl_createSample(rel, &sample_point, &total_rows, 1);
-	  ocl_extractSampleTuple(estimator, rel, sample_point,item);
-	  gettimeofday(&tvBegin,NULL);
-	  ocl_pushEntryToSampleBufer(estimator, i*8+j, item);
-	  gettimeofday(&tvEnd,NULL);
-	  estimator->stats->maintenance_transfer_time += (tvEnd.tv_sec - tvBegin.tv_sec) * 1000 * 1000;
-	  estimator->stats->maintenance_transfer_time += (tvEnd.tv_usec - tvBegin.tv_usec);
-	  estimator->stats->maintenance_transfer_to_device++;
-	  heap_freetuple(sample_point);
-	}
-        j++;
-	hitmap[i] = hitmap[i] >> 1; 
+// Helper function to stage the changes of an update for a single model.
+static void notifyModelOfUpdate(
+    ocl_estimator_t* estimator, Relation rel, ItemPointer old_tid,
+    HeapTuple new_tuple, void** changes) {
+  unsigned int i;
+  int position;
+  ocl_sample_change_buffer_t* buffer;
+  kde_float_t* item;
+  ocl_markEstimatorDirty(estimator);
+  // The old row version is gone, so it must not replace any point later on.
+  ocl_dropReplacementRow(estimator, old_tid);
+
+  if (kde_sample_maintenance_option == CAR) {
+    // Refresh the sample points that were drawn from the old row version.
+    position = ocl_findSampleTid(estimator, old_tid);
+    if (position >= 0) {
+      buffer = getChangeBuffer(estimator, changes);
+      item = palloc(ocl_sizeOfSampleItem(estimator));
+      ocl_extractSampleTuple(estimator, rel, new_tuple, item);
+      for (; position >= 0;
+           position = ocl_nextSampleTidPosition(estimator, position)) {
+        if (buffer->deleted[position] || buffer->write_slot[position] >= 0)
+          continue;
+        stageSampleWrite(buffer, position, item, &(new_tuple->t_self));
       }
+      pfree(item);
     }
-    pfree(item); 
-    pfree(hitmap);
-    pfree(tuple_buffer);
+  }
+  // Pending writes of this statement may stem from the old row version.
+  for (buffer = *changes; buffer; buffer = buffer->next) {
+    if (buffer->columns != estimator->columns) continue;
+    for (i = 0; i < buffer->nr_of_writes; ++i) {
+      if (ItemPointerEquals(&(buffer->write_tids[i]), old_tid))
+        buffer->write_tids[i] = new_tuple->t_self;
+    }
+  }
+  // Points that keep their old values still follow the row, so a later
+  // deletion of the new version finds them.
+  ocl_remapSampleTid(estimator, old_tid, &(new_tuple->t_self));
+}
+
+void ocl_notifySampleMaintenanceOfUpdate(
+    Relation rel, ItemPointer old_tid, HeapTuple new_tuple, void** changes) {
+  ocl_estimator_t* estimator = ocl_getEstimator(rel->rd_id);
+  if (estimator == NULL) return;
+  void* local_changes = NULL;
+  if (changes == NULL) changes = &local_changes;
+  for (; estimator; estimator = estimator->next) {
+    notifyModelOfUpdate(estimator, rel, old_tid, new_tuple, changes);
+  }
+  // Without a statement-level buffer, apply the changes right away.
+  if (local_changes) ocl_flushSampleMaintenance(rel, local_changes);
+}
+
+// Helper function to apply the collected changes of a single model.
+static void flushChangeBuffer(
+    Relation rel, ocl_sample_change_buffer_t* buffer) {
+  unsigned int i;
+  struct timeval tvBegin, tvEnd;
+  ocl_estimator_t* estimator = ocl_getEstimatorForColumns(
+      buffer->table, buffer->columns);
+  // Drop the changes if the estimator has been replaced in the meantime.
+  if (estimator == NULL ||
+      estimator->nr_of_dimensions != buffer->nr_of_dimensions ||
+      estimator->rows_in_sample != buffer->rows_in_sample) {
+    releaseChangeBuffer(buffer);
+    return;
+  }
+  if (buffer->nr_of_deletions > 0) {
+    // Replace the deleted points by random rows, unless they are overwritten
+    // by an insertion anyways.
+    kde_float_t* item = palloc(ocl_sizeOfSampleItem(estimator));
+    ItemPointerData sample_tid;
+    for (i = 0; i < estimator->rows_in_sample; ++i) {
+      if (!buffer->deleted[i] || buffer->write_slot[i] >= 0) continue;
+      ocl_drawReplacementRow(estimator, rel, item, &sample_tid);
+      stageSampleWrite(buffer, i, item, &sample_tid);
+    }
+    pfree(item);
+  }
+  // Now write all changed items to the device sample.
+  gettimeofday(&tvBegin,NULL);
+  ocl_scatterEntriesToSampleBuffer(
+      estimator, buffer->nr_of_writes, buffer->write_positions,
+      buffer->write_items);
+  gettimeofday(&tvEnd,NULL);
+  estimator->stats->maintenance_transfer_time += (tvEnd.tv_sec - tvBegin.tv_sec) * 1000 * 1000;
+  estimator->stats->maintenance_transfer_time += (tvEnd.tv_usec - tvBegin.tv_usec);
+  for (i = 0; i < buffer->nr_of_writes; ++i) {
+    ocl_setSampleTid(
+        estimator, buffer->write_positions[i], &(buffer->write_tids[i]));
+  }
+  releaseChangeBuffer(buffer);
+}
+
+void ocl_flushSampleMaintenance(Relation rel, void* changes) {
+  ocl_sample_change_buffer_t* buffer = changes;
+  while (buffer) {
+    ocl_sample_change_buffer_t* next = buffer->next;
+    flushChangeBuffer(rel, buffer);
+    buffer = next;
   }
 }
 
@@ -537,6 +617,88 @@ static unsigned int min_tuple_size(TupleDesc desc){
 }
 
 
+// Helper function for the acceptance/rejection step of the random tuple
+// sampler: Reads the given block and returns a copy of a random living tuple
+// from it, or NULL if the block was rejected.
+static HeapTuple sampleTupleFromBlock(
+    Relation rel, BlockNumber bn, unsigned int max_tuples,
+    TransactionId OldestXmin, HeapTupleData *used_tuples, double* live_rows){
+  OffsetNumber targoffset,maxoffset;
+  Page targpage;  
+  //Now open the box.
+  Buffer targbuffer = ReadBuffer(rel,bn);
+  LockBuffer(targbuffer, BUFFER_LOCK_SHARE);
+  
+  targpage = BufferGetPage(targbuffer);
+  maxoffset = PageGetMaxOffsetNumber(targpage);
+  
+  int qualifying_rows = 0;
+  
+  /* Inner loop over all tuples on the selected page */
+  for (targoffset = FirstOffsetNumber; targoffset <= maxoffset; targoffset++) {
+    
+    ItemId itemid;
+    //HeapTupleData targtuple;
+    
+    itemid = PageGetItemId(targpage, targoffset);
+	  
+    //This stuff is basically taken from acquire_sample_rows
+    if (!ItemIdIsNormal(itemid)) continue;
+	  
+    ItemPointerSet(&used_tuples[qualifying_rows].t_self, bn, targoffset);
+
+    used_tuples[qualifying_rows].t_data = (HeapTupleHeader) PageGetItem(targpage, itemid);
+    used_tuples[qualifying_rows].t_len = ItemIdGetLength(itemid);
+    
+    switch (HeapTupleSatisfiesVacuum(
+        used_tuples[qualifying_rows].t_data, OldestXmin,targbuffer)) {
+      case HEAPTUPLE_LIVE:
+        qualifying_rows += 1;
+        ++(*live_rows);
+        continue;
+
+      case HEAPTUPLE_INSERT_IN_PROGRESS:
+        if (TransactionIdIsCurrentTransactionId(
+              HeapTupleHeaderGetXmin(used_tuples[qualifying_rows].t_data))) {
+          qualifying_rows += 1;
+          ++(*live_rows);
+          continue;
+        }
+      case HEAPTUPLE_DELETE_IN_PROGRESS:
+        if (!TransactionIdIsCurrentTransactionId(
+              HeapTupleHeaderGetUpdateXid(used_tuples[qualifying_rows].t_data))) {
+          ++(*live_rows);
+        }
+      case HEAPTUPLE_DEAD:
+      case HEAPTUPLE_RECENTLY_DEAD:
+        continue;
+
+      default:
+        elog(ERROR, "unexpected HeapTupleSatisfiesVacuum result");
+        continue;
+    }
+    
+  }
+  //This should never ever happen otherwise we can't guarantee uniform sampling.
+  Assert(qualifying_rows <= max_tuples);
+  // Very well, we know the number of interesting tuples in the page
+  // Step 4: Calculate the acceptance rate:
+  double acceptance_rate = qualifying_rows/(double) max_tuples;
+  if (anl_random_fract() > acceptance_rate){
+    UnlockReleaseBuffer(targbuffer);
+    return NULL;
+  }
+    
+  // And we didn't even got rejected, so pick a block.
+  int selected_tuple = (int) (anl_random_fract()*(double) (qualifying_rows));
+  if (selected_tuple >= qualifying_rows) selected_tuple = qualifying_rows-1;
+
+  HeapTuple tup = heap_copytuple(used_tuples + selected_tuple);
+  
+  UnlockReleaseBuffer(targbuffer);
+  return tup;
+}
+
 /*
  * The following method fetches a truly random living tuple from a table
  * and does not need a full table scan.
@@ -566,80 +728,11 @@ static HeapTuple sampleTuple(
     if(bn >= blocks) bn = blocks-1;
   
     ++*visited_blocks;
-    OffsetNumber targoffset,maxoffset;
-    Page targpage;  
-    //Now open the box.
-    Buffer targbuffer = ReadBuffer(rel,bn);
-    LockBuffer(targbuffer, BUFFER_LOCK_SHARE);
-    
-    targpage = BufferGetPage(targbuffer);
-    maxoffset = PageGetMaxOffsetNumber(targpage);
-    
-    int qualifying_rows = 0;
-    
-    /* Inner loop over all tuples on the selected page */
-    for (targoffset = FirstOffsetNumber; targoffset <= maxoffset; targoffset++) {
-      
-      ItemId itemid;
-      //HeapTupleData targtuple;
-      
-      itemid = PageGetItemId(targpage, targoffset);
-	  
-      //This stuff is basically taken from acquire_sample_rows
-      if (!ItemIdIsNormal(itemid)) continue;
-	  
-      ItemPointerSet(&used_tuples[qualifying_rows].t_self, bn, targoffset);
-
-      used_tuples[qualifying_rows].t_data = (HeapTupleHeader) PageGetItem(targpage, itemid);
-      used_tuples[qualifying_rows].t_len = ItemIdGetLength(itemid);
-      
-      switch (HeapTupleSatisfiesVacuum(
-          used_tuples[qualifying_rows].t_data, OldestXmin,targbuffer)) {
-        case HEAPTUPLE_LIVE:
-          qualifying_rows += 1;
-          ++(*live_rows);
-          continue;
-
-        case HEAPTUPLE_INSERT_IN_PROGRESS:
-          if (TransactionIdIsCurrentTransactionId(
-                HeapTupleHeaderGetXmin(used_tuples[qualifying_rows].t_data))) {
-            qualifying_rows += 1;
-            ++(*live_rows);
-            continue;
-          }
-        case HEAPTUPLE_DELETE_IN_PROGRESS:
-          if (!TransactionIdIsCurrentTransactionId(
-                HeapTupleHeaderGetUpdateXid(used_tuples[qualifying_rows].t_data))) {
-            ++(*live_rows);
-          }
-        case HEAPTUPLE_DEAD:
-        case HEAPTUPLE_RECENTLY_DEAD:
-          continue;
-
-        default:
-          elog(ERROR, "unexpected HeapTupleSatisfiesVacuum result");
-          continue;
-      }
-      
-    }
-    //This should never ever happen otherwise we can't guarantee uniform sampling.
-    Assert(qualifying_rows <= max_tuples);
-    // Very well, we know the number of interesting tuples in the page
-    // Step 4: Calculate the acceptance rate:
-    double acceptance_rate = qualifying_rows/(double) max_tuples;
-    if (anl_random_fract() > acceptance_rate){
-      UnlockReleaseBuffer(targbuffer);
-      continue;
-    }
-      
-    // And we didn't even got rejected, so pick a block.
-    int selected_tuple = (int) (anl_random_fract()*(double) (qualifying_rows));
-    if (selected_tuple >= qualifying_rows) selected_tuple = qualifying_rows-1;
-
-    HeapTuple tup = heap_copytuple(used_tuples + selected_tuple);
+    HeapTuple tup = sampleTupleFromBlock(
+        rel, bn, max_tuples, OldestXmin, used_tuples, live_rows);
+    if (tup == NULL) continue;
     
     pfree(used_tuples);
-    UnlockReleaseBuffer(targbuffer);
     return tup;
   }
 }
@@ -685,6 +778,54 @@ int ocl_createSample(Relation rel, HeapTuple *sample,double* estimated_rows,int
   return sample_size;
 }
 
+static int compareBlocks(const void* a, const void* b) {
+  BlockNumber block_a = *((const BlockNumber*) a);
+  BlockNumber block_b = *((const BlockNumber*) b);
+  if (block_a < block_b) return -1;
+  return block_a > block_b;
+}
+
+int ocl_drawSampleBlocks(Relation rel, BlockNumber* sample_blocks, int nr_of_blocks) {
+  BlockNumber blocks = RelationGetNumberOfBlocks(rel);
+  int i;
+  if (blocks == 0) return 0;
+  for (i = 0; i < nr_of_blocks; i++) {
+    BlockNumber bn = (BlockNumber) (anl_random_fract()*(double) blocks);
+    if(bn >= blocks) bn = blocks-1;
+    sample_blocks[i] = bn;
+  }
+  // Sort the blocks, so the reads are issued in file order.
+  qsort(sample_blocks, nr_of_blocks, sizeof(BlockNumber), compareBlocks);
+  for (i = 0; i < nr_of_blocks; i++) {
+    if (i > 0 && sample_blocks[i] == sample_blocks[i-1]) continue;
+    PrefetchBuffer(rel, MAIN_FORKNUM, sample_blocks[i]);
+  }
+  return nr_of_blocks;
+}
+
+int ocl_createSampleFromBlocks(
+    Relation rel, const BlockNumber* sample_blocks, int nr_of_blocks,
+    HeapTuple *sample) {
+  TransactionId oldestXmin = GetOldestXmin(rel->rd_rel->relisshared, true);
+  BlockNumber blocks = RelationGetNumberOfBlocks(rel);
+  int max_tuples = ocl_maxTuplesPerBlock(rel->rd_att);
+  HeapTupleData *used_tuples = (HeapTupleData *) palloc(max_tuples * sizeof(HeapTupleData));
+  double live_rows = 0.0;
+  int sample_size = 0;
+  int i;
+  
+  for (i = 0; i < nr_of_blocks; i++) {
+    // The table might have been truncated since the blocks were drawn.
+    if (sample_blocks[i] >= blocks) continue;
+    HeapTuple tup = sampleTupleFromBlock(
+        rel, sample_blocks[i], max_tuples, oldestXmin, used_tuples, &live_rows);
+    if (tup) sample[sample_size++] = tup;
+  }
+  
+  pfree(used_tuples);
+  return sample_size;
+}
+
 int ocl_isSafeToSample(Relation rel, double total_rows) {
     BlockNumber blocks = RelationGetNumberOfBlocks(rel);
     return blocks == 0 ||
@@ -720,8 +861,7 @@ void ocl_notifySampleMaintenanceOfSelectivity(
   }
 
   // Schedule the kernel to update the quality factors
-  cl_kernel kernel = ocl_getKernel(
-      "update_sample_quality_metrics", estimator->nr_of_dimensions);
+  cl_kernel kernel = estimator->sample_optimization->quality_kernel;
   ocl_context_t * ctxt = ocl_getContext();
   cl_int err = 0;
   err |= clSetKernelArg(
@@ -778,24 +918,22 @@ void ocl_notifySampleMaintenanceOfSelectivity(
     
         //We have got work todo. Get structures to obtain random rows.
     kde_float_t* item = palloc(ocl_sizeOfSampleItem(estimator));
-    HeapTuple sample_point;
+    ItemPointerData sample_tid;
     
-    double total_rows;
     Relation rel = try_relation_open(estimator->table, ShareUpdateExclusiveLock);
     
     for(i=0; i < bitmap_size; i++){
       int j=0;
       while(hitmap[i]){
 	if(hitmap[i] & 1){
-	  ocl_createSample(rel, &sample_point, &total_rows, 1);
-	  ocl_extractSampleTuple(estimator, rel, sample_point,item);
+	  ocl_drawReplacementRow(estimator, rel, item, &sample_tid);
 	  gettimeofday(&tvBegin,NULL);
 	  ocl_pushEntryToSampleBufer(estimator, i*8+j, item);
 	  gettimeofday(&tvEnd,NULL);
 	  estimator->stats->maintenance_transfer_time += (tvEnd.tv_sec - tvBegin.tv_sec) * 1000 * 1000;
 	  estimator->stats->maintenance_transfer_time += (tvEnd.tv_usec - tvBegin.tv_usec);
 	  estimator->stats->maintenance_transfer_to_device++;
-	  heap_freetuple(sample_point);
+	  ocl_setSampleTid(estimator, i*8+j, &sample_tid);
 	}
         j++;
 	hitmap[i] = hitmap[i] >> 1; 
@@ -807,8 +945,7 @@ void ocl_notifySampleMaintenanceOfSelectivity(
   else if (kde_sample_maintenance_option == PKR){
     kde_float_t* item;
 
-    HeapTuple sample_point;
-    double total_rows;
+    ItemPointerData sample_tid;
     
     if(estimator->stats->nr_of_estimations % kde_sample_maintenance_period != 0){
       err = clReleaseEvent(quality_update_event);
@@ -827,15 +964,14 @@ void ocl_notifySampleMaintenanceOfSelectivity(
         return;
       }*/
       item = palloc(ocl_sizeOfSampleItem(estimator));
-      ocl_createSample(onerel,&sample_point,&total_rows,1);
-      ocl_extractSampleTuple(estimator, onerel, sample_point,item);
+      ocl_drawReplacementRow(estimator, onerel, item, &sample_tid);
       gettimeofday(&tvBegin,NULL);
       ocl_pushEntryToSampleBufer(estimator, insert_position, item);
       gettimeofday(&tvEnd,NULL);
       estimator->stats->maintenance_transfer_time += (tvEnd.tv_sec - tvBegin.tv_sec) * 1000 * 1000;
       estimator->stats->maintenance_transfer_time += (tvEnd.tv_usec - tvBegin.tv_usec);
       estimator->stats->maintenance_transfer_to_device += 2;
-      heap_freetuple(sample_point);
+      ocl_setSampleTid(estimator, insert_position, &sample_tid);
       pfree(item);
       relation_close(onerel, ShareUpdateExclusiveLock);
     }
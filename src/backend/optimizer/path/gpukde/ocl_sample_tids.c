@@ -0,0 +1,167 @@
+/*
+ * ocl_sample_tids.c
+ */
+
+#include "ocl_sample_tids.h"
+
+#ifdef USE_OPENCL
+
+#include <stdlib.h>
+
+// Helper function to compute the bucket of a TID (Knuth's multiplicative hash).
+static unsigned int hashTid(ocl_sample_tids_t* state, ItemPointer tid) {
+  uint32 key = (ItemPointerGetBlockNumber(tid) << 16) ^
+      ItemPointerGetOffsetNumber(tid);
+  uint32 hash = key * 2654435761u;
+  hash ^= hash >> 16;
+  return hash & (state->nr_of_buckets - 1);
+}
+
+// Helper function to allocate the source rows of the estimator.
+static ocl_sample_tids_t* getState(ocl_estimator_t* estimator) {
+  unsigned int i;
+  ocl_sample_tids_t* state;
+  if (estimator->sample_tids) return estimator->sample_tids;
+  state = calloc(1, sizeof(ocl_sample_tids_t));
+  state->tids = calloc(estimator->rows_in_sample, sizeof(ItemPointerData));
+  state->next_slot = calloc(estimator->rows_in_sample, sizeof(int));
+  for (i = 0; i < estimator->rows_in_sample; ++i) {
+    ItemPointerSetInvalid(&(state->tids[i]));
+    state->next_slot[i] = -1;
+  }
+  // Keep the load factor of the table below one half.
+  state->nr_of_buckets = 1;
+  while (state->nr_of_buckets < 2 * estimator->rows_in_sample) {
+    state->nr_of_buckets <<= 1;
+  }
+  state->buckets = malloc(sizeof(int) * state->nr_of_buckets);
+  for (i = 0; i < state->nr_of_buckets; ++i) state->buckets[i] = -1;
+  estimator->sample_tids = state;
+  return state;
+}
+
+// Helper function to find the bucket of a TID, or the empty bucket where it
+// would be inserted.
+static unsigned int findBucket(ocl_sample_tids_t* state, ItemPointer tid) {
+  unsigned int bucket = hashTid(state, tid);
+  while (state->buckets[bucket] >= 0 &&
+         !ItemPointerEquals(&(state->tids[state->buckets[bucket]]), tid)) {
+    bucket = (bucket + 1) & (state->nr_of_buckets - 1);
+  }
+  return bucket;
+}
+
+// Helper function to empty a bucket. Following entries of the probe sequence
+// are shifted back, so lookups never stop at the hole.
+static void removeBucket(ocl_sample_tids_t* state, unsigned int hole) {
+  unsigned int mask = state->nr_of_buckets - 1;
+  unsigned int current = (hole + 1) & mask;
+  while (state->buckets[current] >= 0) {
+    unsigned int home = hashTid(
+        state, &(state->tids[state->buckets[current]]));
+    // The entry may move into the hole unless its home lies between the hole
+    // and its current position.
+    if (((current - home) & mask) >= ((current - hole) & mask)) {
+      state->buckets[hole] = state->buckets[current];
+      hole = current;
+    }
+    current = (current + 1) & mask;
+  }
+  state->buckets[hole] = -1;
+}
+
+// Helper function to remove a sample point from the chain of its source row.
+static void unlinkPosition(ocl_sample_tids_t* state, unsigned int position) {
+  unsigned int bucket;
+  int current;
+  if (!ItemPointerIsValid(&(state->tids[position]))) return;
+  bucket = findBucket(state, &(state->tids[position]));
+  current = state->buckets[bucket];
+  Assert(current >= 0);
+  if (current == (int)position) {
+    state->buckets[bucket] = state->next_slot[position];
+    if (state->buckets[bucket] < 0) removeBucket(state, bucket);
+  } else {
+    while (state->next_slot[current] != (int)position) {
+      current = state->next_slot[current];
+      Assert(current >= 0);
+    }
+    state->next_slot[current] = state->next_slot[position];
+  }
+  state->next_slot[position] = -1;
+  ItemPointerSetInvalid(&(state->tids[position]));
+}
+
+// Helper function to add a sample point to the chain of its source row.
+static void linkPosition(
+    ocl_sample_tids_t* state, unsigned int position, ItemPointer tid) {
+  unsigned int bucket = findBucket(state, tid);
+  state->tids[position] = *tid;
+  state->next_slot[position] = state->buckets[bucket];
+  state->buckets[bucket] = position;
+}
+
+void ocl_resetSampleTids(
+    ocl_estimator_t* estimator, const ItemPointerData* tids) {
+  unsigned int i;
+  ocl_sample_tids_t* state = getState(estimator);
+  for (i = 0; i < estimator->rows_in_sample; ++i) {
+    ItemPointerSetInvalid(&(state->tids[i]));
+    state->next_slot[i] = -1;
+  }
+  for (i = 0; i < state->nr_of_buckets; ++i) state->buckets[i] = -1;
+  if (tids == NULL) return;
+  for (i = 0; i < estimator->rows_in_sample; ++i) {
+    ItemPointerData tid = tids[i];
+    if (ItemPointerIsValid(&tid)) linkPosition(state, i, &tid);
+  }
+}
+
+void ocl_setSampleTid(
+    ocl_estimator_t* estimator, unsigned int position, ItemPointer tid) {
+  ocl_sample_tids_t* state = getState(estimator);
+  unlinkPosition(state, position);
+  if (tid && ItemPointerIsValid(tid)) linkPosition(state, position, tid);
+}
+
+const ItemPointerData* ocl_getSampleTids(ocl_estimator_t* estimator) {
+  return getState(estimator)->tids;
+}
+
+int ocl_findSampleTid(ocl_estimator_t* estimator, ItemPointer tid) {
+  ocl_sample_tids_t* state = estimator->sample_tids;
+  if (state == NULL || !ItemPointerIsValid(tid)) return -1;
+  return state->buckets[findBucket(state, tid)];
+}
+
+int ocl_nextSampleTidPosition(ocl_estimator_t* estimator, int position) {
+  return estimator->sample_tids->next_slot[position];
+}
+
+int ocl_remapSampleTid(
+    ocl_estimator_t* estimator, ItemPointer old_tid, ItemPointer new_tid) {
+  int remapped = 0;
+  int position = ocl_findSampleTid(estimator, old_tid);
+  ocl_sample_tids_t* state = estimator->sample_tids;
+  while (position >= 0) {
+    // Relinking resets the chain, so remember the next point first.
+    int next = state->next_slot[position];
+    unlinkPosition(state, position);
+    if (ItemPointerIsValid(new_tid)) linkPosition(state, position, new_tid);
+    position = next;
+    remapped++;
+  }
+  return remapped;
+}
+
+void ocl_releaseSampleTids(ocl_estimator_t* estimator) {
+  ocl_sample_tids_t* state = estimator->sample_tids;
+  if (state == NULL) return;
+  free(state->tids);
+  free(state->next_slot);
+  free(state->buckets);
+  free(state);
+  estimator->sample_tids = NULL;
+}
+
+#endif /* USE_OPENCL */
@@ -0,0 +1,70 @@
+/*
+ * ocl_sample_tids.h
+ *
+ *  Source rows of the sample points. Every sample point remembers the TID of
+ *  the table row it was drawn from, and a host-side hash table maps TIDs to
+ *  the sample points, so sample maintenance can find the points of a
+ *  deleted row with a single probe instead of comparing its values against
+ *  the device sample. A row can back several sample points, which are
+ *  chained via next_slot.
+ *
+ *  Points without a source row (e.g. the weighted points of a compacted
+ *  model or imported points) carry an invalid TID and are never found.
+ */
+
+#ifndef OCL_SAMPLE_TIDS_H_
+#define OCL_SAMPLE_TIDS_H_
+
+#include "ocl_estimator.h"
+
+#ifdef USE_OPENCL
+
+#include "storage/itemptr.h"
+
+typedef struct ocl_sample_tids {
+  ItemPointerData* tids;        // Source row of each sample point.
+  int* next_slot;               // Next sample point with the same source row.
+  int* buckets;                 // First sample point per bucket, -1 if empty.
+  unsigned int nr_of_buckets;   // Power of two.
+} ocl_sample_tids_t;
+
+/*
+ * Replaces the source rows of all sample points. If tids is NULL, no sample
+ * point has a source row.
+ */
+void ocl_resetSampleTids(ocl_estimator_t* estimator, const ItemPointerData* tids);
+
+/*
+ * Sets the source row of the sample point at the given position. Passing
+ * NULL marks the point as having no source row.
+ */
+void ocl_setSampleTid(
+    ocl_estimator_t* estimator, unsigned int position, ItemPointer tid);
+
+/*
+ * Returns the source rows of all sample points.
+ */
+const ItemPointerData* ocl_getSampleTids(ocl_estimator_t* estimator);
+
+/*
+ * Returns the position of the first sample point drawn from the given row,
+ * or -1 if the row is not in the sample. Further points drawn from the same
+ * row are returned by ocl_nextSampleTidPosition.
+ */
+int ocl_findSampleTid(ocl_estimator_t* estimator, ItemPointer tid);
+int ocl_nextSampleTidPosition(ocl_estimator_t* estimator, int position);
+
+/*
+ * Moves all sample points drawn from old_tid over to new_tid, e.g. after the
+ * row was updated. Returns the number of moved points.
+ */
+int ocl_remapSampleTid(
+    ocl_estimator_t* estimator, ItemPointer old_tid, ItemPointer new_tid);
+
+/*
+ * Releases the source rows of the estimator.
+ */
+void ocl_releaseSampleTids(ocl_estimator_t* estimator);
+
+#endif /* USE_OPENCL */
+#endif /* OCL_SAMPLE_TIDS_H_ */
@@ -0,0 +1,155 @@
+/*
+ * ocl_selectivity_cache.c
+ */
+
+#include "ocl_selectivity_cache.h"
+
+#ifdef USE_OPENCL
+
+#include <stdlib.h>
+
+// GUC configuration variable.
+int kde_selectivity_cache_size = 64;
+extern int kde_backend;
+extern int kde_kernel;
+extern int kde_estimation_precision;
+extern bool kde_enable_spatial_pruning;
+extern double kde_spatial_pruning_error;
+extern bool kde_enable_progressive_estimation;
+extern double kde_progressive_estimation_tolerance;
+extern bool kde_enable_factor_cache;
+
+// Helper function to collect the settings that influence an estimate. The
+// error bounds only matter if their estimation path is enabled.
+static ocl_estimation_settings_t currentSettings(void) {
+  ocl_estimation_settings_t settings;
+  settings.flags = (uint32)kde_backend |
+      ((uint32)kde_estimation_precision << 8) |
+      ((uint32)kde_kernel << 12) |
+      (kde_enable_spatial_pruning ? 0x1u << 16 : 0) |
+      (kde_enable_progressive_estimation ? 0x1u << 17 : 0) |
+      (kde_enable_factor_cache ? 0x1u << 18 : 0);
+  settings.spatial_pruning_error =
+      kde_enable_spatial_pruning ? kde_spatial_pruning_error : 0.0;
+  settings.progressive_estimation_tolerance =
+      kde_enable_progressive_estimation ?
+          kde_progressive_estimation_tolerance : 0.0;
+  return settings;
+}
+
+// Helper function to check whether an entry was computed with the settings.
+static bool sameSettings(
+    const ocl_estimation_settings_t* a, const ocl_estimation_settings_t* b) {
+  return a->flags == b->flags &&
+      a->spatial_pruning_error == b->spatial_pruning_error &&
+      a->progressive_estimation_tolerance ==
+          b->progressive_estimation_tolerance;
+}
+
+// Helper function to (re-)allocate the cache with the configured capacity.
+static ocl_selectivity_cache_t* getCache(ocl_estimator_t* estimator) {
+  ocl_selectivity_cache_t* cache = estimator->selectivity_cache;
+  unsigned int capacity = kde_selectivity_cache_size;
+  if (cache && cache->capacity == capacity) return cache;
+  // The capacity has changed (or there is no cache yet), start over.
+  ocl_releaseSelectivityCache(estimator);
+  if (kde_selectivity_cache_size <= 0) return NULL;
+  cache = calloc(1, sizeof(ocl_selectivity_cache_t));
+  cache->capacity = capacity;
+  cache->ranges = malloc(
+      sizeof(kde_float_t) * 2 * estimator->nr_of_dimensions * capacity);
+  cache->model_versions = malloc(sizeof(uint64) * capacity);
+  cache->settings = malloc(sizeof(ocl_estimation_settings_t) * capacity);
+  cache->selectivities = malloc(sizeof(double) * capacity);
+  cache->last_used = malloc(sizeof(uint64) * capacity);
+  cache->last_evaluated = -1;
+  estimator->selectivity_cache = cache;
+  return cache;
+}
+
+// Helper function to find the entry for the given query bounds.
+static int findEntry(
+    ocl_estimator_t* estimator, ocl_selectivity_cache_t* cache,
+    const kde_float_t* query) {
+  unsigned int i, j;
+  unsigned int range_size = 2 * estimator->nr_of_dimensions;
+  ocl_estimation_settings_t settings = currentSettings();
+  for (i = 0; i < cache->nr_of_entries; ++i) {
+    const kde_float_t* entry = &(cache->ranges[i * range_size]);
+    if (cache->model_versions[i] != estimator->model_version) continue;
+    if (!sameSettings(&(cache->settings[i]), &settings)) continue;
+    for (j = 0; j < range_size; ++j) {
+      if (entry[j] != query[j]) break;
+    }
+    if (j == range_size) return i;
+  }
+  return -1;
+}
+
+bool ocl_lookupSelectivityCache(
+    ocl_estimator_t* estimator, const kde_float_t* query,
+    bool device_state_needed, Selectivity* selectivity) {
+  ocl_selectivity_cache_t* cache = getCache(estimator);
+  int entry;
+  if (cache == NULL) return false;
+  entry = findEntry(estimator, cache, query);
+  if (entry < 0 || (device_state_needed && entry != cache->last_evaluated)) {
+    estimator->stats->selectivity_cache_misses++;
+    return false;
+  }
+  cache->last_used[entry] = ++(cache->clock);
+  *selectivity = cache->selectivities[entry];
+  estimator->stats->selectivity_cache_hits++;
+  return true;
+}
+
+void ocl_insertSelectivityCache(
+    ocl_estimator_t* estimator, const kde_float_t* query,
+    Selectivity selectivity, bool is_last_evaluation) {
+  unsigned int i;
+  ocl_selectivity_cache_t* cache = getCache(estimator);
+  unsigned int range_size = 2 * estimator->nr_of_dimensions;
+  int entry;
+  if (cache == NULL) return;
+  // Re-use an existing entry for the query, or pick a free / the LRU slot.
+  entry = findEntry(estimator, cache, query);
+  if (entry < 0) {
+    if (cache->nr_of_entries < cache->capacity) {
+      entry = cache->nr_of_entries++;
+    } else {
+      entry = 0;
+      for (i = 1; i < cache->nr_of_entries; ++i) {
+        if (cache->last_used[i] < cache->last_used[entry]) entry = i;
+      }
+      if (entry == cache->last_evaluated) cache->last_evaluated = -1;
+    }
+  }
+  memcpy(&(cache->ranges[entry * range_size]), query,
+         sizeof(kde_float_t) * range_size);
+  cache->model_versions[entry] = estimator->model_version;
+  cache->settings[entry] = currentSettings();
+  cache->selectivities[entry] = selectivity;
+  cache->last_used[entry] = ++(cache->clock);
+  if (is_last_evaluation) cache->last_evaluated = entry;
+}
+
+void ocl_clearSelectivityCache(ocl_estimator_t* estimator) {
+  ocl_selectivity_cache_t* cache = estimator->selectivity_cache;
+  if (cache == NULL) return;
+  cache->nr_of_entries = 0;
+  cache->last_evaluated = -1;
+}
+
+void ocl_releaseSelectivityCache(ocl_estimator_t* estimator) {
+  ocl_selectivity_cache_t* cache = estimator->selectivity_cache;
+  if (cache == NULL) return;
+  free(cache->ranges);
+  free(cache->model_versions);
+  free(cache->settings);
+  free(cache->selectivities);
+  free(cache->last_used);
+  free(cache);
+  estimator->selectivity_cache = NULL;
+}
+
+#endif /* USE_OPENCL */
@@ -0,0 +1,77 @@
+/*
+ * ocl_selectivity_cache.h
+ *
+ *  Per-estimator memoization of selectivity estimates. The planner asks for
+ *  the same restriction many times while it enumerates paths and join
+ *  orders, so we remember recent estimates and skip the device round trip.
+ *
+ *  Entries are keyed on the model version, the estimation settings (backend,
+ *  kernel, precision, factor cache, and spatial pruning and progressive
+ *  estimation with their error bounds) and the (normalized) query bounds, so
+ *  changing a setting never returns an estimate that was computed with the
+ *  old one.
+ *  The cache is owned by the estimator and must be cleared whenever the
+ *  sample or the bandwidth of the model changes.
+ */
+
+#ifndef OCL_SELECTIVITY_CACHE_H_
+#define OCL_SELECTIVITY_CACHE_H_
+
+#include "ocl_estimator.h"
+
+#ifdef USE_OPENCL
+
+// The settings that were used to compute an estimate.
+typedef struct ocl_estimation_settings {
+  uint32 flags;                             // Backend, kernel and switches.
+  double spatial_pruning_error;             // 0 if pruning is disabled.
+  double progressive_estimation_tolerance;  // 0 if disabled.
+} ocl_estimation_settings_t;
+
+typedef struct ocl_selectivity_cache {
+  unsigned int capacity;        // Maximum number of cached estimates.
+  unsigned int nr_of_entries;   // Current number of cached estimates.
+  kde_float_t* ranges;          // Query bounds, 2*d values per entry.
+  uint64* model_versions;       // Model version of each entry.
+  ocl_estimation_settings_t* settings;  // Estimation settings of each entry.
+  double* selectivities;        // Cached selectivity of each entry.
+  uint64* last_used;            // LRU timestamp of each entry.
+  uint64 clock;                 // Current LRU timestamp.
+  int last_evaluated;           // Entry that was last computed on the device.
+} ocl_selectivity_cache_t;
+
+/*
+ * Looks up the estimate for the given query bounds. If device_state_needed is
+ * set, we only report a hit if the entry was also the last estimate that was
+ * computed on the device, since model maintenance consumes the per-point
+ * results of the last estimate.
+ *
+ * Returns true and sets selectivity on a hit.
+ */
+bool ocl_lookupSelectivityCache(
+    ocl_estimator_t* estimator, const kde_float_t* query,
+    bool device_state_needed, Selectivity* selectivity);
+
+/*
+ * Stores the estimate that was just computed for the given query bounds,
+ * evicting the least recently used entry if the cache is full. Set
+ * is_last_evaluation if the device state (per-point results) now belongs to
+ * this estimate.
+ */
+void ocl_insertSelectivityCache(
+    ocl_estimator_t* estimator, const kde_float_t* query,
+    Selectivity selectivity, bool is_last_evaluation);
+
+/*
+ * Drops all cached estimates of the estimator. Must be called whenever the
+ * model changes.
+ */
+void ocl_clearSelectivityCache(ocl_estimator_t* estimator);
+
+/*
+ * Releases the cache of the estimator.
+ */
+void ocl_releaseSelectivityCache(ocl_estimator_t* estimator);
+
+#endif /* USE_OPENCL */
+#endif /* OCL_SELECTIVITY_CACHE_H_ */
@@ -0,0 +1,191 @@
+/*
+ * ocl_shared_registry.c
+ */
+
+#include "ocl_shared_registry.h"
+
+#ifdef USE_OPENCL
+
+#include "catalog/pg_type.h"
+#include "optimizer/path/gpukde/ocl_estimator_api.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/hsearch.h"
+
+/*
+ * Header of the shared model directory.
+ */
+typedef struct ocl_shared_registry {
+  bool loaded;          // Has the directory been populated from the catalog?
+  uint64 last_version;  // Last model version that was handed out.
+  uint64 dropped;       // Models that were not tracked since it was full.
+} ocl_shared_registry_t;
+
+/*
+ * KDE models and STHoles histograms are versioned in the same directory.
+ */
+typedef enum ocl_shared_model_kind {
+  OCL_SHARED_KDE_MODEL,
+  OCL_SHARED_STHOLES_HISTOGRAM
+} ocl_shared_model_kind_t;
+
+/*
+ * Key of the shared model directory.
+ */
+typedef struct ocl_shared_model_key {
+  Oid table;
+  int32 kind;
+} ocl_shared_model_key_t;
+
+/*
+ * Entry of the shared model directory.
+ */
+typedef struct ocl_shared_model {
+  ocl_shared_model_key_t key;   // Hash key, must be first.
+  uint64 version;               // Currently published version of the model.
+} ocl_shared_model_t;
+
+static ocl_shared_registry_t* shared_registry = NULL;
+static HTAB* shared_models = NULL;
+
+Size ocl_sharedRegistryShmemSize(void) {
+  Size size = MAXALIGN(sizeof(ocl_shared_registry_t));
+  size = add_size(size, hash_estimate_size(
+      OCL_MAX_SHARED_MODELS, sizeof(ocl_shared_model_t)));
+  return size;
+}
+
+void ocl_sharedRegistryShmemInit(void) {
+  bool found;
+  HASHCTL info;
+  shared_registry = ShmemInitStruct(
+      "KDE Model Registry", sizeof(ocl_shared_registry_t), &found);
+  if (!found) {
+    shared_registry->loaded = false;
+    shared_registry->last_version = 0;
+    shared_registry->dropped = 0;
+  }
+  MemSet(&info, 0, sizeof(info));
+  info.keysize = sizeof(ocl_shared_model_key_t);
+  info.entrysize = sizeof(ocl_shared_model_t);
+  info.hash = tag_hash;
+  shared_models = ShmemInitHash(
+      "KDE Model Registry Hash", OCL_MAX_SHARED_MODELS, OCL_MAX_SHARED_MODELS,
+      &info, HASH_ELEM | HASH_FUNCTION);
+}
+
+// Helper function to report models that the full directory could not track.
+static void reportFullRegistry(unsigned int dropped) {
+  if (dropped == 0) return;
+  ereport(WARNING,
+          (errmsg("shared KDE model registry is full, %u models are not "
+                  "tracked", dropped),
+           errdetail("The registry tracks at most %i models.",
+                     OCL_MAX_SHARED_MODELS),
+           errhint("Other backends do not pick up new versions of these "
+                   "models until they reconnect.")));
+}
+
+bool ocl_isSharedRegistryLoaded(void) {
+  bool loaded;
+  LWLockAcquire(KdeModelRegistryLock, LW_SHARED);
+  loaded = shared_registry->loaded;
+  LWLockRelease(KdeModelRegistryLock);
+  return loaded;
+}
+
+void ocl_populateSharedRegistry(Oid* tables, unsigned int nr_of_tables) {
+  unsigned int i;
+  unsigned int dropped = 0;
+  LWLockAcquire(KdeModelRegistryLock, LW_EXCLUSIVE);
+  if (!shared_registry->loaded) {
+    for (i = 0; i < nr_of_tables; ++i) {
+      bool found;
+      ocl_shared_model_key_t key;
+      ocl_shared_model_t* model;
+      key.table = tables[i];
+      key.kind = OCL_SHARED_KDE_MODEL;
+      model = hash_search(shared_models, &key, HASH_ENTER_NULL, &found);
+      if (model == NULL) {
+        dropped = nr_of_tables - i;
+        break;
+      }
+      if (!found) model->version = ++(shared_registry->last_version);
+    }
+    shared_registry->dropped += dropped;
+    shared_registry->loaded = true;
+  }
+  LWLockRelease(KdeModelRegistryLock);
+  reportFullRegistry(dropped);
+}
+
+// Helper function to look up the published version of a model.
+static uint64 getSharedVersion(Oid table, ocl_shared_model_kind_t kind) {
+  uint64 version = 0;
+  ocl_shared_model_key_t key;
+  ocl_shared_model_t* model;
+  key.table = table;
+  key.kind = kind;
+  LWLockAcquire(KdeModelRegistryLock, LW_SHARED);
+  model = hash_search(shared_models, &key, HASH_FIND, NULL);
+  if (model) version = model->version;
+  LWLockRelease(KdeModelRegistryLock);
+  return version;
+}
+
+// Helper function to hand out a new version for a model.
+static uint64 publishSharedVersion(Oid table, ocl_shared_model_kind_t kind) {
+  uint64 version = 0;
+  bool found;
+  ocl_shared_model_key_t key;
+  ocl_shared_model_t* model;
+  key.table = table;
+  key.kind = kind;
+  LWLockAcquire(KdeModelRegistryLock, LW_EXCLUSIVE);
+  model = hash_search(shared_models, &key, HASH_ENTER_NULL, &found);
+  if (model) {
+    model->version = ++(shared_registry->last_version);
+    version = model->version;
+  } else {
+    shared_registry->dropped++;
+  }
+  LWLockRelease(KdeModelRegistryLock);
+  if (model == NULL) reportFullRegistry(1);
+  return version;
+}
+
+uint64 ocl_getSharedModelVersion(Oid table) {
+  return getSharedVersion(table, OCL_SHARED_KDE_MODEL);
+}
+
+uint64 ocl_publishSharedModelVersion(Oid table) {
+  return publishSharedVersion(table, OCL_SHARED_KDE_MODEL);
+}
+
+uint64 ocl_getSharedHistogramVersion(Oid table) {
+  return getSharedVersion(table, OCL_SHARED_STHOLES_HISTOGRAM);
+}
+
+uint64 ocl_publishSharedHistogramVersion(Oid table) {
+  return publishSharedVersion(table, OCL_SHARED_STHOLES_HISTOGRAM);
+}
+
+Datum ocl_getSharedRegistryStats(PG_FUNCTION_ARGS) {
+  Datum datum_array[3];
+  int64 models, last_version, dropped;
+  LWLockAcquire(KdeModelRegistryLock, LW_SHARED);
+  models = hash_get_num_entries(shared_models);
+  last_version = shared_registry->last_version;
+  dropped = shared_registry->dropped;
+  LWLockRelease(KdeModelRegistryLock);
+  datum_array[0] = Int64GetDatum(models);
+  datum_array[1] = Int64GetDatum(last_version);
+  datum_array[2] = Int64GetDatum(dropped);
+  PG_RETURN_ARRAYTYPE_P(
+      construct_array(
+          datum_array, 3, INT8OID, sizeof(int64), FLOAT8PASSBYVAL, 'd'));
+}
+
+#endif /* USE_OPENCL */
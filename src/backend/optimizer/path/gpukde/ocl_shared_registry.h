@@ -0,0 +1,59 @@
+/*
+ * ocl_shared_registry.h
+ *
+ *  Shared-memory directory that publishes the current version of every KDE
+ *  model and every STHoles histogram to all backends.
+ *
+ *  OpenCL device buffers cannot be shared between processes, so every backend
+ *  still keeps its own device-side copy of the models it uses. The shared
+ *  directory allows backends to load models lazily (only when a table is
+ *  actually queried) and to detect when another backend has published a new
+ *  version of a model, which is then swapped in on the next access.
+ */
+
+#ifndef OCL_SHARED_REGISTRY_H_
+#define OCL_SHARED_REGISTRY_H_
+
+#include "postgres.h"
+
+#ifdef USE_OPENCL
+
+/*
+ * Maximum number of models that can be tracked in the shared directory.
+ */
+#define OCL_MAX_SHARED_MODELS 1024
+
+/*
+ * Checks whether the shared directory has already been populated from
+ * pg_kdemodels since the last server start.
+ */
+bool ocl_isSharedRegistryLoaded(void);
+
+/*
+ * Populates the shared directory with the given tables. This is a no-op if
+ * another backend has already populated the directory.
+ */
+void ocl_populateSharedRegistry(Oid* tables, unsigned int nr_of_tables);
+
+/*
+ * Returns the currently published model version for the given table, or 0
+ * if no model has been published for the table.
+ */
+uint64 ocl_getSharedModelVersion(Oid table);
+
+/*
+ * Publishes a new model version for the given table and returns it. Returns
+ * 0 (and warns) if the shared directory is full.
+ */
+uint64 ocl_publishSharedModelVersion(Oid table);
+
+/*
+ * Same as above, for the STHoles histogram of the given table. Histogram
+ * versions are not populated from pg_stholes, so 0 means that no histogram
+ * has been written since the last server start.
+ */
+uint64 ocl_getSharedHistogramVersion(Oid table);
+uint64 ocl_publishSharedHistogramVersion(Oid table);
+
+#endif /* USE_OPENCL */
+#endif /* OCL_SHARED_REGISTRY_H_ */
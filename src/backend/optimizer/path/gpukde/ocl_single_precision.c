@@ -0,0 +1,196 @@
+/*
+ * ocl_single_precision.c
+ */
+
+#include "ocl_single_precision.h"
+
+#ifdef USE_OPENCL
+
+#include <math.h>
+#include <stdlib.h>
+
+#include "ocl_adaptive_bandwidth.h"
+
+extern ocl_kernel_type_t global_kernel_type;
+
+// GUC configuration variable.
+int kde_estimation_precision = DOUBLE_PRECISION;
+
+// Helper function to allocate the single-precision buffers of the estimator.
+static ocl_single_precision_t* getState(ocl_estimator_t* estimator) {
+  ocl_context_t* context;
+  cl_int err = CL_SUCCESS;
+  unsigned int d = estimator->nr_of_dimensions;
+  ocl_single_precision_t* state;
+  if (estimator->single_precision) return estimator->single_precision;
+  context = ocl_getContext();
+  state = calloc(1, sizeof(ocl_single_precision_t));
+  state->sample_buffer = ocl_createBuffer(
+      context->context, CL_MEM_READ_WRITE,
+      sizeof(float) * d * estimator->rows_in_sample, NULL, &err);
+  Assert(err == CL_SUCCESS);
+  state->mean_buffer = ocl_createBuffer(
+      context->context, CL_MEM_READ_WRITE, sizeof(float) * d, NULL, &err);
+  Assert(err == CL_SUCCESS);
+  state->sdev_buffer = ocl_createBuffer(
+      context->context, CL_MEM_READ_WRITE, sizeof(float) * d, NULL, &err);
+  Assert(err == CL_SUCCESS);
+  state->bandwidth_buffer = ocl_createBuffer(
+      context->context, CL_MEM_READ_WRITE, sizeof(float) * d, NULL, &err);
+  Assert(err == CL_SUCCESS);
+  state->input_buffer = ocl_createBuffer(
+      context->context, CL_MEM_READ_ONLY, sizeof(float) * 2 * d, NULL, &err);
+  Assert(err == CL_SUCCESS);
+  state->local_results_buffer = ocl_createBuffer(
+      context->context, CL_MEM_READ_WRITE,
+      sizeof(float) * estimator->rows_in_sample, NULL, &err);
+  Assert(err == CL_SUCCESS);
+  state->result_buffer = ocl_createBuffer(
+      context->context, CL_MEM_READ_WRITE, sizeof(float), NULL, &err);
+  Assert(err == CL_SUCCESS);
+  // The conversion runs in the double-precision program.
+  state->convert_kernel = ocl_getKernel("convert_to_float", 0);
+  if (global_kernel_type == EPANECHNIKOV) {
+    state->kde_kernel = ocl_getSinglePrecisionKernel("epanechnikov_kde", d);
+  } else {
+    state->kde_kernel = ocl_getSinglePrecisionKernel("gauss_kde", d);
+  }
+  err |= clSetKernelArg(
+      state->kde_kernel, 0, sizeof(cl_mem), &(state->sample_buffer));
+  err |= clSetKernelArg(
+      state->kde_kernel, 1, sizeof(cl_mem), &(state->local_results_buffer));
+  err |= clSetKernelArg(
+      state->kde_kernel, 2, sizeof(cl_mem), &(state->input_buffer));
+  err |= clSetKernelArg(
+      state->kde_kernel, 3, sizeof(cl_mem), &(state->bandwidth_buffer));
+  err |= clSetKernelArg(
+      state->kde_kernel, 4, sizeof(cl_mem), &(state->mean_buffer));
+  err |= clSetKernelArg(
+      state->kde_kernel, 5, sizeof(cl_mem), &(state->sdev_buffer));
+  Assert(err == CL_SUCCESS);
+  state->sum_descriptor = prepareSinglePrecisionSumDescriptor(
+      state->local_results_buffer, estimator->rows_in_sample,
+      state->result_buffer, 0);
+  state->sample_valid = false;
+  estimator->single_precision = state;
+  return state;
+}
+
+// Helper function to convert a double buffer to its float copy.
+static cl_event convertBuffer(
+    ocl_single_precision_t* state, cl_mem source, cl_mem target,
+    size_t elements, unsigned int nr_of_wait_events, cl_event* wait_events) {
+  ocl_context_t* context = ocl_getContext();
+  cl_int err = CL_SUCCESS;
+  cl_event event;
+  err |= clSetKernelArg(state->convert_kernel, 0, sizeof(cl_mem), &source);
+  err |= clSetKernelArg(state->convert_kernel, 1, sizeof(cl_mem), &target);
+  err |= clEnqueueNDRangeKernel(
+      context->queue, state->convert_kernel, 1, NULL, &elements, NULL,
+      nr_of_wait_events, wait_events, &event);
+  Assert(err == CL_SUCCESS);
+  return event;
+}
+
+double ocl_singlePrecisionRangeKDE(
+    ocl_estimator_t* estimator, const kde_float_t* query) {
+  unsigned int i;
+  ocl_context_t* context = ocl_getContext();
+  cl_int err PG_USED_FOR_ASSERTS_ONLY = CL_SUCCESS;
+  unsigned int d = estimator->nr_of_dimensions;
+  ocl_single_precision_t* state = getState(estimator);
+  // Collect everything the kde kernel has to wait for.
+  cl_event events[5];
+  unsigned int nr_of_events = 0;
+  cl_event optimization_event;
+  float* float_query;
+  size_t global_size = estimator->rows_in_sample;
+  cl_event kde_event;
+  cl_event sum_event;
+  float result;
+  double normalization_factor;
+  // Refresh the float copy of the sample if it is outdated.
+  if (!state->sample_valid) {
+    events[nr_of_events++] = convertBuffer(
+        state, estimator->sample_buffer, state->sample_buffer,
+        d * estimator->rows_in_sample, 0, NULL);
+    events[nr_of_events++] = convertBuffer(
+        state, estimator->mean_buffer, state->mean_buffer, d, 0, NULL);
+    events[nr_of_events++] = convertBuffer(
+        state, estimator->sdev_buffer, state->sdev_buffer, d, 0, NULL);
+    state->sample_valid = true;
+  }
+  // The bandwidth is tiny, so we simply convert it for every estimate. This
+  // also picks up any pending bandwidth update.
+  optimization_event = estimator->bandwidth_optimization->optimization_event;
+  events[nr_of_events++] = convertBuffer(
+      state, estimator->bandwidth_buffer, state->bandwidth_buffer, d,
+      optimization_event ? 1 : 0, &optimization_event);
+  if (optimization_event) {
+    err = clReleaseEvent(optimization_event);
+    Assert(err == CL_SUCCESS);
+    estimator->bandwidth_optimization->optimization_event = NULL;
+  }
+  // Transfer the query bounds to the device.
+  float_query = palloc(sizeof(float) * 2 * d);
+  for (i = 0; i < 2 * d; ++i) float_query[i] = query[i];
+  err = clEnqueueWriteBuffer(
+      context->queue, state->input_buffer, CL_FALSE, 0,
+      sizeof(float) * 2 * d, float_query, 0, NULL, &(events[nr_of_events++]));
+  estimator->stats->estimation_transfer_to_device++;
+  Assert(err == CL_SUCCESS);
+  // Compute the local contributions.
+  err = clEnqueueNDRangeKernel(
+      context->queue, state->kde_kernel, 1, NULL, &global_size, NULL,
+      nr_of_events, events, &kde_event);
+  Assert(err == CL_SUCCESS);
+  for (i = 0; i < nr_of_events; ++i) {
+    err = clReleaseEvent(events[i]);
+    Assert(err == CL_SUCCESS);
+  }
+  // Sum up the contributions and transfer the result back.
+  sum_event = predefinedSumOfArray(state->sum_descriptor, kde_event);
+  err = clReleaseEvent(kde_event);
+  Assert(err == CL_SUCCESS);
+  err = clEnqueueReadBuffer(
+      context->queue, state->result_buffer, CL_TRUE, 0, sizeof(float),
+      &result, 1, &sum_event, NULL);
+  estimator->stats->estimation_transfer_to_host++;
+  Assert(err == CL_SUCCESS);
+  err = clReleaseEvent(sum_event);
+  Assert(err == CL_SUCCESS);
+  pfree(float_query);
+  // Normalize the result in double precision.
+  if (global_kernel_type == EPANECHNIKOV) {
+    normalization_factor = pow(0.75, d);
+  } else {
+    normalization_factor = pow(0.5, d);
+  }
+  return result * normalization_factor / estimator->rows_in_sample;
+}
+
+void ocl_invalidateSinglePrecisionSample(ocl_estimator_t* estimator) {
+  if (estimator->single_precision == NULL) return;
+  estimator->single_precision->sample_valid = false;
+}
+
+void ocl_releaseSinglePrecisionBuffers(ocl_estimator_t* estimator) {
+  ocl_single_precision_t* state = estimator->single_precision;
+  cl_int err = CL_SUCCESS;
+  if (state == NULL) return;
+  err |= clReleaseMemObject(state->sample_buffer);
+  err |= clReleaseMemObject(state->mean_buffer);
+  err |= clReleaseMemObject(state->sdev_buffer);
+  err |= clReleaseMemObject(state->bandwidth_buffer);
+  err |= clReleaseMemObject(state->input_buffer);
+  err |= clReleaseMemObject(state->local_results_buffer);
+  err |= clReleaseMemObject(state->result_buffer);
+  err |= clReleaseKernel(state->kde_kernel);
+  err |= clReleaseKernel(state->convert_kernel);
+  Assert(err == CL_SUCCESS);
+  releaseAggregationDescriptor(state->sum_descriptor);
+  free(state);
+  estimator->single_precision = NULL;
+}
+
+#endif /* USE_OPENCL */
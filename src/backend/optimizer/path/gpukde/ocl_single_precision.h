@@ -0,0 +1,56 @@
+/*
+ * ocl_single_precision.h
+ *
+ *  Single-precision estimation path for kde_estimation_precision = single.
+ *  Many devices run double-precision arithmetic at a fraction of the float
+ *  rate, so the estimator can evaluate the kde kernels on a float copy of the
+ *  sample instead. The summation of the per-point contributions compensates
+ *  for the rounding errors of the float type (Kahan summation).
+ *
+ *  The model itself (sample, bandwidth, maintenance and optimization) is
+ *  always kept in double precision. The float copy of the sample is converted
+ *  on the device and refreshed lazily whenever the sample changes.
+ */
+
+#ifndef OCL_SINGLE_PRECISION_H_
+#define OCL_SINGLE_PRECISION_H_
+
+#include "ocl_estimator.h"
+
+#ifdef USE_OPENCL
+
+typedef struct ocl_single_precision {
+  cl_mem sample_buffer;         // Float copy of the (normalized) sample.
+  cl_mem mean_buffer;           // Float copy of the sample mean.
+  cl_mem sdev_buffer;           // Float copy of the sample standard deviation.
+  cl_mem bandwidth_buffer;      // Float copy of the bandwidth.
+  cl_mem input_buffer;          // Query bounds.
+  cl_mem local_results_buffer;  // Local contribution of each sample point.
+  cl_mem result_buffer;         // Final estimate.
+  cl_kernel kde_kernel;
+  cl_kernel convert_kernel;
+  ocl_aggregation_descriptor_t* sum_descriptor;
+  bool sample_valid;            // False if the sample copy is outdated.
+} ocl_single_precision_t;
+
+/*
+ * Computes the selectivity estimate for the given (unnormalized) query bounds
+ * in single precision. Other than the double-precision path, this does not
+ * keep the per-point contributions for model maintenance.
+ */
+double ocl_singlePrecisionRangeKDE(
+    ocl_estimator_t* estimator, const kde_float_t* query);
+
+/*
+ * Marks the float copy of the sample as outdated. Must be called whenever
+ * the sample of the model changes.
+ */
+void ocl_invalidateSinglePrecisionSample(ocl_estimator_t* estimator);
+
+/*
+ * Releases all buffers of the single-precision path.
+ */
+void ocl_releaseSinglePrecisionBuffers(ocl_estimator_t* estimator);
+
+#endif /* USE_OPENCL */
+#endif /* OCL_SINGLE_PRECISION_H_ */
@@ -0,0 +1,376 @@
+/*
+ * ocl_spatial_index.c
+ */
+
+#include "ocl_spatial_index.h"
+
+#ifdef USE_OPENCL
+
+#include <math.h>
+#include <stdlib.h>
+
+#include "ocl_adaptive_bandwidth.h"
+
+extern ocl_kernel_type_t global_kernel_type;
+
+// GUC configuration variables.
+bool kde_enable_spatial_pruning = false;
+double kde_spatial_pruning_error = 1e-6;
+
+// Context for sorting sample positions along a single dimension.
+static const kde_float_t* sort_sample = NULL;
+static unsigned int sort_dimensions = 0;
+static unsigned int sort_dimension = 0;
+
+static int comparePositions(const void* a, const void* b) {
+  kde_float_t va = sort_sample[
+      *(const unsigned int*)a * sort_dimensions + sort_dimension];
+  kde_float_t vb = sort_sample[
+      *(const unsigned int*)b * sort_dimensions + sort_dimension];
+  return (va > vb) - (va < vb);
+}
+
+/*
+ * Helper function to recursively split the given sample positions along the
+ * dimension with the largest extent until every part fits into a bucket.
+ * Splits are placed at multiples of the bucket size, so all buckets but the
+ * last one are full.
+ */
+static void partition(
+    const kde_float_t* sample, unsigned int d, unsigned int* positions,
+    unsigned int nr_of_positions) {
+  unsigned int i, j;
+  unsigned int split_dimension = 0;
+  kde_float_t max_extent = -1;
+  unsigned int buckets, split;
+  if (nr_of_positions <= OCL_SPATIAL_INDEX_BUCKET_SIZE) return;
+  for (j = 0; j < d; ++j) {
+    kde_float_t lo = INFINITY;
+    kde_float_t up = -INFINITY;
+    for (i = 0; i < nr_of_positions; ++i) {
+      kde_float_t val = sample[positions[i] * d + j];
+      lo = Min(lo, val);
+      up = Max(up, val);
+    }
+    if (up - lo > max_extent) {
+      max_extent = up - lo;
+      split_dimension = j;
+    }
+  }
+  sort_sample = sample;
+  sort_dimensions = d;
+  sort_dimension = split_dimension;
+  qsort(positions, nr_of_positions, sizeof(unsigned int), comparePositions);
+  buckets = (nr_of_positions + OCL_SPATIAL_INDEX_BUCKET_SIZE - 1)
+      / OCL_SPATIAL_INDEX_BUCKET_SIZE;
+  split = ((buckets + 1) / 2) * OCL_SPATIAL_INDEX_BUCKET_SIZE;
+  partition(sample, d, positions, split);
+  partition(sample, d, positions + split, nr_of_positions - split);
+}
+
+// Helper function to extend the bounding box of a bucket by the given item.
+static void extendBounds(
+    ocl_spatial_index_t* index, unsigned int bucket, unsigned int d,
+    const kde_float_t* item) {
+  unsigned int i;
+  kde_float_t* bounds = &(index->host_bounds[2 * d * bucket]);
+  for (i = 0; i < d; ++i) {
+    bounds[2 * i] = Min(bounds[2 * i], item[i]);
+    bounds[2 * i + 1] = Max(bounds[2 * i + 1], item[i]);
+  }
+}
+
+// Helper function to (re-)build the index from the given sample (in sample
+// position order).
+static void buildIndex(
+    ocl_estimator_t* estimator, ocl_spatial_index_t* index,
+    const kde_float_t* sample) {
+  unsigned int i, j;
+  unsigned int d = estimator->nr_of_dimensions;
+  unsigned int n = estimator->rows_in_sample;
+  unsigned int* positions = palloc(sizeof(unsigned int) * n);
+  for (i = 0; i < n; ++i) positions[i] = i;
+  partition(sample, d, positions, n);
+  // The bucket slots are filled in partition order, padding slots are zero.
+  memset(index->host_sample, 0, sizeof(kde_float_t) * d *
+         index->nr_of_buckets * OCL_SPATIAL_INDEX_BUCKET_SIZE);
+  for (i = 0; i < index->nr_of_buckets; ++i) {
+    for (j = 0; j < d; ++j) {
+      index->host_bounds[2 * d * i + 2 * j] = INFINITY;
+      index->host_bounds[2 * d * i + 2 * j + 1] = -INFINITY;
+    }
+    index->host_counts[i] = 0;
+  }
+  for (i = 0; i < n; ++i) {
+    unsigned int bucket = i / OCL_SPATIAL_INDEX_BUCKET_SIZE;
+    const kde_float_t* item = &(sample[positions[i] * d]);
+    memcpy(&(index->host_sample[i * d]), item, sizeof(kde_float_t) * d);
+    index->slot_of_position[positions[i]] = i;
+    index->host_counts[bucket]++;
+    extendBounds(index, bucket, d, item);
+  }
+  pfree(positions);
+  index->updates_since_build = 0;
+  index->valid = true;
+  index->dirty = true;
+}
+
+// Helper function to build the index from the device sample.
+static void buildIndexFromDevice(
+    ocl_estimator_t* estimator, ocl_spatial_index_t* index) {
+  ocl_context_t* context = ocl_getContext();
+  cl_int err = CL_SUCCESS;
+  size_t sample_size = ocl_sizeOfSampleItem(estimator) *
+      estimator->rows_in_sample;
+  kde_float_t* sample = palloc(sample_size);
+  // Make sure all pending sample updates have reached the device.
+  err |= clFinish(context->queue);
+  err |= clEnqueueReadBuffer(
+      context->queue, estimator->sample_buffer, CL_TRUE, 0, sample_size,
+      sample, 0, NULL, NULL);
+  Assert(err == CL_SUCCESS);
+  estimator->stats->estimation_transfer_to_host++;
+  buildIndex(estimator, index, sample);
+  pfree(sample);
+}
+
+// Helper function to rebuild the index from the (up-to-date) host copy.
+static void rebuildIndexFromHost(
+    ocl_estimator_t* estimator, ocl_spatial_index_t* index) {
+  unsigned int i;
+  unsigned int d = estimator->nr_of_dimensions;
+  kde_float_t* sample = palloc(
+      ocl_sizeOfSampleItem(estimator) * estimator->rows_in_sample);
+  for (i = 0; i < estimator->rows_in_sample; ++i) {
+    memcpy(&(sample[i * d]),
+           &(index->host_sample[index->slot_of_position[i] * d]),
+           sizeof(kde_float_t) * d);
+  }
+  buildIndex(estimator, index, sample);
+  pfree(sample);
+}
+
+// Helper function to allocate the spatial index of the estimator.
+static ocl_spatial_index_t* getIndex(ocl_estimator_t* estimator) {
+  ocl_context_t* context;
+  cl_int err = CL_SUCCESS;
+  unsigned int d = estimator->nr_of_dimensions;
+  ocl_spatial_index_t* index;
+  size_t slots;
+  if (estimator->spatial_index) return estimator->spatial_index;
+  context = ocl_getContext();
+  index = calloc(1, sizeof(ocl_spatial_index_t));
+  index->nr_of_buckets = (estimator->rows_in_sample +
+      OCL_SPATIAL_INDEX_BUCKET_SIZE - 1) / OCL_SPATIAL_INDEX_BUCKET_SIZE;
+  slots = index->nr_of_buckets * OCL_SPATIAL_INDEX_BUCKET_SIZE;
+  index->host_sample = malloc(sizeof(kde_float_t) * d * slots);
+  index->host_bounds = malloc(
+      sizeof(kde_float_t) * 2 * d * index->nr_of_buckets);
+  index->host_counts = malloc(sizeof(unsigned int) * index->nr_of_buckets);
+  index->slot_of_position = malloc(
+      sizeof(unsigned int) * estimator->rows_in_sample);
+  index->sample_buffer = ocl_createBuffer(
+      context->context, CL_MEM_READ_ONLY,
+      sizeof(kde_float_t) * d * slots, NULL, &err);
+  Assert(err == CL_SUCCESS);
+  index->bounds_buffer = ocl_createBuffer(
+      context->context, CL_MEM_READ_ONLY,
+      sizeof(kde_float_t) * 2 * d * index->nr_of_buckets, NULL, &err);
+  Assert(err == CL_SUCCESS);
+  index->count_buffer = ocl_createBuffer(
+      context->context, CL_MEM_READ_ONLY,
+      sizeof(unsigned int) * index->nr_of_buckets, NULL, &err);
+  Assert(err == CL_SUCCESS);
+  index->bucket_results_buffer = ocl_createBuffer(
+      context->context, CL_MEM_READ_WRITE,
+      sizeof(kde_float_t) * index->nr_of_buckets, NULL, &err);
+  Assert(err == CL_SUCCESS);
+  index->result_buffer = ocl_createBuffer(
+      context->context, CL_MEM_READ_WRITE, sizeof(kde_float_t), NULL, &err);
+  Assert(err == CL_SUCCESS);
+  if (global_kernel_type == EPANECHNIKOV) {
+    index->kde_kernel = ocl_getKernel("epanechnikov_kde_pruned", d);
+  } else {
+    index->kde_kernel = ocl_getKernel("gauss_kde_pruned", d);
+  }
+  err |= clSetKernelArg(
+      index->kde_kernel, 0, sizeof(cl_mem), &(index->sample_buffer));
+  err |= clSetKernelArg(
+      index->kde_kernel, 1, sizeof(cl_mem), &(index->bounds_buffer));
+  err |= clSetKernelArg(
+      index->kde_kernel, 2, sizeof(cl_mem), &(index->count_buffer));
+  err |= clSetKernelArg(
+      index->kde_kernel, 3, sizeof(cl_mem), &(index->bucket_results_buffer));
+  err |= clSetKernelArg(
+      index->kde_kernel, 4, sizeof(cl_mem), &(estimator->input_buffer));
+  err |= clSetKernelArg(
+      index->kde_kernel, 5, sizeof(cl_mem), &(estimator->bandwidth_buffer));
+  err |= clSetKernelArg(
+      index->kde_kernel, 6, sizeof(cl_mem), &(estimator->mean_buffer));
+  err |= clSetKernelArg(
+      index->kde_kernel, 7, sizeof(cl_mem), &(estimator->sdev_buffer));
+  err |= clSetKernelArg(
+      index->kde_kernel, 9,
+      sizeof(kde_float_t) * OCL_SPATIAL_INDEX_BUCKET_SIZE, NULL);
+  Assert(err == CL_SUCCESS);
+  index->sum_descriptor = prepareSumDescriptor(
+      index->bucket_results_buffer, index->nr_of_buckets,
+      index->result_buffer, 0);
+  index->valid = false;
+  estimator->spatial_index = index;
+  return index;
+}
+
+/*
+ * Helper function to compute at how many bandwidths the kernel is cut off.
+ *
+ * A sample point that is c bandwidths outside of the query in any dimension
+ * contributes at most erfc(c / sqrt(2)) / 2 to the normalized Gauss estimate,
+ * so we pick the smallest c for which this stays below the error bound.
+ */
+static double kernelCutoff(void) {
+  static double cached_error = -1.0;
+  static double cached_cutoff = 0.0;
+  unsigned int i;
+  double lo = 0.0;
+  double up = 40.0;   // erfc underflows beyond this point.
+  if (global_kernel_type == EPANECHNIKOV) return 1.0;  // Compact support.
+  if (cached_error == kde_spatial_pruning_error) return cached_cutoff;
+  for (i = 0; i < 64; ++i) {
+    double c = (lo + up) / 2;
+    if (erfc(c / M_SQRT2) / 2 > kde_spatial_pruning_error) {
+      lo = c;
+    } else {
+      up = c;
+    }
+  }
+  cached_error = kde_spatial_pruning_error;
+  cached_cutoff = up;
+  return up;
+}
+
+double ocl_spatialIndexRangeKDE(
+    ocl_estimator_t* estimator, const kde_float_t* query) {
+  unsigned int i;
+  ocl_context_t* context = ocl_getContext();
+  cl_int err = CL_SUCCESS;
+  unsigned int d = estimator->nr_of_dimensions;
+  ocl_spatial_index_t* index = getIndex(estimator);
+  cl_event events[5];
+  unsigned int nr_of_events = 0;
+  cl_event optimization_event;
+  kde_float_t cutoff;
+  size_t local_size = OCL_SPATIAL_INDEX_BUCKET_SIZE;
+  size_t global_size = index->nr_of_buckets * local_size;
+  cl_event kde_event;
+  cl_event sum_event;
+  kde_float_t result;
+  double normalization_factor;
+  // Make sure the index reflects the current sample. In-place updates only
+  // widen the bounding boxes, so we rebuild after many of them.
+  if (!index->valid) {
+    buildIndexFromDevice(estimator, index);
+  } else if (index->updates_since_build > estimator->rows_in_sample / 2) {
+    rebuildIndexFromHost(estimator, index);
+  }
+  // Collect everything the kde kernel has to wait for.
+  if (index->dirty) {
+    size_t slots = index->nr_of_buckets * OCL_SPATIAL_INDEX_BUCKET_SIZE;
+    err |= clEnqueueWriteBuffer(
+        context->queue, index->sample_buffer, CL_FALSE, 0,
+        sizeof(kde_float_t) * d * slots, index->host_sample,
+        0, NULL, &(events[nr_of_events++]));
+    err |= clEnqueueWriteBuffer(
+        context->queue, index->bounds_buffer, CL_FALSE, 0,
+        sizeof(kde_float_t) * 2 * d * index->nr_of_buckets,
+        index->host_bounds, 0, NULL, &(events[nr_of_events++]));
+    err |= clEnqueueWriteBuffer(
+        context->queue, index->count_buffer, CL_FALSE, 0,
+        sizeof(unsigned int) * index->nr_of_buckets, index->host_counts,
+        0, NULL, &(events[nr_of_events++]));
+    Assert(err == CL_SUCCESS);
+    estimator->stats->estimation_transfer_to_device += 3;
+    index->dirty = false;
+  }
+  // Transfer the query bounds to the device.
+  err = clEnqueueWriteBuffer(
+      context->queue, estimator->input_buffer, CL_FALSE, 0,
+      sizeof(kde_float_t) * 2 * d, query, 0, NULL, &(events[nr_of_events++]));
+  estimator->stats->estimation_transfer_to_device++;
+  Assert(err == CL_SUCCESS);
+  // Pick up any pending bandwidth update.
+  optimization_event = estimator->bandwidth_optimization->optimization_event;
+  if (optimization_event) {
+    events[nr_of_events++] = optimization_event;
+    estimator->bandwidth_optimization->optimization_event = NULL;
+  }
+  // Compute the contribution of each bucket, one work group per bucket.
+  cutoff = kernelCutoff();
+  err = clSetKernelArg(index->kde_kernel, 8, sizeof(kde_float_t), &cutoff);
+  Assert(err == CL_SUCCESS);
+  err = clEnqueueNDRangeKernel(
+      context->queue, index->kde_kernel, 1, NULL, &global_size, &local_size,
+      nr_of_events, events, &kde_event);
+  Assert(err == CL_SUCCESS);
+  for (i = 0; i < nr_of_events; ++i) {
+    err = clReleaseEvent(events[i]);
+    Assert(err == CL_SUCCESS);
+  }
+  // Sum up the bucket contributions and transfer the result back.
+  sum_event = predefinedSumOfArray(index->sum_descriptor, kde_event);
+  err = clReleaseEvent(kde_event);
+  Assert(err == CL_SUCCESS);
+  err = clEnqueueReadBuffer(
+      context->queue, index->result_buffer, CL_TRUE, 0, sizeof(kde_float_t),
+      &result, 1, &sum_event, NULL);
+  estimator->stats->estimation_transfer_to_host++;
+  Assert(err == CL_SUCCESS);
+  err = clReleaseEvent(sum_event);
+  Assert(err == CL_SUCCESS);
+  if (global_kernel_type == EPANECHNIKOV) {
+    normalization_factor = pow(0.75, d);
+  } else {
+    normalization_factor = pow(0.5, d);
+  }
+  return result * normalization_factor / estimator->rows_in_sample;
+}
+
+void ocl_spatialIndexUpdateSampleItem(
+    ocl_estimator_t* estimator, int position, const kde_float_t* item) {
+  ocl_spatial_index_t* index = estimator->spatial_index;
+  unsigned int d = estimator->nr_of_dimensions;
+  unsigned int slot;
+  if (index == NULL || !index->valid) return;
+  slot = index->slot_of_position[position];
+  memcpy(&(index->host_sample[slot * d]), item, sizeof(kde_float_t) * d);
+  extendBounds(index, slot / OCL_SPATIAL_INDEX_BUCKET_SIZE, d, item);
+  index->updates_since_build++;
+  index->dirty = true;
+}
+
+void ocl_invalidateSpatialIndex(ocl_estimator_t* estimator) {
+  if (estimator->spatial_index == NULL) return;
+  estimator->spatial_index->valid = false;
+}
+
+void ocl_releaseSpatialIndex(ocl_estimator_t* estimator) {
+  ocl_spatial_index_t* index = estimator->spatial_index;
+  cl_int err = CL_SUCCESS;
+  if (index == NULL) return;
+  err |= clReleaseMemObject(index->sample_buffer);
+  err |= clReleaseMemObject(index->bounds_buffer);
+  err |= clReleaseMemObject(index->count_buffer);
+  err |= clReleaseMemObject(index->bucket_results_buffer);
+  err |= clReleaseMemObject(index->result_buffer);
+  err |= clReleaseKernel(index->kde_kernel);
+  Assert(err == CL_SUCCESS);
+  releaseAggregationDescriptor(index->sum_descriptor);
+  free(index->host_sample);
+  free(index->host_bounds);
+  free(index->host_counts);
+  free(index->slot_of_position);
+  free(index);
+  estimator->spatial_index = NULL;
+}
+
+#endif /* USE_OPENCL */
@@ -0,0 +1,76 @@
+/*
+ * ocl_spatial_index.h
+ *
+ *  Spatial pruning index for kde_enable_spatial_pruning. The sample is
+ *  partitioned into buckets of nearby points using a k-d split, and every
+ *  bucket keeps the bounding box of its points. The pruned kde kernels run
+ *  one work group per bucket and skip buckets whose bounding box, extended by
+ *  the support of the kernel, does not intersect the query. The Epanechnikov
+ *  kernel has compact support, so pruning is exact. For the Gauss kernel, the
+ *  support is cut off such that the total error of the estimate stays below
+ *  kde_spatial_pruning_error.
+ *
+ *  The index keeps a bucket-ordered copy of the sample on the host and on the
+ *  device. Sample maintenance updates points in place and only widens the
+ *  bounding boxes, after many updates the index is rebuilt.
+ */
+
+#ifndef OCL_SPATIAL_INDEX_H_
+#define OCL_SPATIAL_INDEX_H_
+
+#include "ocl_estimator.h"
+
+#ifdef USE_OPENCL
+
+/*
+ * Number of sample points per bucket. This is also the work group size of
+ * the pruned kde kernels, so it has to be a power of two.
+ */
+#define OCL_SPATIAL_INDEX_BUCKET_SIZE 64
+
+typedef struct ocl_spatial_index {
+  unsigned int nr_of_buckets;
+  kde_float_t* host_sample;     // Bucket-ordered copy of the sample.
+  kde_float_t* host_bounds;     // Bounding box (2*d values) per bucket.
+  unsigned int* host_counts;    // Number of points per bucket.
+  unsigned int* slot_of_position; // Maps sample positions to bucket slots.
+  unsigned int updates_since_build;
+  bool valid;                   // False if the index has to be rebuilt.
+  bool dirty;                   // True if the device copy is outdated.
+  cl_mem sample_buffer;
+  cl_mem bounds_buffer;
+  cl_mem count_buffer;
+  cl_mem bucket_results_buffer; // Contribution of each bucket.
+  cl_mem result_buffer;         // Final estimate.
+  cl_kernel kde_kernel;
+  ocl_aggregation_descriptor_t* sum_descriptor;
+} ocl_spatial_index_t;
+
+/*
+ * Computes the selectivity estimate for the given (unnormalized) query bounds
+ * using the spatial index. Other than the regular path, this does not keep
+ * the per-point contributions for model maintenance.
+ */
+double ocl_spatialIndexRangeKDE(
+    ocl_estimator_t* estimator, const kde_float_t* query);
+
+/*
+ * Updates the sample item at the given position in the index. The item must
+ * already be normalized. This is a no-op if the index has not been built.
+ */
+void ocl_spatialIndexUpdateSampleItem(
+    ocl_estimator_t* estimator, int position, const kde_float_t* item);
+
+/*
+ * Drops the index, it is rebuilt from the device sample on the next
+ * estimate.
+ */
+void ocl_invalidateSpatialIndex(ocl_estimator_t* estimator);
+
+/*
+ * Releases all buffers of the spatial index.
+ */
+void ocl_releaseSpatialIndex(ocl_estimator_t* estimator);
+
+#endif /* USE_OPENCL */
+#endif /* OCL_SPATIAL_INDEX_H_ */
@@ -9,11 +9,22 @@
 #include "ocl_utilities.h"
 
 #include <math.h>
+#include <sys/stat.h>
 #include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ocl_optimization_worker.h"
 
 #include "miscadmin.h"
+#include "access/hash.h"
+#include "access/htup_details.h"
 #include "catalog/pg_type.h"
+#include "funcapi.h"
 #include "optimizer/path/gpukde/ocl_estimator_api.h"
+#include "postmaster/bgworker.h"
+#include "storage/ipc.h"
+#include "utils/builtins.h"
 
 #ifdef USE_OPENCL
 
@@ -30,6 +41,8 @@ bool kde_enable;
 bool kde_debug;
 int kde_samplesize;
 int kde_bandwidth_representation;
+bool ocl_use_program_cache;
+char* ocl_prewarm_dimensions;
 
 cl_kernel init_buffer_min = NULL;
 cl_kernel init_buffer_sum = NULL;
@@ -39,6 +52,11 @@ cl_kernel slow_sum = NULL;
 cl_kernel fast_min = NULL;
 cl_kernel slow_min = NULL;
 cl_kernel last_min = NULL;
+cl_mem tmp_buffer_min = NULL;
+cl_mem tmp_buffer_index = NULL;
+
+// Number of OpenCL buffers and kernels created by this backend.
+static long nr_of_allocations = 0;
 
 bool ocl_isDebug() {
   return kde_debug;
@@ -220,6 +238,148 @@ static void concatFiles(
   }
 }
 
+/*
+ * Compiled program binaries are cached in $PGDATA/pg_kde_programs. Each cache
+ * file starts with a header that stores the full cache key, so we never load
+ * a binary that was built for a different device, driver, kernel source or
+ * set of build parameters.
+ */
+#define PROGRAM_CACHE_MAGIC 0x4f434c42 // "OCLB"
+
+typedef struct program_cache_header {
+  uint32 magic;
+  uint32 key_length;
+  uint64 binary_size;
+} program_cache_header_t;
+
+// Helper function to construct the cache key and file name for a program.
+static char* buildProgramCacheKey(
+    ocl_context_t* context, const char* kernel_sources,
+    size_t kernel_source_length, const char* device_params,
+    char* cache_file_name) {
+  char device_name[256];
+  char device_version[256];
+  char driver_version[256];
+  cl_int err = CL_SUCCESS;
+  err |= clGetDeviceInfo(context->device, CL_DEVICE_NAME,
+                         sizeof(device_name), device_name, NULL);
+  err |= clGetDeviceInfo(context->device, CL_DEVICE_VERSION,
+                         sizeof(device_version), device_version, NULL);
+  err |= clGetDeviceInfo(context->device, CL_DRIVER_VERSION,
+                         sizeof(driver_version), driver_version, NULL);
+  if (err != CL_SUCCESS) return NULL;
+  uint32 source_hash = DatumGetUInt32(hash_any(
+      (const unsigned char*)kernel_sources, (int)kernel_source_length));
+  size_t key_length = strlen(device_name) + strlen(device_version) +
+      strlen(driver_version) + strlen(device_params) + 64;
+  char* key = malloc(key_length);
+  snprintf(key, key_length, "%s;%s;%s;%08x;%s", device_name, device_version,
+           driver_version, source_hash, device_params);
+  uint32 key_hash = DatumGetUInt32(hash_any(
+      (const unsigned char*)key, (int)strlen(key)));
+  snprintf(cache_file_name, 1024, "%s/pg_kde_programs/%08x_%08x.bin",
+           DataDir, source_hash, key_hash);
+  return key;
+}
+
+// Helper function to load a program from the binary cache. Returns NULL if the
+// cache file is missing, does not match or is damaged, so that the caller
+// rebuilds the program from source.
+static cl_program loadCachedProgram(
+    ocl_context_t* context, const char* cache_file_name, const char* key,
+    const char* device_params) {
+  FILE* f = fopen(cache_file_name, "rb");
+  if (f == NULL) return NULL;
+  cl_program program = NULL;
+  unsigned char* binary = NULL;
+  char* stored_key = NULL;
+  program_cache_header_t header;
+  struct stat file_stat;
+  if (fstat(fileno(f), &file_stat) != 0) goto cleanup;
+  if (fread(&header, sizeof(header), 1, f) != 1) goto cleanup;
+  if (header.magic != PROGRAM_CACHE_MAGIC) goto cleanup;
+  if (header.key_length != strlen(key)) goto cleanup;
+  // The file holds exactly the header, the key and the binary. Anything else
+  // (e.g. a truncated file) must not be trusted for the allocation below.
+  if ((uint64)file_stat.st_size <= sizeof(header) + header.key_length ||
+      header.binary_size != (uint64)file_stat.st_size - sizeof(header) -
+          header.key_length) goto cleanup;
+  stored_key = malloc(header.key_length);
+  if (stored_key == NULL) goto cleanup;
+  if (fread(stored_key, header.key_length, 1, f) != 1) goto cleanup;
+  if (memcmp(stored_key, key, header.key_length) != 0) goto cleanup;
+  binary = malloc(header.binary_size);
+  if (binary == NULL) goto cleanup;
+  if (fread(binary, header.binary_size, 1, f) != 1) goto cleanup;
+  // Ok, we found a matching binary. Create the program.
+  cl_int err = CL_SUCCESS;
+  cl_int binary_status = CL_SUCCESS;
+  size_t binary_size = header.binary_size;
+  program = clCreateProgramWithBinary(
+      context->context, 1, &(context->device), &binary_size,
+      (const unsigned char**)&binary, &binary_status, &err);
+  if (err != CL_SUCCESS || binary_status != CL_SUCCESS) {
+    if (program) clReleaseProgram(program);
+    program = NULL;
+    goto cleanup;
+  }
+  err = clBuildProgram(
+      program, 1, &(context->device), device_params, NULL, NULL);
+  if (err != CL_SUCCESS) {
+    clReleaseProgram(program);
+    program = NULL;
+    goto cleanup;
+  }
+  if (ocl_isDebug()) {
+    fprintf(stderr, "Loaded OpenCL kernels %s from cache\n", device_params);
+  }
+
+cleanup:
+  fclose(f);
+  if (stored_key) free(stored_key);
+  if (binary) free(binary);
+  return program;
+}
+
+// Helper function to write the binary of a built program to the cache.
+static void storeCachedProgram(
+    ocl_context_t* context, cl_program program, const char* cache_file_name,
+    const char* key) {
+  cl_int err = CL_SUCCESS;
+  size_t binary_size;
+  err = clGetProgramInfo(
+      program, CL_PROGRAM_BINARY_SIZES, sizeof(size_t), &binary_size, NULL);
+  if (err != CL_SUCCESS || binary_size == 0) return;
+  unsigned char* binary = malloc(binary_size);
+  err = clGetProgramInfo(
+      program, CL_PROGRAM_BINARIES, sizeof(unsigned char*), &binary, NULL);
+  if (err != CL_SUCCESS) {
+    free(binary);
+    return;
+  }
+  // Write to a temporary file first and rename it into place, so concurrent
+  // backends never observe a partially written binary.
+  char tmp_file_name[1100];
+  snprintf(tmp_file_name, sizeof(tmp_file_name), "%s.%i.tmp",
+           cache_file_name, (int)getpid());
+  FILE* f = fopen(tmp_file_name, "wb");
+  if (f == NULL) {
+    free(binary);
+    return;
+  }
+  program_cache_header_t header;
+  header.magic = PROGRAM_CACHE_MAGIC;
+  header.key_length = strlen(key);
+  header.binary_size = binary_size;
+  bool success = fwrite(&header, sizeof(header), 1, f) == 1;
+  success &= fwrite(key, header.key_length, 1, f) == 1;
+  success &= fwrite(binary, binary_size, 1, f) == 1;
+  success &= fclose(f) == 0;
+  if (success) success = rename(tmp_file_name, cache_file_name) == 0;
+  if (!success) unlink(tmp_file_name);
+  free(binary);
+}
+
 // Helper function to build a program from all kernel files using the given build params
 static cl_program buildProgram(
     ocl_context_t* context, const char* build_params) {
@@ -261,16 +421,26 @@ static cl_program buildProgram(
       strcat(device_params, "\" ");
     }
   }
-  if (sizeof(kde_float_t) == sizeof(double)) {
-    strcat(device_params, "-DTYPE=8 ");
-  } else if (sizeof(kde_float_t) == sizeof(float)) {
-    strcat(device_params, "-DTYPE=4 ");
-  }
   strcat(device_params, build_params);
 
+  // Check whether we have a cached binary for this program.
+  cl_program program = NULL;
+  char* cache_key = NULL;
+  char cache_file_name[1024];
+  if (ocl_use_program_cache) {
+    cache_key = buildProgramCacheKey(
+        context, kernel_sources, kernel_source_length, device_params,
+        cache_file_name);
+    if (cache_key) {
+      program = loadCachedProgram(
+          context, cache_file_name, cache_key, device_params);
+    }
+  }
+  if (program) goto register_program;
+
   // Ok, build the program.
   cl_int err = CL_SUCCESS;
-  cl_program program = clCreateProgramWithSource(
+  program = clCreateProgramWithSource(
       context->context, 1, (const char**)&kernel_sources,
       &kernel_source_length, &err);
   Assert(err == CL_SUCCESS);
@@ -296,6 +466,10 @@ static cl_program buildProgram(
     program = NULL;
     goto cleanup;
   }
+  // Store the binary for subsequent backends.
+  if (cache_key) storeCachedProgram(context, program, cache_file_name, cache_key);
+
+register_program:
   // And add it to the registry:
   dictionary_insert(context->program_registry, build_params, program);
 
@@ -306,22 +480,25 @@ cleanup:
   }
   free(file_buffers);
   free(file_lengths);
+  free(kernel_sources);
+  if (cache_key) free(cache_key);
   // We are done.
   return program;
 }
 
-/*
- *	Fetches the given kernel for the given build_params.
- */
-cl_kernel ocl_getKernel(const char* kernel_name, int dimensions) {
-  // We only introduce the number of dimensions into the kernels.
-  char build_params[32];
+// Helper function to fetch (and build, if required) the program for the given
+// dimensionality and floating point type.
+static cl_program getProgram(int dimensions, bool single_precision) {
+  // We only introduce the number of dimensions and the type into the kernels.
+  char build_params[64];
+  int type_size = single_precision ? sizeof(float) : sizeof(kde_float_t);
   
   if(kde_bandwidth_representation == LOG_BW){
-    sprintf(build_params, "-DLOG_BANDWIDTH -DD=%i",dimensions);
+    sprintf(build_params, "-DTYPE=%i -DLOG_BANDWIDTH -DD=%i",
+            type_size, dimensions);
   }
   else {
-    sprintf(build_params, "-DD=%i", dimensions);
+    sprintf(build_params, "-DTYPE=%i -DD=%i", type_size, dimensions);
   }  
 
   // Get the context
@@ -332,18 +509,97 @@ cl_kernel ocl_getKernel(const char* kernel_name, int dimensions) {
   if (program == NULL) {
     // The program was not found, build a new program using the given build_params.
     program = buildProgram(context, build_params);
-    if (program == NULL) return NULL;
   }
+  return program;
+}
+
+/*
+ *	Fetches the given kernel for the given build_params.
+ */
+cl_kernel ocl_getKernel(const char* kernel_name, int dimensions) {
+  cl_program program = getProgram(dimensions, false);
+  if (program == NULL) return NULL;
   // Ok, we have the program, create the kernel.
   cl_int err;
   cl_kernel result = clCreateKernel(program, kernel_name, &err);
   if (err != CL_SUCCESS) {
     return NULL;
   } else {
+    nr_of_allocations++;
+    return result;
+  }
+}
+
+cl_kernel ocl_getSinglePrecisionKernel(const char* kernel_name, int dimensions) {
+  cl_program program = getProgram(dimensions, true);
+  if (program == NULL) return NULL;
+  cl_int err;
+  cl_kernel result = clCreateKernel(program, kernel_name, &err);
+  if (err != CL_SUCCESS) {
+    return NULL;
+  } else {
+    nr_of_allocations++;
     return result;
   }
 }
 
+cl_mem ocl_createBuffer(
+    cl_context context, cl_mem_flags flags, size_t size, void* host_ptr,
+    cl_int* err) {
+  cl_mem result = clCreateBuffer(context, flags, size, host_ptr, err);
+  if (result) nr_of_allocations++;
+  return result;
+}
+
+cl_mem ocl_createSubBuffer(
+    cl_mem buffer, cl_mem_flags flags, cl_buffer_create_type type,
+    const void* info, cl_int* err) {
+  cl_mem result = clCreateSubBuffer(buffer, flags, type, info, err);
+  if (result) nr_of_allocations++;
+  return result;
+}
+
+long ocl_getAllocationCount(void) {
+  return nr_of_allocations;
+}
+
+/*
+ * Main function of the background worker that fills the program cache for all
+ * dimensionalities listed in ocl_prewarm_dimensions.
+ */
+static void ocl_prewarmProgramCache(Datum main_arg) {
+  BackgroundWorkerUnblockSignals();
+  if (ocl_getContext() == NULL) proc_exit(1);
+  // The aggregation kernels are always built without dimensions.
+  getProgram(0, false);
+  char* dimensions = strdup(ocl_prewarm_dimensions);
+  char* tmp = strtok(dimensions, ", ");
+  while (tmp) {
+    int d = atoi(tmp);
+    if (d > 0 && d <= 15) getProgram(d, false);
+    tmp = strtok(NULL, ", ");
+  }
+  free(dimensions);
+  ocl_releaseContext();
+  // Exit with a non-zero code, so the postmaster does not restart us.
+  proc_exit(1);
+}
+
+void ocl_registerBackgroundWorkers(void) {
+  if (ocl_use_program_cache && ocl_prewarm_dimensions &&
+      ocl_prewarm_dimensions[0] != '\0') {
+    BackgroundWorker worker;
+    MemSet(&worker, 0, sizeof(BackgroundWorker));
+    snprintf(worker.bgw_name, BGW_MAXLEN, "kde program cache prewarm");
+    worker.bgw_flags = 0;
+    worker.bgw_start_time = BgWorkerStart_PostmasterStart;
+    worker.bgw_restart_time = BGW_NEVER_RESTART;
+    worker.bgw_main = ocl_prewarmProgramCache;
+    RegisterBackgroundWorker(&worker);
+  }
+  ocl_registerOptimizationWorker();
+}
+
 void ocl_dumpBufferToFile(
     const char* file, cl_mem buffer, int dimensions, int items) {
 
@@ -402,17 +658,26 @@ void ocl_printBuffer(
   pfree(host_buffer);
 }
 
-ocl_aggregation_descriptor_t* prepareSumDescriptor(
-    cl_mem input_buffer, unsigned int elements,
-    cl_mem result_buffer, unsigned int result_buffer_offset) {
+// Helper function to prepare a sum descriptor for the given element type.
+static ocl_aggregation_descriptor_t* prepareSumDescriptorForType(
+    cl_mem input_buffer, cl_mem weight_buffer, unsigned int elements,
+    cl_mem result_buffer, unsigned int result_buffer_offset,
+    bool single_precision) {
   ocl_context_t* context = ocl_getContext();
   cl_int err = CL_SUCCESS;
+  unsigned int zero = 0;
+  size_t element_size = single_precision ? sizeof(float) : sizeof(kde_float_t);
   
   ocl_aggregation_descriptor_t* descriptor = calloc(
       1, sizeof(ocl_aggregation_descriptor_t));
   // Prepare the kernels.
-  descriptor->pre_aggregation = ocl_getKernel("sum_par", 0);
-  descriptor->final_aggregation = ocl_getKernel("sum_seq", 0);
+  if (single_precision) {
+    descriptor->pre_aggregation = ocl_getSinglePrecisionKernel("sum_par", 0);
+    descriptor->final_aggregation = ocl_getSinglePrecisionKernel("sum_seq", 0);
+  } else {
+    descriptor->pre_aggregation = ocl_getKernel("sum_par", 0);
+    descriptor->final_aggregation = ocl_getKernel("sum_seq", 0);
+  }
   // Determine the optimal local size.
   err = clGetKernelWorkGroupInfo(
         descriptor->pre_aggregation, context->device, CL_KERNEL_WORK_GROUP_SIZE,
@@ -421,16 +686,47 @@ ocl_aggregation_descriptor_t* prepareSumDescriptor(
   
   // Truncate to local memory requirements.
   descriptor->local_size = Min(
-      descriptor->local_size, context->local_mem_size / sizeof(kde_float_t));
+      descriptor->local_size, context->local_mem_size / element_size);
   // And truncate to the next power of two.
   descriptor->local_size =
       (size_t)0x1 << (int)(log2((double)descriptor->local_size));
   // Allocate the temporary result buffer.
-  descriptor->intermediate_result_buffer =  clCreateBuffer(
+  descriptor->element_size = element_size;
+  descriptor->intermediate_result_buffer =  ocl_createBuffer(
       context->context, CL_MEM_READ_WRITE,
-      sizeof(kde_float_t) * context->max_compute_units, NULL, &err);
+      element_size * context->max_compute_units, NULL, &err);
+  Assert(err == CL_SUCCESS);
+  
+  // The arguments that do not depend on the input stay fixed.
+  err |= clSetKernelArg(
+      descriptor->pre_aggregation, 1,
+      element_size * descriptor->local_size, NULL);
+  err |= clSetKernelArg(
+      descriptor->pre_aggregation, 2, sizeof(cl_mem),
+      &(descriptor->intermediate_result_buffer));
+  err |= clSetKernelArg(
+      descriptor->final_aggregation, 0, sizeof(cl_mem),
+      &(descriptor->intermediate_result_buffer));
+  err |= clSetKernelArg(
+      descriptor->final_aggregation, 1, sizeof(unsigned int), &zero);
+  err |= clSetKernelArg(
+      descriptor->final_aggregation, 2, sizeof(unsigned int),
+      &(context->max_compute_units));
   Assert(err == CL_SUCCESS);
+  rebindSumDescriptor(
+      descriptor, input_buffer, weight_buffer, elements, result_buffer,
+      result_buffer_offset);
   
+  // We are done :)
+  return descriptor;
+}
+
+void rebindSumDescriptor(
+    ocl_aggregation_descriptor_t* descriptor, cl_mem input_buffer,
+    cl_mem weight_buffer, unsigned int elements, cl_mem result_buffer,
+    unsigned int result_buffer_offset) {
+  ocl_context_t* context = ocl_getContext();
+  cl_int err = CL_SUCCESS;
   // Figure out how many elements we have to aggregate per thread:
   unsigned int tuples_per_thread =
       elements / (context->max_compute_units * descriptor->local_size);
@@ -440,38 +736,43 @@ ocl_aggregation_descriptor_t* prepareSumDescriptor(
   // Prepare the pre-aggregation kernel.
   err |= clSetKernelArg(
       descriptor->pre_aggregation, 0, sizeof(cl_mem), &input_buffer);
-  err |= clSetKernelArg(
-      descriptor->pre_aggregation, 1,
-      sizeof(kde_float_t) * descriptor->local_size, NULL);
-  err |= clSetKernelArg(
-      descriptor->pre_aggregation, 2, sizeof(cl_mem),
-      &(descriptor->intermediate_result_buffer));
   err |= clSetKernelArg(
       descriptor->pre_aggregation, 3, sizeof(unsigned int), &tuples_per_thread);
   err |= clSetKernelArg(
       descriptor->pre_aggregation, 4,
       sizeof(unsigned int), &elements);
-  Assert(err == CL_SUCCESS);
-  
-  // Prepare the post-aggregation kernel.
-  unsigned int zero = 0;
-  err |= clSetKernelArg(
-      descriptor->final_aggregation, 0, sizeof(cl_mem),
-      &(descriptor->intermediate_result_buffer));
-  err |= clSetKernelArg(
-      descriptor->final_aggregation, 1, sizeof(unsigned int), &zero);
   err |= clSetKernelArg(
-      descriptor->final_aggregation, 2, sizeof(unsigned int),
-      &(context->max_compute_units));
+      descriptor->pre_aggregation, 5, sizeof(cl_mem), &weight_buffer);
+  // Prepare the post-aggregation kernel.
   err |= clSetKernelArg(
       descriptor->final_aggregation, 3, sizeof(cl_mem), &result_buffer);
   err |= clSetKernelArg(
       descriptor->final_aggregation, 4, sizeof(unsigned int),
       &result_buffer_offset);
   Assert(err == CL_SUCCESS);
-  
-  // We are done :)
-  return descriptor;
+}
+
+ocl_aggregation_descriptor_t* prepareSumDescriptor(
+    cl_mem input_buffer, unsigned int elements,
+    cl_mem result_buffer, unsigned int result_buffer_offset) {
+  return prepareSumDescriptorForType(
+      input_buffer, NULL, elements, result_buffer, result_buffer_offset,
+      false);
+}
+
+ocl_aggregation_descriptor_t* prepareWeightedSumDescriptor(
+    cl_mem input_buffer, cl_mem weight_buffer, unsigned int elements,
+    cl_mem result_buffer, unsigned int result_buffer_offset) {
+  return prepareSumDescriptorForType(
+      input_buffer, weight_buffer, elements, result_buffer,
+      result_buffer_offset, false);
+}
+
+ocl_aggregation_descriptor_t* prepareSinglePrecisionSumDescriptor(
+    cl_mem input_buffer, unsigned int elements,
+    cl_mem result_buffer, unsigned int result_buffer_offset) {
+  return prepareSumDescriptorForType(
+      input_buffer, NULL, elements, result_buffer, result_buffer_offset, true);
 }
 
 void releaseAggregationDescriptor(ocl_aggregation_descriptor_t* descriptor) {
@@ -525,14 +826,30 @@ cl_event predefinedSumOfArray(
 }
 
 cl_event sumOfArray(
+    ocl_aggregation_descriptor_t** descriptor,
     cl_mem input_buffer, unsigned int elements,
     cl_mem result_buffer, unsigned int result_buffer_offset,
     cl_event external_event) {
-  ocl_aggregation_descriptor_t* desc = prepareSumDescriptor(
-      input_buffer, elements, result_buffer, result_buffer_offset);
-  cl_event result_event = predefinedSumOfArray(desc, external_event);
-  releaseAggregationDescriptor(desc);
-  return result_event;
+  return weightedSumOfArray(
+      descriptor, input_buffer, NULL, elements, result_buffer,
+      result_buffer_offset, external_event);
+}
+
+cl_event weightedSumOfArray(
+    ocl_aggregation_descriptor_t** descriptor,
+    cl_mem input_buffer, cl_mem weight_buffer, unsigned int elements,
+    cl_mem result_buffer, unsigned int result_buffer_offset,
+    cl_event external_event) {
+  if (*descriptor == NULL) {
+    *descriptor = prepareWeightedSumDescriptor(
+        input_buffer, weight_buffer, elements, result_buffer,
+        result_buffer_offset);
+  } else {
+    rebindSumDescriptor(
+        *descriptor, input_buffer, weight_buffer, elements, result_buffer,
+        result_buffer_offset);
+  }
+  return predefinedSumOfArray(*descriptor, external_event);
 }
 
 cl_event minOfArray(
@@ -575,16 +892,20 @@ cl_event minOfArray(
   unsigned int slow_kernel_elements = elements - slow_kernel_data_offset;
   unsigned int slow_kernel_result_offset = processors;
 
-  // Allocate a temporary result buffers.
-  cl_mem tmp_buffer_min = clCreateBuffer(
-      context->context, CL_MEM_READ_WRITE,
-      sizeof(kde_float_t) * (processors + 1), NULL, &err);
-  Assert(err == CL_SUCCESS);
-  
-  cl_mem tmp_buffer_index = clCreateBuffer(
-      context->context, CL_MEM_READ_WRITE,
-      sizeof(unsigned int) * (processors + 1), NULL, &err);
-  Assert(err == CL_SUCCESS);
+  // Allocate the temporary result buffers. Their size only depends on the
+  // device, so they are kept just like the kernels.
+  if (tmp_buffer_min == NULL) {
+    tmp_buffer_min = ocl_createBuffer(
+        context->context, CL_MEM_READ_WRITE,
+        sizeof(kde_float_t) * (processors + 1), NULL, &err);
+    Assert(err == CL_SUCCESS);
+  }
+  if (tmp_buffer_index == NULL) {
+    tmp_buffer_index = ocl_createBuffer(
+        context->context, CL_MEM_READ_WRITE,
+        sizeof(unsigned int) * (processors + 1), NULL, &err);
+    Assert(err == CL_SUCCESS);
+  }
   
   size_t global_size = processors + 1; 
   
@@ -659,10 +980,6 @@ cl_event minOfArray(
   Assert(err == CL_SUCCESS);
   
   // Clean up ...
-  err |= clReleaseMemObject(tmp_buffer_min);
-  err |= clReleaseMemObject(tmp_buffer_index);
-  Assert(err == CL_SUCCESS);
-  
   if (events[0]) err |= clReleaseEvent(events[0]);
   if (events[1]) err |= clReleaseEvent(events[1]);
   Assert(err == CL_SUCCESS);
@@ -670,15 +987,67 @@ cl_event minOfArray(
   return finalize_event;
 }
 
-/* Functions for accessing the timing file */
-static FILE* timing_file = NULL;
-char* kde_timing_logfile_name;
+/* Functions for aggregating the timings of the estimator phases */
+typedef struct kde_phase_timing {
+  int64 calls;
+  uint64 total_time;  // In nanoseconds.
+  uint64 max_time;
+} kde_phase_timing_t;
+
+static kde_phase_timing_t phase_timings[KDE_NR_OF_PHASES];
+
+static const char* phase_names[KDE_NR_OF_PHASES] = {
+  "estimation", "propagation", "drill", "merge", "transfer", "construction",
+  "maintenance"
+};
+
+#ifdef KDE_INSTRUMENTATION
+uint64 kde_readClock(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64)now.tv_sec * 1000000000 + now.tv_nsec;
+}
 
-FILE* kde_getTimingFile(void) { return timing_file; }
+void kde_recordPhase(kde_phase_t phase, uint64 start) {
+  uint64 elapsed = kde_readClock() - start;
+  phase_timings[phase].calls++;
+  phase_timings[phase].total_time += elapsed;
+  if (elapsed > phase_timings[phase].max_time) {
+    phase_timings[phase].max_time = elapsed;
+  }
+}
+#endif /* KDE_INSTRUMENTATION */
 
-void assign_kde_timing_logfile_name(const char *newval, void *extra) {
-  if (timing_file != NULL) fclose(timing_file);
-  timing_file = fopen(newval, "w");
+Datum ocl_getTimings(PG_FUNCTION_ARGS) {
+  FuncCallContext* funcctx;
+  if (SRF_IS_FIRSTCALL()) {
+    funcctx = SRF_FIRSTCALL_INIT();
+    MemoryContext oldcontext = MemoryContextSwitchTo(
+        funcctx->multi_call_memory_ctx);
+    TupleDesc tupdesc = CreateTemplateTupleDesc(4, false);
+    TupleDescInitEntry(tupdesc, (AttrNumber) 1, "phase", TEXTOID, -1, 0);
+    TupleDescInitEntry(tupdesc, (AttrNumber) 2, "calls", INT8OID, -1, 0);
+    TupleDescInitEntry(tupdesc, (AttrNumber) 3, "total_time",
+                       FLOAT8OID, -1, 0);
+    TupleDescInitEntry(tupdesc, (AttrNumber) 4, "max_time", FLOAT8OID, -1, 0);
+    funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+    funcctx->max_calls = KDE_NR_OF_PHASES;
+    MemoryContextSwitchTo(oldcontext);
+  }
+  funcctx = SRF_PERCALL_SETUP();
+  if (funcctx->call_cntr < funcctx->max_calls) {
+    const kde_phase_timing_t* timing = &(phase_timings[funcctx->call_cntr]);
+    Datum values[4];
+    bool nulls[4] = {false, false, false, false};
+    values[0] = CStringGetTextDatum(phase_names[funcctx->call_cntr]);
+    values[1] = Int64GetDatum(timing->calls);
+    // Times are reported in milliseconds.
+    values[2] = Float8GetDatum(timing->total_time / 1000000.0);
+    values[3] = Float8GetDatum(timing->max_time / 1000000.0);
+    HeapTuple tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+    SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+  }
+  SRF_RETURN_DONE(funcctx);
 }
 
 #endif /* USE_OPENCL */
@@ -101,6 +101,31 @@ void ocl_releaseContext(void);
  */
 cl_kernel ocl_getKernel(const char* kernel_name, int dimensions);
 
+/*
+ * Same as ocl_getKernel, but returns the kernel from the program that was
+ * built for single-precision floats.
+ */
+cl_kernel ocl_getSinglePrecisionKernel(const char* kernel_name, int dimensions);
+
+// #########################################################################
+// ################## FUNCTIONS FOR DEVICE ALLOCATIONS #####################
+
+/*
+ * Wrappers around clCreateBuffer and clCreateSubBuffer that count the created
+ * memory objects. Estimates and online learning keep their buffers and
+ * kernels across calls, so this count (together with the kernels created by
+ * ocl_getKernel) stays constant once a model has warmed up.
+ */
+cl_mem ocl_createBuffer(
+    cl_context context, cl_mem_flags flags, size_t size, void* host_ptr,
+    cl_int* err);
+cl_mem ocl_createSubBuffer(
+    cl_mem buffer, cl_mem_flags flags, cl_buffer_create_type type,
+    const void* info, cl_int* err);
+
+// Returns the number of OpenCL buffers and kernels created by this backend.
+long ocl_getAllocationCount(void);
+
 // #########################################################################
 // ############## HELPER FUNCTIONS FOR THE COMPUTATIONS ####################
 
@@ -109,6 +134,7 @@ typedef struct ocl_aggregation_descriptor {
   cl_mem intermediate_result_buffer;
   // Call sizes.
   size_t local_size;
+  size_t element_size;
   // Required kernels.
   cl_kernel pre_aggregation;
   cl_kernel final_aggregation;
@@ -119,6 +145,26 @@ ocl_aggregation_descriptor_t* prepareSumDescriptor(
     cl_mem input_buffer, unsigned int elements,
     cl_mem result_buffer, unsigned int result_buffer_offset);
 
+// Same as prepareSumDescriptor, but scales each element by the corresponding
+// element of weight_buffer. A NULL weight_buffer sums the plain elements.
+ocl_aggregation_descriptor_t* prepareWeightedSumDescriptor(
+    cl_mem input_buffer, cl_mem weight_buffer, unsigned int elements,
+    cl_mem result_buffer, unsigned int result_buffer_offset);
+
+// Same as prepareSumDescriptor, but for buffers of single-precision floats.
+// The summation compensates for the rounding errors of the float type.
+ocl_aggregation_descriptor_t* prepareSinglePrecisionSumDescriptor(
+    cl_mem input_buffer, unsigned int elements,
+    cl_mem result_buffer, unsigned int result_buffer_offset);
+
+// Points the descriptor to new buffers and a new number of elements. The
+// kernels and the intermediate buffer of the descriptor are reused, so the
+// previous sum must have finished before the new one starts.
+void rebindSumDescriptor(
+    ocl_aggregation_descriptor_t* descriptor, cl_mem input_buffer,
+    cl_mem weight_buffer, unsigned int elements, cl_mem result_buffer,
+    unsigned int result_buffer_offset);
+
 // Release the aggregation descriptor.
 void releaseAggregationDescriptor(ocl_aggregation_descriptor_t* descriptor);
 /*
@@ -128,12 +174,22 @@ void releaseAggregationDescriptor(ocl_aggregation_descriptor_t* descriptor);
 cl_event predefinedSumOfArray(
     ocl_aggregation_descriptor_t* descriptor, cl_event external_event);
 
-// Helper function to compute the sum of an array.
+// Helper function to compute the sum of an array. The descriptor is prepared
+// on first use and rebound to the given buffers on later calls, so callers
+// keep it around (e.g. per estimator) and release it themselves.
 cl_event sumOfArray(
+    ocl_aggregation_descriptor_t** descriptor,
     cl_mem input_buffer, unsigned int elements,
     cl_mem result_buffer, unsigned int result_buffer_offset,
     cl_event external_event);
 
+// Helper function to compute the weighted sum of an array.
+cl_event weightedSumOfArray(
+    ocl_aggregation_descriptor_t** descriptor,
+    cl_mem input_buffer, cl_mem weight_buffer, unsigned int elements,
+    cl_mem result_buffer, unsigned int result_buffer_offset,
+    cl_event external_event);
+
 /*
  * Computes the min of the elements in input_buffer, writing minimum and value
  * to the specified position in result_* buffers.
@@ -143,28 +199,46 @@ cl_event minOfArray(
     cl_mem result_min, cl_mem result_index,
     unsigned int result_buffer_offset, cl_event external_event);
 
-// Macros for timing operations.
-FILE* kde_getTimingFile(void);
-
-#define CREATE_TIMER() struct timeval __start; gettimeofday(&__start, NULL);
-#define RESET_TIMER() gettimeofday(&__start, NULL);
-#define READ_TIMER(variable) if (kde_getTimingFile()) {      \
-   struct timeval __now; gettimeofday(&__now, NULL);         \
-   long __seconds = __now.tv_sec - __start.tv_sec;           \
-   long __useconds = __now.tv_usec - __start.tv_usec;        \
-   long long __time = (__seconds) * 1000000 + __useconds;    \
-   variable = __time;                                        \
-}
-#define LOG_TIME(text, time) if (kde_getTimingFile()) {      \
-   FILE* __f = kde_getTimingFile();                          \
-   fprintf(__f, text ": %lld microseconds.\n", time);        \
-   fflush(__f);                                              \
-}
-#define LOG_TIMER(text) if (kde_getTimingFile()) {           \
-   long long ___time = 0;                                    \
-   READ_TIMER(___time);                                      \
-   LOG_TIME(text, ___time);                                  \
-}
+// Phases of the estimators that we aggregate timings for.
+typedef enum {
+  KDE_PHASE_ESTIMATION,
+  KDE_PHASE_PROPAGATION,
+  KDE_PHASE_DRILL,
+  KDE_PHASE_MERGE,
+  KDE_PHASE_TRANSFER,
+  KDE_PHASE_CONSTRUCTION,
+  KDE_PHASE_MAINTENANCE,
+  KDE_NR_OF_PHASES
+} kde_phase_t;
+
+/*
+ * Macros for timing operations. A timer is created at the beginning of a
+ * phase, and its elapsed time is added to the phase when it is recorded. The
+ * totals are reported by the kde_timings view. Without KDE_INSTRUMENTATION,
+ * the macros compile to nothing.
+ *
+ * TIME_TRANSFER adds the time of a single host<->device transfer to the
+ * transfer phase, independent of the timer of the enclosing phase. The
+ * transfer has to be blocking, and must not wait for pending kernels.
+ */
+#ifdef KDE_INSTRUMENTATION
+uint64 kde_readClock(void);
+void kde_recordPhase(kde_phase_t phase, uint64 start);
+
+#define CREATE_TIMER() uint64 __timer_start = kde_readClock()
+#define RESET_TIMER() __timer_start = kde_readClock()
+#define RECORD_TIMER(phase) kde_recordPhase(phase, __timer_start)
+#define TIME_TRANSFER(statement) do { \
+    uint64 __transfer_start = kde_readClock(); \
+    statement; \
+    kde_recordPhase(KDE_PHASE_TRANSFER, __transfer_start); \
+  } while (0)
+#else
+#define CREATE_TIMER() ((void) 0)
+#define RESET_TIMER() ((void) 0)
+#define RECORD_TIMER(phase) ((void) 0)
+#define TIME_TRANSFER(statement) do { statement; } while (0)
+#endif /* KDE_INSTRUMENTATION */
 
 #endif /* USE_OPENCL */
 #endif /* OCL_UTILITIES_H_ */
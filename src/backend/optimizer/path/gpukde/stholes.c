@@ -2,17 +2,29 @@
 
 #include "optimizer/path/gpukde/stholes_estimator_api.h"
 #include "ocl_estimator.h"
+#include "ocl_shared_registry.h"
+#include "container/directory.h"
 #include <executor/tuptable.h>
 #include <float.h>
 #include <math.h>
 #include <float.h>
 #include <time.h>
+#include "miscadmin.h"
+#include "access/heapam.h"
 #include "access/htup_details.h"
+#include "access/xact.h"
+#include "access/xlog.h"
+#include "catalog/pg_stholes.h"
 #include "catalog/pg_type.h"
+#include "lib/stringinfo.h"
 #include "nodes/plannodes.h"
 #include <nodes/execnodes.h>
 #include "executor/instrument.h"
 #include "executor/tuptable.h"
+#include "storage/ipc.h"
+#include "utils/fmgroids.h"
+#include "utils/rel.h"
+#include "utils/tqual.h"
 
 struct st_hole;
 
@@ -41,8 +53,30 @@ typedef struct st_hole {
   kde_float_t v_box;
   // Caches the best merge for this hole.
   merge_t merge_cache;
+  bool merge_cache_stale;
+  // Position of this hole in the merge heap of the histogram, or -1.
+  int heap_index;
 } st_hole_t;
 
+/**
+ * Breadth-ordered copy of the hole tree. The children of a hole are stored
+ * next to each other, and the bounds are stored per dimension, so finding the
+ * child that contains a tuple scans contiguous memory.
+ */
+typedef struct st_flat_tree {
+  unsigned int nr_of_holes;
+  unsigned int capacity;
+  st_hole_t** holes;            // Hole of each entry.
+  unsigned int* first_child;    // Index of the first child of each entry.
+  unsigned int* nr_children;
+  kde_float_t* lower_bounds;    // lower_bounds[dimension * capacity + entry]
+  kde_float_t* upper_bounds;
+  kde_float_t* counters;        // Tuples claimed by each entry in this scan.
+} st_flat_tree_t;
+
+// Number of tuples that are extracted before they are propagated.
+#define STHOLES_BATCH_SIZE 256
+
 /**
  * The head of an stholes histogram. 
  * Contains additional meta information
@@ -63,12 +97,55 @@ typedef struct st_head {
   kde_float_t epsilon;
   kde_float_t last_selectivity;
   int process_feedback;
+  // Indexed min-heap over the merge caches of all holes besides the root.
+  // Holes with a stale merge cache are ordered first.
+  st_hole_t** merge_heap;
+  int merge_heap_size;
+  int merge_heap_capacity;
+  // Flattened copy of the tree for counting the tuples of a scan.
+  struct st_flat_tree* flat;
+  bool flat_valid;
+  // Extracted tuples that are propagated as one batch.
+  kde_float_t* batch;
+  unsigned int batch_size;
+  // Set if the histogram has changed since it was written to the catalog.
+  bool dirty;
+  // Shared version of the histogram that this copy is based on.
+  uint64 version;
+  // Set if the current state was written in this transaction. The histogram
+  // only becomes clean once the transaction commits.
+  bool store_pending;
+  // Set if the histogram was created by the current transaction.
+  bool created;
+  // Set if the histogram was evicted while its write was pending.
+  bool evicted;
+  // Neighbours in the LRU list of the registry.
+  struct st_head* lru_prev;
+  struct st_head* lru_next;
 } st_head_t;
 
-st_head_t* current = NULL;
+/**
+ * Registry of the histograms that are loaded in this backend.
+ */
+typedef struct st_registry {
+  // Maps a table oid to its histogram.
+  directory_t histograms;
+  // Tables for which the catalog holds no histogram, mapped to the shared
+  // version that was current when we looked.
+  directory_t missing_histograms;
+  // Histograms that were written in the current transaction.
+  st_head_t** pending;
+  unsigned int nr_of_pending;
+  // LRU list of all loaded histograms.
+  st_head_t* most_recent;
+  st_head_t* least_recent;
+} st_registry_t;
+
+static st_registry_t* st_registry = NULL;
 bool stholes_enable;
 bool stholes_maintenance;
 int stholes_hole_limit;
+int stholes_memory_limit;
 
 /** 
  * Check if stholes is stholes_enabled in guc
@@ -95,6 +172,8 @@ static st_hole_t* initializeNewSTHole(const st_head_t* head) {
   hole->v = -1.0f;
   hole->v_box = -1.0f;
   hole->merge_cache.penalty = INFINITY;
+  hole->merge_cache_stale = true;
+  hole->heap_index = -1;
   // Return the result.
   return hole;
 }
@@ -131,8 +210,79 @@ static st_head_t* createNewHistogram(
   return head;
 }
 
+// Helper function defining the order of the merge heap.
+static inline bool mergesBefore(const st_hole_t* a, const st_hole_t* b) {
+  if (a->merge_cache_stale != b->merge_cache_stale) {
+    return a->merge_cache_stale;
+  }
+  return a->merge_cache.penalty < b->merge_cache.penalty;
+}
+
+static void placeInMergeHeap(st_head_t* head, st_hole_t* hole, int pos) {
+  head->merge_heap[pos] = hole;
+  hole->heap_index = pos;
+}
+
+static void siftUpMergeHeap(st_head_t* head, int pos) {
+  st_hole_t* hole = head->merge_heap[pos];
+  while (pos > 0) {
+    int parent = (pos - 1) / 2;
+    if (!mergesBefore(hole, head->merge_heap[parent])) break;
+    placeInMergeHeap(head, head->merge_heap[parent], pos);
+    pos = parent;
+  }
+  placeInMergeHeap(head, hole, pos);
+}
+
+static void siftDownMergeHeap(st_head_t* head, int pos) {
+  st_hole_t* hole = head->merge_heap[pos];
+  while (true) {
+    int child = 2 * pos + 1;
+    if (child >= head->merge_heap_size) break;
+    if (child + 1 < head->merge_heap_size &&
+        mergesBefore(head->merge_heap[child + 1], head->merge_heap[child])) {
+      child++;
+    }
+    if (!mergesBefore(head->merge_heap[child], hole)) break;
+    placeInMergeHeap(head, head->merge_heap[child], pos);
+    pos = child;
+  }
+  placeInMergeHeap(head, hole, pos);
+}
+
+// Add a hole that was registered in the tree to the merge heap.
+static void insertIntoMergeHeap(st_head_t* head, st_hole_t* hole) {
+  if (hole->heap_index >= 0) return;  // Only moved to a different parent.
+  if (head->merge_heap_size == head->merge_heap_capacity) {
+    head->merge_heap_capacity = Max(16, 2 * head->merge_heap_capacity);
+    head->merge_heap = realloc(
+        head->merge_heap, head->merge_heap_capacity * sizeof(st_hole_t*));
+  }
+  placeInMergeHeap(head, hole, head->merge_heap_size++);
+  siftUpMergeHeap(head, hole->heap_index);
+}
+
+static void removeFromMergeHeap(st_head_t* head, st_hole_t* hole) {
+  int pos = hole->heap_index;
+  if (pos < 0) return;
+  hole->heap_index = -1;
+  st_hole_t* last = head->merge_heap[--head->merge_heap_size];
+  if (last == hole) return;
+  placeInMergeHeap(head, last, pos);
+  siftUpMergeHeap(head, pos);
+  siftDownMergeHeap(head, last->heap_index);
+}
+
+// Helper function to mark the merge cache of a hole for recomputation.
+static void invalidateMergeCache(st_head_t* head, st_hole_t* hole) {
+  hole->merge_cache.penalty = INFINITY;
+  if (hole->merge_cache_stale) return;
+  hole->merge_cache_stale = true;
+  if (hole->heap_index >= 0) siftUpMergeHeap(head, hole->heap_index);
+}
+
 // Helper function to reset merge cache references referring to a given bucket.
-static void resetMergeCache(st_hole_t* hole) {
+static void resetMergeCache(st_head_t* head, st_hole_t* hole) {
   unsigned int i;
   // First, we check whether any of our siblings have selected us
   // for a sibling-sibling merge.
@@ -140,7 +290,7 @@ static void resetMergeCache(st_hole_t* hole) {
     for (i=0; i<hole->parent->nr_children; ++i) {
       if (hole->parent->children[i]->merge_cache.merge_partner == hole) {
         // Reset this child.
-        hole->parent->children[i]->merge_cache.penalty = INFINITY;
+        invalidateMergeCache(head, hole->parent->children[i]);
       }
     }
   }
@@ -148,11 +298,11 @@ static void resetMergeCache(st_hole_t* hole) {
   // parent-child merge.
   for (i=0; i<hole->nr_children; ++i) {
     if (hole->children[i]->merge_cache.merge_partner == hole) {
-      hole->children[i]->merge_cache.penalty = INFINITY;
+      invalidateMergeCache(head, hole->children[i]);
     }
   }
   // Finally, we invalidate our own merge cache.
-  hole->merge_cache.penalty = INFINITY;
+  invalidateMergeCache(head, hole);
 }
 
 /**
@@ -164,6 +314,14 @@ static void releaseResources(st_hole_t* hole) {
   free(hole);
 }
 
+/**
+ * Release a hole that is removed from the tree.
+ */
+static void releaseHole(st_head_t* head, st_hole_t* hole) {
+  removeFromMergeHeap(head, hole);
+  releaseResources(hole);
+}
+
 static void _destroyHistogram(st_hole_t* hole) {
   int i = 0;
   for (; i < hole->nr_children; i++) {
@@ -172,12 +330,467 @@ static void _destroyHistogram(st_hole_t* hole) {
   releaseResources(hole);
 }
 
+static void releaseFlatTree(st_flat_tree_t* tree) {
+  if (tree == NULL) return;
+  free(tree->holes);
+  free(tree->first_child);
+  free(tree->nr_children);
+  free(tree->lower_bounds);
+  free(tree->upper_bounds);
+  free(tree->counters);
+  free(tree);
+}
+
 static void destroyHistogram(st_head_t* head) {
   _destroyHistogram(head->root);
   releaseResources(head->last_query);
+  releaseFlatTree(head->flat);
+  free(head->batch);
+  free(head->merge_heap);
   free(head);
 }
 
+/**
+ * Approximate memory footprint of a histogram in bytes.
+ */
+static size_t histogramSize(const st_head_t* head) {
+  size_t hole_size = sizeof(st_hole_t) + sizeof(st_hole_t*) +
+      sizeof(kde_float_t) * head->dimensions * 2;
+  size_t size = sizeof(st_head_t) + 32 * sizeof(unsigned int) +
+      (head->holes + 1) * hole_size +
+      head->merge_heap_capacity * sizeof(st_hole_t*);
+  if (head->flat) {
+    size += head->flat->capacity * (
+        sizeof(st_hole_t*) + 2 * sizeof(unsigned int) +
+        sizeof(kde_float_t) * (2 * head->dimensions + 1));
+  }
+  if (head->batch) {
+    size += sizeof(kde_float_t) * head->dimensions * STHOLES_BATCH_SIZE;
+  }
+  return size;
+}
+
+static void _serializeHole(
+    const st_head_t* head, const st_hole_t* hole, StringInfo buffer) {
+  int i;
+  int32 nr_children = hole->nr_children;
+  appendBinaryStringInfo(
+      buffer, (const char*) &(hole->tuples), sizeof(kde_float_t));
+  appendBinaryStringInfo(buffer, (const char*) &nr_children, sizeof(int32));
+  appendBinaryStringInfo(
+      buffer, (const char*) hole->bounds,
+      sizeof(kde_float_t) * head->dimensions * 2);
+  for (i = 0; i < hole->nr_children; ++i) {
+    _serializeHole(head, hole->children[i], buffer);
+  }
+}
+
+/**
+ * Serialize a histogram: the column of each dimension, followed by all holes
+ * in pre-order (tuples, number of children and bounds per hole).
+ */
+static bytea* serializeHistogram(const st_head_t* head) {
+  StringInfoData buffer;
+  AttrNumber column;
+  AttrNumber* attributes = palloc(sizeof(AttrNumber) * head->dimensions);
+  for (column = 0; column < 32; ++column) {
+    if (head->columns & (0x1 << column)) {
+      attributes[head->column_order[column]] = column;
+    }
+  }
+  initStringInfo(&buffer);
+  appendBinaryStringInfo(
+      &buffer, (const char*) attributes, sizeof(AttrNumber) * head->dimensions);
+  _serializeHole(head, head->root, &buffer);
+  bytea* result = palloc(VARHDRSZ + buffer.len);
+  SET_VARSIZE(result, VARHDRSZ + buffer.len);
+  memcpy(VARDATA(result), buffer.data, buffer.len);
+  pfree(buffer.data);
+  pfree(attributes);
+  return result;
+}
+
+static void registerChild(
+    st_head_t* head, st_hole_t* parent, st_hole_t* child);
+
+static st_hole_t* _deserializeHole(st_head_t* head, const char** cursor) {
+  int i;
+  int32 nr_children;
+  st_hole_t* hole = initializeNewSTHole(head);
+  memcpy(&(hole->tuples), *cursor, sizeof(kde_float_t));
+  *cursor += sizeof(kde_float_t);
+  memcpy(&nr_children, *cursor, sizeof(int32));
+  *cursor += sizeof(int32);
+  memcpy(hole->bounds, *cursor, sizeof(kde_float_t) * head->dimensions * 2);
+  *cursor += sizeof(kde_float_t) * head->dimensions * 2;
+  head->holes++;
+  for (i = 0; i < nr_children; ++i) {
+    registerChild(head, hole, _deserializeHole(head, cursor));
+  }
+  return hole;
+}
+
+/**
+ * Rebuild a histogram from its serialized form.
+ */
+static st_head_t* deserializeHistogram(
+    Oid table, unsigned int dimensions, const bytea* data) {
+  const char* cursor = VARDATA_ANY(data);
+  AttrNumber* attributes = palloc(sizeof(AttrNumber) * dimensions);
+  memcpy(attributes, cursor, sizeof(AttrNumber) * dimensions);
+  cursor += sizeof(AttrNumber) * dimensions;
+  st_head_t* head = createNewHistogram(table, attributes, dimensions);
+  pfree(attributes);
+  // Replace the empty root by the stored tree.
+  releaseResources(head->root);
+  head->holes = 0;
+  head->root = _deserializeHole(head, &cursor);
+  return head;
+}
+
+// Helper function to remember a histogram that was written in this transaction.
+static void addPendingHistogram(st_head_t* head) {
+  unsigned int i;
+  for (i = 0; i < st_registry->nr_of_pending; ++i) {
+    if (st_registry->pending[i] == head) return;
+  }
+  st_registry->pending = realloc(
+      st_registry->pending,
+      sizeof(st_head_t*) * (st_registry->nr_of_pending + 1));
+  st_registry->pending[st_registry->nr_of_pending++] = head;
+}
+
+/**
+ * Write a histogram to the catalog, replacing the stored version. Unless
+ * replace is set, a stored histogram over a different set of columns is kept
+ * and false is returned.
+ */
+static bool storeHistogram(st_head_t* head, bool replace) {
+  HeapTuple tuple;
+  Datum values[Natts_pg_stholes];
+  bool  nulls[Natts_pg_stholes];
+  bool  repl[Natts_pg_stholes];
+  memset(nulls, false, sizeof(nulls));
+  memset(repl, true, sizeof(repl));
+  values[Anum_pg_stholes_table-1] = ObjectIdGetDatum(head->table);
+  values[Anum_pg_stholes_columns-1] = Int32GetDatum(head->columns);
+  values[Anum_pg_stholes_tuples-1] = Int32GetDatum(head->tuples);
+  bytea* histogram = serializeHistogram(head);
+  values[Anum_pg_stholes_histogram-1] = PointerGetDatum(histogram);
+
+  // Tables have at most one histogram, so update it if it exists.
+  Relation stholesRel = heap_open(STHolesRelationID, RowExclusiveLock);
+  ScanKeyData key[1];
+  ScanKeyInit(
+      &key[0], Anum_pg_stholes_table, BTEqualStrategyNumber, F_OIDEQ,
+      ObjectIdGetDatum(head->table));
+  HeapScanDesc scan = heap_beginscan(stholesRel, SnapshotNow, 1, key);
+  tuple = heap_getnext(scan, ForwardScanDirection);
+  if (!HeapTupleIsValid(tuple)) {
+    heap_endscan(scan);
+    tuple = heap_form_tuple(RelationGetDescr(stholesRel), values, nulls);
+    simple_heap_insert(stholesRel, tuple);
+  } else if (!replace &&
+             ((Form_pg_stholes) GETSTRUCT(tuple))->columns != head->columns) {
+    heap_endscan(scan);
+    heap_close(stholesRel, RowExclusiveLock);
+    pfree(histogram);
+    return false;
+  } else {
+    HeapTuple newtuple = heap_modify_tuple(
+        tuple, RelationGetDescr(stholesRel), values, nulls, repl);
+    simple_heap_update(stholesRel, &tuple->t_self, newtuple);
+    heap_endscan(scan);
+  }
+  heap_close(stholesRel, RowExclusiveLock);
+  pfree(histogram);
+  // The histogram is clean once the write commits.
+  head->store_pending = true;
+  addPendingHistogram(head);
+  return true;
+}
+
+/**
+ * Read the histogram of a table from the catalog. Returns NULL if the table
+ * has no histogram.
+ */
+static st_head_t* loadHistogram(Oid table) {
+  st_head_t* head = NULL;
+  bool isNull;
+  Relation stholesRel = heap_open(STHolesRelationID, AccessShareLock);
+  ScanKeyData key[1];
+  ScanKeyInit(
+      &key[0], Anum_pg_stholes_table, BTEqualStrategyNumber, F_OIDEQ,
+      ObjectIdGetDatum(table));
+  HeapScanDesc scan = heap_beginscan(stholesRel, SnapshotNow, 1, key);
+  HeapTuple tuple = heap_getnext(scan, ForwardScanDirection);
+  if (HeapTupleIsValid(tuple)) {
+    Form_pg_stholes entry = (Form_pg_stholes) GETSTRUCT(tuple);
+    unsigned int dimensions = 0;
+    int32 columns = entry->columns;
+    for (; columns; columns >>= 1) dimensions += columns & 0x1;
+    Datum datum = heap_getattr(
+        tuple, Anum_pg_stholes_histogram, RelationGetDescr(stholesRel),
+        &isNull);
+    bytea* histogram = DatumGetByteaP(datum);
+    head = deserializeHistogram(table, dimensions, histogram);
+    head->tuples = entry->tuples;
+    if ((Pointer) histogram != DatumGetPointer(datum)) pfree(histogram);
+  }
+  heap_endscan(scan);
+  heap_close(stholesRel, AccessShareLock);
+  return head;
+}
+
+// Helper function to unlink a histogram from the LRU list.
+static void unlinkHistogram(st_head_t* head) {
+  if (head->lru_prev) {
+    head->lru_prev->lru_next = head->lru_next;
+  } else {
+    st_registry->most_recent = head->lru_next;
+  }
+  if (head->lru_next) {
+    head->lru_next->lru_prev = head->lru_prev;
+  } else {
+    st_registry->least_recent = head->lru_prev;
+  }
+  head->lru_prev = NULL;
+  head->lru_next = NULL;
+}
+
+// Helper function to mark a histogram as the most recently used one.
+static void touchHistogram(st_head_t* head) {
+  if (st_registry->most_recent == head) return;
+  if (head->lru_prev || head->lru_next) unlinkHistogram(head);
+  head->lru_next = st_registry->most_recent;
+  if (st_registry->most_recent) st_registry->most_recent->lru_prev = head;
+  st_registry->most_recent = head;
+  if (st_registry->least_recent == NULL) st_registry->least_recent = head;
+}
+
+// Helper function to check whether a histogram was written in this transaction.
+static bool isPendingHistogram(const st_head_t* head) {
+  unsigned int i;
+  for (i = 0; i < st_registry->nr_of_pending; ++i) {
+    if (st_registry->pending[i] == head) return true;
+  }
+  return false;
+}
+
+/**
+ * Remove a histogram from the registry. Changes are written back if we can
+ * access the catalog and no other backend has published a newer histogram
+ * since we loaded ours.
+ */
+static void evictHistogram(st_head_t* head, bool materialize) {
+  if (materialize && head->dirty && !head->store_pending &&
+      IsTransactionState() && !RecoveryInProgress() &&
+      (head->created ||
+       head->version == ocl_getSharedHistogramVersion(head->table))) {
+    storeHistogram(head, false);
+  }
+  unlinkHistogram(head);
+  directory_remove(st_registry->histograms, &(head->table), false);
+  // Histograms with a pending write are released when the transaction ends.
+  if (isPendingHistogram(head)) {
+    head->evicted = true;
+  } else {
+    destroyHistogram(head);
+  }
+}
+
+/**
+ * Evict the least recently used histograms until the loaded histograms fit
+ * into stholes_memory_limit. The given histogram is never evicted.
+ */
+static void enforceMemoryLimit(st_head_t* keep) {
+  size_t total_size = 0;
+  st_head_t* head;
+  for (head = st_registry->most_recent; head; head = head->lru_next) {
+    total_size += histogramSize(head);
+  }
+  while (total_size > (size_t) stholes_memory_limit * 1024 &&
+         st_registry->least_recent != keep) {
+    head = st_registry->least_recent;
+    total_size -= histogramSize(head);
+    if (ocl_isDebug()) {
+      fprintf(stderr, "Evicting the stholes histogram of table %i.\n",
+              head->table);
+    }
+    evictHistogram(head, true);
+  }
+}
+
+// Helper function to add a histogram to the registry.
+static void registerHistogram(st_head_t* head) {
+  directory_insert(st_registry->histograms, &(head->table), head);
+  if (directory_find(st_registry->missing_histograms, &(head->table)) !=
+      st_registry->missing_histograms->entries) {
+    directory_remove(st_registry->missing_histograms, &(head->table), true);
+  }
+  touchHistogram(head);
+  enforceMemoryLimit(head);
+}
+
+/**
+ * Transaction callback that finishes the histogram writes of the transaction.
+ *
+ * On commit, the written histograms are published with a new shared version
+ * and become clean. On abort, they stay dirty, histograms created by the
+ * transaction are dropped, and histograms evicted by the transaction are
+ * registered again.
+ */
+static void
+stholes_finishPendingWrites(XactEvent event, void* arg) {
+  unsigned int i;
+  if (st_registry == NULL || st_registry->nr_of_pending == 0) return;
+  if (event == XACT_EVENT_PRE_COMMIT || event == XACT_EVENT_PRE_PREPARE) return;
+  st_head_t** pending = st_registry->pending;
+  unsigned int nr_of_pending = st_registry->nr_of_pending;
+  st_registry->pending = NULL;
+  st_registry->nr_of_pending = 0;
+  if (event == XACT_EVENT_COMMIT) {
+    for (i = 0; i < nr_of_pending; ++i) {
+      st_head_t* head = pending[i];
+      head->version = ocl_publishSharedHistogramVersion(head->table);
+      if (head->store_pending) head->dirty = false;
+      head->store_pending = false;
+      head->created = false;
+      if (head->evicted) destroyHistogram(head);
+    }
+    free(pending);
+    return;
+  }
+  // Drop the histograms that only existed in the aborted transaction.
+  for (i = 0; i < nr_of_pending; ++i) {
+    st_head_t* head = pending[i];
+    head->store_pending = false;
+    if (!head->created) continue;
+    if (!head->evicted) {
+      unlinkHistogram(head);
+      directory_remove(st_registry->histograms, &(head->table), false);
+    }
+    destroyHistogram(head);
+    pending[i] = NULL;
+  }
+  // Anything that was registered for these tables since the eviction comes
+  // from the aborted transaction as well, so restore the evicted histograms.
+  for (i = 0; i < nr_of_pending; ++i) {
+    st_head_t* head = pending[i];
+    if (head == NULL || !head->evicted) continue;
+    head->evicted = false;
+    st_head_t* other = DIRECTORY_FETCH(
+        st_registry->histograms, &(head->table), st_head_t);
+    if (other != NULL) {
+      unlinkHistogram(other);
+      directory_remove(st_registry->histograms, &(other->table), false);
+      destroyHistogram(other);
+    }
+    // Don't enforce the memory limit here, evicting requires a transaction.
+    directory_insert(st_registry->histograms, &(head->table), head);
+    touchHistogram(head);
+  }
+  free(pending);
+}
+
+// Helper function to count the histograms that changed since they were written.
+static unsigned int countDirtyHistograms() {
+  unsigned int dirty_histograms = 0;
+  st_head_t* head;
+  for (head = st_registry->most_recent; head; head = head->lru_next) {
+    if (head->dirty && !head->store_pending) dirty_histograms++;
+  }
+  return dirty_histograms;
+}
+
+static void
+stholes_cleanUpRegistry(int code, Datum arg) {
+  if (!st_registry) return;
+  unsigned int dirty_histograms = countDirtyHistograms();
+  if (dirty_histograms > 0) {
+    fprintf(stderr, "Materializing %i changed stholes histograms.\n",
+            dirty_histograms);
+    // Open a new transaction to ensure that we can write back any changes.
+    AbortOutOfAnyTransaction();
+    StartTransactionCommand();
+  }
+  while (st_registry->most_recent) {
+    evictHistogram(st_registry->most_recent, true);
+  }
+  if (dirty_histograms > 0) CommitTransactionCommand();
+  // Release evicted histograms whose transaction did not finish.
+  unsigned int i;
+  for (i = 0; i < st_registry->nr_of_pending; ++i) {
+    if (st_registry->pending[i]->evicted) {
+      destroyHistogram(st_registry->pending[i]);
+    }
+  }
+  free(st_registry->pending);
+  directory_release(st_registry->histograms, false);
+  directory_release(st_registry->missing_histograms, true);
+  free(st_registry);
+  st_registry = NULL;
+}
+
+// Helper function to fetch (and initialize if it does not exist) the registry.
+static st_registry_t* getRegistry(void) {
+  static bool callbacks_registered = false;
+  if (st_registry) return st_registry;
+  if (IsBootstrapProcessingMode()) return NULL;
+  st_registry = calloc(1, sizeof(st_registry_t));
+  st_registry->histograms = directory_init(sizeof(Oid), 20);
+  st_registry->missing_histograms = directory_init(sizeof(Oid), 20);
+  if (!callbacks_registered) {
+    // Histograms only become clean once their write commits.
+    RegisterXactCallback(stholes_finishPendingWrites, NULL);
+    // Write changed histograms back to the catalogue when the backend exits.
+    on_shmem_exit(stholes_cleanUpRegistry, 0);
+    callbacks_registered = true;
+  }
+  return st_registry;
+}
+
+/**
+ * Fetch the histogram of a table, loading it from the catalog if necessary.
+ */
+static st_head_t* fetchHistogram(Oid table) {
+  if (getRegistry() == NULL) return NULL;
+  // Read the version before the catalog, so a concurrent write makes us
+  // reload rather than miss it.
+  uint64 version = ocl_getSharedHistogramVersion(table);
+  st_head_t* head = DIRECTORY_FETCH(st_registry->histograms, &table, st_head_t);
+  if (head) {
+    if (head->created || head->store_pending || head->version == version) {
+      touchHistogram(head);
+      return head;
+    }
+    // Another backend has written a newer histogram, drop our copy.
+    evictHistogram(head, false);
+  }
+  // Don't scan the catalog again for tables without a histogram, unless a
+  // histogram has been written since we looked.
+  unsigned int position = directory_find(
+      st_registry->missing_histograms, &table);
+  if (position != st_registry->missing_histograms->entries) {
+    if (*(uint64*) directory_valueAt(
+            st_registry->missing_histograms, position) == version) {
+      return NULL;
+    }
+    directory_remove(st_registry->missing_histograms, &table, true);
+  }
+  head = loadHistogram(table);
+  if (head == NULL) {
+    uint64* missing_version = malloc(sizeof(uint64));
+    *missing_version = version;
+    directory_insert(st_registry->missing_histograms, &table, missing_version);
+    return NULL;
+  }
+  head->version = version;
+  head->max_holes = stholes_hole_limit;
+  registerHistogram(head);
+  return head;
+}
+
 
 // Convert the last query to an sthole.
 // We can then simply use our standard functions for vBox and v for it.
@@ -249,7 +862,7 @@ static kde_float_t v(const st_head_t* head, st_hole_t* hole) {
  * Add a new child to the given parent.
  */
 static void registerChild(
-    const st_head_t* head, st_hole_t* parent, st_hole_t* child) {
+    st_head_t* head, st_hole_t* parent, st_hole_t* child) {
   parent->nr_children++;
   if (parent->child_capacity < parent->nr_children) {
     // Increase the child capacity by 10.
@@ -259,6 +872,7 @@ static void registerChild(
   }
   parent->children[parent->nr_children - 1] = child;
   child->parent = parent;
+  insertIntoMergeHeap(head, child);
   // We changed the children, update the volume cache.
   if (parent->v > -1.0f) {
     parent->v -= vBox(head, child);
@@ -386,14 +1000,11 @@ static int _disjunctivenessTest(st_head_t* head, st_hole_t* hole) {
   return 1;
 }
 
-static long long unsigned int model_update_timer = 0;
-
 /**
  * Aggregate estimated tuples recursively
  */
 static kde_float_t _est(const st_head_t* head, st_hole_t* hole,
     kde_float_t* intersection_vol) {
-  CREATE_TIMER();
   kde_float_t est = 0.0;
   *intersection_vol = 0;
   
@@ -428,47 +1039,109 @@ static kde_float_t _est(const st_head_t* head, st_hole_t* hole,
   }
   
   releaseResources(q_i_b);
-  LOG_TIMER("Estimation");
   Assert(! isnan(est));
   Assert(! isinf(est));
   return est;
 }  
 
 
-static int _propagateTuple(
-    st_head_t* head, st_hole_t* hole, kde_float_t* tuple) {
+/**
+ * Rebuild the flattened copy of the tree (in breadth-first order) and reset
+ * its counters.
+ */
+static void buildFlatTree(st_head_t* head) {
+  unsigned int i, k;
+  if (head->flat == NULL) head->flat = calloc(1, sizeof(st_flat_tree_t));
+  st_flat_tree_t* tree = head->flat;
+  if (tree->capacity < head->holes) {
+    tree->capacity = Max(head->holes, 2 * tree->capacity);
+    tree->holes = realloc(tree->holes, sizeof(st_hole_t*) * tree->capacity);
+    tree->first_child = realloc(
+        tree->first_child, sizeof(unsigned int) * tree->capacity);
+    tree->nr_children = realloc(
+        tree->nr_children, sizeof(unsigned int) * tree->capacity);
+    tree->lower_bounds = realloc(
+        tree->lower_bounds,
+        sizeof(kde_float_t) * head->dimensions * tree->capacity);
+    tree->upper_bounds = realloc(
+        tree->upper_bounds,
+        sizeof(kde_float_t) * head->dimensions * tree->capacity);
+    tree->counters = realloc(
+        tree->counters, sizeof(kde_float_t) * tree->capacity);
+  }
+  // The holes array doubles as the queue of the breadth-first traversal.
+  tree->holes[0] = head->root;
+  tree->nr_of_holes = 1;
+  for (k = 0; k < tree->nr_of_holes; ++k) {
+    st_hole_t* hole = tree->holes[k];
+    tree->first_child[k] = tree->nr_of_holes;
+    tree->nr_children[k] = hole->nr_children;
+    for (i = 0; i < hole->nr_children; ++i) {
+      Assert(tree->nr_of_holes < tree->capacity);
+      tree->holes[tree->nr_of_holes++] = hole->children[i];
+    }
+    for (i = 0; i < head->dimensions; ++i) {
+      tree->lower_bounds[i * tree->capacity + k] = hole->bounds[2*i];
+      tree->upper_bounds[i * tree->capacity + k] = hole->bounds[2*i+1];
+    }
+  }
+  memset(tree->counters, 0, sizeof(kde_float_t) * tree->nr_of_holes);
+  head->flat_valid = true;
+}
+
+// Helper function to check whether an entry of the flat tree contains a point.
+static inline bool flatHoleContains(
+    const st_flat_tree_t* tree, unsigned int dimensions, unsigned int entry,
+    const kde_float_t* point) {
+  unsigned int i;
+  for (i = 0; i < dimensions; ++i) {
+    if (point[i] < tree->lower_bounds[i * tree->capacity + entry] ||
+        point[i] >= tree->upper_bounds[i * tree->capacity + entry]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Count the tuples of the batch buffer: every tuple is claimed by the deepest
+ * hole that contains it.
+ */
+static void propagateBatch(st_head_t* head) {
+  unsigned int t;
+  st_flat_tree_t* tree = head->flat;
   CREATE_TIMER();
-  // Check if this point is within our bounds.
-  int i = 0;
-  for (; i < head->dimensions; i++) {
-      // If it is not, our father will hear about this
-      if (tuple[i] >= hole->bounds[2*i+1] ||
-          tuple[i] < hole->bounds[2*i]) {
-        return 0;
+  for (t = 0; t < head->batch_size; ++t) {
+    const kde_float_t* point = &(head->batch[t * head->dimensions]);
+    // We should never encounter a tuple that isn't claimed.
+    if (!flatHoleContains(tree, head->dimensions, 0, point)) continue;
+    unsigned int entry = 0;
+    for (;;) {
+      // Children are disjoint, so at most one of them contains the point.
+      unsigned int child = tree->first_child[entry];
+      unsigned int last_child = child + tree->nr_children[entry];
+      while (child < last_child &&
+             !flatHoleContains(tree, head->dimensions, child, point)) {
+        child++;
       }
+      if (child == last_child) break;
+      entry = child;
+    }
+    tree->counters[entry]++;
   }
-  // Inform our children about this point
-  for (i = 0; i < hole->nr_children; i++) {
-    // If one of our children claims this point, we tell our parents about it.
-    if (_propagateTuple(head, hole->children[i], tuple) == 1) return 1;
-  }
-  
-  // None of the children showed interest in the point, claim it for ourselves.
-  hole->counter++;
-  long long unsigned int time = 0;
-  READ_TIMER(time);
-  model_update_timer += time; 
-  return 1;
+  head->batch_size = 0;
+  RECORD_TIMER(KDE_PHASE_PROPAGATION);
 }
 
 /**
- * Recursively reset the counter for all holes 
+ * Propagate the pending tuples and hand the counters of the scan to the holes.
  */
-static void resetAllCounters(st_hole_t* hole) {
-  hole->counter = 0;
-  int i = 0;
-  for (; i < hole->nr_children; i++) {
-    resetAllCounters(hole->children[i]);
+static void collectCounters(st_head_t* head) {
+  unsigned int k;
+  if (!head->flat_valid) return;
+  if (head->batch_size > 0) propagateBatch(head);
+  for (k = 0; k < head->flat->nr_of_holes; ++k) {
+    head->flat->holes[k]->counter = head->flat->counters[k];
   }
 }
 
@@ -682,15 +1355,15 @@ static void _drillHoles(st_head_t* head, st_hole_t* parent, st_hole_t* hole) {
   // the hole itself have to be reset.
   for (i = 0; i < candidate->nr_children; ++i) {
     st_hole_t* child = candidate->children[i];
-    if (child->merge_cache.penalty == INFINITY) continue;
+    if (child->merge_cache_stale) continue;
     if (child->merge_cache.merge_partner == hole) {
       // Invalid, since the parent of child is now bn.
-      child->merge_cache.penalty = INFINITY;
+      invalidateMergeCache(head, child);
     } else {
       // Check if the child's cache refers to any of parent's children.
       for (j = 0; j < hole->nr_children; ++j) {
         if (child->merge_cache.merge_partner == hole->children[j]) {
-          child->merge_cache.penalty = INFINITY;
+          invalidateMergeCache(head, child);
           break;
         }
       }
@@ -701,10 +1374,10 @@ static void _drillHoles(st_head_t* head, st_hole_t* parent, st_hole_t* hole) {
   // refer to a child of the candidate hole need to be reset.
   for (i = 0; i < hole->nr_children; ++i) {
     st_hole_t* child = hole->children[i];
-    if (child->merge_cache.penalty == INFINITY) continue;
+    if (child->merge_cache_stale) continue;
     for (j = 0; j < candidate->nr_children; ++j) {
       if (child->merge_cache.merge_partner == candidate->children[j]) {
-        child->merge_cache.penalty = INFINITY;
+        invalidateMergeCache(head, child);
         break;
       }
     }
@@ -720,7 +1393,7 @@ static void _drillHoles(st_head_t* head, st_hole_t* parent, st_hole_t* hole) {
   // Does this bucket still carry information?
   // If not, migrate all children to the parent. Of course, the root bucket can't be removed.
   if (parent != NULL && v(head, hole) <= fabs(head->epsilon*vBox(head,hole))) {
-    resetMergeCache(hole);  // Invalidate all cache entries to the hole.
+    resetMergeCache(head, hole);  // Invalidate all cache entries to the hole.
     unregisterChild(head, parent, hole);
     
     int old_parent_size = parent->nr_children;
@@ -734,7 +1407,7 @@ static void _drillHoles(st_head_t* head, st_hole_t* parent, st_hole_t* hole) {
 
     head->holes--;
 
-    releaseResources(hole);
+    releaseHole(head, hole);
     
     Assert(_disjunctivenessTest(head,parent));
     Assert(! isnan(hole->tuples)); 
@@ -763,7 +1436,9 @@ nohole:
 
 
 static void drillHoles(st_head_t* head) {
+  CREATE_TIMER();
   _drillHoles(head, NULL, head->root);
+  RECORD_TIMER(KDE_PHASE_DRILL);
 }
 
 /**
@@ -814,7 +1489,7 @@ static void performParentChildMerge(
   
   // We need to reset all mergecache entries refering to the to-be-merged child,
   // as those will become invalid.
-  resetMergeCache(child);
+  resetMergeCache(head, child);
 
   // Now we migrate all grandchildren to the parent.
   int i = 0;
@@ -823,7 +1498,7 @@ static void performParentChildMerge(
   }
   
   unregisterChild(head, parent, child);
-  releaseResources(child);
+  releaseHole(head, child);
  
   head->holes--;
 }
@@ -905,8 +1580,8 @@ static void performSiblingSiblingMerge(
   kde_float_t v_bp = v(head, parent);
 
   // Before we do anything, reset the merge cache of c1 and c2.
-  resetMergeCache(c1);
-  resetMergeCache(c2);
+  resetMergeCache(head, c1);
+  resetMergeCache(head, c2);
 
   // Initialize a new bucket as the bounding box of both c1 and c2.
   st_hole_t* bn = initializeNewSTHole(head);
@@ -979,23 +1654,23 @@ static void performSiblingSiblingMerge(
   // And unregister and delete c1 and c2.
   unregisterChild(head, parent, c1);
   unregisterChild(head, parent, c2);
-  releaseResources(c1);
-  releaseResources(c2);
+  releaseHole(head, c1);
+  releaseHole(head, c2);
 
   // We will now adjust the merge cache of the children of bn. In particular,
   // all caches of bn's children that refer to children of the parent or to
   // the parent itself have to be reset.
   for (i = 0; i < bn->nr_children; ++i) {
     st_hole_t* child = bn->children[i];
-    if (child->merge_cache.penalty == INFINITY) continue;
+    if (child->merge_cache_stale) continue;
     if (child->merge_cache.merge_partner == parent) {
       // Invalid, since the parent of child is now bn.
-      child->merge_cache.penalty = INFINITY;
+      invalidateMergeCache(head, child);
     } else {
       // Check if the child's cache refers to any of parent's children.
       for (j = 0; j < parent->nr_children; ++j) {
         if (child->merge_cache.merge_partner == parent->children[j]) {
-          child->merge_cache.penalty = INFINITY;
+          invalidateMergeCache(head, child);
           break;
         }
       }
@@ -1005,10 +1680,10 @@ static void performSiblingSiblingMerge(
   // caches of parent's children that refer to a child of bn need to be reset.
   for (i = 0; i < parent->nr_children; ++i) {
     st_hole_t* child = parent->children[i];
-    if (child->merge_cache.penalty == INFINITY) continue;
+    if (child->merge_cache_stale) continue;
     for (j = 0; j < bn->nr_children; ++j) {
       if (child->merge_cache.merge_partner == bn->children[j]) {
-        child->merge_cache.penalty = INFINITY;
+        invalidateMergeCache(head, child);
         break;
       }
     }
@@ -1020,47 +1695,42 @@ static void performSiblingSiblingMerge(
 }
 
 /**
- * Find a min cost merge in the tree
- */ 
-static void _getSmallestMerge(
-    st_head_t* head, st_hole_t* parent, st_hole_t* hole, merge_t* best_merge) {
-  Assert(hole->parent == parent); // Ensure the structural integrity is correct.
-
-  // First, we recurse to all of our children to check for their best merge.
-  int i = 0;
-  for (; i < hole->nr_children; i++) {
-    _getSmallestMerge(head, hole, hole->children[i], best_merge);
-  }
-
-  // Check if we need to recompute the merge cache.
-  if (hole->merge_cache.penalty == INFINITY) {
-    // We need to recompute the cheapest merge.
-    // First, we check the merge against our parent.
-    if (parent != NULL) {
-      // First, we check how expensive a merge with our parent would be.
-      hole->merge_cache.penalty = parentChildMergeCost(head, parent, hole);
-      hole->merge_cache.merge_partner = parent;
-      // Next, we check the merge costs with our siblings:
-      for (i = 0; i < hole->parent->nr_children; ++i) {
-        st_hole_t* sibling = hole->parent->children[i];
-        if (sibling != hole) {
-          kde_float_t merge_cost = siblingSiblingMergeCost(
-              head, hole->parent, hole, sibling);
-          if (merge_cost < hole->merge_cache.penalty) {
-            hole->merge_cache.penalty = merge_cost;
-            hole->merge_cache.merge_partner = sibling;
-          }
-        }
+ * Recompute the cheapest merge of a hole.
+ */
+static void computeMergeCache(st_head_t* head, st_hole_t* hole) {
+  int i;
+  st_hole_t* parent = hole->parent;
+  Assert(parent != NULL); // The root is never merged away.
+  // First, we check how expensive a merge with our parent would be.
+  hole->merge_cache.penalty = parentChildMergeCost(head, parent, hole);
+  hole->merge_cache.merge_partner = parent;
+  // Next, we check the merge costs with our siblings:
+  for (i = 0; i < parent->nr_children; ++i) {
+    st_hole_t* sibling = parent->children[i];
+    if (sibling != hole) {
+      kde_float_t merge_cost = siblingSiblingMergeCost(
+          head, parent, hole, sibling);
+      if (merge_cost < hole->merge_cache.penalty) {
+        hole->merge_cache.penalty = merge_cost;
+        hole->merge_cache.merge_partner = sibling;
       }
     }
   }
+  hole->merge_cache_stale = false;
+}
 
-  // Ok, we have a valid merge cache. Check if we are the currently cheapest
-  // one.
-  if (hole->merge_cache.penalty < best_merge->penalty) {
-    best_merge->penalty = hole->merge_cache.penalty;
-    best_merge->merge_partner = hole;
+/**
+ * Find a min cost merge in the tree. Only the merge caches that were
+ * invalidated since the last call are recomputed.
+ */ 
+static st_hole_t* getSmallestMerge(st_head_t* head) {
+  while (head->merge_heap_size > 0 &&
+         head->merge_heap[0]->merge_cache_stale) {
+    computeMergeCache(head, head->merge_heap[0]);
+    siftDownMergeHeap(head, 0);
   }
+  if (head->merge_heap_size == 0) return NULL;
+  return head->merge_heap[0];
 }
 
 /**
@@ -1077,13 +1747,12 @@ static void printTree(st_head_t* head) {
  * Performs min penalty merges until we are in our memory boundaries again.
  */ 
 static void mergeHoles(st_head_t* head) {
+  CREATE_TIMER();
   while (head->holes > head->max_holes) {
-    merge_t bestMerge;
-    bestMerge.penalty = INFINITY;
     // Get the best possible merge in the tree
-    _getSmallestMerge(head, NULL, head->root, &bestMerge);
+    st_hole_t* merge_partner_1 = getSmallestMerge(head);
+    if (merge_partner_1 == NULL) break;
     // See, what kind of merge it is and run it:
-    st_hole_t* merge_partner_1 = bestMerge.merge_partner;
     st_hole_t* merge_partner_2 = merge_partner_1->merge_cache.merge_partner;
     if (merge_partner_2 == merge_partner_1->parent) {
       // Parent-Child merge, with merge_partner_1 being the child.
@@ -1094,6 +1763,7 @@ static void mergeHoles(st_head_t* head) {
           head, merge_partner_1->parent, merge_partner_1, merge_partner_2);
     }
   }
+  RECORD_TIMER(KDE_PHASE_MERGE);
 }
 
 /**
@@ -1106,8 +1776,13 @@ static void propagateTuple(
   int i = 0;
   bool isNull;
   TupleDesc desc = slot->tts_tupleDescriptor;
-  kde_float_t* tuple = (kde_float_t*) malloc(
-      sizeof(kde_float_t)*head->dimensions);
+  // Only scans that follow an estimate deliver feedback.
+  if (!head->flat_valid) return;
+  if (head->batch == NULL) {
+    head->batch = malloc(
+        sizeof(kde_float_t) * head->dimensions * STHOLES_BATCH_SIZE);
+  }
+  kde_float_t* tuple = &(head->batch[head->batch_size * head->dimensions]);
   
   HeapTuple htup = slot->tts_tuple;
   Assert(htup);
@@ -1134,18 +1809,18 @@ static void propagateTuple(
     
   } 
   
-  //Very well, by now we should have a nice tuple. Lets do some traversing.
-  int rc = _propagateTuple(head, head->root, tuple);
-  Assert(rc); // We should never encounter a tuple that isn't claimed.
+  // Very well, by now we should have a nice tuple. Count it with the batch.
+  if (++head->batch_size == STHOLES_BATCH_SIZE) propagateBatch(head);
 }
 
 /**
  * API method to propagate a tuple from the result stream.
  */
 void stholes_propagateTuple(Relation rel, const TupleTableSlot* slot) {
-  if (current != NULL && rel->rd_id == current->table) {
-    propagateTuple(current, rel, slot);
-  }
+  if (st_registry == NULL) return;
+  st_head_t* head = DIRECTORY_FETCH(
+      st_registry->histograms, &(rel->rd_id), st_head_t);
+  if (head != NULL) propagateTuple(head, rel, slot);
 }
 
 /**
@@ -1153,8 +1828,13 @@ void stholes_propagateTuple(Relation rel, const TupleTableSlot* slot) {
  */
 void stholes_addhistogram(
   Oid table, AttrNumber* attributes, unsigned int dimensions) {
-  if (current != NULL) destroyHistogram(current);
-  current = createNewHistogram(table,attributes,dimensions);
+  if (getRegistry() == NULL) return;
+  st_head_t* head = DIRECTORY_FETCH(st_registry->histograms, &table, st_head_t);
+  if (head != NULL) evictHistogram(head, false);
+  head = createNewHistogram(table,attributes,dimensions);
+  storeHistogram(head, true);
+  head->created = true;
+  registerHistogram(head);
   fprintf(stderr, "Created a new stholes histogram\n");
   
 }  
@@ -1187,16 +1867,18 @@ static int est(
   for (i = 0; i < head->dimensions; i++) {
     if (head->root->bounds[2*i] > head->last_query->bounds[2*i]) {
       head->root->bounds[2*i] = head->last_query->bounds[2*i];
-      // Invalidate the cached volume and the merge-cache.
+      // Invalidate the cached volume, the merge-cache and the flat tree.
+      head->flat_valid = false;
       head->root->v = -1.0f;
       head->root->v_box = -1.0f;
-      resetMergeCache(head->root);
+      resetMergeCache(head, head->root);
     }
     if (head->root->bounds[2*i+1] < head->last_query->bounds[2*i+1]) {
       head->root->bounds[2*i+1] = head->last_query->bounds[2*i+1]; //+ abs(head->last_query.bounds[2*i+1]) * head->epsilon;
+      head->flat_valid = false;
       head->root->v = -1.0f;
       head->root->v_box = -1.0f;
-      resetMergeCache(head->root);
+      resetMergeCache(head, head->root);
     }
   }
 
@@ -1236,18 +1918,28 @@ static void _printTree(st_head_t* head, st_hole_t* hole, int depth) {
  */
 int stholes_est(
     Oid rel, const ocl_estimator_request_t* request, Selectivity* selectivity) {
-  if (current == NULL) return 0;
-  if (rel == current->table) {
-    resetAllCounters(current->root);
-    int rc = est(current, request, selectivity);
-    current->last_selectivity = *selectivity;
-    current->process_feedback = 1;
-    return rc;
-  }
-  return 0;
+  st_head_t* head = fetchHistogram(rel);
+  if (head == NULL) return 0;
+  CREATE_TIMER();
+  int rc = est(head, request, selectivity);
+  RECORD_TIMER(KDE_PHASE_ESTIMATION);
+  head->last_selectivity = *selectivity;
+  head->process_feedback = 1;
+  // Start counting the tuples of the upcoming scan.
+  if (head->flat_valid) {
+    memset(head->flat->counters, 0,
+           sizeof(kde_float_t) * head->flat->nr_of_holes);
+  } else {
+    buildFlatTree(head);
+  }
+  head->batch_size = 0;
+  return rc;
 }  
 
 static void buildAndRefine(st_head_t* model) {
+  collectCounters(model);
+  // Drilling and merging change the tree.
+  model->flat_valid = false;
   // First, we need to identify candidate holes and drill them.
   drillHoles(model);
   // Then, we need to merge superfluous holes until we are within our
@@ -1259,35 +1951,35 @@ static void buildAndRefine(st_head_t* model) {
  *  API method called to initiate the histogram optimization process
  */
 void stholes_process_feedback(PlanState *node) {
-  if (current == NULL) return;
-  if (! current->process_feedback) return;
+  if (st_registry == NULL) return;
   if (nodeTag(node) != T_SeqScanState) return;
   if (node->instrument == NULL) return;
+  st_head_t* head = DIRECTORY_FETCH(
+      st_registry->histograms,
+      &(((SeqScanState*) node)->ss_currentRelation->rd_id), st_head_t);
+  if (head == NULL) return;
+  if (! head->process_feedback) return;
   CREATE_TIMER();
-  if (((SeqScanState*) node)->ss_currentRelation->rd_id == current->table &&
-      current->process_feedback) {
-    // Count the statistics.
-    float8 qual_tuples =
-        (float8)(node->instrument->tuplecount + node->instrument->ntuples) /
-        (node->instrument->nloops + 1);
-    float8 all_tuples =
-        (float8)(node->instrument->tuplecount + node->instrument->nfiltered2 +
-                 node->instrument->nfiltered1 + node->instrument->ntuples) /
-        (node->instrument->nloops+1);
-    // Update the model.
-    current->tuples = all_tuples;
-    buildAndRefine(current);
-    // And report the estimation error.
-    ocl_reportErrorToLogFile(
-        ((SeqScanState*) node)->ss_currentRelation->rd_id,
-        current->last_selectivity,
-        qual_tuples / all_tuples,
-        all_tuples);
-    // We are done processing the feedback :)
-    current->process_feedback = 0;
-  }
-  long long unsigned int time = 0;
-  READ_TIMER(time);
-  model_update_timer += time;  
-  LOG_TIME("Model Maintenance", model_update_timer);
+  // Count the statistics.
+  float8 qual_tuples =
+      (float8)(node->instrument->tuplecount + node->instrument->ntuples) /
+      (node->instrument->nloops + 1);
+  float8 all_tuples =
+      (float8)(node->instrument->tuplecount + node->instrument->nfiltered2 +
+               node->instrument->nfiltered1 + node->instrument->ntuples) /
+      (node->instrument->nloops+1);
+  // Update the model.
+  head->tuples = all_tuples;
+  buildAndRefine(head);
+  head->dirty = true;
+  head->store_pending = false;
+  // And report the estimation error.
+  ocl_reportErrorToLogFile(
+      ((SeqScanState*) node)->ss_currentRelation->rd_id,
+      head->last_selectivity,
+      qual_tuples / all_tuples,
+      all_tuples);
+  // We are done processing the feedback :)
+  head->process_feedback = 0;
+  RECORD_TIMER(KDE_PHASE_MAINTENANCE);
 }
@@ -21,7 +21,9 @@
 #include "access/subtrans.h"
 #include "access/twophase.h"
 #include "commands/async.h"
+#include "kde_feedback/kde_feedback_queue.h"
 #include "miscadmin.h"
+#include "optimizer/path/gpukde/ocl_estimator_api.h"
 #include "pgstat.h"
 #include "postmaster/autovacuum.h"
 #include "postmaster/bgwriter.h"
@@ -127,6 +129,11 @@ CreateSharedMemoryAndSemaphores(bool makePrivate, int port)
 		size = add_size(size, BTreeShmemSize());
 		size = add_size(size, SyncScanShmemSize());
 		size = add_size(size, AsyncShmemSize());
+		size = add_size(size, kde_feedback_queue_shmem_size());
+#ifdef USE_OPENCL
+		size = add_size(size, ocl_sharedRegistryShmemSize());
+		size = add_size(size, ocl_optimizationQueueShmemSize());
+#endif
 #ifdef EXEC_BACKEND
 		size = add_size(size, ShmemBackendArraySize());
 #endif
@@ -236,6 +243,11 @@ CreateSharedMemoryAndSemaphores(bool makePrivate, int port)
 	BTreeShmemInit();
 	SyncScanShmemInit();
 	AsyncShmemInit();
+	kde_feedback_queue_shmem_init();
+#ifdef USE_OPENCL
+	ocl_sharedRegistryShmemInit();
+	ocl_optimizationQueueShmemInit();
+#endif
 
 #ifdef EXEC_BACKEND
 
@@ -31,8 +31,10 @@
 
 #include "access/htup_details.h"
 #include "catalog/pg_authid.h"
+#include "kde_feedback/kde_feedback_queue.h"
 #include "mb/pg_wchar.h"
 #include "miscadmin.h"
+#include "optimizer/path/gpukde/ocl_estimator_api.h"
 #include "postmaster/autovacuum.h"
 #include "postmaster/postmaster.h"
 #include "storage/fd.h"
@@ -1311,6 +1313,11 @@ process_shared_preload_libraries(void)
 	load_libraries(shared_preload_libraries_string,
 				   "shared_preload_libraries",
 				   false);
+	/* built-in workers of the KDE estimator are registered alongside */
+	kde_register_feedback_worker();
+#ifdef USE_OPENCL
+	ocl_registerBackgroundWorkers();
+#endif
 	process_shared_preload_libraries_in_progress = false;
 }
 
@@ -141,21 +141,30 @@ extern bool kde_debug;
 /* Determines how many rows should be kept in the KDE sample.*/
 extern int kde_samplesize;
 extern void assign_kde_samplesize(int newval, void *extra);
+/* Determines how many weighted points a KDE model keeps after compaction. */
+extern int kde_coreset_size;
+/* Number of memoized selectivity estimates per KDE model. */
+extern int kde_selectivity_cache_size;
 /* Determines whether we use the GPU or the CPU for running KDE. */
 extern bool ocl_use_gpu;
 extern void assign_ocl_use_gpu(bool newval, void *extra);
+/* Determines whether compiled OpenCL programs are cached in the data directory. */
+extern bool ocl_use_program_cache;
+/* List of dimensionalities for which the program cache is filled at startup. */
+extern char* ocl_prewarm_dimensions;
 /* Name of the file where we log estimation errors. */
 extern char* kde_estimation_quality_logfile_name;
 extern void assign_kde_estimation_quality_logfile_name(const char* newval, void *extra);
-/* Name of the file where we log timing information. */
-extern char* kde_timing_logfile_name;
-extern void assign_kde_timing_logfile_name(const char* newval, void* extra);
 /* Determines whether we use feedback collection. */
 extern bool kde_collect_feedback;
+/* Number of feedback records that can be queued for the feedback worker. */
+extern int kde_feedback_queue_size;
 /* Determines whether to use query feedback to pick an optimal bandwidth during estimator construction */
 extern bool kde_enable_bandwidth_optimization;
 /* Determines how many feedback records should at most be used for the bandwidth optimization. If set to -1, all will be used.*/
 extern int kde_bandwidth_optimization_feedback_window;
+/* Determines whether the bandwidth optimization runs in a background worker. */
+extern bool kde_optimization_worker;
 /* Determines whether to use online learningto adjust the bandwidth at runtime. */
 extern bool kde_enable_adaptive_bandwidth;
 /* Determines the mini-batch size that is used for online learning. */
@@ -166,8 +175,22 @@ extern double kde_sample_maintenance_threshold;
 extern double kde_sample_maintenance_karma_limit;
 /* Determines the number of queries until the worst sample point is replaced */
 extern int kde_sample_maintenance_period;
+/* Number of pre-drawn replacement rows per KDE model. */
+extern int kde_replacement_pool_size;
+/* Determines whether estimates skip sample buckets that cannot contribute. */
+extern bool kde_enable_spatial_pruning;
+/* Determines the maximum error that spatial pruning may introduce. */
+extern double kde_spatial_pruning_error;
+/* Determines whether estimates stop early on a prefix of the sample. */
+extern bool kde_enable_progressive_estimation;
+/* Determines whether per-dimension kernel factors are cached across queries. */
+extern bool kde_enable_factor_cache;
+/* Determines the relative confidence interval of progressive estimates. */
+extern double kde_progressive_estimation_tolerance;
 /* Determines the maximum number of buckets in the stholes histogram */
 extern int stholes_hole_limit;
+/* Determines how much memory the stholes histograms of a backend may use */
+extern int stholes_memory_limit;
 
 /* Determines the error metric that is used to optimize the bandwidth. */
 static const struct config_enum_entry kde_error_metric_options[] = {
@@ -194,6 +217,28 @@ static const struct config_enum_entry kde_bandwidth_representation_options[] = {
 };
 extern int kde_bandwidth_representation;
 
+static const struct config_enum_entry kde_kernel_options[] = {
+  {"gauss", GAUSS, false},
+  {"epanechnikov", EPANECHNIKOV, false},
+  {NULL, 0, false},
+};
+extern int kde_kernel;
+
+static const struct config_enum_entry kde_backend_options[] = {
+  {"opencl", OPENCL_BACKEND, false},
+  {"native", NATIVE_BACKEND, false},
+  {"grid", GRID_BACKEND, false},
+  {NULL, 0, false},
+};
+extern int kde_backend;
+
+static const struct config_enum_entry kde_precision_options[] = {
+  {"double", DOUBLE_PRECISION, false},
+  {"single", SINGLE_PRECISION, false},
+  {NULL, 0, false},
+};
+extern int kde_estimation_precision;
+
 static const struct config_enum_entry kde_sample_maintenance_options[] = {
   {"None", NONE_M, false},
   {"CAR", CAR, false},
@@ -1603,6 +1648,46 @@ static struct config_bool ConfigureNamesBool[] =
     false,
     NULL, NULL, NULL
   },
+  {
+    {"kde_optimization_worker", PGC_POSTMASTER, DEVELOPER_OPTIONS,
+      gettext_noop("Run the bandwidth optimization in a background worker instead of during model construction."),
+      NULL,
+      GUC_NOT_IN_SAMPLE
+    },
+    &kde_optimization_worker,
+    false,
+    NULL, NULL, NULL
+  },
+  {
+    {"kde_enable_spatial_pruning", PGC_USERSET, DEVELOPER_OPTIONS,
+      gettext_noop("Skip sample buckets that cannot contribute to a KDE estimate."),
+      NULL,
+      GUC_NOT_IN_SAMPLE
+    },
+    &kde_enable_spatial_pruning,
+    false,
+    NULL, NULL, NULL
+  },
+  {
+    {"kde_enable_progressive_estimation", PGC_USERSET, DEVELOPER_OPTIONS,
+      gettext_noop("Stop KDE estimates early once a prefix of the sample is accurate enough."),
+      NULL,
+      GUC_NOT_IN_SAMPLE
+    },
+    &kde_enable_progressive_estimation,
+    false,
+    NULL, NULL, NULL
+  },
+  {
+    {"kde_enable_factor_cache", PGC_USERSET, DEVELOPER_OPTIONS,
+      gettext_noop("Cache the per-dimension Gauss kernel factors of recent KDE query bounds."),
+      NULL,
+      GUC_NOT_IN_SAMPLE
+    },
+    &kde_enable_factor_cache,
+    false,
+    NULL, NULL, NULL
+  },
   {
     {"ocl_use_gpu", PGC_USERSET, DEVELOPER_OPTIONS,
       gettext_noop("Use the GPU for OpenCL?"),
@@ -1613,6 +1698,16 @@ static struct config_bool ConfigureNamesBool[] =
     true,
     NULL, assign_ocl_use_gpu, NULL
   },
+  {
+    {"ocl_use_program_cache", PGC_USERSET, DEVELOPER_OPTIONS,
+      gettext_noop("Cache compiled OpenCL programs in the data directory."),
+      NULL,
+      GUC_NOT_IN_SAMPLE
+    },
+    &ocl_use_program_cache,
+    true,
+    NULL, NULL, NULL
+  },
 #endif
 
 	/* End-of-list marker */
@@ -2581,6 +2676,28 @@ static struct config_int ConfigureNamesInt[] =
     4300, 1, INT_MAX,
     NULL, assign_kde_samplesize, NULL
   },
+  {
+    {"kde_coreset_size", PGC_USERSET, DEVELOPER_OPTIONS,
+      gettext_noop("Number of weighted points that a KDE model keeps after "
+          "compacting its sample. Set to 0 to keep the full sample."),
+      NULL,
+      GUC_NOT_IN_SAMPLE
+    },
+    &kde_coreset_size,
+    0, 0, INT_MAX,
+    NULL, NULL, NULL
+  },
+  {
+    {"kde_selectivity_cache_size", PGC_USERSET, DEVELOPER_OPTIONS,
+      gettext_noop("Number of selectivity estimates that are memoized per KDE "
+          "model. Set to 0 to disable the cache."),
+      NULL,
+      GUC_NOT_IN_SAMPLE
+    },
+    &kde_selectivity_cache_size,
+    64, 0, 4096,
+    NULL, NULL, NULL
+  },
   {
     {"kde_optimization_feedback_window", PGC_USERSET, DEVELOPER_OPTIONS,
       gettext_noop("Determines how many of the most recent feedback records "
@@ -2613,6 +2730,28 @@ static struct config_int ConfigureNamesInt[] =
     1, 1, INT_MAX,
     NULL, NULL, NULL
   },
+  {
+    {"kde_replacement_pool_size", PGC_USERSET, DEVELOPER_OPTIONS,
+      gettext_noop("Number of random rows that are drawn ahead of time to "
+          "replace KDE sample points. Set to 0 to draw every row on demand."),
+      NULL,
+      GUC_NOT_IN_SAMPLE
+    },
+    &kde_replacement_pool_size,
+    64, 0, 65536,
+    NULL, NULL, NULL
+  },
+  {
+    {"kde_feedback_queue_size", PGC_POSTMASTER, DEVELOPER_OPTIONS,
+      gettext_noop("Number of feedback records that can wait for the "
+          "feedback worker. Set to 0 to insert feedback during the query."),
+      NULL,
+      GUC_NOT_IN_SAMPLE
+    },
+    &kde_feedback_queue_size,
+    1024, 0, 65536,
+    NULL, NULL, NULL
+  },
   {
     {"stholes_hole_limit", PGC_USERSET, DEVELOPER_OPTIONS,
       gettext_noop("Maximum number of buckets in the stholes histogram."),
@@ -2623,6 +2762,17 @@ static struct config_int ConfigureNamesInt[] =
     10, 1, INT_MAX,
     NULL, NULL, NULL
   },
+  {
+    {"stholes_memory_limit", PGC_USERSET, DEVELOPER_OPTIONS,
+      gettext_noop("Maximum memory used by the stholes histograms of a session."),
+      gettext_noop("The least recently used histograms are evicted once "
+                   "the limit is exceeded."),
+      GUC_NOT_IN_SAMPLE | GUC_UNIT_KB
+    },
+    &stholes_memory_limit,
+    4096, 64, MAX_KILOBYTES,
+    NULL, NULL, NULL
+  },
 #endif /* USE_OPENCL */
 
 	/* End-of-list marker */
@@ -2776,6 +2926,26 @@ static struct config_real ConfigureNamesReal[] =
 	  -2, -DBL_MAX, DBL_MAX,
 	  NULL, NULL, NULL
 	},
+	{
+	  {"kde_spatial_pruning_error", PGC_USERSET, DEVELOPER_OPTIONS,
+	    gettext_noop("Maximum error of a KDE estimate that is introduced by spatial pruning."),
+	    NULL,
+	    GUC_NOT_IN_SAMPLE
+	  },
+	  &kde_spatial_pruning_error,
+	  1e-6, 0.0, 1.0,
+	  NULL, NULL, NULL
+	},
+	{
+	  {"kde_progressive_estimation_tolerance", PGC_USERSET, DEVELOPER_OPTIONS,
+	    gettext_noop("Relative width of the 95% confidence interval at which progressive KDE estimates stop."),
+	    NULL,
+	    GUC_NOT_IN_SAMPLE
+	  },
+	  &kde_progressive_estimation_tolerance,
+	  0.01, 0.0, 1.0,
+	  NULL, NULL, NULL
+	},
 	{
 	  { "kde_sample_maintenance_karma_limit", PGC_USERSET, DEVELOPER_OPTIONS,
 	    gettext_noop("Value historic karma is multiplied by after a query."),
@@ -3350,14 +3520,14 @@ static struct config_string ConfigureNamesString[] =
 		NULL, assign_kde_estimation_quality_logfile_name, NULL
 	},
 	{
-		{"kde_timing_logfile", PGC_USERSET, DEVELOPER_OPTIONS,
-			gettext_noop("Sets the file that is used to log timing information."),
-			NULL,
+		{"ocl_prewarm_dimensions", PGC_POSTMASTER, DEVELOPER_OPTIONS,
+			gettext_noop("Sets the model dimensionalities for which OpenCL programs are compiled at server start."),
+			gettext_noop("Comma-separated list of dimensionalities. An empty list disables prewarming."),
 			GUC_NOT_IN_SAMPLE
 		},
-		&kde_timing_logfile_name,
+		&ocl_prewarm_dimensions,
 		"",
-		NULL, assign_kde_timing_logfile_name, NULL
+		NULL, NULL, NULL
 	},
 
 #endif	/* USE_OPENCL */
@@ -3597,6 +3767,33 @@ static struct config_enum ConfigureNamesEnum[] =
     RMSPROP, kde_online_optimization_options,
     NULL, NULL, NULL
   },
+  {
+    {"kde_kernel", PGC_USERSET, DEVELOPER_OPTIONS,
+      gettext_noop("Sets the kernel function of KDE models (gauss,epanechnikov)."),
+      NULL
+    },
+    &kde_kernel,
+    GAUSS, kde_kernel_options,
+    NULL, assign_kde_kernel, NULL
+  },
+  {
+    {"kde_backend", PGC_USERSET, DEVELOPER_OPTIONS,
+      gettext_noop("Selects where KDE estimates are computed (opencl,native,grid)."),
+      NULL
+    },
+    &kde_backend,
+    OPENCL_BACKEND, kde_backend_options,
+    NULL, NULL, NULL
+  },
+  {
+    {"kde_estimation_precision", PGC_USERSET, DEVELOPER_OPTIONS,
+      gettext_noop("Sets the floating point precision of KDE estimates (double,single)."),
+      NULL
+    },
+    &kde_estimation_precision,
+    DOUBLE_PRECISION, kde_precision_options,
+    NULL, NULL, NULL
+  },
   {
     {"kde_bandwidth_representation", PGC_USERSET, DEVELOPER_OPTIONS,
       gettext_noop("Sets the representation of the bandwidth. (bandwidth,log(bandwidth))"),
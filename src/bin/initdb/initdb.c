@@ -194,7 +194,8 @@ const char *subdirs[] = {
 	"pg_tblspc",
 	"pg_stat",
 	"pg_stat_tmp",
-	"pg_kde_samples"
+	"pg_kde_samples",
+	"pg_kde_programs"
 };
 
 
@@ -4736,6 +4736,12 @@ DATA(insert OID = 4045 (  kde_import_sample  PGNSP PGUID 12 1 0 0 0 f f f f t f
 DESCR("Import the sample for the KDE estimator of the given table from the given file.");
 DATA(insert OID = 4046 (  kde_get_stats  PGNSP PGUID 12 1 0 0 0 f f f f t f s 1 0 2277 "2205" _null_ _null_ _null_ _null_  ocl_getStats _null_ _null_ _null_ ));
 DESCR("Returns the current estimator statistics.");
+DATA(insert OID = 4047 (  kde_get_timings  PGNSP PGUID 12 1 10 0 0 f f f f f t v 0 0 2249 "" "{25,20,701,701}" "{o,o,o,o}" "{phase,calls,total_time,max_time}" _null_ ocl_getTimings _null_ _null_ _null_ ));
+DESCR("Returns the time spent in the phases of the estimators of this session.");
+DATA(insert OID = 4048 (  kde_get_feedback_stats  PGNSP PGUID 12 1 0 0 0 f f f f t f v 0 0 1016 "" _null_ _null_ _null_ _null_  kde_get_feedback_stats _null_ _null_ _null_ ));
+DESCR("Returns the number of queued, dropped and pending feedback records.");
+DATA(insert OID = 4049 (  kde_get_registry_stats  PGNSP PGUID 12 1 0 0 0 f f f f t f v 0 0 1016 "" _null_ _null_ _null_ _null_  ocl_getSharedRegistryStats _null_ _null_ _null_ ));
+DESCR("Returns the number of tracked models, the last published version and the number of models dropped by the shared KDE model registry.");
 
 /* event triggers */
 DATA(insert OID = 3566 (  pg_event_trigger_dropped_objects		PGNSP PGUID 12 10 100 0 0 f f f f t t s 0 0 2249 "" "{26,26,23,25,25,25,25}" "{o,o,o,o,o,o,o}" "{classid, objid, objsubid, object_type, schema_name, object_name, object_identity}" _null_ pg_event_trigger_dropped_objects _null_ _null_ _null_ ));
@@ -0,0 +1,52 @@
+/*
+ *
+ * pg_stholes.h
+ *    definition of system catalogue tables for the STHoles histograms.
+ *
+ * src/include/catalog/pg_stholes.h
+ *
+ * NOTES
+ *    the genbki.pl script reads this file and generates .bki
+ *    information from the DATA() statements.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#ifndef PG_STHOLES_H_
+#define PG_STHOLES_H_
+
+#include "catalog/genbki.h"
+
+/*
+ * Definition of the STHoles histogram table.
+ */
+#define STHolesRelationID  3782
+
+CATALOG(pg_stholes,3782) BKI_WITHOUT_OIDS
+{
+  Oid     table;
+  int32   columns;
+  int32   tuples;
+#ifdef CATALOG_VARLEN
+  bytea   histogram;
+#endif
+} FormData_pg_stholes;
+
+/* ----------------
+ *    Form_pg_stholes corresponds to a pointer to a tuple with
+ *    the format of pg_stholes relation.
+ * ----------------
+ */
+typedef FormData_pg_stholes *Form_pg_stholes;
+
+/* ----------------
+ *    compiler constants for pg_stholes
+ * ----------------
+ */
+#define Natts_pg_stholes                  4
+#define Anum_pg_stholes_table             1
+#define Anum_pg_stholes_columns           2
+#define Anum_pg_stholes_tuples            3
+#define Anum_pg_stholes_histogram         4
+
+#endif /* PG_STHOLES_H_ */
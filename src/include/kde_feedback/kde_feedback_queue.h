@@ -0,0 +1,80 @@
+/*
+ * kde_feedback_queue.h
+ *
+ *  Asynchronous collection of query feedback. Instead of inserting into
+ *  pg_kdefeedback while the executor shuts down, backends append their
+ *  feedback records to a ring buffer in shared memory. A background worker
+ *  drains the ring and inserts the records in batches. If the ring is full,
+ *  records are dropped (and counted) rather than delaying the query.
+ *
+ *  Background workers are bound to a single database, so the worker restarts
+ *  itself whenever only records of other databases are left in the ring.
+ *  Records of a database that the worker fails to connect to are dropped.
+ */
+
+#ifndef KDE_FEEDBACK_QUEUE_H_
+#define KDE_FEEDBACK_QUEUE_H_
+
+#include "postgres.h"
+#include "kde_feedback/kde_feedback.h"
+
+/*
+ * Maximum number of range clauses in a feedback record. The column map of a
+ * record has one bit per attribute, so this covers all representable records.
+ */
+#define KDE_FEEDBACK_MAX_CLAUSES 32
+
+/*
+ * A single row of pg_kdefeedback.
+ */
+typedef struct kde_feedback_record {
+  Oid database;
+  int64 timestamp;
+  Oid table;
+  int32 columns;                // Column map of the clauses.
+  float8 all_tuples;
+  float8 qualified_tuples;
+  unsigned int nr_of_clauses;
+  RQClause clauses[KDE_FEEDBACK_MAX_CLAUSES];
+} kde_feedback_record_t;
+
+/*
+ * Shared memory setup for the feedback queue.
+ */
+extern Size kde_feedback_queue_shmem_size(void);
+extern void kde_feedback_queue_shmem_init(void);
+
+/*
+ * Hands a feedback record of the current database over to the worker.
+ *
+ * Returns false if the queue is disabled, in which case the caller has to
+ * insert the record itself.
+ */
+extern bool kde_enqueue_feedback(const kde_feedback_record_t* record);
+
+/*
+ * Counts a feedback record that could not be queued, e.g. because it has
+ * more than KDE_FEEDBACK_MAX_CLAUSES clauses.
+ */
+extern void kde_count_dropped_feedback(void);
+
+/*
+ * Inserts the given records into pg_kdefeedback, using a single multi-row
+ * insert.
+ */
+extern void kde_insert_feedback(
+    const kde_feedback_record_t* records, unsigned int nr_of_records);
+
+/*
+ * Inserts the queued records of the current database right away, so they are
+ * visible to the current transaction. The records only leave the queue once
+ * the transaction commits.
+ */
+extern void kde_drain_feedback_queue(void);
+
+/*
+ * Registers the feedback worker with the postmaster (if the queue is enabled).
+ */
+extern void kde_register_feedback_worker(void);
+
+#endif /* KDE_FEEDBACK_QUEUE_H_ */
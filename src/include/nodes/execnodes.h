@@ -306,6 +306,7 @@ typedef struct JunkFilter
  *		ConstraintExprs			array of constraint-checking expr states
  *		junkFilter				for removing junk attributes from tuples
  *		projectReturning		for computing a RETURNING list
+ *		KdeChanges				buffered KDE sample changes of the statement
  * ----------------
  */
 typedef struct ResultRelInfo
@@ -325,6 +326,7 @@ typedef struct ResultRelInfo
 	List	  **ri_ConstraintExprs;
 	JunkFilter *ri_junkFilter;
 	ProjectionInfo *ri_projectReturning;
+	void	   *ri_KdeChanges;
 } ResultRelInfo;
 
 /* ----------------
@@ -188,5 +188,8 @@ extern Selectivity clause_selectivity(PlannerInfo *root,
 				   int varRelid,
 				   JoinType jointype,
 				   SpecialJoinInfo *sjinfo);
+#ifdef USE_OPENCL
+extern void clauselist_prefetch_kde_selectivities(PlannerInfo *root);
+#endif
 
 #endif   /* COST_H */
@@ -89,6 +89,31 @@ typedef enum {
   LOG_BW
 } kde_bandwidth_representation_t;
 
+/*
+ * Enum definition to select where KDE estimates are computed.
+ */
+typedef enum {
+  OPENCL_BACKEND,   // Run the estimation kernels on the OpenCL device.
+  NATIVE_BACKEND,   // Compute the estimate directly on the host.
+  GRID_BACKEND      // Look the estimate up in a precomputed grid (d <= 4).
+} kde_backend_t;
+
+/*
+ * Enum definition to select the kernel function of the KDE models.
+ */
+typedef enum ocl_kernel_type {
+  GAUSS,
+  EPANECHNIKOV
+} ocl_kernel_type_t;
+
+/*
+ * Enum definition to select the floating point precision of KDE estimates.
+ */
+typedef enum {
+  DOUBLE_PRECISION, // Evaluate the kde kernels in double precision.
+  SINGLE_PRECISION  // Evaluate the kde kernels on a float copy of the sample.
+} kde_precision_t;
+
 /*
  * Function for updating a range request with new bounds on a given attribute.
  */
@@ -100,6 +125,24 @@ extern int ocl_updateRequest(ocl_estimator_request_t* request, AttrNumber column
  */
 int ocl_estimateSelectivity(const ocl_estimator_request_t* estimation_request, Selectivity* selectivity);
 
+/*
+ * Batched variant of ocl_estimateSelectivity. All requests for the same table
+ * are evaluated in a single kernel launch. Sets estimated[i] for every request
+ * that could be answered and returns the number of answered requests. If the
+ * settings select a path that the batched kernel does not implement (single
+ * precision, spatial pruning or progressive estimation), the requests are
+ * evaluated one by one instead.
+ *
+ * Batched estimates do not register for feedback. They are memoized, so
+ * subsequent calls to ocl_estimateSelectivity for the same ranges can re-use
+ * them unless online learning or Karma maintenance is active. The planner
+ * uses this to estimate the restrictions of all base relations of a query
+ * up front (see clauselist_prefetch_kde_selectivities).
+ */
+int ocl_estimateSelectivityBatch(
+    const ocl_estimator_request_t* requests, unsigned int nr_of_requests,
+    Selectivity* selectivities, bool* estimated);
+
 /*
  * Helper function to get the maximum sample size for KDE estimators.
  */
@@ -124,20 +167,54 @@ void ocl_constructEstimator(Relation rel, unsigned int rows_in_table,
  */
 bool ocl_useKDE(void);
 
+/*
+ * Returns whether the planner should estimate the restrictions of a query up
+ * front with ocl_estimateSelectivityBatch. This is not the case if the
+ * selectivity cache is disabled or if model maintenance is active.
+ */
+bool ocl_useBatchedEstimation(void);
+
+/*
+ * Functions to set up the shared-memory model registry.
+ */
+extern Size ocl_sharedRegistryShmemSize(void);
+extern void ocl_sharedRegistryShmemInit(void);
+
+/*
+ * Functions to set up the shared-memory queue of the optimization worker.
+ */
+extern Size ocl_optimizationQueueShmemSize(void);
+extern void ocl_optimizationQueueShmemInit(void);
+
+/*
+ * Registers the background workers of the KDE estimator with the postmaster.
+ */
+extern void ocl_registerBackgroundWorkers(void);
+
 /*
  * Helper functions for GUC that handle assignments for the configuration variables.
  */
 extern void assign_ocl_use_gpu(bool newval, void *extra);
 extern void assign_kde_enable(bool newval, void *extra);
 extern void assign_kde_samplesize(int newval, void *extra);
+extern void assign_kde_kernel(int newval, void *extra);
 extern void assign_kde_estimation_quality_logfile_name(const char *newval, void *extra);
-extern void assign_kde_timing_logfile_name(const char *newval, void *extra);
 
 /*
  * Functions for propagating informations to the estimator sample maintenanec..
+ *
+ * The resulting sample changes are collected in *changes (allocated in the
+ * current memory context on first use), and applied to the device by
+ * ocl_flushSampleMaintenance at the end of the statement. If changes is NULL,
+ * the sample is updated immediately.
  */
-extern void ocl_notifySampleMaintenanceOfInsertion(Relation rel, HeapTuple new_tuple);
-extern void ocl_notifySampleMaintenanceOfDeletion(Relation rel, ItemPointer deleted_tuple);
+extern void ocl_notifySampleMaintenanceOfInsertion(
+    Relation rel, HeapTuple new_tuple, void** changes);
+extern void ocl_notifySampleMaintenanceOfDeletion(
+    Relation rel, ItemPointer deleted_tuple, void** changes);
+extern void ocl_notifySampleMaintenanceOfUpdate(
+    Relation rel, ItemPointer old_tuple, HeapTuple new_tuple, void** changes);
+extern void ocl_flushSampleMaintenance(Relation rel, void* changes);
 
 /*
  * Propagate selectivity information to the model maintenance.
@@ -150,6 +227,18 @@ extern void ocl_notifyModelMaintenanceOfSelectivity(
  */
 extern int ocl_createSample(Relation rel, HeapTuple *sample, double* estimated_rows, int sample_size);
 
+/*
+ * Draw random blocks for ocl_createSampleFromBlocks. The blocks are sorted
+ * and prefetched, so they can be read later on without blocking.
+ */
+extern int ocl_drawSampleBlocks(Relation rel, BlockNumber* sample_blocks, int nr_of_blocks);
+
+/*
+ * Run the acceptance/rejection step on the given blocks. Returns the number
+ * of accepted (uniformly random) tuples, at most one per block.
+ */
+extern int ocl_createSampleFromBlocks(Relation rel, const BlockNumber* sample_blocks, int nr_of_blocks, HeapTuple *sample);
+
 /*
  * Check if the relation has a not to bad living tuple per block ratio
  */
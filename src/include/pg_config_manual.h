@@ -255,6 +255,12 @@
  */
 #define TRACE_SORT 1
 
+/*
+ * Enable aggregating the time spent in the phases of the KDE and STHoles
+ * estimators; see also the kde_timings view.
+ */
+#define KDE_INSTRUMENTATION 1
+
 /*
  * Enable tracing of syncscan operations (see also the trace_syncscan GUC var).
  */
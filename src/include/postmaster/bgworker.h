@@ -95,6 +95,9 @@ extern BackgroundWorker *MyBgworkerEntry;
  */
 extern void BackgroundWorkerInitializeConnection(char *dbname, char *username);
 
+/* Just like the above, but specifying the database by OID. */
+extern void BackgroundWorkerInitializeConnectionByOid(Oid dboid, char *username);
+
 /* Block/unblock signals in a background worker process */
 extern void BackgroundWorkerBlockSignals(void);
 extern void BackgroundWorkerUnblockSignals(void);
@@ -1173,4 +1173,13 @@ extern Datum ocl_getStats(PG_FUNCTION_ARGS);
 extern Datum ocl_importKDESample(PG_FUNCTION_ARGS);
 extern Datum ocl_exportKDESample(PG_FUNCTION_ARGS);
 
+/* backend/optimizer/path/gpukde/ocl_utilities.c */
+extern Datum ocl_getTimings(PG_FUNCTION_ARGS);
+
+/* backend/optimizer/path/gpukde/ocl_shared_registry.c */
+extern Datum ocl_getSharedRegistryStats(PG_FUNCTION_ARGS);
+
+/* backend/kde_feedback/kde_feedback_queue.c */
+extern Datum kde_get_feedback_stats(PG_FUNCTION_ARGS);
+
 #endif   /* BUILTINS_H */
@@ -0,0 +1,46 @@
+--
+-- Test the batched KDE estimates of the planner
+--
+SET kde_enable TO true;
+SET kde_samplesize TO 1000;
+
+CREATE TABLE kde_batch (a float8, b float8);
+INSERT INTO kde_batch SELECT i % 100, (i * 7) % 100 FROM generate_series(1, 2000) i;
+ANALYZE kde_batch(a, b);
+
+-- Returns the estimated row counts of the sequential scans of a query.
+CREATE FUNCTION kde_scan_rows(query text) RETURNS SETOF int AS $$
+DECLARE
+  line text;
+BEGIN
+  FOR line IN EXECUTE 'EXPLAIN ' || query LOOP
+    IF line ~ 'Seq Scan' THEN
+      RETURN NEXT substring(line from 'rows=([0-9]+)')::int;
+    END IF;
+  END LOOP;
+END;
+$$ LANGUAGE plpgsql;
+
+-- Both scans of the self-join are estimated in a single batch.
+CREATE TABLE kde_batch_rows AS
+  SELECT rows FROM kde_scan_rows(
+    'SELECT * FROM kde_batch x, kde_batch y
+     WHERE x.a < 30 AND x.b > 10 AND y.a > 60 AND x.b = y.b') rows;
+
+-- Drop the memoized estimates, and estimate the scans one by one.
+SELECT kde_reset_bandwidth('kde_batch'::regclass);
+CREATE TABLE kde_single_rows AS
+  SELECT rows FROM kde_scan_rows(
+    'SELECT * FROM kde_batch WHERE a < 30 AND b > 10') rows
+  UNION ALL
+  SELECT rows FROM kde_scan_rows('SELECT * FROM kde_batch WHERE a > 60') rows;
+
+SELECT (SELECT array_agg(rows ORDER BY rows) FROM kde_batch_rows) =
+       (SELECT array_agg(rows ORDER BY rows) FROM kde_single_rows)
+       AS batch_matches_single;
+
+DROP TABLE kde_single_rows;
+DROP TABLE kde_batch_rows;
+DROP FUNCTION kde_scan_rows(text);
+DELETE FROM pg_kdemodels WHERE "table" = 'kde_batch'::regclass;
+DROP TABLE kde_batch;
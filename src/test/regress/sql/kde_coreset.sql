@@ -0,0 +1,54 @@
+--
+-- Test that compacted KDE models approximate the full sample
+--
+SET kde_enable TO true;
+-- Both models are built from the whole table.
+SET kde_samplesize TO 2000;
+
+CREATE TABLE kde_coreset (a float8, b float8);
+INSERT INTO kde_coreset SELECT i % 97, (i * 7) % 89 FROM generate_series(1, 2000) i;
+
+-- Returns the estimated row count of the sequential scan of a query.
+CREATE FUNCTION kde_scan_rows(query text) RETURNS int AS $$
+DECLARE
+  line text;
+BEGIN
+  FOR line IN EXECUTE 'EXPLAIN ' || query LOOP
+    IF line ~ 'Seq Scan' THEN
+      RETURN substring(line from 'rows=([0-9]+)')::int;
+    END IF;
+  END LOOP;
+END;
+$$ LANGUAGE plpgsql;
+
+CREATE TABLE kde_coreset_queries (id int, query text);
+INSERT INTO kde_coreset_queries VALUES
+  (1, 'SELECT * FROM kde_coreset WHERE a < 30 AND b > 10'),
+  (2, 'SELECT * FROM kde_coreset WHERE a > 20 AND a < 60 AND b > 30 AND b < 70'),
+  (3, 'SELECT * FROM kde_coreset WHERE a > 50');
+
+SET kde_coreset_size TO 0;
+ANALYZE kde_coreset(a, b);
+CREATE TABLE kde_full_rows AS
+  SELECT id, kde_scan_rows(query) AS rows FROM kde_coreset_queries;
+SET kde_coreset_size TO 500;
+ANALYZE kde_coreset(a, b);
+CREATE TABLE kde_compacted_rows AS
+  SELECT id, kde_scan_rows(query) AS rows FROM kde_coreset_queries;
+
+-- The weights of the compacted model sum up to the rows of the sample.
+SELECT rows BETWEEN 1990 AND 2010 AS complete_weight
+  FROM kde_scan_rows('SELECT * FROM kde_coreset WHERE a > -1000 AND a < 1000 AND b > -1000 AND b < 1000') rows;
+
+-- The centroids move the points, and the smaller model gets a larger
+-- bandwidth, so we allow an error of 5% of the table.
+SELECT f.id, abs(f.rows - c.rows) <= 100 AS compacted_matches_full
+  FROM kde_full_rows f JOIN kde_compacted_rows c USING (id)
+  ORDER BY f.id;
+
+DROP TABLE kde_compacted_rows;
+DROP TABLE kde_full_rows;
+DROP TABLE kde_coreset_queries;
+DROP FUNCTION kde_scan_rows(text);
+DELETE FROM pg_kdemodels WHERE "table" = 'kde_coreset'::regclass;
+DROP TABLE kde_coreset;
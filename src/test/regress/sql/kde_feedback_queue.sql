@@ -0,0 +1,40 @@
+--
+-- Test the shared-memory queue of the query feedback
+--
+-- This assumes the default kde_feedback_queue_size, so that the feedback is
+-- queued instead of inserted by the query.
+SET kde_collect_feedback TO true;
+
+CREATE TABLE kde_feedback (a float8, b float8);
+INSERT INTO kde_feedback SELECT i % 100, (i * 7) % 100 FROM generate_series(1, 2000) i;
+CREATE TABLE kde_feedback_stats AS SELECT kde_get_feedback_stats() AS stats;
+
+-- A range query queues one feedback record.
+SELECT count(*) FROM kde_feedback WHERE a < 30 AND b > 10;
+SELECT (kde_get_feedback_stats())[1] = stats[1] + 1 AS queued,
+       (kde_get_feedback_stats())[2] = stats[2] AS nothing_dropped
+  FROM kde_feedback_stats;
+
+-- A record holds at most 32 range clauses, the feedback of a query that
+-- restricts more columns is dropped.
+UPDATE kde_feedback_stats SET stats = kde_get_feedback_stats();
+DO $$
+BEGIN
+  EXECUTE 'CREATE TABLE kde_feedback_wide (' ||
+      (SELECT string_agg('c' || i || ' float8', ', ')
+         FROM generate_series(1, 33) i) || ')';
+  EXECUTE 'INSERT INTO kde_feedback_wide VALUES (' ||
+      (SELECT string_agg('1', ', ') FROM generate_series(1, 33) i) || ')';
+  EXECUTE 'SELECT count(*) FROM kde_feedback_wide WHERE ' ||
+      (SELECT string_agg('c' || i || ' < 10', ' AND ')
+         FROM generate_series(1, 33) i);
+END;
+$$;
+SELECT (kde_get_feedback_stats())[1] = stats[1] AS nothing_queued,
+       (kde_get_feedback_stats())[2] = stats[2] + 1 AS dropped
+  FROM kde_feedback_stats;
+
+SET kde_collect_feedback TO false;
+DROP TABLE kde_feedback_wide;
+DROP TABLE kde_feedback_stats;
+DROP TABLE kde_feedback;
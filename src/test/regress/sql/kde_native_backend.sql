@@ -0,0 +1,62 @@
+--
+-- Test that the native backend matches the OpenCL estimates
+--
+SET kde_enable TO true;
+SET kde_samplesize TO 1000;
+-- Don't answer the second round of estimates from memoized ones.
+SET kde_selectivity_cache_size TO 0;
+
+CREATE TABLE kde_native (a float8, b float8);
+INSERT INTO kde_native SELECT i % 100, (i * 7) % 100 FROM generate_series(1, 2000) i;
+ANALYZE kde_native(a, b);
+
+-- Returns the estimated row count of the sequential scan of a query.
+CREATE FUNCTION kde_scan_rows(query text) RETURNS int AS $$
+DECLARE
+  line text;
+BEGIN
+  FOR line IN EXECUTE 'EXPLAIN ' || query LOOP
+    IF line ~ 'Seq Scan' THEN
+      RETURN substring(line from 'rows=([0-9]+)')::int;
+    END IF;
+  END LOOP;
+END;
+$$ LANGUAGE plpgsql;
+
+CREATE TABLE kde_native_queries (id int, query text);
+INSERT INTO kde_native_queries VALUES
+  (1, 'SELECT * FROM kde_native WHERE a < 30 AND b > 10'),
+  (2, 'SELECT * FROM kde_native WHERE a > 20 AND a < 25 AND b > 70 AND b < 90'),
+  (3, 'SELECT * FROM kde_native WHERE a > 95');
+
+SET kde_backend TO opencl;
+CREATE TABLE kde_opencl_rows AS
+  SELECT id, kde_scan_rows(query) AS rows FROM kde_native_queries;
+SET kde_backend TO native;
+CREATE TABLE kde_native_rows AS
+  SELECT id, kde_scan_rows(query) AS rows FROM kde_native_queries;
+SET kde_kernel TO epanechnikov;
+SET kde_backend TO opencl;
+CREATE TABLE kde_opencl_epanechnikov_rows AS
+  SELECT id, kde_scan_rows(query) AS rows FROM kde_native_queries;
+SET kde_backend TO native;
+CREATE TABLE kde_native_epanechnikov_rows AS
+  SELECT id, kde_scan_rows(query) AS rows FROM kde_native_queries;
+
+-- Both backends evaluate the same model, only the rounding differs.
+SELECT o.id, abs(o.rows - n.rows) <= 1 AS native_matches_opencl
+  FROM kde_opencl_rows o JOIN kde_native_rows n USING (id)
+  ORDER BY o.id;
+SELECT o.id, abs(o.rows - n.rows) <= 1 AS native_matches_opencl
+  FROM kde_opencl_epanechnikov_rows o
+  JOIN kde_native_epanechnikov_rows n USING (id)
+  ORDER BY o.id;
+
+DROP TABLE kde_native_epanechnikov_rows;
+DROP TABLE kde_opencl_epanechnikov_rows;
+DROP TABLE kde_native_rows;
+DROP TABLE kde_opencl_rows;
+DROP TABLE kde_native_queries;
+DROP FUNCTION kde_scan_rows(text);
+DELETE FROM pg_kdemodels WHERE "table" = 'kde_native'::regclass;
+DROP TABLE kde_native;
@@ -0,0 +1,69 @@
+--
+-- Test the memoized KDE selectivity estimates
+--
+SET kde_enable TO true;
+SET kde_samplesize TO 1000;
+
+CREATE TABLE kde_cache (a float8, b float8);
+INSERT INTO kde_cache SELECT i % 100, (i * 7) % 100 FROM generate_series(1, 2000) i;
+ANALYZE kde_cache(a, b);
+
+-- Returns the estimated row count of the sequential scan of a query.
+CREATE FUNCTION kde_scan_rows(query text) RETURNS int AS $$
+DECLARE
+  line text;
+BEGIN
+  FOR line IN EXECUTE 'EXPLAIN ' || query LOOP
+    IF line ~ 'Seq Scan' THEN
+      RETURN substring(line from 'rows=([0-9]+)')::int;
+    END IF;
+  END LOOP;
+END;
+$$ LANGUAGE plpgsql;
+
+-- Elements 11 and 12 of kde_get_stats are the cache hits and misses.
+CREATE TABLE kde_cache_stats AS
+  SELECT kde_get_stats('kde_cache'::regclass) AS stats;
+
+-- The first estimate is computed, the second one is memoized.
+CREATE TABLE kde_cache_rows AS
+  SELECT kde_scan_rows('SELECT * FROM kde_cache WHERE a < 30 AND b > 10') AS rows;
+SELECT (kde_get_stats('kde_cache'::regclass))[12] > stats[12] AS missed
+  FROM kde_cache_stats;
+UPDATE kde_cache_stats SET stats = kde_get_stats('kde_cache'::regclass);
+SELECT kde_scan_rows('SELECT * FROM kde_cache WHERE a < 30 AND b > 10') = rows
+       AS same_estimate
+  FROM kde_cache_rows;
+SELECT (kde_get_stats('kde_cache'::regclass))[11] > stats[11] AS hit,
+       (kde_get_stats('kde_cache'::regclass))[12] = stats[12] AS not_missed
+  FROM kde_cache_stats;
+
+-- Estimates are only re-used with the settings that computed them.
+SET kde_backend TO native;
+UPDATE kde_cache_stats SET stats = kde_get_stats('kde_cache'::regclass);
+SELECT kde_scan_rows('SELECT * FROM kde_cache WHERE a < 30 AND b > 10') > 0
+       AS estimated;
+SELECT (kde_get_stats('kde_cache'::regclass))[12] > stats[12] AS missed
+  FROM kde_cache_stats;
+SET kde_backend TO opencl;
+UPDATE kde_cache_stats SET stats = kde_get_stats('kde_cache'::regclass);
+SELECT kde_scan_rows('SELECT * FROM kde_cache WHERE a < 30 AND b > 10') = rows
+       AS same_estimate
+  FROM kde_cache_rows;
+SELECT (kde_get_stats('kde_cache'::regclass))[11] > stats[11] AS hit,
+       (kde_get_stats('kde_cache'::regclass))[12] = stats[12] AS not_missed
+  FROM kde_cache_stats;
+
+-- A new model drops the memoized estimates.
+ANALYZE kde_cache(a, b);
+UPDATE kde_cache_stats SET stats = kde_get_stats('kde_cache'::regclass);
+SELECT kde_scan_rows('SELECT * FROM kde_cache WHERE a < 30 AND b > 10') > 0
+       AS estimated;
+SELECT (kde_get_stats('kde_cache'::regclass))[12] > stats[12] AS missed
+  FROM kde_cache_stats;
+
+DROP TABLE kde_cache_rows;
+DROP TABLE kde_cache_stats;
+DROP FUNCTION kde_scan_rows(text);
+DELETE FROM pg_kdemodels WHERE "table" = 'kde_cache'::regclass;
+DROP TABLE kde_cache;
@@ -0,0 +1,61 @@
+--
+-- Test the shared registry of KDE model versions
+--
+SET kde_enable TO true;
+SET kde_samplesize TO 1000;
+
+CREATE TABLE kde_registry (a float8, b float8);
+INSERT INTO kde_registry SELECT i % 100, (i * 7) % 100 FROM generate_series(1, 2000) i;
+CREATE TABLE kde_registry_stats AS SELECT kde_get_registry_stats() AS stats;
+
+-- Committing a new model publishes a new version.
+ANALYZE kde_registry(a, b);
+SELECT (kde_get_registry_stats())[2] > stats[2] AS published,
+       (kde_get_registry_stats())[3] = stats[3] AS nothing_dropped
+  FROM kde_registry_stats;
+
+-- Returns the estimated row count of the sequential scan of a query.
+CREATE FUNCTION kde_scan_rows(query text) RETURNS int AS $$
+DECLARE
+  line text;
+BEGIN
+  FOR line IN EXECUTE 'EXPLAIN ' || query LOOP
+    IF line ~ 'Seq Scan' THEN
+      RETURN substring(line from 'rows=([0-9]+)')::int;
+    END IF;
+  END LOOP;
+END;
+$$ LANGUAGE plpgsql;
+
+-- A new session loads the published model.
+CREATE TABLE kde_registry_rows AS
+  SELECT kde_scan_rows('SELECT * FROM kde_registry WHERE a < 30 AND b > 10') AS rows;
+\c -
+SET kde_enable TO true;
+SELECT kde_scan_rows('SELECT * FROM kde_registry WHERE a < 30 AND b > 10') = rows
+       AS same_estimate
+  FROM kde_registry_rows;
+
+-- A rolled back model is not published, and neither this session nor a new
+-- one uses it. The rolled back model only sees rows with a < 30.
+UPDATE kde_registry_stats SET stats = kde_get_registry_stats();
+BEGIN;
+DELETE FROM kde_registry WHERE a >= 30;
+ANALYZE kde_registry(a, b);
+ROLLBACK;
+SELECT (kde_get_registry_stats())[2] = stats[2] AS not_published
+  FROM kde_registry_stats;
+SELECT kde_scan_rows('SELECT * FROM kde_registry WHERE a < 30 AND b > 10') = rows
+       AS same_estimate
+  FROM kde_registry_rows;
+\c -
+SET kde_enable TO true;
+SELECT kde_scan_rows('SELECT * FROM kde_registry WHERE a < 30 AND b > 10') = rows
+       AS same_estimate
+  FROM kde_registry_rows;
+
+DROP TABLE kde_registry_rows;
+DROP TABLE kde_registry_stats;
+DROP FUNCTION kde_scan_rows(text);
+DELETE FROM pg_kdemodels WHERE "table" = 'kde_registry'::regclass;
+DROP TABLE kde_registry;
@@ -0,0 +1,55 @@
+--
+-- Test that pruned KDE estimates match the unpruned ones
+--
+SET kde_enable TO true;
+SET kde_kernel TO epanechnikov;
+SET kde_samplesize TO 1000;
+-- Don't answer the second round of estimates from memoized ones.
+SET kde_selectivity_cache_size TO 0;
+
+CREATE TABLE kde_pruning (a float8, b float8);
+INSERT INTO kde_pruning SELECT i % 100, (i * 7) % 100 FROM generate_series(1, 2000) i;
+ANALYZE kde_pruning(a, b);
+
+-- Returns the estimated row count of the sequential scan of a query.
+CREATE FUNCTION kde_scan_rows(query text) RETURNS int AS $$
+DECLARE
+  line text;
+BEGIN
+  FOR line IN EXECUTE 'EXPLAIN ' || query LOOP
+    IF line ~ 'Seq Scan' THEN
+      RETURN substring(line from 'rows=([0-9]+)')::int;
+    END IF;
+  END LOOP;
+END;
+$$ LANGUAGE plpgsql;
+
+CREATE TABLE kde_pruning_queries (id int, query text);
+INSERT INTO kde_pruning_queries VALUES
+  (1, 'SELECT * FROM kde_pruning WHERE a > -1000 AND a < 1000 AND b > -1000 AND b < 1000'),
+  (2, 'SELECT * FROM kde_pruning WHERE a < 30 AND b > 10'),
+  (3, 'SELECT * FROM kde_pruning WHERE a > 20 AND a < 25 AND b > 70 AND b < 90'),
+  (4, 'SELECT * FROM kde_pruning WHERE a > 95');
+
+SET kde_enable_spatial_pruning TO false;
+CREATE TABLE kde_unpruned_rows AS
+  SELECT id, kde_scan_rows(query) AS rows FROM kde_pruning_queries;
+SET kde_enable_spatial_pruning TO true;
+CREATE TABLE kde_pruned_rows AS
+  SELECT id, kde_scan_rows(query) AS rows FROM kde_pruning_queries;
+
+-- A query that contains the support of every point selects the whole table.
+SELECT rows BETWEEN 1990 AND 2010 AS complete_support
+  FROM kde_unpruned_rows WHERE id = 1;
+
+-- Both kernels sum the same contributions, only in a different order.
+SELECT u.id, abs(u.rows - p.rows) <= 1 AS pruned_matches_unpruned
+  FROM kde_unpruned_rows u JOIN kde_pruned_rows p USING (id)
+  ORDER BY u.id;
+
+DROP TABLE kde_pruned_rows;
+DROP TABLE kde_unpruned_rows;
+DROP TABLE kde_pruning_queries;
+DROP FUNCTION kde_scan_rows(text);
+DELETE FROM pg_kdemodels WHERE "table" = 'kde_pruning'::regclass;
+DROP TABLE kde_pruning;
@@ -0,0 +1,48 @@
+--
+-- Test that every table keeps its own STHoles histogram
+--
+SET stholes_enable TO true;
+
+CREATE TABLE kde_stholes_a (a float8, b float8);
+INSERT INTO kde_stholes_a SELECT (i % 100) * (i % 100) / 100.0, (i * 7) % 100 FROM generate_series(1, 2000) i;
+CREATE TABLE kde_stholes_b (a float8, b float8);
+INSERT INTO kde_stholes_b SELECT i % 100, (i * 7) % 100 FROM generate_series(1, 2000) i;
+ANALYZE kde_stholes_a(a, b);
+ANALYZE kde_stholes_b(a, b);
+SELECT count(*) FROM pg_stholes
+  WHERE "table" IN ('kde_stholes_a'::regclass, 'kde_stholes_b'::regclass);
+
+-- Returns the estimated row count of the sequential scan of a query.
+CREATE FUNCTION kde_scan_rows(query text) RETURNS int AS $$
+DECLARE
+  line text;
+BEGIN
+  FOR line IN EXECUTE 'EXPLAIN ' || query LOOP
+    IF line ~ 'Seq Scan' THEN
+      RETURN substring(line from 'rows=([0-9]+)')::int;
+    END IF;
+  END LOOP;
+END;
+$$ LANGUAGE plpgsql;
+
+-- Refine the histogram of the second table with the feedback of a query.
+SELECT count(*) FROM kde_stholes_b WHERE a < 10 AND b > 10;
+CREATE TABLE kde_stholes_rows AS
+  SELECT kde_scan_rows('SELECT * FROM kde_stholes_b WHERE a < 10 AND b > 10') AS rows;
+
+-- The feedback of the same query on the first table only refines its own
+-- histogram, which has seen a different number of rows.
+SELECT count(*) FROM kde_stholes_a WHERE a < 10 AND b > 10;
+SELECT kde_scan_rows('SELECT * FROM kde_stholes_b WHERE a < 10 AND b > 10') = rows
+       AS same_estimate
+  FROM kde_stholes_rows;
+SELECT kde_scan_rows('SELECT * FROM kde_stholes_a WHERE a < 10 AND b > 10') > rows
+       AS separate_histograms
+  FROM kde_stholes_rows;
+
+DROP TABLE kde_stholes_rows;
+DROP FUNCTION kde_scan_rows(text);
+DELETE FROM pg_stholes
+  WHERE "table" IN ('kde_stholes_a'::regclass, 'kde_stholes_b'::regclass);
+DROP TABLE kde_stholes_b;
+DROP TABLE kde_stholes_a;